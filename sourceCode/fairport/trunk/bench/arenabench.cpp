@@ -0,0 +1,128 @@
+//! \file
+//! \brief Allocation count benchmark of per-message arenas
+//!
+//! Opens every message in a store, reads its subject, recipients and
+//! attachment names, and reports the heap allocations and time it took:
+//! first with no arena, then with an arena per message, then with an arena
+//! per batch of messages. Pass the store to read, and optionally the number
+//! of passes over it.
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include "pstsdk/pst.h"
+
+namespace
+{
+    size_t g_allocations = 0;
+}
+
+void* operator new(size_t size)
+{
+    ++g_allocations;
+    void* p = std::malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    std::free(p);
+}
+
+size_t touch(const pstsdk::message& m)
+{
+    using namespace pstsdk;
+
+    size_t result = 0;
+
+    if(m.has_subject())
+        result += m.get_subject().size();
+
+    // the tables are only there if they have rows
+    if(m.get_recipient_count() > 0)
+        for(message::recipient_iterator r = m.recipient_begin(); r != m.recipient_end(); ++r)
+            result += r->get_name().size();
+
+    if(m.get_attachment_count() > 0)
+        for(message::attachment_iterator a = m.attachment_begin(); a != m.attachment_end(); ++a)
+            result += a->get_filename().size();
+
+    return result;
+}
+
+void run(const char* name, const pstsdk::pst& store, const std::vector<pstsdk::node_id>& ids, int passes, size_t batch_size)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    size_t sink = 0;
+    size_t allocations = g_allocations;
+    clock_t start = clock();
+
+    for(int pass = 0; pass < passes; ++pass)
+    {
+        for(size_t i = 0; i < ids.size(); i += (batch_size ? batch_size : 1))
+        {
+            size_t end = i + (batch_size ? batch_size : 1);
+            if(end > ids.size())
+                end = ids.size();
+
+            if(batch_size)
+            {
+                arena a;
+                arena_scope scope(a);
+                for(size_t j = i; j < end; ++j)
+                    sink += touch(store.open_message(ids[j]));
+            }
+            else
+            {
+                sink += touch(store.open_message(ids[i]));
+            }
+        }
+    }
+
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+    allocations = g_allocations - allocations;
+    size_t messages = ids.size() * passes;
+
+    cout << "  " << name << ": "
+         << (messages ? double(allocations) / messages : 0) << " allocations/message, "
+         << (seconds > 0 ? messages / seconds : 0) << " messages/s"
+         << " (" << sink << ")" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    if(argc < 2)
+    {
+        cerr << "usage: arenabench store.pst [passes]" << endl;
+        return 1;
+    }
+
+    string filename(argv[1]);
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+
+    pst store(wstring(filename.begin(), filename.end()));
+
+    vector<node_id> ids;
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter)
+        ids.push_back(iter->get_id());
+
+    cout << ids.size() << " messages, " << passes << " passes" << endl;
+
+    // once to warm the block cache, so every run sees the same cache
+    run("warm up          ", store, ids, 1, 0);
+    run("heap             ", store, ids, passes, 0);
+    run("arena per message", store, ids, passes, 1);
+    run("arena per 64     ", store, ids, passes, 64);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+//! \file
+//! \brief Microbenchmark of the CRC engines in disk.h
+//!
+//! Times each engine over block sized and page sized buffers, and reports
+//! throughput. Run a release build; the numbers from a debug build mean
+//! very little.
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+#include "pstsdk/disk.h"
+
+typedef pstsdk::ulong (*crc_engine)(const void*, pstsdk::ulong, pstsdk::ulong);
+
+void run(const char* name, crc_engine engine, const std::vector<pstsdk::byte>& data, pstsdk::ulong cb)
+{
+    using namespace std;
+
+    const size_t total = 256 * 1024 * 1024;
+    const size_t iterations = total / cb;
+    const size_t blocks = data.size() / cb;
+    pstsdk::ulong sink = 0;
+
+    clock_t start = clock();
+    for(size_t i = 0; i < iterations; ++i)
+        sink += engine(&data[(i % blocks) * cb], cb, 0);
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    cout << "  " << name << ": " << (seconds > 0 ? (total / (1024.0 * 1024.0)) / seconds : 0) << " MB/s"
+         << " (crc " << hex << sink << dec << ")" << endl;
+}
+
+int main()
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<byte> data(1024 * 1024);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<byte>(rand());
+
+    // a Unicode page, a typical small block, and the largest block
+    const pstsdk::ulong sizes[] = { 496, 1024, 8176 };
+
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        cout << sizes[i] << " byte buffers" << endl;
+        run("bytewise", disk::compute_crc_bytewise, data, sizes[i]);
+        run("slice8  ", disk::compute_crc_slice8, data, sizes[i]);
+#ifdef PSTSDK_CRC_CLMUL
+        if(disk::crc_clmul_supported())
+            run("clmul   ", disk::compute_crc_clmul, data, sizes[i]);
+#endif
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+//! \file
+//! \brief Latency benchmark of parallel block decode
+//!
+//! Reads every node (and subnode) of a store with more than one page, start
+//! to finish, on a fresh database each pass so no block is already loaded:
+//! once decoding blocks on the calling thread, then with a decode pool of
+//! each size given. Pass the store to read, optionally the number of passes,
+//! and optionally the pool sizes to try.
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "pstsdk/ndb.h"
+
+size_t read_large(const pstsdk::node& n)
+{
+    using namespace pstsdk;
+
+    size_t result = 0;
+
+    if(n.get_data_id() != 0 && n.get_page_count() > 1)
+    {
+        std::vector<byte> buffer(n.size());
+        n.read(buffer, 0);
+        result += buffer.size();
+    }
+
+    if(n.get_sub_id() != 0)
+        for(const_subnodeinfo_iterator iter = n.subnode_info_begin(); iter != n.subnode_info_end(); ++iter)
+            result += read_large(node(n, *iter));
+
+    return result;
+}
+
+void run(const std::string& name, const std::wstring& filename, const std::tr1::shared_ptr<pstsdk::task_pool>& pool, int passes)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    size_t bytes = 0;
+    double seconds = 0;
+
+    for(int pass = 0; pass < passes; ++pass)
+    {
+        shared_db_ptr db = open_database(filename);
+        db->set_decode_pool(pool);
+
+        vector<node_id> ids;
+        for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter)
+            ids.push_back(iter->id);
+
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        for(size_t i = 0; i < ids.size(); ++i)
+            bytes += read_large(db->lookup_node(ids[i]));
+        seconds += (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+    }
+
+    cout << "  " << name << ": " << (passes ? seconds * 1000 / passes : 0) << " ms/pass, "
+         << (seconds > 0 ? bytes / seconds / (1024 * 1024) : 0) << " MB/s" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    if(argc < 2)
+    {
+        cerr << "usage: decodebench store.pst [passes] [threads...]" << endl;
+        return 1;
+    }
+
+    string name(argv[1]);
+    wstring filename(name.begin(), name.end());
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+
+    vector<uint> sizes;
+    for(int i = 3; i < argc; ++i)
+        sizes.push_back(atoi(argv[i]));
+    if(sizes.empty())
+    {
+        sizes.push_back(2);
+        sizes.push_back(4);
+    }
+
+    cout << passes << " passes" << endl;
+    run("calling thread", filename, std::tr1::shared_ptr<task_pool>(), passes);
+    for(size_t i = 0; i < sizes.size(); ++i)
+    {
+        std::tr1::shared_ptr<task_pool> pool(new task_pool(sizes[i]));
+        ostringstream label;
+        label << "pool of " << pool->get_thread_count() << "     ";
+        run(label.str().substr(0, 14), filename, pool, passes);
+    }
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+//! \file
+//! \brief Reference counting benchmark of atomic and plain counts
+//!
+//! Times a full traversal of a store - every node in the NBT, its data, its
+//! subnodes and, for messages and folders, its property bag - once against
+//! a database counting references atomically and once against one marked
+//! single threaded. Then times a loop of bare block pointer copies in both
+//! modes, to show the per reference cost on its own. The two modes only
+//! differ when the library is built with PSTSDK_INTRUSIVE_REFCOUNT. Pass the
+//! store to read, and optionally the number of passes over it.
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "pstsdk/ndb.h"
+#include "pstsdk/ltp.h"
+
+size_t touch(const pstsdk::node& n)
+{
+    using namespace pstsdk;
+
+    size_t result = n.size();
+
+    if(n.get_data_id() != 0)
+    {
+        byte_slice data = n.read_slice(0, n.get_page_size(0));
+        result += data.empty() ? 0 : data[0];
+    }
+
+    if(n.get_sub_id() != 0)
+        for(const_subnodeinfo_iterator iter = n.subnode_info_begin(); iter != n.subnode_info_end(); ++iter)
+            result += touch(node(n, *iter));
+
+    return result;
+}
+
+size_t traverse(const pstsdk::shared_db_ptr& db)
+{
+    using namespace pstsdk;
+
+    size_t result = 0;
+
+    for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter)
+    {
+        node n(db->lookup_node(iter->id));
+        result += touch(n);
+
+        nid_type type = get_nid_type(iter->id);
+        if(n.size() > 0 && (type == nid_type_message || type == nid_type_folder))
+        {
+            property_bag bag(n);
+            result += bag.get_prop_list().size();
+        }
+    }
+
+    return result;
+}
+
+void run_traversal(const char* name, const std::wstring& filename, bool single, int passes)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr db = open_database(filename);
+    db->set_single_threaded(single);
+
+    // once to warm the block cache, so only the traversal is timed
+    size_t sink = traverse(db);
+
+    clock_t start = clock();
+    for(int pass = 0; pass < passes; ++pass)
+        sink += traverse(db);
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    cout << "  " << name << ": " << (passes ? seconds * 1000 / passes : 0) << " ms/pass"
+         << " (" << sink << ")" << endl;
+}
+
+void run_copies(const char* name, const std::wstring& filename, bool single, long copies)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr db = open_database(filename);
+    db->set_single_threaded(single);
+    data_block_ptr pblock = db->lookup_node(nid_message_store).get_data_block();
+
+    long sink = 0;
+    clock_t start = clock();
+    for(long i = 0; i < copies; ++i)
+    {
+        data_block_ptr copy(pblock);
+        sink += reference_count(copy);
+    }
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    cout << "  " << name << ": " << (copies ? seconds * 1e9 / copies : 0) << " ns/copy"
+         << " (" << sink << ")" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    using namespace std;
+
+    if(argc < 2)
+    {
+        cerr << "usage: refbench store.pst [passes]" << endl;
+        return 1;
+    }
+
+    string name(argv[1]);
+    wstring filename(name.begin(), name.end());
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+
+    cout << "full traversal, " << passes << " passes" << endl;
+    run_traversal("atomic", filename, false, passes);
+    run_traversal("plain ", filename, true, passes);
+
+    cout << "pointer copies" << endl;
+    run_copies("atomic", filename, false, 50000000);
+    run_copies("plain ", filename, true, 50000000);
+
+    return 0;
+}
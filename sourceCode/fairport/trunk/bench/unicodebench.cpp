@@ -0,0 +1,118 @@
+//! \file
+//! \brief Throughput benchmark of UTF-16LE transcoding
+//!
+//! Converts the same UTF-16LE strings, short and long, plain ASCII and mixed
+//! with accented, CJK and astral characters, first with iconv the way
+//! bytes_to_wstring used to (an iconv_open and iconv_close per call), then
+//! with bytes_to_wstring and utf16le_to_utf8. The iconv run is left out
+//! unless PSTSDK_HAVE_ICONV is defined. Optionally pass the number of
+//! conversions per string.
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#ifdef PSTSDK_HAVE_ICONV
+#include <iconv.h>
+#endif
+#include "pstsdk/util/util.h"
+
+#ifdef PSTSDK_HAVE_ICONV
+std::wstring iconv_to_wstring(const std::vector<pstsdk::byte>& bytes)
+{
+    if(bytes.empty())
+        return std::wstring();
+
+    iconv_t cd = iconv_open("WCHAR_T", "UTF-16LE");
+    std::wstring out(bytes.size() / 2, L'\0');
+
+    char* inbuf = const_cast<char*>(reinterpret_cast<const char*>(&bytes[0]));
+    size_t inbytes = bytes.size();
+    char* outbuf = reinterpret_cast<char*>(&out[0]);
+    size_t outbytes = out.size() * sizeof(wchar_t);
+
+    iconv(cd, &inbuf, &inbytes, &outbuf, &outbytes);
+    iconv_close(cd);
+
+    out.resize(out.size() - outbytes / sizeof(wchar_t));
+    return out;
+}
+#endif
+
+std::vector<pstsdk::byte> make_string(const std::string& utf8, size_t length)
+{
+    std::string str;
+    while(str.size() < length)
+        str += utf8;
+
+    return pstsdk::utf8_to_utf16le(str);
+}
+
+#ifdef PSTSDK_HAVE_ICONV
+struct to_iconv
+{
+    size_t operator()(const std::vector<pstsdk::byte>& bytes) const
+        { return iconv_to_wstring(bytes).size(); }
+};
+#endif
+
+struct to_wide
+{
+    size_t operator()(const std::vector<pstsdk::byte>& bytes) const
+        { return pstsdk::bytes_to_wstring(bytes).size(); }
+};
+
+struct to_utf8
+{
+    size_t operator()(const std::vector<pstsdk::byte>& bytes) const
+        { return pstsdk::utf16le_to_utf8(&bytes[0], bytes.size()).size(); }
+};
+
+template<typename Func>
+void run(const char* name, const std::vector<pstsdk::byte>& bytes, long count, Func f)
+{
+    using namespace std;
+
+    size_t sink = 0;
+    clock_t start = clock();
+    for(long i = 0; i < count; ++i)
+        sink += f(bytes);
+    double seconds = double(clock() - start) / CLOCKS_PER_SEC;
+
+    cout << "    " << name << ": " << (count ? seconds * 1e9 / count : 0) << " ns/string, "
+         << (seconds > 0 ? bytes.size() * count / seconds / (1024 * 1024) : 0) << " MB/s"
+         << " (" << sink << ")" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    using namespace std;
+
+    long count = argc > 1 ? atol(argv[1]) : 200000;
+
+    const char* names[] = { "ascii", "mixed" };
+    const char* samples[] = {
+        "Re: Quarterly planning meeting, agenda attached. ",
+        "Caf\xc3\xa9 r\xc3\xa9union \xe4\xbc\x9a\xe8\xad\xb0 \xf0\x9f\x98\x80 na\xc3\xafve "
+    };
+    const size_t lengths[] = { 32, 4096 };
+
+    for(size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); ++s)
+    {
+        for(size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); ++l)
+        {
+            vector<pstsdk::byte> bytes = make_string(samples[s], lengths[l]);
+            long n = count / (lengths[l] / lengths[0]);
+
+            cout << names[s] << ", " << bytes.size() / 2 << " units, " << n << " strings" << endl;
+#ifdef PSTSDK_HAVE_ICONV
+            run("iconv           ", bytes, n, to_iconv());
+#endif
+            run("bytes_to_wstring", bytes, n, to_wide());
+            run("utf16le_to_utf8 ", bytes, n, to_utf8());
+        }
+    }
+
+    return 0;
+}
@@ -11,9 +11,33 @@
 #define PSTSDK_DISK_DISK_H
 
 #include <cstddef>
+#include <cstring>
 
 #include "pstsdk/util/primitives.h"
 
+// The vector kernels (CRC, and the permute/cyclic decoders) are compiled
+// on x86-64 whenever the compiler can target an instruction set for a
+// single function; each is only used if the processor supports it. Define
+// PSTSDK_NO_SIMD to leave them all out, or PSTSDK_NO_CRC_CLMUL for just the
+// carry-less multiply CRC.
+#if !defined(PSTSDK_NO_SIMD) && (defined(__x86_64__) || defined(_M_X64))
+#if defined(_MSC_VER)
+#define PSTSDK_X86_SIMD
+#define PSTSDK_TARGET(isa)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define PSTSDK_X86_SIMD
+#define PSTSDK_TARGET(isa) __attribute__((target(isa)))
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(PSTSDK_X86_SIMD) && !defined(PSTSDK_NO_CRC_CLMUL)
+#define PSTSDK_CRC_CLMUL
+#endif
+
 //! \brief Contains the definition of all in memory representations of disk structures
 namespace pstsdk
 {
@@ -481,6 +505,8 @@ template<typename T>
 ushort compute_signature(const block_reference<T>& reference) { return compute_signature(reference.bid, reference.ib); }
 
 //! \brief Compute the CRC of a block of data
+//!
+//! Uses the fastest of the engines below which the processor supports.
 //! \param[in] pdata A pointer to the block of data
 //! \param[in] cb The size of the data block
 //! \returns The computed CRC
@@ -488,6 +514,47 @@ ushort compute_signature(const block_reference<T>& reference) { return compute_s
 //! \ingroup utilityrelated
 ulong compute_crc(const void * pdata, ulong cb);
 
+//! \brief Compute the CRC of a block of data one byte at a time
+//!
+//! The reference implementation from [MS-PST]; a single table lookup per
+//! byte.
+//! \param[in] pdata A pointer to the block of data
+//! \param[in] cb The size of the data block
+//! \param[in] crc The CRC of any preceding data
+//! \returns The computed CRC
+//! \ingroup utilityrelated
+ulong compute_crc_bytewise(const void * pdata, ulong cb, ulong crc = 0);
+
+//! \brief Compute the CRC of a block of data eight bytes at a time
+//!
+//! The "slice-by-8" algorithm: eight tables, derived from \ref crc_table,
+//! let eight independent lookups consume eight bytes per step.
+//! \param[in] pdata A pointer to the block of data
+//! \param[in] cb The size of the data block
+//! \param[in] crc The CRC of any preceding data
+//! \returns The computed CRC
+//! \ingroup utilityrelated
+ulong compute_crc_slice8(const void * pdata, ulong cb, ulong crc = 0);
+
+#ifdef PSTSDK_CRC_CLMUL
+//! \brief Compute the CRC of a block of data with carry-less multiplication
+//!
+//! Folds 64 bytes per step using PCLMULQDQ, then Barrett reduces to 32
+//! bits. Only call this if \ref crc_clmul_supported returns true.
+//! \param[in] pdata A pointer to the block of data
+//! \param[in] cb The size of the data block
+//! \param[in] crc The CRC of any preceding data
+//! \returns The computed CRC
+//! \ingroup utilityrelated
+ulong compute_crc_clmul(const void * pdata, ulong cb, ulong crc = 0);
+#endif
+
+//! \brief Checks if \ref compute_crc_clmul can run on this processor
+//! \returns true if the library was built with the PCLMULQDQ kernel and
+//! the processor supports it
+//! \ingroup utilityrelated
+bool crc_clmul_supported();
+
 //! \brief Modifies the data block in place, according to the permute method
 //!
 //! This algorithm is called to "encrypt" external data if the \ref crypt_method of the file
@@ -510,6 +577,70 @@ void permute(void * pdata, ulong cb, bool encrypt);
 //! \ingroup disk
 void cyclic(void * pdata, ulong cb, ulong key);
 
+//! \brief Copies a data block, applying the permute method on the way
+//!
+//! Equivalent to a memcpy followed by \ref permute, in a single pass.
+//! Uses the fastest kernel the processor supports.
+//! \param[out] pdest Where to write the result; may equal psrc, but must not otherwise overlap it
+//! \param[in] psrc The data to "encrypt"
+//! \param[in] cb The size of the block of data
+//! \param[in] encrypt True if "encrypting", false is unencrypting
+//! \sa [MS-PST] 5.1
+//! \ingroup disk
+void permute_copy(void * pdest, const void * psrc, ulong cb, bool encrypt);
+
+//! \brief Copies a data block, applying the cyclic method on the way
+//!
+//! Equivalent to a memcpy followed by \ref cyclic, in a single pass.
+//! Uses the fastest kernel the processor supports.
+//! \param[out] pdest Where to write the result; may equal psrc, but must not otherwise overlap it
+//! \param[in] psrc The data to "encrypt"
+//! \param[in] cb The size of the block of data
+//! \param[in] key The key used in the cycle process
+//! \sa [MS-PST] 5.2
+//! \ingroup disk
+void cyclic_copy(void * pdest, const void * psrc, ulong cb, ulong key);
+
+//! \brief \ref permute_copy, one byte at a time through the tables
+//! \ingroup disk
+void permute_scalar(void * pdest, const void * psrc, ulong cb, bool encrypt);
+//! \brief \ref cyclic_copy, one byte at a time through the tables
+//! \ingroup disk
+void cyclic_scalar(void * pdest, const void * psrc, ulong cb, ulong key);
+
+#ifdef PSTSDK_X86_SIMD
+//! \brief \ref permute_copy, sixteen bytes at a time with SSSE3 shuffles
+//!
+//! Each 256 entry table is split into sixteen rows, indexed by the low
+//! nibble of a byte with PSHUFB and selected by its high nibble. Only call
+//! this if \ref ssse3_supported returns true.
+//! \ingroup disk
+void permute_ssse3(void * pdest, const void * psrc, ulong cb, bool encrypt);
+//! \brief \ref cyclic_copy, sixteen bytes at a time with SSSE3 shuffles
+//!
+//! Not chosen by \ref cyclic_copy; on the processors measured it is no
+//! faster than the scalar loop.
+//! \ingroup disk
+void cyclic_ssse3(void * pdest, const void * psrc, ulong cb, ulong key);
+//! \brief \ref permute_copy, thirty two bytes at a time with AVX2 shuffles
+//!
+//! Only call this if \ref avx2_supported returns true.
+//! \ingroup disk
+void permute_avx2(void * pdest, const void * psrc, ulong cb, bool encrypt);
+//! \brief \ref cyclic_copy, thirty two bytes at a time with AVX2 shuffles
+//! \ingroup disk
+void cyclic_avx2(void * pdest, const void * psrc, ulong cb, ulong key);
+#endif
+
+//! \brief Checks if the SSSE3 kernels can run on this processor
+//! \returns true if the library was built with them and the processor supports SSSE3
+//! \ingroup disk
+bool ssse3_supported();
+//! \brief Checks if the AVX2 kernels can run on this processor
+//! \returns true if the library was built with them, and the processor and OS support AVX2
+//! \ingroup disk
+bool avx2_supported();
+
 
 //
 // page structures
@@ -1631,41 +1762,171 @@ inline pstsdk::ushort pstsdk::disk::compute_signature(T id, T address)
     return (ushort(ushort(value >> 16) ^ ushort(value)));
 }
 
-inline pstsdk::ulong pstsdk::disk::compute_crc(const void * pdata, ulong cb)
+//! \cond disk_implementation
+namespace pstsdk
+{
+namespace disk
 {
-    ulong crc = 0;
-    const byte * pb = reinterpret_cast<const byte*>(pdata);
 
-    while(cb-- > 0)
-        crc = crc_table[(int)(byte)crc ^ *pb++] ^ (crc >> 8);
+#ifdef PSTSDK_X86_SIMD
+//! \brief Run cpuid for the given leaf (subleaf 0)
+//! \returns false if the processor doesn't implement that leaf
+inline bool cpuid(unsigned int leaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if(static_cast<unsigned int>(info[0]) < leaf)
+        return false;
+    __cpuidex(info, leaf, 0);
+    for(int i = 0; i < 4; ++i)
+        regs[i] = static_cast<unsigned int>(info[i]);
+#else
+    if(__get_cpuid_max(0, 0) < leaf)
+        return false;
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    return true;
+}
 
-    return crc;
+//! \brief Read the extended control register describing the state the OS saves
+inline ulonglong read_xcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<ulonglong>(edx) << 32) | eax;
+#endif
 }
+#endif
 
-inline void pstsdk::disk::permute(void * pdata, ulong cb, bool encrypt)
+//! \brief The tables used by \ref compute_crc_slice8
+//!
+//! table[0] is \ref crc_table; table[k] advances a byte's contribution to
+//! the CRC by k more zero bytes.
+struct crc_slice_tables
 {
-    byte * pb = reinterpret_cast<byte*>(pdata);
-    const byte * ptable = encrypt ? table1 : table3;
-    byte b;
+    crc_slice_tables()
+    {
+        for(int i = 0; i < 256; ++i)
+            table[0][i] = crc_table[i];
 
-    while(cb-- > 0)
+        for(int k = 1; k < 8; ++k)
+            for(int i = 0; i < 256; ++i)
+                table[k][i] = (table[k-1][i] >> 8) ^ crc_table[table[k-1][i] & 0xFF];
+    }
+
+    ulong table[8][256];
+};
+
+inline const crc_slice_tables& get_crc_slice_tables()
+{
+    static const crc_slice_tables tables;
+    return tables;
+}
+
+#ifdef PSTSDK_CRC_CLMUL
+//! \brief Fold cb bytes into crc with PCLMULQDQ
+//! \pre cb >= 64 and is a multiple of 16
+//!
+//! The constants are x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32) and
+//! x^64 mod P(x), then P(x) and floor(x^64 / P(x)), all bit reflected, for
+//! the CRC-32 polynomial used by the PST format. See "Fast CRC Computation
+//! for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009.
+inline PSTSDK_TARGET("sse2,pclmul") ulong crc_clmul_fold(const byte * pb, size_t cb, ulong crc)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x00));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x10));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x20));
+    __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x30));
+    __m128i x5, x6, x7, x8;
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+    pb += 64;
+    cb -= 64;
+
+    // fold four lanes of 128 bits in parallel
+    while(cb >= 64)
     {
-        b = *pb;
-        *pb++ = ptable[b];
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + 0x30)));
+
+        pb += 64;
+        cb -= 64;
     }
+
+    // fold the four lanes into one
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // then any remaining 16 byte chunks
+    while(cb >= 16)
+    {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb))), x5);
+
+        pb += 16;
+        cb -= 16;
+    }
+
+    // 128 bits down to 64
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return static_cast<ulong>(_mm_cvtsi128_si32(_mm_srli_si128(x1, 4)));
 }
+#endif
 
-inline void pstsdk::disk::cyclic(void * pdata, ulong cb, ulong key)
+//! \brief The cyclic method, given the already folded key
+inline void cyclic_bytes(byte * pd, const byte * ps, ulong cb, ushort w)
 {
-    byte * pb = reinterpret_cast<byte*>(pdata);
     byte b;
-    ushort w;
-
-    w = (ushort)(key ^ (key >> 16));
 
-    while (cb-- > 0)
+    while(cb-- > 0)
     {
-        b = *pb;
+        b = *ps++;
         b = (byte)(b + (byte)w);
         b = table1[b];
         b = (byte)(b + (byte)(w >> 8));
@@ -1673,12 +1934,370 @@ inline void pstsdk::disk::cyclic(void * pdata, ulong cb, ulong key)
         b = (byte)(b - (byte)(w >> 8));
         b = table3[b];
         b = (byte)(b - (byte)w);
-        *pb++ = b;
+        *pd++ = b;
 
         w = (ushort)(w + 1);
     }
 }
 
+#ifdef PSTSDK_X86_SIMD
+enum decode_kernel
+{
+    decode_kernel_scalar,
+    decode_kernel_ssse3,
+    decode_kernel_avx2
+};
+
+inline decode_kernel select_decode_kernel()
+{
+    if(avx2_supported())
+        return decode_kernel_avx2;
+    if(ssse3_supported())
+        return decode_kernel_ssse3;
+    return decode_kernel_scalar;
+}
+
+//! \brief A 256 entry byte table split into sixteen PSHUFB rows
+//!
+//! Rather than the rows themselves this holds the XOR of each row with the
+//! one before it, within each half of the table. Indexing with x, then
+//! x - 16, x - 32 and so on, PSHUFB returns a delta for as long as the
+//! index stays non negative and zero after; XORing those together leaves
+//! row x / 16. The same walk over x ^ 0x80 covers the upper half, and the
+//! top bit of x picks between the two.
+struct lut_ssse3
+{
+    explicit PSTSDK_TARGET("ssse3") lut_ssse3(const byte * ptable)
+    {
+        for(int i = 0; i < 16; ++i)
+        {
+            delta[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptable + 16 * i));
+            if(i % 8)
+                delta[i] = _mm_xor_si128(delta[i], _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptable + 16 * (i - 1))));
+        }
+    }
+
+    //! \brief Look up all sixteen bytes of x
+    PSTSDK_TARGET("ssse3") __m128i operator()(__m128i x) const
+    {
+        const __m128i step = _mm_set1_epi8(16);
+        __m128i lower = _mm_setzero_si128();
+        __m128i upper = _mm_setzero_si128();
+        __m128i lower_index = x;
+        __m128i upper_index = _mm_xor_si128(x, _mm_set1_epi8(static_cast<char>(0x80)));
+
+        for(int i = 0; i < 8; ++i)
+        {
+            lower = _mm_xor_si128(lower, _mm_shuffle_epi8(delta[i], lower_index));
+            upper = _mm_xor_si128(upper, _mm_shuffle_epi8(delta[i + 8], upper_index));
+            lower_index = _mm_sub_epi8(lower_index, step);
+            upper_index = _mm_sub_epi8(upper_index, step);
+        }
+
+        __m128i high = _mm_cmplt_epi8(x, _mm_setzero_si128());
+        return _mm_xor_si128(lower, _mm_and_si128(high, _mm_xor_si128(lower, upper)));
+    }
+
+    __m128i delta[16];
+};
+
+//! \brief The AVX2 flavor of \ref lut_ssse3; each row is repeated in both
+//! 128 bit lanes, since VPSHUFB doesn't cross them
+struct lut_avx2
+{
+    explicit PSTSDK_TARGET("avx2") lut_avx2(const byte * ptable)
+    {
+        for(int i = 0; i < 16; ++i)
+        {
+            __m128i row = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptable + 16 * i));
+            if(i % 8)
+                row = _mm_xor_si128(row, _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptable + 16 * (i - 1))));
+            delta[i] = _mm256_broadcastsi128_si256(row);
+        }
+    }
+
+    PSTSDK_TARGET("avx2") __m256i operator()(__m256i x) const
+    {
+        const __m256i step = _mm256_set1_epi8(16);
+        __m256i lower = _mm256_setzero_si256();
+        __m256i upper = _mm256_setzero_si256();
+        __m256i lower_index = x;
+        __m256i upper_index = _mm256_xor_si256(x, _mm256_set1_epi8(static_cast<char>(0x80)));
+
+        for(int i = 0; i < 8; ++i)
+        {
+            lower = _mm256_xor_si256(lower, _mm256_shuffle_epi8(delta[i], lower_index));
+            upper = _mm256_xor_si256(upper, _mm256_shuffle_epi8(delta[i + 8], upper_index));
+            lower_index = _mm256_sub_epi8(lower_index, step);
+            upper_index = _mm256_sub_epi8(upper_index, step);
+        }
+
+        return _mm256_blendv_epi8(lower, upper, x);
+    }
+
+    __m256i delta[16];
+};
+
+inline PSTSDK_TARGET("ssse3") void permute_ssse3_kernel(byte * pd, const byte * ps, ulong cb, const byte * ptable)
+{
+    const lut_ssse3 lut(ptable);
+
+    for(; cb >= 16; cb -= 16, ps += 16, pd += 16)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pd), lut(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ps))));
+
+    while(cb-- > 0)
+        *pd++ = ptable[*ps++];
+}
+
+inline PSTSDK_TARGET("avx2") void permute_avx2_kernel(byte * pd, const byte * ps, ulong cb, const byte * ptable)
+{
+    const lut_avx2 lut(ptable);
+
+    for(; cb >= 32; cb -= 32, ps += 32, pd += 32)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pd), lut(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(ps))));
+
+    while(cb-- > 0)
+        *pd++ = ptable[*ps++];
+}
+
+// The key for byte k of a run is w + k. Its low byte is just a byte wise
+// add of k; its high byte picks up a carry in the lanes where that add
+// wrapped, i.e. where the low byte ended up below the low byte of w.
+
+inline PSTSDK_TARGET("ssse3") void cyclic_ssse3_kernel(byte * pd, const byte * ps, ulong cb, ushort w)
+{
+    const lut_ssse3 lut1(table1), lut2(table2), lut3(table3);
+    const __m128i lanes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i sign = _mm_set1_epi8(static_cast<char>(0x80));
+
+    for(; cb >= 16; cb -= 16, ps += 16, pd += 16, w = (ushort)(w + 16))
+    {
+        __m128i base = _mm_set1_epi8(static_cast<char>(w));
+        __m128i lo = _mm_add_epi8(base, lanes);
+        __m128i carry = _mm_cmpgt_epi8(_mm_xor_si128(base, sign), _mm_xor_si128(lo, sign));
+        __m128i hi = _mm_sub_epi8(_mm_set1_epi8(static_cast<char>(w >> 8)), carry);
+
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ps));
+        b = lut1(_mm_add_epi8(b, lo));
+        b = lut2(_mm_add_epi8(b, hi));
+        b = lut3(_mm_sub_epi8(b, hi));
+        b = _mm_sub_epi8(b, lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pd), b);
+    }
+
+    cyclic_bytes(pd, ps, cb, w);
+}
+
+inline PSTSDK_TARGET("avx2") void cyclic_avx2_kernel(byte * pd, const byte * ps, ulong cb, ushort w)
+{
+    const lut_avx2 lut1(table1), lut2(table2), lut3(table3);
+    const __m256i lanes = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                           16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+    const __m256i sign = _mm256_set1_epi8(static_cast<char>(0x80));
+
+    for(; cb >= 32; cb -= 32, ps += 32, pd += 32, w = (ushort)(w + 32))
+    {
+        __m256i base = _mm256_set1_epi8(static_cast<char>(w));
+        __m256i lo = _mm256_add_epi8(base, lanes);
+        __m256i carry = _mm256_cmpgt_epi8(_mm256_xor_si256(base, sign), _mm256_xor_si256(lo, sign));
+        __m256i hi = _mm256_sub_epi8(_mm256_set1_epi8(static_cast<char>(w >> 8)), carry);
+
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ps));
+        b = lut1(_mm256_add_epi8(b, lo));
+        b = lut2(_mm256_add_epi8(b, hi));
+        b = lut3(_mm256_sub_epi8(b, hi));
+        b = _mm256_sub_epi8(b, lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pd), b);
+    }
+
+    cyclic_bytes(pd, ps, cb, w);
+}
+#endif
+
+} // end disk namespace
+} // end pstsdk namespace
+//! \endcond
+
+inline pstsdk::ulong pstsdk::disk::compute_crc(const void * pdata, ulong cb)
+{
+#ifdef PSTSDK_CRC_CLMUL
+    static const bool use_clmul = crc_clmul_supported();
+
+    if(use_clmul)
+        return compute_crc_clmul(pdata, cb);
+#endif
+
+    return compute_crc_slice8(pdata, cb);
+}
+
+inline pstsdk::ulong pstsdk::disk::compute_crc_bytewise(const void * pdata, ulong cb, ulong crc)
+{
+    const byte * pb = reinterpret_cast<const byte*>(pdata);
+
+    while(cb-- > 0)
+        crc = crc_table[(int)(byte)crc ^ *pb++] ^ (crc >> 8);
+
+    return crc;
+}
+
+inline pstsdk::ulong pstsdk::disk::compute_crc_slice8(const void * pdata, ulong cb, ulong crc)
+{
+    const ulong (*table)[256] = get_crc_slice_tables().table;
+    const byte * pb = reinterpret_cast<const byte*>(pdata);
+
+    // like the rest of the disk layer, this assumes a little endian host
+    while(cb >= 8)
+    {
+        ulong one, two;
+        memcpy(&one, pb, sizeof(one));
+        memcpy(&two, pb + 4, sizeof(two));
+        one ^= crc;
+
+        crc = table[7][one & 0xFF] ^
+              table[6][(one >> 8) & 0xFF] ^
+              table[5][(one >> 16) & 0xFF] ^
+              table[4][one >> 24] ^
+              table[3][two & 0xFF] ^
+              table[2][(two >> 8) & 0xFF] ^
+              table[1][(two >> 16) & 0xFF] ^
+              table[0][two >> 24];
+
+        pb += 8;
+        cb -= 8;
+    }
+
+    return compute_crc_bytewise(pb, cb, crc);
+}
+
+#ifdef PSTSDK_CRC_CLMUL
+inline pstsdk::ulong pstsdk::disk::compute_crc_clmul(const void * pdata, ulong cb, ulong crc)
+{
+    const byte * pb = reinterpret_cast<const byte*>(pdata);
+
+    if(cb >= 64)
+    {
+        ulong chunk = cb & ~ulong(15);
+        crc = crc_clmul_fold(pb, chunk, crc);
+        pb += chunk;
+        cb -= chunk;
+    }
+
+    return compute_crc_slice8(pb, cb, crc);
+}
+#endif
+
+inline bool pstsdk::disk::crc_clmul_supported()
+{
+#ifdef PSTSDK_CRC_CLMUL
+    unsigned int regs[4];
+    return cpuid(1, regs) && (regs[2] & (1 << 1)) != 0;
+#else
+    return false;
+#endif
+}
+
+inline bool pstsdk::disk::ssse3_supported()
+{
+#ifdef PSTSDK_X86_SIMD
+    unsigned int regs[4];
+    return cpuid(1, regs) && (regs[2] & (1 << 9)) != 0;
+#else
+    return false;
+#endif
+}
+
+inline bool pstsdk::disk::avx2_supported()
+{
+#ifdef PSTSDK_X86_SIMD
+    unsigned int regs[4];
+
+    // AVX, and the OS saves the YMM registers (OSXSAVE, then XCR0 bits 1 and 2)
+    if(!cpuid(1, regs) || (regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+        return false;
+    if((read_xcr0() & 0x6) != 0x6)
+        return false;
+
+    return cpuid(7, regs) && (regs[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+inline void pstsdk::disk::permute(void * pdata, ulong cb, bool encrypt)
+{
+    permute_copy(pdata, pdata, cb, encrypt);
+}
+
+inline void pstsdk::disk::cyclic(void * pdata, ulong cb, ulong key)
+{
+    cyclic_copy(pdata, pdata, cb, key);
+}
+
+inline void pstsdk::disk::permute_copy(void * pdest, const void * psrc, ulong cb, bool encrypt)
+{
+#ifdef PSTSDK_X86_SIMD
+    static const decode_kernel kernel = select_decode_kernel();
+
+    if(kernel == decode_kernel_avx2)
+        return permute_avx2(pdest, psrc, cb, encrypt);
+    if(kernel == decode_kernel_ssse3)
+        return permute_ssse3(pdest, psrc, cb, encrypt);
+#endif
+
+    permute_scalar(pdest, psrc, cb, encrypt);
+}
+
+inline void pstsdk::disk::cyclic_copy(void * pdest, const void * psrc, ulong cb, ulong key)
+{
+#ifdef PSTSDK_X86_SIMD
+    static const decode_kernel kernel = select_decode_kernel();
+
+    // three 16 shuffle lookups per vector only beat the scalar loop with
+    // 32 byte vectors, so cyclic_ssse3 is never picked here
+    if(kernel == decode_kernel_avx2)
+        return cyclic_avx2(pdest, psrc, cb, key);
+#endif
+
+    cyclic_scalar(pdest, psrc, cb, key);
+}
+
+inline void pstsdk::disk::permute_scalar(void * pdest, const void * psrc, ulong cb, bool encrypt)
+{
+    byte * pd = reinterpret_cast<byte*>(pdest);
+    const byte * ps = reinterpret_cast<const byte*>(psrc);
+    const byte * ptable = encrypt ? table1 : table3;
+
+    while(cb-- > 0)
+        *pd++ = ptable[*ps++];
+}
+
+inline void pstsdk::disk::cyclic_scalar(void * pdest, const void * psrc, ulong cb, ulong key)
+{
+    cyclic_bytes(reinterpret_cast<byte*>(pdest), reinterpret_cast<const byte*>(psrc), cb, (ushort)(key ^ (key >> 16)));
+}
+
+#ifdef PSTSDK_X86_SIMD
+inline void pstsdk::disk::permute_ssse3(void * pdest, const void * psrc, ulong cb, bool encrypt)
+{
+    permute_ssse3_kernel(reinterpret_cast<byte*>(pdest), reinterpret_cast<const byte*>(psrc), cb, encrypt ? table1 : table3);
+}
+
+inline void pstsdk::disk::cyclic_ssse3(void * pdest, const void * psrc, ulong cb, ulong key)
+{
+    cyclic_ssse3_kernel(reinterpret_cast<byte*>(pdest), reinterpret_cast<const byte*>(psrc), cb, (ushort)(key ^ (key >> 16)));
+}
+
+inline void pstsdk::disk::permute_avx2(void * pdest, const void * psrc, ulong cb, bool encrypt)
+{
+    permute_avx2_kernel(reinterpret_cast<byte*>(pdest), reinterpret_cast<const byte*>(psrc), cb, encrypt ? table1 : table3);
+}
+
+inline void pstsdk::disk::cyclic_avx2(void * pdest, const void * psrc, ulong cb, ulong key)
+{
+    cyclic_avx2_kernel(reinterpret_cast<byte*>(pdest), reinterpret_cast<const byte*>(psrc), cb, (ushort)(key ^ (key >> 16)));
+}
+#endif
+
 template<typename T>
 inline size_t pstsdk::disk::align_disk(size_t size)
 {
@@ -50,7 +50,7 @@ template<typename K, typename V>
 class bth_node;
 
 class heap_impl;
-typedef std::tr1::shared_ptr<heap_impl> heap_ptr;
+typedef counted_ptr<heap_impl>::type heap_ptr;
 
 //! \brief Defines a stream device for a heap allocation for use by boost iostream
 //!
@@ -90,7 +90,9 @@ typedef boost::iostreams::stream<hid_stream_device> hid_stream;
 //! objects. As more and more "child" objects are created and opened from
 //! inside the heap, they will reference the heap_impl as appropriate.
 //! \ingroup ltp_heaprelated
-class heap_impl : public std::tr1::enable_shared_from_this<heap_impl>
+class heap_impl : 
+    public ref_counted, 
+    public arena_object
 {
 public:
     //! \brief Get the size of the given allocation
@@ -136,6 +138,15 @@ public:
     //! \param[in] id The allocation to read
     //! \returns The entire allocation
     std::vector<byte> read(heap_id id) const;
+
+    //! \brief Get a view of an entire allocation
+    //!
+    //! The slice shares the buffer of the page the allocation lives on, so
+    //! nothing is copied.
+    //! \throws length_error (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the page or index of the allocation as indicated by the id are out of bounds for this node
+    //! \param[in] id The allocation to read
+    //! \returns A view of the allocation
+    byte_slice read_slice(heap_id id) const;
     
     //! \brief Creates a stream device over a specified heap allocation
     //!
@@ -172,7 +183,13 @@ private:
     heap_impl(const node& n, byte client_sig);
     heap_impl(const node& n, byte client_sig, alias_tag);
     heap_impl(const heap_impl& other) 
-        : m_node(other.m_node) { }
+        : ref_counted(other), m_node(other.m_node) { }
+
+    //! \brief Find an allocation on its page
+    //! \param[in] id The allocation, non-zero
+    //! \param[out] offset The offset of the allocation in its page
+    //! \returns The size of the allocation
+    size_t locate(heap_id id, ulong& offset) const;
 
     node m_node;
 };
@@ -248,6 +265,9 @@ public:
     //! \copydoc heap_impl::read(heap_id) const
     std::vector<byte> read(heap_id id) const
         { return m_pheap->read(id); }
+    //! \copydoc heap_impl::read_slice(heap_id) const
+    byte_slice read_slice(heap_id id) const
+        { return m_pheap->read_slice(id); }
     //! \copydoc heap_impl::open_stream()
     hid_stream_device open_stream(heap_id id)
         { return m_pheap->open_stream(id); }
@@ -293,6 +313,7 @@ private:
 template<typename K, typename V>
 class bth_node : 
     public virtual btree_node<K,V>, 
+    public arena_object,
     private boost::noncopyable
 {
 public:
@@ -457,13 +478,11 @@ inline std::tr1::shared_ptr<pstsdk::bth_node<K,V> > pstsdk::bth_node<K,V>::open_
 template<typename K, typename V>
 inline std::tr1::shared_ptr<pstsdk::bth_nonleaf_node<K,V> > pstsdk::bth_node<K,V>::open_nonleaf(const heap_ptr& h, heap_id id, ushort level)
 {
-    uint num_entries = h->size(id) / sizeof(disk::bth_nonleaf_entry<K>);
-    std::vector<byte> buffer(h->size(id));
-    disk::bth_nonleaf_node<K>* pbth_nonleaf_node = (disk::bth_nonleaf_node<K>*)&buffer[0];
+    byte_slice buffer = h->read_slice(id);
+    uint num_entries = buffer.size() / sizeof(disk::bth_nonleaf_entry<K>);
+    const disk::bth_nonleaf_node<K>* pbth_nonleaf_node = (const disk::bth_nonleaf_node<K>*)buffer.data();
     std::vector<std::pair<K, heap_id> > child_nodes;
 
-    h->read(buffer, id, 0);
-
     child_nodes.reserve(num_entries);
 
     for(uint i = 0; i < num_entries; ++i)
@@ -485,11 +504,9 @@ inline std::tr1::shared_ptr<pstsdk::bth_leaf_node<K,V> > pstsdk::bth_node<K,V>::
 
     if(id)
     {
-        uint num_entries = h->size(id) / sizeof(disk::bth_leaf_entry<K,V>);
-        std::vector<byte> buffer(h->size(id));
-        disk::bth_leaf_node<K,V>* pbth_leaf_node = (disk::bth_leaf_node<K,V>*)&buffer[0];
-
-        h->read(buffer, id, 0);
+        byte_slice buffer = h->read_slice(id);
+        uint num_entries = buffer.size() / sizeof(disk::bth_leaf_entry<K,V>);
+        const disk::bth_leaf_node<K,V>* pbth_leaf_node = (const disk::bth_leaf_node<K,V>*)buffer.data();
 
         entries.reserve(num_entries);
 
@@ -539,7 +556,7 @@ inline const pstsdk::bth_node<K,V>* pstsdk::bth_nonleaf_node<K,V>::get_child(uin
 }
 
 inline pstsdk::heap_impl::heap_impl(const node& n)
-: m_node(n)
+: ref_counted(!n.get_db_ptr()->is_single_threaded()), m_node(n)
 {
     // need to throw if the node is smaller than first_header
     disk::heap_first_header first_header = m_node.read<disk::heap_first_header>(0);
@@ -551,7 +568,7 @@ inline pstsdk::heap_impl::heap_impl(const node& n)
 }
 
 inline pstsdk::heap_impl::heap_impl(const node& n, alias_tag)
-: m_node(n, alias_tag())
+: ref_counted(!n.get_db_ptr()->is_single_threaded()), m_node(n, alias_tag())
 {
     // need to throw if the node is smaller than first_header
     disk::heap_first_header first_header = m_node.read<disk::heap_first_header>(0);
@@ -563,7 +580,7 @@ inline pstsdk::heap_impl::heap_impl(const node& n, alias_tag)
 }
 
 inline pstsdk::heap_impl::heap_impl(const node& n, byte client_sig)
-: m_node(n)
+: ref_counted(!n.get_db_ptr()->is_single_threaded()), m_node(n)
 {
     // need to throw if the node is smaller than first_header
     disk::heap_first_header first_header = m_node.read<disk::heap_first_header>(0);
@@ -577,7 +594,7 @@ inline pstsdk::heap_impl::heap_impl(const node& n, byte client_sig)
 }
 
 inline pstsdk::heap_impl::heap_impl(const node& n, byte client_sig, alias_tag)
-: m_node(n, alias_tag())
+: ref_counted(!n.get_db_ptr()->is_single_threaded()), m_node(n, alias_tag())
 {
     // need to throw if the node is smaller than first_header
     disk::heap_first_header first_header = m_node.read<disk::heap_first_header>(0);
@@ -602,33 +619,42 @@ inline pstsdk::byte pstsdk::heap_impl::get_client_signature() const
     return first_header.client_signature;
 }
 
-inline size_t pstsdk::heap_impl::size(heap_id id) const
+inline size_t pstsdk::heap_impl::locate(heap_id id, ulong& offset) const
 {
-    if(id == 0)
-        return 0;
-
     disk::heap_page_header header = m_node.read<disk::heap_page_header>(get_heap_page(id), 0);
+    size_t page_size = m_node.get_page_size(get_heap_page(id));
 
 #ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    if(header.page_map_offset > m_node.get_page_size(get_heap_page(id)))
+    if(header.page_map_offset > page_size)
         throw std::length_error("page_map_offset > node size");
 #endif
 
-    std::vector<byte> buffer(m_node.get_page_size(get_heap_page(id)) - header.page_map_offset);
-    m_node.read(buffer, get_heap_page(id), header.page_map_offset);
-    disk::heap_page_map* pmap = reinterpret_cast<disk::heap_page_map*>(&buffer[0]);
+    // the page map is only looked at, so view it in place
+    byte_slice map = m_node.read_slice(get_heap_page(id), header.page_map_offset, page_size - header.page_map_offset);
+    const disk::heap_page_map* pmap = reinterpret_cast<const disk::heap_page_map*>(map.data());
 
 #ifdef PSTSDK_VALIDATION_LEVEL_WEAK
     if(get_heap_index(id) > pmap->num_allocs)
         throw std::length_error("index > num_allocs");
 #endif
 
+    offset = pmap->allocs[get_heap_index(id)];
     return pmap->allocs[get_heap_index(id) + 1] - pmap->allocs[get_heap_index(id)];
 }
 
+inline size_t pstsdk::heap_impl::size(heap_id id) const
+{
+    if(id == 0)
+        return 0;
+
+    ulong offset;
+    return locate(id, offset);
+}
+
 inline size_t pstsdk::heap_impl::read(std::vector<byte>& buffer, heap_id id, ulong offset) const
 {
-    size_t hid_size = size(id);
+    ulong hid_offset = 0;
+    size_t hid_size = id ? locate(id, hid_offset) : 0;
 
 #ifdef PSTSDK_VALIDATION_LEVEL_WEAK
     if(buffer.size() > hid_size)
@@ -644,17 +670,23 @@ inline size_t pstsdk::heap_impl::read(std::vector<byte>& buffer, heap_id id, ulo
     if(hid_size == 0)
         return 0;
 
-    disk::heap_page_header header = m_node.read<disk::heap_page_header>(get_heap_page(id), 0);
-    std::vector<byte> map_buffer(m_node.get_page_size(get_heap_page(id)) - header.page_map_offset);
-    m_node.read(map_buffer, get_heap_page(id), header.page_map_offset);
-    disk::heap_page_map* pmap = reinterpret_cast<disk::heap_page_map*>(&map_buffer[0]);
+    return m_node.read(buffer, get_heap_page(id), hid_offset + offset);
+}
+
+inline pstsdk::byte_slice pstsdk::heap_impl::read_slice(heap_id id) const
+{
+    if(id == 0)
+        return byte_slice();
+
+    ulong offset;
+    size_t hid_size = locate(id, offset);
 
-    return m_node.read(buffer, get_heap_page(id), pmap->allocs[get_heap_index(id)] + offset);
+    return m_node.read_slice(get_heap_page(id), offset, hid_size);
 }
 
 inline pstsdk::hid_stream_device pstsdk::heap_impl::open_stream(heap_id id)
 {
-    return hid_stream_device(shared_from_this(), id);
+    return hid_stream_device(counted_from_this(const_cast<heap_impl*>(this)), id);
 }
 
 inline std::streamsize pstsdk::hid_stream_device::read(char* pbuffer, std::streamsize n)
@@ -665,10 +697,10 @@ inline std::streamsize pstsdk::hid_stream_device::read(char* pbuffer, std::strea
     if(n == 0 || m_hid == 0)
         return -1;
 
-    std::vector<byte> buff(static_cast<uint>(n));
-    size_t read = m_pheap->read(buff, m_hid, static_cast<ulong>(m_pos));
+    byte_slice data = m_pheap->read_slice(m_hid).slice(static_cast<size_t>(m_pos), static_cast<size_t>(n));
+    size_t read = data.size();
 
-    memcpy(pbuffer, &buff[0], read);
+    memcpy(pbuffer, data.data(), read);
 
     m_pos += read;
 
@@ -701,15 +733,13 @@ inline std::streampos pstsdk::hid_stream_device::seek(boost::iostreams::stream_o
 
 inline std::vector<pstsdk::byte> pstsdk::heap_impl::read(heap_id id) const
 {
-    std::vector<byte> result(size(id));
-    read(result, id, 0);
-    return result;
+    return read_slice(id).to_vector();
 }
 
 template<typename K, typename V>
 inline std::tr1::shared_ptr<pstsdk::bth_node<K,V> > pstsdk::heap_impl::open_bth(heap_id root)
 { 
-    return bth_node<K,V>::open_root(shared_from_this(), root); 
+    return bth_node<K,V>::open_root(counted_from_this(this), root); 
 }
 
 #ifdef _MSC_VER
@@ -6,10 +6,13 @@
 #ifndef PSTSDK_LTP_NAMEID_H
 #define PSTSDK_LTP_NAMEID_H
 
+#include <cstring>
 #include <string>
+#include <vector>
 #include <algorithm>
 
 #include "pstsdk/util/primitives.h"
+#include "pstsdk/util/slot_index.h"
 
 #include "pstsdk/ndb/database_iface.h"
 
@@ -70,6 +73,13 @@ private:
 //! 
 //! To use this class, one just constructs it with a store pointer
 //! and calls the various lookup overloads as needed.
+//!
+//! The whole map is read into memory when it is constructed. Each entry
+//! is decoded once into a named_prop, the GUID stream is kept as an array,
+//! and an open addressed hash index maps named props back to prop_ids, so
+//! lookups in either direction touch no streams and do no string decoding.
+//! The on disk hash buckets are not used. After construction the object is
+//! not modified, so lookups may be made from several threads at once.
 //! \sa [MS-PST] 2.4.7
 //! \ingroup ltp_namedproprelated
 class name_id_map : private boost::noncopyable
@@ -77,10 +87,11 @@ class name_id_map : private boost::noncopyable
 public:
     //! \brief Construct a name_id_map for the given store
     //!
-    //! This will open the name_id_map node for the store
+    //! This will open the name_id_map node for the store and build the
+    //! in memory index of all of its entries
+    //! \throws database_corrupt If an entry names a string or GUID which isn't present
     //! \param db The store to get the named property mapping for
-    name_id_map(const shared_db_ptr& db) 
-        : m_bag(db->lookup_node(nid_name_id_map)), m_buckets(m_bag.read_prop<slong>(0x1)), m_entry_stream(m_bag.open_prop_stream(0x3)), m_guid_stream(m_bag.open_prop_stream(0x2)), m_string_stream(m_bag.open_prop_stream(0x4)) { }
+    name_id_map(const shared_db_ptr& db);
 
     //! \brief Query if a given named prop exists
     //! \param[in] g The namespace guid for the named prop
@@ -104,7 +115,8 @@ public:
     bool prop_id_exists(prop_id id) const;
     //! \brief Get the total count of named property mappings in this store
     //! \returns The count of named property mappings in this store
-    size_t get_prop_count() const;
+    size_t get_prop_count() const
+        { return m_entries.size(); }
 
     //! \brief Get all of the prop_ids which have a named_prop mapping in this store
     //! \returns a vector of prop_ids
@@ -137,43 +149,102 @@ public:
     named_prop lookup(prop_id id) const;
 
 private:
+    //! \brief A decoded entry of the entry stream
+    struct entry
+    {
+        entry(const named_prop& p, prop_id mapped_id)
+            : prop(p), id(mapped_id) { }
+
+        named_prop prop;    //!< The named prop this entry maps
+        prop_id id;         //!< The prop_id this entry maps it to
+    };
+
+    //! \brief Matches the entries of m_entries mapping one named prop
+    struct entry_matches
+    {
+        entry_matches(const std::vector<entry>& entries, const named_prop& p)
+            : m_entries(entries), m_prop(p) { }
+        bool operator()(size_t i) const
+            { return same_named_prop(m_entries[i].prop, m_prop); }
+
+        const std::vector<entry>& m_entries;
+        const named_prop& m_prop;
+    };
+
     // helper functions
-    named_prop construct(const disk::nameid& entry) const;
-    named_prop construct(ulong index) const;
+    //! \brief Decode an entry of the entry stream
+    //! \param[in] raw The entry, as stored
+    //! \param[in] strings The string stream, [MS-PST] 2.4.7.4
+    //! \returns The named prop the entry describes
+    named_prop construct(const disk::nameid& raw, const std::vector<byte>& strings) const;
     //! \brief Given a guid index into the GUID stream, return the namespace GUID
     //! \sa [MS-PST] 2.4.7.1/wGuid
     //! \param[in] guid_index The index into the guid stream
     //! \returns The namespace GUID
     guid read_guid(ushort guid_index) const;
-    ushort get_guid_index(const guid& g) const;
-    std::wstring read_wstring(ulong string_offset) const;
-    ulong compute_hash_base(const named_prop& n) const; 
-    ulong compute_hash_value(ushort guid_index, const named_prop& n) const
-        { return (n.is_string() ? ((guid_index << 1) | 1) : (guid_index << 1)) ^ compute_hash_base(n); }
-    prop_id get_bucket_prop(ulong hash_value) const
-        { return static_cast<prop_id>((hash_value % m_buckets) + 0x1000); }
-
-    property_bag m_bag;                     //!< The property bag backing the named prop map
-    ulong m_buckets;                        //!< The number of buckets in the property bag, [NS-PST] 2.4.7.5
-    mutable prop_stream m_entry_stream;     //!< The entry stream, [MS-PST] 2.4.7.3
-    mutable prop_stream m_guid_stream;      //!< The guid stream, [MS-PST] 2.4.7.2
-    mutable prop_stream m_string_stream;    //!< The string stream, [MS-PST] 2.4.7.4
+    //! \brief Build m_index from m_entries
+    void index_entries();
+    //! \brief Find the entry mapping a named prop
+    //! \param[in] p The named prop
+    //! \returns The entry, or NULL if the named prop isn't mapped
+    const entry* find_entry(const named_prop& p) const;
+    static ulong hash_named_prop(const named_prop& p);
+    static bool same_named_prop(const named_prop& lhs, const named_prop& rhs);
+
+    std::vector<entry> m_entries;   //!< The decoded entry stream, [MS-PST] 2.4.7.3
+    std::vector<guid> m_guids;      //!< The guid stream, [MS-PST] 2.4.7.2
+    slot_index<ulong> m_index;      //!< Index of m_entries by named prop
 };
 
-inline pstsdk::named_prop pstsdk::name_id_map::construct(const disk::nameid& entry) const
+//! \brief Add a named property to a projection
+//! \throws key_not_found<named_prop> If the named prop doesn't have a prop_id mapping
+//! \param[in,out] projection The projection to add to
+//! \param[in] p The named prop
+//! \param[in] map The named property map of the store the projection will be used on
+//! \returns The prop_id the named prop maps to, to read it from a \ref prop_record with
+//! \ingroup ltp_namedproprelated
+prop_id add_named_prop(prop_projection& projection, const named_prop& p, const name_id_map& map);
+
+inline pstsdk::name_id_map::name_id_map(const shared_db_ptr& db)
 {
-    if(nameid_is_string(entry))
-        return named_prop(read_guid(disk::nameid_get_guid_index(entry)), read_wstring(entry.string_offset));
-    else
-        return named_prop(read_guid(disk::nameid_get_guid_index(entry)), entry.id);
+    property_bag bag(db->lookup_node(nid_name_id_map));
+    std::vector<byte> entries(bag.read_prop<std::vector<byte> >(0x3));
+    std::vector<byte> guids(bag.read_prop<std::vector<byte> >(0x2));
+    std::vector<byte> strings(bag.read_prop<std::vector<byte> >(0x4));
+
+    m_guids.resize(guids.size() / sizeof(guid));
+    if(!m_guids.empty())
+        memcpy(&m_guids[0], &guids[0], m_guids.size() * sizeof(guid));
+
+    size_t count = entries.size() / sizeof(disk::nameid);
+    m_entries.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        disk::nameid e;
+        memcpy(&e, &entries[i * sizeof(disk::nameid)], sizeof(e));
+        m_entries.push_back(entry(construct(e, strings), disk::nameid_get_prop_index(e) + 0x8000));
+    }
+
+    index_entries();
 }
 
-inline pstsdk::named_prop pstsdk::name_id_map::construct(ulong index) const
+inline pstsdk::named_prop pstsdk::name_id_map::construct(const disk::nameid& raw, const std::vector<byte>& strings) const
 {
-    disk::nameid entry;
-    m_entry_stream.seekg(index * sizeof(disk::nameid), std::ios_base::beg);
-    m_entry_stream.read((char*)&entry, sizeof(entry));
-    return construct(entry);
+    guid g = read_guid(disk::nameid_get_guid_index(raw));
+
+    if(!nameid_is_string(raw))
+        return named_prop(g, raw.id);
+
+    // a string is a ulong byte count followed by that many bytes of UTF-16LE
+    ulong size;
+    if(strings.size() < sizeof(size) || raw.string_offset > strings.size() - sizeof(size))
+        throw database_corrupt("name_id_map string offset out of range");
+
+    memcpy(&size, &strings[raw.string_offset], sizeof(size));
+    if(size > strings.size() - raw.string_offset - sizeof(size))
+        throw database_corrupt("name_id_map string length out of range");
+
+    return named_prop(g, bytes_to_wstring(&strings[raw.string_offset + sizeof(size)], size));
 }
 
 inline pstsdk::guid pstsdk::name_id_map::read_guid(ushort guid_index) const
@@ -185,72 +256,71 @@ inline pstsdk::guid pstsdk::name_id_map::read_guid(ushort guid_index) const
     if(guid_index == 2)
         return ps_public_strings;
 
-    guid g;
-    m_guid_stream.seekg((guid_index-3) * sizeof(guid), std::ios_base::beg);
-    m_guid_stream.read((char*)&g, sizeof(g));
-    return g;
+    if(static_cast<size_t>(guid_index - 3) >= m_guids.size())
+        throw database_corrupt("name_id_map guid index out of range");
+
+    return m_guids[guid_index - 3];
 }
 
-inline pstsdk::ushort pstsdk::name_id_map::get_guid_index(const guid& g) const
+inline void pstsdk::name_id_map::index_entries()
 {
-    if(memcmp(&g, &ps_none, sizeof(g)) == 0)
-        return 0;
-    if(memcmp(&g, &ps_mapi, sizeof(g)) == 0)
-        return 1;
-    if(memcmp(&g, &ps_public_strings, sizeof(g)) == 0)
-        return 2;
-
-    guid g_disk;
-    ushort num = 0;
-    m_guid_stream.seekg(0, std::ios_base::beg);
-    while(m_guid_stream.read((char*)&g_disk, sizeof(g_disk)))
+    m_index.reset(m_entries.size());
+
+    for(size_t i = 0; i < m_entries.size(); ++i)
     {
-        if(memcmp(&g, &g_disk, sizeof(g)) == 0)
-            return num + 3;
-        ++num;
-    }
+        // a map should never name the same property twice; if one does,
+        // the first entry wins
+        if(find_entry(m_entries[i].prop) != NULL)
+            continue;
 
-    // didn't find it
-    m_guid_stream.clear();
-    throw key_not_found<guid>(g);
+        m_index.insert(hash_named_prop(m_entries[i].prop), i);
+    }
 }
 
-inline std::wstring pstsdk::name_id_map::read_wstring(ulong string_offset) const
+inline const pstsdk::name_id_map::entry* pstsdk::name_id_map::find_entry(const named_prop& p) const
 {
-    m_string_stream.seekg(string_offset, std::ios_base::beg);
+    size_t i = m_index.find(hash_named_prop(p), entry_matches(m_entries, p));
 
-    ulong size;
-    m_string_stream.read((char*)&size, sizeof(size));
+    return i != slot_index<ulong>::npos ? &m_entries[i] : NULL;
+}
 
-    std::vector<byte> buffer(size);
-    m_string_stream.read(reinterpret_cast<char *>(&buffer[0]), size);
+inline pstsdk::ulong pstsdk::name_id_map::hash_named_prop(const named_prop& p)
+{
+    // FNV-1a over the guid, then the name or id
+    ulong hash = 2166136261u;
 
-    return bytes_to_wstring(buffer);
-}
+    const byte* pguid = reinterpret_cast<const byte*>(&p.get_guid());
+    for(size_t i = 0; i < sizeof(guid); ++i)
+        hash = (hash ^ pguid[i]) * 16777619u;
 
-inline pstsdk::ulong pstsdk::name_id_map::compute_hash_base(const named_prop& n) const {
-    if(n.is_string())
-    {
-        std::vector<byte> bytes(wstring_to_bytes(n.get_name()));
-        return disk::compute_crc(&bytes[0], bytes.size());
-    }
-    else
+    if(p.is_string())
     {
-        return n.get_id();
+        const std::wstring& name = p.get_name();
+        for(size_t i = 0; i < name.size(); ++i)
+            hash = (hash ^ static_cast<ulong>(name[i])) * 16777619u;
+        return hash ^ 1;
     }
+
+    return (hash ^ static_cast<ulong>(p.get_id())) * 16777619u;
 }
 
-inline bool pstsdk::name_id_map::named_prop_exists(const named_prop& p) const
+inline bool pstsdk::name_id_map::same_named_prop(const named_prop& lhs, const named_prop& rhs)
 {
-    try 
-    {
-        lookup(p);
-        return true;
-    }
-    catch(std::exception&)
-    {
+    if(lhs.is_string() != rhs.is_string())
         return false;
-    }
+
+    if(memcmp(&lhs.get_guid(), &rhs.get_guid(), sizeof(guid)) != 0)
+        return false;
+
+    return lhs.is_string() ? lhs.get_name() == rhs.get_name() : lhs.get_id() == rhs.get_id();
+}
+
+inline bool pstsdk::name_id_map::named_prop_exists(const named_prop& p) const
+{
+    if(memcmp(&p.get_guid(), &ps_mapi, sizeof(guid)) == 0)
+        return !p.is_string() && p.get_id() < 0x8000;
+
+    return find_entry(p) != NULL;
 }
 
 inline bool pstsdk::name_id_map::prop_id_exists(prop_id id) const
@@ -264,74 +334,30 @@ inline bool pstsdk::name_id_map::prop_id_exists(prop_id id) const
 
 inline std::vector<prop_id> pstsdk::name_id_map::get_prop_list() const
 {
-    disk::nameid entry;
     std::vector<prop_id> props;
+    props.reserve(m_entries.size());
 
-    m_entry_stream.seekg(0, std::ios_base::beg);
-    while(m_entry_stream.read((char*)&entry, sizeof(entry)) != 0)
-        props.push_back(nameid_get_prop_index(entry) + 0x8000);
-
-    m_entry_stream.clear();
+    for(size_t i = 0; i < m_entries.size(); ++i)
+        props.push_back(m_entries[i].id);
 
     return props;
 }
 
-inline size_t pstsdk::name_id_map::get_prop_count() const
-{
-    m_entry_stream.seekg(0, std::ios_base::end);
-
-    return static_cast<size_t>(m_entry_stream.tellg()) / sizeof(disk::nameid);
-}
-
 inline pstsdk::prop_id pstsdk::name_id_map::lookup(const named_prop& p) const
 {
-    ushort guid_index;
-    
-    try
-    {
-        guid_index = get_guid_index(p.get_guid());
-    }
-    catch(key_not_found<guid>&)
-    {
-        throw key_not_found<named_prop>(p);
-    }
-
     // special handling of ps_mapi
-    if(guid_index == 1)
+    if(memcmp(&p.get_guid(), &ps_mapi, sizeof(guid)) == 0)
     {
         if(p.is_string()) throw key_not_found<named_prop>(p);
         if(p.get_id() >= 0x8000) throw key_not_found<named_prop>(p);
         return static_cast<prop_id>(p.get_id());
     }
 
-    ulong hash_value = compute_hash_value(guid_index, p);
-    ulong hash_base = compute_hash_base(p);
-
-    if(!m_bag.prop_exists(get_bucket_prop(hash_value)))
+    const entry* pentry = find_entry(p);
+    if(pentry == NULL)
         throw key_not_found<named_prop>(p);
 
-    prop_stream bucket(const_cast<name_id_map*>(this)->m_bag.open_prop_stream(get_bucket_prop(hash_value)));
-    disk::nameid_hash_entry entry;
-    while(bucket.read((char*)&entry, sizeof(entry)) != 0)
-    {
-        if( (entry.hash_base == hash_base) &&
-            (disk::nameid_is_string(entry) == p.is_string()) &&
-            (disk::nameid_get_guid_index(entry) == guid_index)
-        )
-        {
-            // just double check the string..
-            if(p.is_string())
-            {
-                if(construct(disk::nameid_get_prop_index(entry)).get_name() != p.get_name())
-                    continue;
-            }
-
-            // found it!
-            return disk::nameid_get_prop_index(entry) + 0x8000;
-        }
-    }
-
-    throw key_not_found<named_prop>(p);
+    return pentry->id;
 }
 
 inline pstsdk::named_prop pstsdk::name_id_map::lookup(prop_id id) const
@@ -341,10 +367,18 @@ inline pstsdk::named_prop pstsdk::name_id_map::lookup(prop_id id) const
 
     ulong index = id - 0x8000;
 
-    if(index > get_prop_count())
+    if(index >= get_prop_count())
         throw key_not_found<prop_id>(id);
 
-    return construct(index);
+    return m_entries[index].prop;
+}
+
+inline prop_id add_named_prop(prop_projection& projection, const named_prop& p, const name_id_map& map)
+{
+    prop_id id = map.lookup(p);
+    projection.add(id);
+
+    return id;
 }
 
 } // end namespace pstsdk
@@ -33,6 +33,7 @@
 
 #include "pstsdk/util/primitives.h"
 #include "pstsdk/util/errors.h"
+#include "pstsdk/util/unicode.h"
 
 #include "pstsdk/ltp/heap.h"
 
@@ -138,6 +139,39 @@ public:
     template<typename T>
     std::vector<T> read_prop_array(prop_id id) const;
 
+    //! \brief Read a string property as UTF-8
+    //!
+    //! Unicode strings are converted straight from their stored UTF-16LE
+    //! without going through a std::wstring. 8-bit strings are read in the
+    //! object's PidTagMessageCodepage, or failing that its
+    //! PidTagInternetCodepage, and in Windows-1252 if it has neither (see
+    //! \ref ansi_to_utf8). Unlike read_prop<std::string>, characters
+    //! outside of 8 bits are not truncated.
+    //! \param[in] id The prop_id
+    //! \throws key_not_found<prop_id> If the specified property is not present
+    //! \throws not_implemented If an 8-bit string is in a codepage \ref ansi_to_utf8 doesn't understand
+    //! \returns The property value, in UTF-8
+    std::string read_prop_utf8(prop_id id) const;
+
+    //! \brief Read a multivalued string property as UTF-8
+    //! \param[in] id The prop_id
+    //! \throws key_not_found<prop_id> If the specified property is not present
+    //! \throws not_implemented If the strings are 8-bit, in a codepage \ref ansi_to_utf8 doesn't understand
+    //! \returns A vector of the property values, in UTF-8
+    //! \sa read_prop_utf8
+    std::vector<std::string> read_prop_array_utf8(prop_id id) const;
+
+    //! \brief Get a view of a variable length property's raw bytes
+    //!
+    //! Where the property lives in a single page of the underlying node
+    //! this doesn't copy it; the slice shares that page's buffer.
+    //! \note This operation is only valid for variable length properties
+    //! \param[in] id The prop_id
+    //! \throws key_not_found<prop_id> If the specified property is not present
+    //! \returns A view of the property value
+    byte_slice read_prop_slice(prop_id id) const
+        { return get_value_variable(id); }
+
     //! \brief Creates a stream device over a property on this object
     //!
     //! The returned stream device can be used to construct a proper stream:
@@ -162,6 +196,10 @@ public:
 #endif
 
 protected:
+    //! \brief The codepage this object's 8-bit strings are in
+    //! \sa read_prop_utf8
+    ulong get_codepage() const;
+
     //! \brief Implemented by child classes to fetch a 1 byte sized property
     virtual byte get_value_1(prop_id id) const = 0;
     //! \brief Implemented by child classes to fetch a 2 byte sized property
@@ -171,7 +209,7 @@ protected:
     //! \brief Implemented by child classes to fetch a 8 byte sized property
     virtual ulonglong get_value_8(prop_id id) const = 0;
     //! \brief Implemented by child classes to fetch a variable sized property
-    virtual std::vector<byte> get_value_variable(prop_id id) const = 0;
+    virtual byte_slice get_value_variable(prop_id id) const = 0;
 };
 
 } // end pstsdk namespace
@@ -207,8 +245,10 @@ inline T pstsdk::const_property_object::read_prop(prop_id id) const
     }
     else
     {
-        std::vector<byte> buffer = get_value_variable(id);
-        return *(reinterpret_cast<T*>(&buffer[0]));
+        byte_slice buffer = get_value_variable(id);
+        T t;
+        memcpy(&t, buffer.data(), sizeof(T));
+        return t;
     }
 }
 
@@ -221,8 +261,11 @@ inline std::vector<T> pstsdk::const_property_object::read_prop_array(prop_id id)
     if(!std::tr1::is_pod<T>::value)
         throw std::invalid_argument("T must be a POD or one of the specialized classes");
 
-    std::vector<byte> buffer = get_value_variable(id); 
-    return std::vector<T>(reinterpret_cast<T*>(&buffer[0]), reinterpret_cast<T*>(&buffer[0] + buffer.size()));
+    byte_slice buffer = get_value_variable(id); 
+    std::vector<T> results(buffer.size() / sizeof(T));
+    if(!results.empty())
+        memcpy(&results[0], buffer.data(), results.size() * sizeof(T));
+    return results;
 }
 
 namespace pstsdk
@@ -293,18 +336,18 @@ inline std::vector<time_t> const_property_object::read_prop_array<time_t>(prop_i
 template<>
 inline std::vector<byte> const_property_object::read_prop<std::vector<byte> >(prop_id id) const
 {
-    return get_value_variable(id); 
+    return get_value_variable(id).to_vector(); 
 }
 
 template<>
 inline std::vector<std::vector<byte> > const_property_object::read_prop_array<std::vector<byte> >(prop_id id) const
 {
-    std::vector<byte> buffer = get_value_variable(id);
+    byte_slice buffer = get_value_variable(id);
 #ifdef PSTSDK_VALIDATION_LEVEL_WEAK
     if(buffer.size() < sizeof(ulong))
         throw std::length_error("mv prop too short");
 #endif
-    disk::mv_toc* ptoc = reinterpret_cast<disk::mv_toc*>(&buffer[0]);
+    const disk::mv_toc* ptoc = reinterpret_cast<const disk::mv_toc*>(buffer.data());
     std::vector<std::vector<byte> > results;
 
 #ifdef PSTSDK_VALIDATION_LEVEL_WEAK
@@ -320,7 +363,7 @@ inline std::vector<std::vector<byte> > const_property_object::read_prop_array<st
         if(end < start)
             throw std::length_error("inconsistent mv prop toc");
 #endif
-        results.push_back(std::vector<byte>(&buffer[start], &buffer[start] + (end-start)));
+        results.push_back(std::vector<byte>(buffer.begin() + start, buffer.begin() + end));
     }
 
     return results;
@@ -329,7 +372,7 @@ inline std::vector<std::vector<byte> > const_property_object::read_prop_array<st
 template<>
 inline std::wstring const_property_object::read_prop<std::wstring>(prop_id id) const
 {
-    std::vector<byte> buffer = get_value_variable(id); 
+    byte_slice buffer = get_value_variable(id); 
 
     if(get_prop_type(id) == prop_type_string)
     {
@@ -338,7 +381,7 @@ inline std::wstring const_property_object::read_prop<std::wstring>(prop_id id) c
     }
     else
     {
-        return bytes_to_wstring(buffer);
+        return bytes_to_wstring(buffer.data(), buffer.size());
     }
 }
 
@@ -367,7 +410,7 @@ inline std::vector<std::wstring> const_property_object::read_prop_array<std::wst
 template<>
 inline std::string const_property_object::read_prop<std::string>(prop_id id) const
 {
-    std::vector<byte> buffer = get_value_variable(id); 
+    byte_slice buffer = get_value_variable(id); 
 
     if(get_prop_type(id) == prop_type_string)
     {
@@ -377,7 +420,7 @@ inline std::string const_property_object::read_prop<std::string>(prop_id id) con
     {
         if(buffer.size())
         {
-            std::wstring s(bytes_to_wstring(buffer));
+            std::wstring s(bytes_to_wstring(buffer.data(), buffer.size()));
             return std::string(s.begin(), s.end());
         }
         return std::string();
@@ -403,7 +446,10 @@ inline std::vector<std::string> const_property_object::read_prop_array<std::stri
                 std::wstring s(bytes_to_wstring(buffer[i]));
                 results.push_back(std::string(s.begin(), s.end()));
             }
-            results.push_back(std::string());
+            else
+            {
+                results.push_back(std::string());
+            }
         }
     }
 
@@ -412,4 +458,48 @@ inline std::vector<std::string> const_property_object::read_prop_array<std::stri
 
 } // end pstsdk namespace
 
+inline pstsdk::ulong pstsdk::const_property_object::get_codepage() const
+{
+    // PidTagMessageCodepage, then PidTagInternetCodepage
+    const prop_id codepage_props[] = { 0x3FFD, 0x3FDE };
+
+    for(size_t i = 0; i < sizeof(codepage_props) / sizeof(codepage_props[0]); ++i)
+    {
+        if(prop_exists(codepage_props[i]) && get_prop_type(codepage_props[i]) == prop_type_long)
+            return get_value_4(codepage_props[i]);
+    }
+
+    return default_codepage;
+}
+
+inline std::string pstsdk::const_property_object::read_prop_utf8(prop_id id) const
+{
+    byte_slice buffer = get_value_variable(id);
+
+    if(get_prop_type(id) == prop_type_string)
+        return ansi_to_utf8(buffer.data(), buffer.size(), get_codepage());
+    else
+        return utf16le_to_utf8(buffer.data(), buffer.size());
+}
+
+inline std::vector<std::string> pstsdk::const_property_object::read_prop_array_utf8(prop_id id) const
+{
+    std::vector<std::vector<byte> > buffer = read_prop_array<std::vector<byte> >(id);
+    std::vector<std::string> results;
+    results.reserve(buffer.size());
+
+    bool ansi = (get_prop_type(id) == prop_type_mv_string);
+    ulong codepage = ansi ? get_codepage() : default_codepage;
+    for(size_t i = 0; i < buffer.size(); ++i)
+    {
+        const byte* pbytes = buffer[i].empty() ? NULL : &buffer[i][0];
+        if(ansi)
+            results.push_back(ansi_to_utf8(pbytes, buffer[i].size(), codepage));
+        else
+            results.push_back(utf16le_to_utf8(pbytes, buffer[i].size()));
+    }
+
+    return results;
+}
+
 #endif
@@ -27,6 +27,43 @@ typedef bth_nonleaf_node<prop_id, disk::prop_entry> pc_bth_nonleaf_node;
 typedef bth_leaf_node<prop_id, disk::prop_entry> pc_bth_leaf_node;
 //@}
 
+class prop_record;
+
+//! \brief A set of properties to read from property bags in one pass
+//!
+//! The set is kept sorted, so \ref property_bag::project can find all of
+//! its properties in a single ordered walk over the BTH rather than one
+//! lookup per property. The properties are read back from the resulting
+//! \ref prop_record by prop_id. Named properties are resolved to prop_ids
+//! as they are added (see \ref add_named_prop), so a projection built once
+//! can be applied to every message in a store.
+//! \ingroup ltp_objectrelated
+class prop_projection
+{
+public:
+    //! \brief Construct an empty projection
+    prop_projection() { }
+    //! \brief Construct a projection of the given properties
+    //! \param[in] props The prop_ids
+    explicit prop_projection(const std::vector<prop_id>& props);
+
+    //! \brief Add a property to the projection
+    //!
+    //! Adding a property already in the projection does nothing.
+    //! \param[in] id The prop_id
+    void add(prop_id id);
+
+    //! \brief Get the number of properties in this projection
+    //! \returns The number of distinct prop_ids
+    size_t size() const { return m_sorted.size(); }
+    //! \brief Get the prop_ids of this projection
+    //! \returns The prop_ids, in ascending order
+    const std::vector<prop_id>& get_sorted_props() const { return m_sorted; }
+
+private:
+    std::vector<prop_id> m_sorted;  //!< The distinct prop_ids added, ascending
+};
+
 //! \brief Property Context (PC) Implementation
 //!
 //! A Property Context is simply a BTH where the BTH is stored as the client
@@ -35,6 +72,13 @@ typedef bth_leaf_node<prop_id, disk::prop_entry> pc_bth_leaf_node;
 //!
 //! const_property_object does most of the heavy lifting in terms of 
 //! property access and interpretation.
+//!
+//! On construction the BTH entries are copied into a sorted array of
+//! prop_ids and a parallel array of prop_entries, and every lookup is a
+//! binary search of the first array. Most PCs are a single BTH leaf, so
+//! this costs one copy of an array which is already in memory. The arrays
+//! are never changed afterwards, so a property_bag can be read from
+//! several threads at once.
 //! \sa [MS-PST] 2.3.3
 //! \ingroup ltp_objectrelated
 class property_bag : public const_property_object
@@ -62,15 +106,34 @@ public:
 #ifndef BOOST_NO_RVALUE_REFERENCES
     //! \brief Move construct a property_bag
     //! \param other The property bag to move from
-    property_bag(property_bag&& other) : m_pbth(std::move(other.m_pbth)) { }
+    property_bag(property_bag&& other)
+        : m_pbth(std::move(other.m_pbth)), m_ids(std::move(other.m_ids)), m_entries(std::move(other.m_entries)) { }
 #endif
 
     std::vector<prop_id> get_prop_list() const;
     prop_type get_prop_type(prop_id id) const
-        { return (prop_type)m_pbth->lookup(id).type; }
+        { return (prop_type)find(id).type; }
     bool prop_exists(prop_id id) const;
     size_t size(prop_id id) const;
     hnid_stream_device open_prop_stream(prop_id id);
+    //! \brief Hand a variable length property, a page at a time, to a sink
+    //!
+    //! A property in the heap is written as one slice of its heap page; a
+    //! property in a subnode is written with \ref node::for_each_page, so
+    //! only one of its pages is held at a time.
+    //! \param[in] id The prop_id
+    //! \param[in] sink The sink to write the property to
+    //! \throws key_not_found<prop_id> If the specified property is not present
+    //! \returns The number of bytes written to the sink
+    size_t for_each_prop_page(prop_id id, page_sink& sink) const;
+
+    //! \brief Read the properties of a projection in one pass
+    //!
+    //! Merges the projection's sorted prop_ids with this bag's sorted
+    //! entries in a single ordered pass.
+    //! \param[in] projection The properties to read
+    //! \returns A record of those of the properties this bag has
+    prop_record project(const prop_projection& projection) const;
     
     //! \brief Get the node underlying this property_bag
     //! \returns The node
@@ -80,19 +143,85 @@ public:
     node& get_node() { return m_pbth->get_node(); }
 
 private:
+    friend class prop_record;
     property_bag& operator=(const property_bag& other); // = delete
 
     byte get_value_1(prop_id id) const
-        { return (byte)m_pbth->lookup(id).id; }
+        { return (byte)find(id).id; }
     ushort get_value_2(prop_id id) const
-        { return (ushort)m_pbth->lookup(id).id; }
+        { return (ushort)find(id).id; }
     ulong get_value_4(prop_id id) const
-        { return (ulong)m_pbth->lookup(id).id; }
+        { return (ulong)find(id).id; }
     ulonglong get_value_8(prop_id id) const;
-    std::vector<byte> get_value_variable(prop_id id) const;
-    void get_prop_list_impl(std::vector<prop_id>& proplist, const pc_bth_node* pbth_node) const;
+    byte_slice get_value_variable(prop_id id) const;
+    //! \brief Copy the BTH entries into m_ids and m_entries
+    //! \throws database_corrupt (\ref PSTSDK_VALIDATION_LEVEL_FULL) If the BTH keys aren't ascending
+    void flatten();
+    //! \brief Append the entries under a BTH node to m_ids and m_entries
+    void flatten_impl(const pc_bth_node* pbth_node);
+    //! \brief Find the BTH entry of a property
+    //! \throws key_not_found<prop_id> If the property is not present
+    //! \param[in] id The prop_id
+    //! \returns The entry
+    const disk::prop_entry& find(prop_id id) const;
+
+    // shared with prop_record, which reads values out of the same heap
+    static const disk::prop_entry* find_entry(const std::vector<prop_id>& ids, const std::vector<disk::prop_entry>& entries, prop_id id);
+    static byte_slice read_hnid(pc_bth_node& bth, heapnode_id h_id);
+    static size_t hnid_size(pc_bth_node& bth, heapnode_id h_id);
+    static hnid_stream_device open_hnid_stream(pc_bth_node& bth, heapnode_id h_id);
 
     std::tr1::shared_ptr<pc_bth_node> m_pbth;
+    std::vector<prop_id> m_ids;                 //!< The prop_ids of the BTH, ascending
+    std::vector<disk::prop_entry> m_entries;    //!< The BTH entry of each of m_ids
+};
+
+//! \brief The properties of a property_bag named by a prop_projection
+//!
+//! Returned by \ref property_bag::project. The BTH entries of the projected
+//! properties the bag has are copied into a small sorted array, so reading
+//! them does no BTH lookups; variable length values are still read from the
+//! bag's heap or subnodes when asked for. Properties of the projection the
+//! bag doesn't have don't exist on the record. The record shares the bag's
+//! heap, so it remains valid after the bag is gone.
+//! \ingroup ltp_objectrelated
+class prop_record : public const_property_object
+{
+public:
+    std::vector<prop_id> get_prop_list() const
+        { return m_ids; }
+    prop_type get_prop_type(prop_id id) const
+        { return (prop_type)find(id).type; }
+    bool prop_exists(prop_id id) const
+        { return property_bag::find_entry(m_ids, m_entries, id) != NULL; }
+    size_t size(prop_id id) const
+        { return property_bag::hnid_size(*m_pbth, (heapnode_id)find(id).id); }
+    hnid_stream_device open_prop_stream(prop_id id)
+        { return property_bag::open_hnid_stream(*m_pbth, (heapnode_id)find(id).id); }
+
+private:
+    friend class property_bag;
+    explicit prop_record(const std::tr1::shared_ptr<pc_bth_node>& pbth)
+        : m_pbth(pbth) { }
+
+    byte get_value_1(prop_id id) const
+        { return (byte)find(id).id; }
+    ushort get_value_2(prop_id id) const
+        { return (ushort)find(id).id; }
+    ulong get_value_4(prop_id id) const
+        { return (ulong)find(id).id; }
+    ulonglong get_value_8(prop_id id) const;
+    byte_slice get_value_variable(prop_id id) const
+        { return property_bag::read_hnid(*m_pbth, (heapnode_id)find(id).id); }
+    //! \brief Find the BTH entry of a property
+    //! \throws key_not_found<prop_id> If the property isn't in this record
+    //! \param[in] id The prop_id
+    //! \returns The entry
+    const disk::prop_entry& find(prop_id id) const;
+
+    std::vector<prop_id> m_ids;                 //!< The prop_ids present, ascending
+    std::vector<disk::prop_entry> m_entries;    //!< The BTH entry of each of m_ids
+    std::tr1::shared_ptr<pc_bth_node> m_pbth;   //!< The BTH of the bag, for its heap and node
 };
 
 } // end pstsdk namespace
@@ -102,6 +231,7 @@ inline pstsdk::property_bag::property_bag(const pstsdk::node& n)
     heap h(n, disk::heap_sig_pc);
 
     m_pbth = h.open_bth<prop_id, disk::prop_entry>(h.get_root_id());
+    flatten();
 }
 
 inline pstsdk::property_bag::property_bag(const pstsdk::node& n, alias_tag)
@@ -109,6 +239,7 @@ inline pstsdk::property_bag::property_bag(const pstsdk::node& n, alias_tag)
     heap h(n, disk::heap_sig_pc, alias_tag());
 
     m_pbth = h.open_bth<prop_id, disk::prop_entry>(h.get_root_id());
+    flatten();
 }
 
 inline pstsdk::property_bag::property_bag(const pstsdk::heap& h)
@@ -121,6 +252,7 @@ inline pstsdk::property_bag::property_bag(const pstsdk::heap& h)
     heap my_heap(h);
 
     m_pbth = my_heap.open_bth<prop_id, disk::prop_entry>(my_heap.get_root_id());
+    flatten();
 }
 
 inline pstsdk::property_bag::property_bag(const pstsdk::heap& h, alias_tag)
@@ -133,9 +265,11 @@ inline pstsdk::property_bag::property_bag(const pstsdk::heap& h, alias_tag)
     heap my_heap(h, alias_tag());
 
     m_pbth = my_heap.open_bth<prop_id, disk::prop_entry>(my_heap.get_root_id());
+    flatten();
 }
 
 inline pstsdk::property_bag::property_bag(const property_bag& other)
+: m_ids(other.m_ids), m_entries(other.m_entries)
 {
     heap h(other.m_pbth->get_node());
 
@@ -143,6 +277,7 @@ inline pstsdk::property_bag::property_bag(const property_bag& other)
 }
 
 inline pstsdk::property_bag::property_bag(const property_bag& other, alias_tag)
+: m_ids(other.m_ids), m_entries(other.m_entries)
 {
     heap h(other.m_pbth->get_node(), alias_tag());
 
@@ -151,94 +286,206 @@ inline pstsdk::property_bag::property_bag(const property_bag& other, alias_tag)
 
 inline std::vector<pstsdk::prop_id> pstsdk::property_bag::get_prop_list() const
 {
-    std::vector<prop_id> proplist;
+    return m_ids;
+}
 
-    get_prop_list_impl(proplist, m_pbth.get());
+inline void pstsdk::property_bag::flatten()
+{
+    flatten_impl(m_pbth.get());
 
-    return proplist;
+#ifdef PSTSDK_VALIDATION_LEVEL_FULL
+    // every lookup is a binary search, which needs the keys in order
+    for(size_t i = 1; i < m_ids.size(); ++i)
+    {
+        if(m_ids[i - 1] >= m_ids[i])
+            throw database_corrupt("property_bag: BTH keys are not ascending");
+    }
+#endif
 }
 
-inline void pstsdk::property_bag::get_prop_list_impl(std::vector<prop_id>& proplist, const pc_bth_node* pbth_node) const
+inline void pstsdk::property_bag::flatten_impl(const pc_bth_node* pbth_node)
 {
     if(pbth_node->get_level() == 0)
     {
         // leaf
         const pc_bth_leaf_node* pleaf = static_cast<const pc_bth_leaf_node*>(pbth_node);
 
+        m_ids.reserve(m_ids.size() + pleaf->num_values());
+        m_entries.reserve(m_entries.size() + pleaf->num_values());
+
         for(uint i = 0; i < pleaf->num_values(); ++i)
-            proplist.push_back(pleaf->get_key(i));
+        {
+            m_ids.push_back(pleaf->get_key(i));
+            m_entries.push_back(pleaf->get_value(i));
+        }
     }
     else
     {
         // non-leaf
         const pc_bth_nonleaf_node* pnonleaf = static_cast<const pc_bth_nonleaf_node*>(pbth_node); 
         for(uint i = 0; i < pnonleaf->num_values(); ++i)
-            get_prop_list_impl(proplist, pnonleaf->get_child(i));
+            flatten_impl(pnonleaf->get_child(i));
     }
 }
 
-inline bool pstsdk::property_bag::prop_exists(prop_id id) const
+inline const pstsdk::disk::prop_entry* pstsdk::property_bag::find_entry(const std::vector<prop_id>& ids, const std::vector<disk::prop_entry>& entries, prop_id id)
 {
-    try
-    {
-        (void)m_pbth->lookup(id);
-    }
-    catch(key_not_found<prop_id>&)
-    {
-        return false;
-    }
+    std::vector<prop_id>::const_iterator pos = std::lower_bound(ids.begin(), ids.end(), id);
+
+    if(pos == ids.end() || *pos != id)
+        return NULL;
 
-    return true;
+    return &entries[pos - ids.begin()];
+}
+
+inline const pstsdk::disk::prop_entry& pstsdk::property_bag::find(prop_id id) const
+{
+    const disk::prop_entry* pentry = find_entry(m_ids, m_entries, id);
+    if(pentry == NULL)
+        throw key_not_found<prop_id>(id);
+
+    return *pentry;
+}
+
+inline bool pstsdk::property_bag::prop_exists(prop_id id) const
+{
+    return find_entry(m_ids, m_entries, id) != NULL;
 }
 
 
 inline pstsdk::ulonglong pstsdk::property_bag::get_value_8(prop_id id) const
 {
-    std::vector<byte> buffer = get_value_variable(id);
+    byte_slice buffer = get_value_variable(id);
 
-    return *(ulonglong*)&buffer[0];
+    return *(const ulonglong*)buffer.data();
 }
 
-inline std::vector<pstsdk::byte> pstsdk::property_bag::get_value_variable(prop_id id) const
+inline pstsdk::byte_slice pstsdk::property_bag::get_value_variable(prop_id id) const
 {
-    heapnode_id h_id = (heapnode_id)get_value_4(id);
-    std::vector<byte> buffer;
+    return read_hnid(*m_pbth, (heapnode_id)get_value_4(id));
+}
 
+inline pstsdk::byte_slice pstsdk::property_bag::read_hnid(pc_bth_node& bth, heapnode_id h_id)
+{
     if(is_subnode_id(h_id))
     {
-        node sub(m_pbth->get_node().lookup(h_id));
-        buffer.resize(sub.size());
-        sub.read(buffer, 0);
+        node sub(bth.get_node().lookup(h_id));
+        return sub.read_slice(0, sub.size());
     }
     else
     {
-        buffer = m_pbth->get_heap_ptr()->read(h_id);
+        return bth.get_heap_ptr()->read_slice(h_id);
     }
-
-    return buffer;
 }
 
 
 inline size_t pstsdk::property_bag::size(prop_id id) const
 {
-    heapnode_id h_id = (heapnode_id)get_value_4(id);
+    return hnid_size(*m_pbth, (heapnode_id)get_value_4(id));
+}
 
+inline size_t pstsdk::property_bag::hnid_size(pc_bth_node& bth, heapnode_id h_id)
+{
     if(is_subnode_id(h_id))
-        return node(m_pbth->get_node().lookup(h_id)).size();
+        return node(bth.get_node().lookup(h_id)).size();
     else
-        return m_pbth->get_heap_ptr()->size(h_id);
+        return bth.get_heap_ptr()->size(h_id);
 }
 
-inline pstsdk::hnid_stream_device pstsdk::property_bag::open_prop_stream(prop_id id)
+inline size_t pstsdk::property_bag::for_each_prop_page(prop_id id, page_sink& sink) const
 {
     heapnode_id h_id = (heapnode_id)get_value_4(id);
 
     if(h_id == 0)
-        return m_pbth->get_heap_ptr()->open_stream(h_id);
+        return 0;
+
+    if(is_subnode_id(h_id))
+        return m_pbth->get_node().lookup(h_id).for_each_page(sink);
+
+    byte_slice data = m_pbth->get_heap_ptr()->read_slice(h_id);
+    if(!data.empty())
+        sink.write(data);
+
+    return data.size();
+}
+
+inline pstsdk::hnid_stream_device pstsdk::property_bag::open_prop_stream(prop_id id)
+{
+    return open_hnid_stream(*m_pbth, (heapnode_id)get_value_4(id));
+}
+
+inline pstsdk::hnid_stream_device pstsdk::property_bag::open_hnid_stream(pc_bth_node& bth, heapnode_id h_id)
+{
+    if(h_id == 0)
+        return bth.get_heap_ptr()->open_stream(h_id);
 
     if(is_subnode_id(h_id))
-        return m_pbth->get_node().lookup(h_id).open_as_stream();
+        return bth.get_node().lookup(h_id).open_as_stream();
     else
-        return m_pbth->get_heap_ptr()->open_stream(h_id);
+        return bth.get_heap_ptr()->open_stream(h_id);
+}
+
+inline pstsdk::prop_record pstsdk::property_bag::project(const prop_projection& projection) const
+{
+    const std::vector<prop_id>& props = projection.get_sorted_props();
+    prop_record record(m_pbth);
+
+    record.m_ids.reserve(props.size());
+    record.m_entries.reserve(props.size());
+
+    // merge the two ascending lists
+    size_t i = 0;
+    size_t j = 0;
+    while(i < m_ids.size() && j < props.size())
+    {
+        if(m_ids[i] < props[j])
+        {
+            ++i;
+        }
+        else if(props[j] < m_ids[i])
+        {
+            ++j;
+        }
+        else
+        {
+            record.m_ids.push_back(m_ids[i]);
+            record.m_entries.push_back(m_entries[i]);
+            ++i;
+            ++j;
+        }
+    }
+
+    return record;
+}
+
+inline pstsdk::prop_projection::prop_projection(const std::vector<prop_id>& props)
+: m_sorted(props)
+{
+    std::sort(m_sorted.begin(), m_sorted.end());
+    m_sorted.erase(std::unique(m_sorted.begin(), m_sorted.end()), m_sorted.end());
+}
+
+inline void pstsdk::prop_projection::add(prop_id id)
+{
+    std::vector<prop_id>::iterator pos = std::lower_bound(m_sorted.begin(), m_sorted.end(), id);
+
+    if(pos == m_sorted.end() || *pos != id)
+        m_sorted.insert(pos, id);
+}
+
+inline pstsdk::ulonglong pstsdk::prop_record::get_value_8(prop_id id) const
+{
+    byte_slice buffer = get_value_variable(id);
+
+    return *(const ulonglong*)buffer.data();
+}
+
+inline const pstsdk::disk::prop_entry& pstsdk::prop_record::find(prop_id id) const
+{
+    const disk::prop_entry* pentry = property_bag::find_entry(m_ids, m_entries, id);
+    if(pentry == NULL)
+        throw key_not_found<prop_id>(id);
+
+    return *pentry;
 }
 #endif
@@ -6,15 +6,12 @@
 #ifndef PSTSDK_LTP_TABLE_H
 #define PSTSDK_LTP_TABLE_H
 
+#include <algorithm>
 #include <vector>
-#if __GNUC__
-# include <tr1/unordered_map>
-#else
-# include <unordered_map>
-#endif
 #include <boost/iterator/iterator_facade.hpp>
 
 #include "pstsdk/util/primitives.h"
+#include "pstsdk/util/slot_index.h"
 
 #include "pstsdk/ndb/node.h"
 
@@ -27,8 +24,8 @@ namespace pstsdk
 class table_impl;
 //! \addtogroup ltp_objectrelated
 //@{
-typedef std::tr1::shared_ptr<table_impl> table_ptr;
-typedef std::tr1::shared_ptr<const table_impl> const_table_ptr;
+typedef counted_ptr<table_impl>::type table_ptr;
+typedef counted_ptr<const table_impl>::type const_table_ptr;
 //@}
 
 //! \brief Open the specified node as a table
@@ -80,7 +77,7 @@ private:
     ushort get_value_2(prop_id id) const;
     ulong get_value_4(prop_id id) const;
     ulonglong get_value_8(prop_id id) const;
-    std::vector<byte> get_value_variable(prop_id id) const;
+    byte_slice get_value_variable(prop_id id) const;
 
     ulong m_position;           //!< The row this object represents
     const_table_ptr m_table;    //!< The table this object is a part of
@@ -123,6 +120,66 @@ private:
     const_table_ptr m_table;
 };
 
+//! \brief A table column, resolved once for use across many rows
+//!
+//! Returned by \ref table_impl::prepare_column. It records where the column
+//! lives in a row, so reading a cell through it skips looking the column up
+//! again. It is only meaningful to the table which prepared it.
+//! \ingroup ltp_objectrelated
+class prepared_column
+{
+public:
+    //! \brief Construct a handle to a column which isn't in any table
+    //! \param[in] id The prop_id of the column
+    explicit prepared_column(prop_id id = 0)
+        : m_present(false) { memset(&m_column, 0, sizeof(m_column)); m_column.id = id; }
+    //! \brief Construct a handle to a column of a table
+    //! \param[in] column The column, as described by the table's TCINFO
+    explicit prepared_column(const disk::column_description& column)
+        : m_column(column), m_present(true) { }
+
+    //! \brief Get the prop_id of this column
+    //! \returns The prop_id
+    prop_id get_id() const { return m_column.id; }
+    //! \brief Is this column in the table it was prepared against?
+    //! \returns false if no row of the table can have this property
+    bool is_present() const { return m_present; }
+    //! \brief Get the description of this column
+    //! \pre is_present()
+    //! \returns The column description
+    const disk::column_description& get_description() const { return m_column; }
+
+private:
+    disk::column_description m_column;
+    bool m_present;
+};
+
+//! \brief One column of a batch read from a table
+//!
+//! The caller fills in id; \ref table_impl::read_columns fills in the rest,
+//! one entry per row read. Cells are returned the way
+//! \ref table_impl::get_cell_value returns them: the value itself for
+//! fixed size properties, and the heapnode_id of the data for variable
+//! length properties (see \ref table_impl::read_cell).
+//! \ingroup ltp_objectrelated
+struct column_batch
+{
+    //! \brief Construct an empty batch for a column
+    //! \param[in] id The column to read
+    explicit column_batch(prop_id column = 0)
+        : id(column) { }
+
+    //! \brief Does the cell of the given row in this batch exist?
+    //! \param[in] i The row, relative to the start of the batch
+    //! \returns true if values[i] is valid; false for rows past the batch
+    bool exists(ulong i) const
+        { return i / 8 < validity.size() && test_bit(&validity[0], i); }
+
+    prop_id id;                     //!< The column to read
+    std::vector<ulonglong> values;  //!< Cell values, one per row; 0 where the cell doesn't exist
+    std::vector<byte> validity;     //!< One bit per row, set where the cell exists; most significant bit first, as \ref test_bit expects
+};
+
 //! \brief Table implementation
 //!
 //! Similar to the \ref node and \ref heap classes, the table class is divided
@@ -137,7 +194,9 @@ private:
 //! underlying table type. This is the table implementation "interface" class.
 //! \sa [MS-PST] 2.3.4
 //! \ingroup ltp_objectrelated
-class table_impl : public std::tr1::enable_shared_from_this<table_impl>
+class table_impl : 
+    public ref_counted, 
+    public arena_object
 {
 public:
     virtual ~table_impl() { }
@@ -151,15 +210,15 @@ public:
     //! \param[in] row The offset into the table to construct a row for
     //! \returns The requested row
     const_table_row operator[](ulong row) const
-        { return const_table_row(row, shared_from_this()); }
+        { return const_table_row(row, counted_from_this(this)); }
     //! \brief Get an iterator pointing to the first row
     //! \returns The requested iterator
     const_table_row_iter begin() const
-        { return const_table_row_iter(0, shared_from_this()); }
+        { return const_table_row_iter(0, counted_from_this(this)); }
     //! \brief Get an end iterator for this table
     //! \returns The requested iterator
     const_table_row_iter end() const
-        { return const_table_row_iter(size(), shared_from_this()); }
+        { return const_table_row_iter(size(), counted_from_this(this)); }
     
     //! \brief Get the node backing this table
     //! \returns The node
@@ -174,6 +233,13 @@ public:
     //! \param[in] id The prop_id to find the cell value of
     //! \returns The cell value
     virtual ulonglong get_cell_value(ulong row, prop_id id) const = 0;
+    //! \brief Get the contents of the specified cell in the specified row
+    //! \throws key_not_found<prop_id> If the specified property does not exist on the specified row
+    //! \throws out_of_range If the specified row offset is beyond the size of this table
+    //! \param[in] row The offset into the table
+    //! \param[in] column The column, from prepare_column
+    //! \returns The cell value
+    virtual ulonglong get_cell_value(ulong row, const prepared_column& column) const = 0;
     //! \brief Get the contents of a indirect property in the specified row
     //! \throws key_not_found<prop_id> If the specified property does not exist on the specified row
     //! \throws out_of_range If the specified row offset is beyond the size of this table
@@ -181,6 +247,13 @@ public:
     //! \param[in] id The prop_id to find the cell value of
     //! \returns The raw bytes of the property
     virtual std::vector<byte> read_cell(ulong row, prop_id id) const = 0;
+    //! \brief Get the contents of a indirect property in the specified row
+    //! \throws key_not_found<prop_id> If the specified property does not exist on the specified row
+    //! \throws out_of_range If the specified row offset is beyond the size of this table
+    //! \param[in] row The offset into the table
+    //! \param[in] column The column, from prepare_column
+    //! \returns The raw bytes of the property
+    virtual std::vector<byte> read_cell(ulong row, const prepared_column& column) const = 0;
     //! \brief Open a stream over a property in a given row
     //! \throws key_not_found<prop_id> If the specified property does not exist on the specified row
     //! \throws out_of_range If the specified row offset is beyond the size of this table
@@ -213,12 +286,42 @@ public:
     //! \param[in] id The prop_id
     //! \returns true if the property exists
     virtual bool prop_exists(ulong row, prop_id id) const = 0;
+    //! \brief Check to see if a property exists for a given row
+    //! \param[in] row The offset into the table
+    //! \param[in] column The column, from prepare_column
+    //! \returns true if the property exists
+    virtual bool prop_exists(ulong row, const prepared_column& column) const = 0;
+    //! \brief Look up a column once, for use across many rows
+    //!
+    //! Scans touching the same columns of every row should prepare them up
+    //! front and use the prepared_column overloads.
+    //! \param[in] id The prop_id of the column
+    //! \returns The column; not present if this table has no such column
+    virtual prepared_column prepare_column(prop_id id) const = 0;
     //! \brief Return the size of a property for a given row
     //! \note This operation is only valid for variable length properties
     //! \param[in] row The offset into the table
     //! \param[in] id The prop_id
     //! \returns The vector.size() if read_prop were called
     virtual size_t row_prop_size(ulong row, prop_id id) const = 0;
+    //! \brief Read a range of rows of several columns at once
+    //!
+    //! Equivalent to calling prop_exists and get_cell_value for every cell
+    //! of the range, but the row matrix is read a page at a time and each
+    //! column is resolved once. Columns not in the table come back with
+    //! every cell missing.
+    //! \throws out_of_range If start is beyond the size of this table
+    //! \param[in] start The offset into the table of the first row to read
+    //! \param[in] count The number of rows to read; clipped to the end of the table
+    //! \param[in,out] columns The columns to read; their values and validity are replaced
+    //! \returns The number of rows read
+    virtual ulong read_columns(ulong start, ulong count, std::vector<column_batch>& columns) const = 0;
+
+protected:
+    //! \brief Construct the table base
+    //! \param[in] atomic True if the table may be referenced from several threads
+    explicit table_impl(bool atomic)
+        : ref_counted(atomic) { }
 };
 
 //! \brief Implementation of an ANSI TC (64k rows) and a unicode TC
@@ -244,15 +347,23 @@ public:
     const node& get_node() const
         { return m_prows->get_node(); }
     ulong lookup_row(row_id id) const;
-    ulonglong get_cell_value(ulong row, prop_id id) const;
-    std::vector<byte> read_cell(ulong row, prop_id id) const;
+    ulonglong get_cell_value(ulong row, prop_id id) const
+        { return get_cell_value(row, prepare_column(id)); }
+    ulonglong get_cell_value(ulong row, const prepared_column& column) const;
+    std::vector<byte> read_cell(ulong row, prop_id id) const
+        { return read_cell(row, prepare_column(id)); }
+    std::vector<byte> read_cell(ulong row, const prepared_column& column) const;
     hnid_stream_device open_cell_stream(ulong row, prop_id id);
     std::vector<prop_id> get_prop_list() const;
     prop_type get_prop_type(prop_id id) const;
     row_id get_row_id(ulong row) const;
     size_t size() const;
-    bool prop_exists(ulong row, prop_id id) const;
+    bool prop_exists(ulong row, prop_id id) const
+        { return prop_exists(row, prepare_column(id)); }
+    bool prop_exists(ulong row, const prepared_column& column) const;
+    prepared_column prepare_column(prop_id id) const;
     size_t row_prop_size(ulong row, prop_id id) const;
+    ulong read_columns(ulong start, ulong count, std::vector<column_batch>& columns) const;
 
 private:
     friend table_ptr open_table(const node& n);
@@ -260,15 +371,26 @@ private:
     basic_table(const node& n);
     basic_table(const node& n, alias_tag);
 
+    //! \brief Matches the columns of m_columns with one prop_id
+    struct column_matches
+    {
+        column_matches(const std::vector<disk::column_description>& columns, prop_id id)
+            : m_columns(columns), m_id(id) { }
+        bool operator()(size_t i) const
+            { return m_columns[i].id == m_id; }
+
+        const std::vector<disk::column_description>& m_columns;
+        prop_id m_id;
+    };
+
     std::tr1::shared_ptr<bth_node<row_id, T> > m_prows;
 
     // only one of the following two items is valid
     std::vector<byte> m_vec_rowarray;
     std::tr1::shared_ptr<node> m_pnode_rowarray;
 
-    std::tr1::unordered_map<prop_id, disk::column_description> m_columns; 
-    typedef std::tr1::unordered_map<prop_id, disk::column_description>::iterator column_iter;
-    typedef std::tr1::unordered_map<prop_id, disk::column_description>::const_iterator const_column_iter;
+    std::vector<disk::column_description> m_columns;    //!< The columns, in TCINFO order
+    slot_index<ushort> m_column_index;                  //!< Index of m_columns by prop_id
 
     ushort m_offsets[disk::tc_offsets_max];
 
@@ -282,14 +404,17 @@ private:
     //! \brief Calculate the number of rows per page (..external block)
     //! \returns The number of rows which fit on a single external block
     ulong rows_per_page() const { return (m_pnode_rowarray ? m_pnode_rowarray->get_page_size(0) / cb_per_row() : m_vec_rowarray.size() / cb_per_row()); }
+    //! \brief Build m_column_index from m_columns
+    void index_columns();
+    //! \brief Find a column by prop_id
+    //! \param[in] id The prop_id of the column
+    //! \returns The column, or NULL if this table has no such column
+    const disk::column_description* find_column(prop_id id) const;
     //! \brief Read and interpret data from a row
     //! \tparam Val the type to read
     //! \param[in] row The row to read
     //! \param[in] offset The offset into the row
     template<typename Val> Val read_raw_row(ulong row, ushort offset) const;
-    //! \brief Read the CEB for a given row
-    //! \returns The CEB
-    std::vector<byte> read_exists_bitmap(ulong row) const;
 };
 
 typedef basic_table<ushort> small_table;
@@ -340,12 +465,24 @@ public:
     //! \copydoc table_impl::get_node() const
     const node& get_node() const
         { return m_ptable->get_node(); }
-    //! \copydoc table_impl::get_cell_value()
+    //! \copydoc table_impl::get_cell_value(ulong,prop_id) const
     ulonglong get_cell_value(ulong row, prop_id id) const
         { return m_ptable->get_cell_value(row, id); }
-    //! \copydoc table_impl::read_cell()
+    //! \copydoc table_impl::get_cell_value(ulong,const prepared_column&) const
+    ulonglong get_cell_value(ulong row, const prepared_column& column) const
+        { return m_ptable->get_cell_value(row, column); }
+    //! \copydoc table_impl::read_cell(ulong,prop_id) const
     std::vector<byte> read_cell(ulong row, prop_id id) const
         { return m_ptable->read_cell(row, id); }
+    //! \copydoc table_impl::read_cell(ulong,const prepared_column&) const
+    std::vector<byte> read_cell(ulong row, const prepared_column& column) const
+        { return m_ptable->read_cell(row, column); }
+    //! \copydoc table_impl::prop_exists(ulong,const prepared_column&) const
+    bool prop_exists(ulong row, const prepared_column& column) const
+        { return m_ptable->prop_exists(row, column); }
+    //! \copydoc table_impl::prepare_column()
+    prepared_column prepare_column(prop_id id) const
+        { return m_ptable->prepare_column(id); }
     //! \copydoc table_impl::open_cell_stream()
     hnid_stream_device open_cell_stream(ulong row, prop_id id)
         { return m_ptable->open_cell_stream(row, id); }
@@ -364,6 +501,9 @@ public:
     //! \copydoc table_impl::size()
     size_t size() const
         { return m_ptable->size(); }
+    //! \copydoc table_impl::read_columns()
+    ulong read_columns(ulong start, ulong count, std::vector<column_batch>& columns) const
+        { return m_ptable->read_columns(start, count, columns); }
 private:
     table();
 
@@ -468,18 +608,20 @@ inline pstsdk::ulonglong pstsdk::const_table_row::get_value_8(prop_id id) const
     return m_table->get_cell_value(m_position, id); 
 }
 
-inline std::vector<pstsdk::byte> pstsdk::const_table_row::get_value_variable(prop_id id) const
+inline pstsdk::byte_slice pstsdk::const_table_row::get_value_variable(prop_id id) const
 { 
-    return m_table->read_cell(m_position, id); 
+    std::vector<byte> buffer = m_table->read_cell(m_position, id); 
+    return byte_slice(buffer);
 }
 
 inline pstsdk::hnid_stream_device pstsdk::const_table_row::open_prop_stream(prop_id id)
 {
-    return (std::tr1::const_pointer_cast<table_impl>(m_table))->open_cell_stream(m_position, id);
+    return const_cast<table_impl*>(m_table.get())->open_cell_stream(m_position, id);
 }
 
 template<typename T>
 inline pstsdk::basic_table<T>::basic_table(const node& n)
+: table_impl(!n.get_db_ptr()->is_single_threaded())
 {
     heap h(n, disk::heap_sig_tc);
 
@@ -494,7 +636,8 @@ inline pstsdk::basic_table<T>::basic_table(const node& n)
     m_prows = h.open_bth<row_id, T>(pheader->row_btree_id);
 
     for(int i = 0; i < pheader->num_columns; ++i)
-        m_columns[pheader->columns[i].id] = pheader->columns[i];
+        m_columns.push_back(pheader->columns[i]);
+    index_columns();
 
     for(int i = 0; i < disk::tc_offsets_max; ++i)
         m_offsets[i] = pheader->size_offsets[i];
@@ -511,6 +654,7 @@ inline pstsdk::basic_table<T>::basic_table(const node& n)
 
 template<typename T>
 inline pstsdk::basic_table<T>::basic_table(const node& n, alias_tag)
+: table_impl(!n.get_db_ptr()->is_single_threaded())
 {
     heap h(n, disk::heap_sig_tc, alias_tag());
 
@@ -525,7 +669,8 @@ inline pstsdk::basic_table<T>::basic_table(const node& n, alias_tag)
     m_prows = h.open_bth<row_id, T>(pheader->row_btree_id);
 
     for(int i = 0; i < pheader->num_columns; ++i)
-        m_columns[pheader->columns[i].id] = pheader->columns[i];
+        m_columns.push_back(pheader->columns[i]);
+    index_columns();
 
     for(int i = 0; i < disk::tc_offsets_max; ++i)
         m_offsets[i] = pheader->size_offsets[i];
@@ -558,12 +703,37 @@ inline std::vector<pstsdk::prop_id> pstsdk::basic_table<T>::get_prop_list() cons
 {
     std::vector<prop_id> props;
 
-    for(const_column_iter i = m_columns.begin(); i != m_columns.end(); ++i)
-        props.push_back(i->first);
+    for(size_t i = 0; i < m_columns.size(); ++i)
+        props.push_back(m_columns[i].id);
 
     return props;
 }
 
+template<typename T>
+inline void pstsdk::basic_table<T>::index_columns()
+{
+    m_column_index.reset(m_columns.size());
+
+    for(size_t i = 0; i < m_columns.size(); ++i)
+        m_column_index.insert(m_columns[i].id, i);
+}
+
+template<typename T>
+inline const pstsdk::disk::column_description* pstsdk::basic_table<T>::find_column(prop_id id) const
+{
+    size_t i = m_column_index.find(id, column_matches(m_columns, id));
+
+    return i != slot_index<ushort>::npos ? &m_columns[i] : NULL;
+}
+
+template<typename T>
+inline pstsdk::prepared_column pstsdk::basic_table<T>::prepare_column(prop_id id) const
+{
+    const disk::column_description* pcolumn = find_column(id);
+
+    return pcolumn ? prepared_column(*pcolumn) : prepared_column(id);
+}
+
 template<typename T>
 inline pstsdk::ulong pstsdk::basic_table<T>::lookup_row(row_id id) const
 { 
@@ -578,27 +748,27 @@ inline pstsdk::ulong pstsdk::basic_table<T>::lookup_row(row_id id) const
 }
 
 template<typename T>
-inline pstsdk::ulonglong pstsdk::basic_table<T>::get_cell_value(ulong row, prop_id id) const
+inline pstsdk::ulonglong pstsdk::basic_table<T>::get_cell_value(ulong row, const prepared_column& column) const
 {
-    if(!prop_exists(row, id))
-        throw key_not_found<prop_id>(id);
+    if(!prop_exists(row, column))
+        throw key_not_found<prop_id>(column.get_id());
 
-    const_column_iter column = m_columns.find(id);
+    const disk::column_description& desc = column.get_description();
     ulonglong value;
 
-    switch(column->second.size)
+    switch(desc.size)
     {
         case 8:
-            value = read_raw_row<ulonglong>(row, column->second.offset);
+            value = read_raw_row<ulonglong>(row, desc.offset);
             break;
         case 4:
-            value = read_raw_row<ulong>(row, column->second.offset);
+            value = read_raw_row<ulong>(row, desc.offset);
             break;
         case 2:
-            value = read_raw_row<ushort>(row, column->second.offset);
+            value = read_raw_row<ushort>(row, desc.offset);
             break;
         case 1:
-            value = read_raw_row<byte>(row, column->second.offset);
+            value = read_raw_row<byte>(row, desc.offset);
             break;
         default:
             throw database_corrupt("get_cell_value: invalid cell size");
@@ -619,9 +789,9 @@ inline size_t pstsdk::basic_table<T>::row_prop_size(ulong row, prop_id id) const
 }
 
 template<typename T>
-inline std::vector<pstsdk::byte> pstsdk::basic_table<T>::read_cell(ulong row, prop_id id) const
+inline std::vector<pstsdk::byte> pstsdk::basic_table<T>::read_cell(ulong row, const prepared_column& column) const
 {
-    heapnode_id hid = static_cast<heapnode_id>(get_cell_value(row, id));
+    heapnode_id hid = static_cast<heapnode_id>(get_cell_value(row, column));
     std::vector<byte> buffer;
 
     if(is_subnode_id(hid))
@@ -651,12 +821,12 @@ inline pstsdk::hnid_stream_device pstsdk::basic_table<T>::open_cell_stream(ulong
 template<typename T>
 inline pstsdk::prop_type pstsdk::basic_table<T>::get_prop_type(prop_id id) const
 {
-    const_column_iter iter = m_columns.find(id);
+    const disk::column_description* pcolumn = find_column(id);
 
-    if(iter == m_columns.end())
+    if(pcolumn == NULL)
         throw key_not_found<prop_id>(id);
 
-    return (prop_type)iter->second.type;
+    return (prop_type)pcolumn->type;
 }
 
 template<typename T>
@@ -688,39 +858,101 @@ inline Val pstsdk::basic_table<T>::read_raw_row(ulong row, ushort offset) const
 }
 
 template<typename T>
-inline std::vector<pstsdk::byte> pstsdk::basic_table<T>::read_exists_bitmap(ulong row) const
+inline bool pstsdk::basic_table<T>::prop_exists(ulong row, const prepared_column& column) const
 {
-    std::vector<byte> exists_bitmap(cb_per_row() - exists_bitmap_start());
-
-    if(row >= size())
-        throw std::out_of_range("row >= size()");
-
-    if(m_pnode_rowarray)
-    {
-        ulong page_num = row / rows_per_page();
-        ulong page_offset = (row % rows_per_page()) * cb_per_row();
+    if(!column.is_present())
+        return false;
 
-        m_pnode_rowarray->read(exists_bitmap, page_num, page_offset + exists_bitmap_start());
-    }
-    else
-    {
-        memcpy(&exists_bitmap[0], &m_vec_rowarray[ row * cb_per_row() + exists_bitmap_start() ], exists_bitmap.size());
-    }    
+    // only the byte of the CEB holding this column's bit is needed
+    ulong bit = column.get_description().bit_offset;
+    byte exists = read_raw_row<byte>(row, static_cast<ushort>(exists_bitmap_start() + bit / 8));
 
-    return exists_bitmap;
+    return test_bit(&exists, bit % 8);
 }
 
 template<typename T>
-inline bool pstsdk::basic_table<T>::prop_exists(ulong row, prop_id id) const
+inline pstsdk::ulong pstsdk::basic_table<T>::read_columns(ulong start, ulong count, std::vector<column_batch>& columns) const
 {
-    const_column_iter column = m_columns.find(id);
+    ulong rows = size();
 
-    if(column == m_columns.end())
-        return false;
+    if(start > rows)
+        throw std::out_of_range("start > size()");
+
+    if(count > rows - start)
+        count = rows - start;
 
-    std::vector<byte> exists_map = read_exists_bitmap(row);
+    // resolve every column once; missing columns keep a null description
+    std::vector<const disk::column_description*> descriptions(columns.size());
+    for(size_t c = 0; c < columns.size(); ++c)
+    {
+        descriptions[c] = find_column(columns[c].id);
+
+        if(descriptions[c] != NULL && descriptions[c]->size != 8 && descriptions[c]->size != 4 && descriptions[c]->size != 2 && descriptions[c]->size != 1)
+            throw database_corrupt("read_columns: invalid cell size");
+
+        columns[c].values.assign(count, 0);
+        columns[c].validity.assign((count + 7) / 8, 0);
+    }
+
+    if(count == 0)
+        return 0;
+
+    ulong cb_row = cb_per_row();
+    ulong ceb = exists_bitmap_start();
+    ulong per_page = rows_per_page();
+    std::vector<byte> page;
+
+    for(ulong done = 0; done < count; )
+    {
+        ulong row = start + done;
+        ulong page_rows = std::min<ulong>(count - done, per_page - row % per_page);
+        const byte* prows;
+
+        if(m_pnode_rowarray)
+        {
+            page.resize(page_rows * cb_row);
+            m_pnode_rowarray->read(page, row / per_page, (row % per_page) * cb_row);
+            prows = &page[0];
+        }
+        else
+        {
+            prows = &m_vec_rowarray[row * cb_row];
+        }
+
+        for(size_t c = 0; c < columns.size(); ++c)
+        {
+            const disk::column_description* pdesc = descriptions[c];
+
+            if(pdesc == NULL)
+                continue;
+
+            std::vector<ulonglong>& values = columns[c].values;
+            std::vector<byte>& validity = columns[c].validity;
+
+            for(ulong r = 0; r < page_rows; ++r)
+            {
+                const byte* prow = prows + r * cb_row;
+
+                if(!test_bit(prow + ceb, pdesc->bit_offset))
+                    continue;
+
+                ulong i = done + r;
+                validity[i / 8] |= (0x80 >> (i % 8));
+
+                switch(pdesc->size)
+                {
+                    case 8: { ulonglong v; memcpy(&v, prow + pdesc->offset, sizeof(v)); values[i] = v; break; }
+                    case 4: { ulong v; memcpy(&v, prow + pdesc->offset, sizeof(v)); values[i] = v; break; }
+                    case 2: { ushort v; memcpy(&v, prow + pdesc->offset, sizeof(v)); values[i] = v; break; }
+                    default: values[i] = prow[pdesc->offset]; break;
+                }
+            }
+        }
+
+        done += page_rows;
+    }
 
-    return test_bit(&exists_map[0], column->second.bit_offset);
+    return count;
 }
 
 inline pstsdk::table::table(const node& n)
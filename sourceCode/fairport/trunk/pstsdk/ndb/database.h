@@ -13,6 +13,8 @@
 
 #include "pstsdk/util/btree.h"
 #include "pstsdk/util/errors.h"
+#include "pstsdk/util/file.h"
+#include "pstsdk/util/mutex.h"
 #include "pstsdk/util/primitives.h"
 #include "pstsdk/util/util.h"
 
@@ -32,30 +34,54 @@ class database_impl;
 typedef database_impl<ulonglong> large_pst;
 typedef database_impl<ulong> small_pst;
 
+//! \brief The default budget of the decoded block cache, in bytes
+//! \sa db_context::set_block_cache_size
+//! \ingroup ndb_databaserelated
+const size_t block_cache_default_size = 8 * 1024 * 1024;
+
+//! \brief The default capacity of the BBT/NBT leaf page cache, in pages
+//! \sa db_context::set_page_cache_size
+//! \ingroup ndb_databaserelated
+const size_t page_cache_default_size = 4096;
+
+//! \brief The default number of pages or blocks prefetched ahead of a traversal
+//! \sa db_context::set_readahead
+//! \ingroup ndb_databaserelated
+const uint readahead_default_count = 8;
+
 //! \brief Open a db_context for the given file
 //! \throws invalid_format if the file format is not understood
 //! \throws runtime_error if an error occurs opening the file
 //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK) if the CRC of this header doesn't match
 //! \param[in] filename The filename to open
+//! \param[in] access How the file should be read; \ref file_access_mmap serves blocks straight out of a mapping
+//! \param[in] mode How the BBT and NBT are held; \ref index_mode_flat loads both up front
+//! \param[in] level How much checking to do while reading the file
 //! \returns A shared_ptr to the opened context
 //! \ingroup ndb_databaserelated
-shared_db_ptr open_database(const std::wstring& filename);
+shared_db_ptr open_database(const std::wstring& filename, file_access access = file_access_positional, index_mode mode = index_mode_paged, validation_level level = default_validation_level);
 //! \brief Try to open the given file as an ANSI store
 //! \throws invalid_format if the file format is not ANSI
 //! \throws runtime_error if an error occurs opening the file
 //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK) if the CRC of this header doesn't match
 //! \param[in] filename The filename to open
+//! \param[in] access How the file should be read
+//! \param[in] mode How the BBT and NBT are held
+//! \param[in] level How much checking to do while reading the file
 //! \returns A shared_ptr to the opened context
 //! \ingroup ndb_databaserelated
-std::tr1::shared_ptr<small_pst> open_small_pst(const std::wstring& filename);
+std::tr1::shared_ptr<small_pst> open_small_pst(const std::wstring& filename, file_access access = file_access_positional, index_mode mode = index_mode_paged, validation_level level = default_validation_level);
 //! \brief Try to open the given file as a Unicode store
 //! \throws invalid_format if the file format is not Unicode
 //! \throws runtime_error if an error occurs opening the file
 //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK) if the CRC of this header doesn't match
 //! \param[in] filename The filename to open
+//! \param[in] access How the file should be read
+//! \param[in] mode How the BBT and NBT are held
+//! \param[in] level How much checking to do while reading the file
 //! \returns A shared_ptr to the opened context
 //! \ingroup ndb_databaserelated
-std::tr1::shared_ptr<large_pst> open_large_pst(const std::wstring& filename);
+std::tr1::shared_ptr<large_pst> open_large_pst(const std::wstring& filename, file_access access = file_access_positional, index_mode mode = index_mode_paged, validation_level level = default_validation_level);
 
 //! \brief PST implementation
 //!
@@ -95,35 +121,87 @@ public:
 
     //! \name Block factory functions
     //@{
-    std::tr1::shared_ptr<block> read_block(const shared_db_ptr& parent, block_id bid)
+    block_ptr read_block(const shared_db_ptr& parent, block_id bid)
         { return read_block(parent, lookup_block_info(bid)); }
-    std::tr1::shared_ptr<data_block> read_data_block(const shared_db_ptr& parent, block_id bid)
+    data_block_ptr read_data_block(const shared_db_ptr& parent, block_id bid)
         { return read_data_block(parent, lookup_block_info(bid)); }
-    std::tr1::shared_ptr<extended_block> read_extended_block(const shared_db_ptr& parent, block_id bid)
+    extended_block_ptr read_extended_block(const shared_db_ptr& parent, block_id bid)
         { return read_extended_block(parent, lookup_block_info(bid)); }
-    std::tr1::shared_ptr<external_block> read_external_block(const shared_db_ptr& parent, block_id bid)
+    external_block_ptr read_external_block(const shared_db_ptr& parent, block_id bid)
         { return read_external_block(parent, lookup_block_info(bid)); }
-    std::tr1::shared_ptr<subnode_block> read_subnode_block(const shared_db_ptr& parent, block_id bid)
+    subnode_block_ptr read_subnode_block(const shared_db_ptr& parent, block_id bid)
         { return read_subnode_block(parent, lookup_block_info(bid)); }
-    std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(const shared_db_ptr& parent, block_id bid)
+    subnode_leaf_block_ptr read_subnode_leaf_block(const shared_db_ptr& parent, block_id bid)
         { return read_subnode_leaf_block(parent, lookup_block_info(bid)); }
-    std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(const shared_db_ptr& parent, block_id bid)
+    subnode_nonleaf_block_ptr read_subnode_nonleaf_block(const shared_db_ptr& parent, block_id bid)
         { return read_subnode_nonleaf_block(parent, lookup_block_info(bid)); }
 
-    std::tr1::shared_ptr<block> read_block(const shared_db_ptr& parent, const block_info& bi);
-    std::tr1::shared_ptr<data_block> read_data_block(const shared_db_ptr& parent, const block_info& bi);
-    std::tr1::shared_ptr<extended_block> read_extended_block(const shared_db_ptr& parent, const block_info& bi);
-    std::tr1::shared_ptr<external_block> read_external_block(const shared_db_ptr& parent, const block_info& bi);
-    std::tr1::shared_ptr<subnode_block> read_subnode_block(const shared_db_ptr& parent, const block_info& bi);
-    std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi);
-    std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi);
+    block_ptr read_block(const shared_db_ptr& parent, const block_info& bi);
+    data_block_ptr read_data_block(const shared_db_ptr& parent, const block_info& bi);
+    extended_block_ptr read_extended_block(const shared_db_ptr& parent, const block_info& bi);
+    external_block_ptr read_external_block(const shared_db_ptr& parent, const block_info& bi);
+    subnode_block_ptr read_subnode_block(const shared_db_ptr& parent, const block_info& bi);
+    subnode_leaf_block_ptr read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi);
+    subnode_nonleaf_block_ptr read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi);
+    //@}
+
+    //! \name Cache control
+    //@{
+    cache_stats get_block_cache_stats() const
+        { return m_block_cache.get_stats(); }
+    void set_block_cache_size(size_t size)
+        { m_block_cache.set_budget(size); }
+    cache_stats get_page_cache_stats() const
+        { return m_page_cache.get_stats(); }
+    void set_page_cache_size(size_t pages)
+        { m_page_cache.set_budget(pages); }
+    //@}
+
+    //! \name Readahead
+    //@{
+    uint get_readahead() const
+        { return m_readahead; }
+    void set_readahead(uint count)
+        { m_readahead = count; }
+    void set_prefetch_method(file_prefetch method)
+        { m_file.set_prefetch(method); }
+    void prefetch_page(const page_info& pi)
+        { m_file.prefetch(pi.address, disk::page_size); }
+    void prefetch_block(block_id bid);
+    //@}
+
+    //! \name Threading
+    //@{
+    bool is_single_threaded() const
+        { return m_single_threaded; }
+    void set_single_threaded(bool single)
+        { m_single_threaded = single; }
+    //@}
+
+    //! \name Parallel decode
+    //@{
+    std::tr1::shared_ptr<task_pool> get_decode_pool() const
+        { return m_decode_pool; }
+    void set_decode_pool(const std::tr1::shared_ptr<task_pool>& pool)
+        { m_decode_pool = pool; }
+    //@}
+
+    //! \name Validation
+    //@{
+    validation_level get_validation_level() const
+        { return m_validation; }
+    void set_validation_level(validation_level level)
+        { m_validation = level; }
+    void validate_block_crc(const block_info& bi, const std::vector<byte>& data, ulong crc);
     //@}
 
+    header_stamp get_header_stamp() const;
+
 //! \cond write_api
-    std::tr1::shared_ptr<external_block> create_external_block(const shared_db_ptr& parent, size_t size);
-    std::tr1::shared_ptr<extended_block> create_extended_block(const shared_db_ptr& parent, std::tr1::shared_ptr<external_block>& pblock);
-    std::tr1::shared_ptr<extended_block> create_extended_block(const shared_db_ptr& parent, std::tr1::shared_ptr<extended_block>& pblock);
-    std::tr1::shared_ptr<extended_block> create_extended_block(const shared_db_ptr& parent, size_t size);
+    external_block_ptr create_external_block(const shared_db_ptr& parent, size_t size);
+    extended_block_ptr create_extended_block(const shared_db_ptr& parent, external_block_ptr& pblock);
+    extended_block_ptr create_extended_block(const shared_db_ptr& parent, extended_block_ptr& pblock);
+    extended_block_ptr create_extended_block(const shared_db_ptr& parent, size_t size);
 
     block_id alloc_bid(bool is_internal);
 //! \endcond
@@ -134,89 +212,134 @@ protected:
     //! \throws invalid_format if the file format is not understood
     //! \throws runtime_error if an error occurs opening the file
     //! \param[in] filename The filename to open
-    database_impl(const std::wstring& filename);
+    //! \param[in] access How the file should be read
+    //! \param[in] level How much checking to do while reading the file
+    database_impl(const std::wstring& filename, file_access access, validation_level level);
     //! \brief Validate the header of this file
     //! \throws invalid_format if this header is for a database format incompatible with this object
-    //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK) if the CRC of this header doesn't match
+    //! \throws crc_fail (\ref validation_level_weak) if the CRC of this header doesn't match
     void validate_header();
 
     //! \brief Read block data, perform validation checks
+    //!
+    //! When the file is memory mapped the returned pointer refers directly
+    //! into the mapping and scratch is not touched; otherwise the block is
+    //! read into scratch. See file::view.
+    //!
+    //! Under \ref validation_level_lazy the CRC of an external block is not
+    //! checked here; see \ref validate_block_crc.
     //! \param[in] bi The block information to read from disk
+    //! \param[in,out] scratch Storage for the block if the file is not mapped
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The validated block data (still "encrypted")
-    std::vector<byte> read_block_data(const block_info& bi);
+    const byte* read_block_data(const block_info& bi, std::vector<byte>& scratch);
     //! \brief Read page data, perform validation checks
     //! \param[in] pi The page information to read from disk
+    //! \param[in,out] scratch Storage for the page if the file is not mapped
     //! \throws unexpected_page (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the page appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the page trailer's signature appears incorrect
     //! \throws database_corrupt (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the page trailer's ptypeRepeat != ptype
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the page's CRC doesn't match the trailer
     //! \returns The validated page data
-    std::vector<byte> read_page_data(const page_info& pi);
+    const byte* read_page_data(const page_info& pi, std::vector<byte>& scratch);
 
-    std::tr1::shared_ptr<nbt_leaf_page> read_nbt_leaf_page(const page_info& pi, disk::nbt_leaf_page<T>& the_page);
-    std::tr1::shared_ptr<bbt_leaf_page> read_bbt_leaf_page(const page_info& pi, disk::bbt_leaf_page<T>& the_page);
+    std::tr1::shared_ptr<nbt_leaf_page> read_nbt_leaf_page(const page_info& pi, const disk::nbt_leaf_page<T>& the_page);
+    std::tr1::shared_ptr<bbt_leaf_page> read_bbt_leaf_page(const page_info& pi, const disk::bbt_leaf_page<T>& the_page);
 
     template<typename K, typename V>
-    std::tr1::shared_ptr<bt_nonleaf_page<K,V> > read_bt_nonleaf_page(const page_info& pi, disk::bt_page<T, disk::bt_entry<T> >& the_page);
-
-    std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi, disk::sub_leaf_block<T>& sub_block);
-    std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi, disk::sub_nonleaf_block<T>& sub_block);
-
-    friend shared_db_ptr open_database(const std::wstring& filename);
-    friend std::tr1::shared_ptr<small_pst> open_small_pst(const std::wstring& filename);
-    friend std::tr1::shared_ptr<large_pst> open_large_pst(const std::wstring& filename);
+    std::tr1::shared_ptr<bt_nonleaf_page<K,V> > read_bt_nonleaf_page(const page_info& pi, const disk::bt_page<T, disk::bt_entry<T> >& the_page);
+
+    subnode_leaf_block_ptr read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi, const disk::sub_leaf_block<T>& sub_block);
+    subnode_nonleaf_block_ptr read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi, const disk::sub_nonleaf_block<T>& sub_block);
+
+    //! \brief Look for a decoded block in the block cache
+    //! \tparam Block The type of block expected
+    //! \param[in] parent The context the block is being read for
+    //! \param[in] bi The block being read
+    //! \returns The cached block, or an empty pointer on a miss
+    template<typename Block>
+    typename counted_ptr<Block>::type lookup_cached_block(const shared_db_ptr& parent, const block_info& bi);
+    //! \brief Add a decoded block to the block cache
+    //! \param[in] parent The context the block was read for
+    //! \param[in] bi The block read
+    //! \param[in] pblock The decoded block
+    void cache_block(const shared_db_ptr& parent, const block_info& bi, const block_ptr& pblock);
+    //! \brief Look for a leaf page in the page cache
+    //! \tparam Page The type of page expected
+    //! \param[in] pi The page being read
+    //! \returns The cached page, or an empty pointer on a miss
+    template<typename Page>
+    std::tr1::shared_ptr<Page> lookup_cached_page(const page_info& pi);
+
+    //! \brief Replace the BBT and NBT with flat pages
+    //!
+    //! Walks every leaf page of both trees once, and swaps the roots for a
+    //! \ref bt_flat_page holding all of their entries. See \ref index_mode_flat.
+    void load_flat_index();
+
+    friend shared_db_ptr open_database(const std::wstring& filename, file_access access, index_mode mode, validation_level level);
+    friend std::tr1::shared_ptr<small_pst> open_small_pst(const std::wstring& filename, file_access access, index_mode mode, validation_level level);
+    friend std::tr1::shared_ptr<large_pst> open_large_pst(const std::wstring& filename, file_access access, index_mode mode, validation_level level);
 
     file m_file;
+    validation_level m_validation;
+    uint m_readahead;
+    bool m_single_threaded;                 //!< Objects handed out count references non-atomically
+    std::tr1::shared_ptr<task_pool> m_decode_pool; //!< Decodes the children of large reads, if set
     disk::header<T> m_header;
     std::tr1::shared_ptr<bbt_page> m_bbt_root;
     std::tr1::shared_ptr<nbt_page> m_nbt_root;
+    mutex m_root_lock;                      //!< Guards lazy loading of m_bbt_root and m_nbt_root
+    sharded_cache<block_id, block_ptr > m_block_cache; //!< Decoded external and subnode leaf blocks
+    sharded_cache<page_id, std::tr1::shared_ptr<page> > m_page_cache;   //!< BBT and NBT leaf pages
 };
 
 //! \cond dont_show_these_member_function_specializations
 template<>
 inline void database_impl<ulong>::validate_header()
 {
-    // the behavior of open_database depends on this throw; this can not go under PSTSDK_VALIDATION_WEAK
+    // the behavior of open_database depends on this throw; this can not go under validation_level_weak
     if(m_header.wVer >= disk::database_format_unicode_min)
         throw invalid_format();
 
-#ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    ulong crc = disk::compute_crc(((byte*)&m_header) + disk::header_crc_locations<ulong>::start, disk::header_crc_locations<ulong>::length);
+    if(m_validation >= validation_level_weak)
+    {
+        ulong crc = disk::compute_crc(((byte*)&m_header) + disk::header_crc_locations<ulong>::start, disk::header_crc_locations<ulong>::length);
 
-    if(crc != m_header.dwCRCPartial)
-        throw crc_fail("header dwCRCPartial failure", 0, 0, crc, m_header.dwCRCPartial);
-#endif
+        if(crc != m_header.dwCRCPartial)
+            throw crc_fail("header dwCRCPartial failure", 0, 0, crc, m_header.dwCRCPartial);
+    }
 }
 
 template<>
 inline void database_impl<ulonglong>::validate_header()
 {
-    // the behavior of open_database depends on this throw; this can not go under PSTSDK_VALIDATION_WEAK
+    // the behavior of open_database depends on this throw; this can not go under validation_level_weak
     if(m_header.wVer < disk::database_format_unicode_min)
         throw invalid_format();
 
-#ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    ulong crc_partial = disk::compute_crc(((byte*)&m_header) + disk::header_crc_locations<ulonglong>::partial_start, disk::header_crc_locations<ulonglong>::partial_length);
-    ulong crc_full = disk::compute_crc(((byte*)&m_header) + disk::header_crc_locations<ulonglong>::full_start, disk::header_crc_locations<ulonglong>::full_length);
+    if(m_validation >= validation_level_weak)
+    {
+        ulong crc_partial = disk::compute_crc(((byte*)&m_header) + disk::header_crc_locations<ulonglong>::partial_start, disk::header_crc_locations<ulonglong>::partial_length);
+        ulong crc_full = disk::compute_crc(((byte*)&m_header) + disk::header_crc_locations<ulonglong>::full_start, disk::header_crc_locations<ulonglong>::full_length);
 
-    if(crc_partial != m_header.dwCRCPartial)
-        throw crc_fail("header dwCRCPartial failure", 0, 0, crc_partial, m_header.dwCRCPartial);
+        if(crc_partial != m_header.dwCRCPartial)
+            throw crc_fail("header dwCRCPartial failure", 0, 0, crc_partial, m_header.dwCRCPartial);
 
-    if(crc_full != m_header.dwCRCFull)
-        throw crc_fail("header dwCRCFull failure", 0, 0, crc_full, m_header.dwCRCFull);
-#endif
+        if(crc_full != m_header.dwCRCFull)
+            throw crc_fail("header dwCRCFull failure", 0, 0, crc_full, m_header.dwCRCFull);
+    }
 }
 //! \endcond
 } // end namespace
 
-inline pstsdk::shared_db_ptr pstsdk::open_database(const std::wstring& filename)
+inline pstsdk::shared_db_ptr pstsdk::open_database(const std::wstring& filename, file_access access, index_mode mode, validation_level level)
 {
     try 
     {
-        shared_db_ptr db = open_small_pst(filename);
+        shared_db_ptr db = open_small_pst(filename, access, mode, level);
         return db;
     }
     catch(invalid_format&)
@@ -224,100 +347,144 @@ inline pstsdk::shared_db_ptr pstsdk::open_database(const std::wstring& filename)
         // well, that didn't work
     }
 
-    shared_db_ptr db = open_large_pst(filename);
+    shared_db_ptr db = open_large_pst(filename, access, mode, level);
     return db;
 }
 
-inline std::tr1::shared_ptr<pstsdk::small_pst> pstsdk::open_small_pst(const std::wstring& filename)
+inline std::tr1::shared_ptr<pstsdk::small_pst> pstsdk::open_small_pst(const std::wstring& filename, file_access access, index_mode mode, validation_level level)
 {
-    std::tr1::shared_ptr<small_pst> db(new small_pst(filename));
+    std::tr1::shared_ptr<small_pst> db(new small_pst(filename, access, level));
+
+    if(mode == index_mode_flat)
+        db->load_flat_index();
+
     return db;
 }
 
-inline std::tr1::shared_ptr<pstsdk::large_pst> pstsdk::open_large_pst(const std::wstring& filename)
+inline std::tr1::shared_ptr<pstsdk::large_pst> pstsdk::open_large_pst(const std::wstring& filename, file_access access, index_mode mode, validation_level level)
 {
-    std::tr1::shared_ptr<large_pst> db(new large_pst(filename));
+    std::tr1::shared_ptr<large_pst> db(new large_pst(filename, access, level));
+
+    if(mode == index_mode_flat)
+        db->load_flat_index();
+
     return db;
 }
 
 template<typename T>
-inline std::vector<pstsdk::byte> pstsdk::database_impl<T>::read_block_data(const block_info& bi)
+inline const pstsdk::byte* pstsdk::database_impl<T>::read_block_data(const block_info& bi, std::vector<byte>& scratch)
 {
     size_t aligned_size = disk::align_disk<T>(bi.size);
+    validation_level level = m_validation;
 
-#ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    if(aligned_size > disk::max_block_disk_size)
-        throw unexpected_block("nonsensical block size");
+    if(level >= validation_level_weak)
+    {
+        if(aligned_size > disk::max_block_disk_size)
+            throw unexpected_block("nonsensical block size");
 
-    if(bi.address + aligned_size > m_header.root_info.ibFileEof)
-        throw unexpected_block("nonsensical block location; past eof");
-#endif
+        if(bi.address + aligned_size > m_header.root_info.ibFileEof)
+            throw unexpected_block("nonsensical block location; past eof");
+    }
 
-    std::vector<byte> buffer(aligned_size);
-    disk::block_trailer<T>* bt = (disk::block_trailer<T>*)(&buffer[0] + aligned_size - sizeof(disk::block_trailer<T>));
+    const byte* pdata = m_file.view(bi.address, aligned_size, scratch);
+    const disk::block_trailer<T>* bt = (const disk::block_trailer<T>*)(pdata + aligned_size - sizeof(disk::block_trailer<T>));
 
-    m_file.read(buffer, bi.address);    
+    if(level >= validation_level_weak)
+    {
+        if(bt->bid != bi.id)
+            throw unexpected_block("wrong block id");
 
-#ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    if(bt->bid != bi.id)
-        throw unexpected_block("wrong block id");
+        if(bt->cb != bi.size)
+            throw unexpected_block("wrong block size");
 
-    if(bt->cb != bi.size)
-        throw unexpected_block("wrong block size");
+        if(bt->signature != disk::compute_signature(bi.id, bi.address))
+            throw sig_mismatch("block sig mismatch", bi.address, bi.id, disk::compute_signature(bi.id, bi.address), bt->signature);
+    }
 
-    if(bt->signature != disk::compute_signature(bi.id, bi.address))
-        throw sig_mismatch("block sig mismatch", bi.address, bi.id, disk::compute_signature(bi.id, bi.address), bt->signature);
-#endif
+    // lazy validation leaves external blocks to validate_block_crc
+    if(level == validation_level_full || (level == validation_level_lazy && disk::bid_is_internal(bi.id)))
+    {
+        ulong crc = disk::compute_crc(pdata, bi.size);
+        if(crc != bt->crc)
+            throw crc_fail("block crc failure", bi.address, bi.id, crc, bt->crc);
+    }
 
-#ifdef PSTSDK_VALIDATION_LEVEL_FULL
-    ulong crc = disk::compute_crc(&buffer[0], bi.size);
-    if(crc != bt->crc)
-        throw crc_fail("block crc failure", bi.address, bi.id, crc, bt->crc);
-#endif
+    return pdata;
+}
+
+template<typename T>
+inline void pstsdk::database_impl<T>::validate_block_crc(const block_info& bi, const std::vector<byte>& data, ulong crc)
+{
+    if(bi.size == 0)
+        return;
+
+    // the CRC covers the block as stored, so undo the decoding first
+    const byte* pdata = &data[0];
+    std::vector<byte> encoded;
+    if(m_header.bCryptMethod == disk::crypt_method_permute)
+    {
+        encoded.resize(bi.size);
+        disk::permute_copy(&encoded[0], pdata, bi.size, true);
+        pdata = &encoded[0];
+    }
+    else if(m_header.bCryptMethod == disk::crypt_method_cyclic)
+    {
+        encoded.resize(bi.size);
+        disk::cyclic_copy(&encoded[0], pdata, bi.size, (ulong)bi.id);
+        pdata = &encoded[0];
+    }
 
-    return buffer;
+    ulong actual = disk::compute_crc(pdata, bi.size);
+    if(actual != crc)
+        throw crc_fail("block crc failure", bi.address, bi.id, actual, crc);
 }
 
 template<typename T>
-std::vector<pstsdk::byte> pstsdk::database_impl<T>::read_page_data(const page_info& pi)
+inline const pstsdk::byte* pstsdk::database_impl<T>::read_page_data(const page_info& pi, std::vector<byte>& scratch)
 {
-#ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    if(pi.address + disk::page_size > m_header.root_info.ibFileEof)
-        throw unexpected_page("nonsensical page location; past eof");
+    validation_level level = m_validation;
 
-    if(((pi.address - disk::first_amap_page_location) % disk::page_size) != 0)
-        throw unexpected_page("nonsensical page location; not sector aligned");
-#endif
+    if(level >= validation_level_weak)
+    {
+        if(pi.address + disk::page_size > m_header.root_info.ibFileEof)
+            throw unexpected_page("nonsensical page location; past eof");
 
-    std::vector<byte> buffer(disk::page_size);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
-    
-    m_file.read(buffer, pi.address);
+        if(((pi.address - disk::first_amap_page_location) % disk::page_size) != 0)
+            throw unexpected_page("nonsensical page location; not sector aligned");
+    }
 
-#ifdef PSTSDK_VALIDATION_LEVEL_FULL
-    ulong crc = disk::compute_crc(&buffer[0], disk::page<T>::page_data_size);
-    if(crc != ppage->trailer.crc)
-        throw crc_fail("page crc failure", pi.address, pi.id, crc, ppage->trailer.crc);
-#endif
+    const byte* pdata = m_file.view(pi.address, disk::page_size, scratch);
+    const disk::page<T>* ppage = (const disk::page<T>*)pdata;
 
-#ifdef PSTSDK_VALIDATION_LEVEL_WEAK
-    if(ppage->trailer.bid != pi.id)
-        throw unexpected_page("wrong page id");
+    // pages are parsed as soon as they're read, so lazy validation checks them too
+    if(level >= validation_level_lazy)
+    {
+        ulong crc = disk::compute_crc(pdata, disk::page<T>::page_data_size);
+        if(crc != ppage->trailer.crc)
+            throw crc_fail("page crc failure", pi.address, pi.id, crc, ppage->trailer.crc);
+    }
 
-    if(ppage->trailer.page_type != ppage->trailer.page_type_repeat)
-        throw database_corrupt("ptype != ptype repeat?");
+    if(level >= validation_level_weak)
+    {
+        if(ppage->trailer.bid != pi.id)
+            throw unexpected_page("wrong page id");
 
-    if(ppage->trailer.signature != disk::compute_signature(pi.id, pi.address))
-        throw sig_mismatch("page sig mismatch", pi.address, pi.id, disk::compute_signature(pi.id, pi.address), ppage->trailer.signature);
-#endif
+        if(ppage->trailer.page_type != ppage->trailer.page_type_repeat)
+            throw database_corrupt("ptype != ptype repeat?");
 
-    return buffer;
+        if(ppage->trailer.signature != disk::compute_signature(pi.id, pi.address))
+            throw sig_mismatch("page sig mismatch", pi.address, pi.id, disk::compute_signature(pi.id, pi.address), ppage->trailer.signature);
+    }
+
+    return pdata;
 }
 
 
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::bbt_page> pstsdk::database_impl<T>::read_bbt_root()
 { 
+    lock_guard lock(m_root_lock);
+
     if(!m_bbt_root)
     {
         page_info pi = { m_header.root_info.brefBBT.bid, m_header.root_info.brefBBT.ib };
@@ -330,6 +497,8 @@ inline std::tr1::shared_ptr<pstsdk::bbt_page> pstsdk::database_impl<T>::read_bbt
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::nbt_page> pstsdk::database_impl<T>::read_nbt_root()
 { 
+    lock_guard lock(m_root_lock);
+
     if(!m_nbt_root)
     {
         page_info pi = { m_header.root_info.brefNBT.bid, m_header.root_info.brefNBT.ib };
@@ -340,8 +509,43 @@ inline std::tr1::shared_ptr<pstsdk::nbt_page> pstsdk::database_impl<T>::read_nbt
 }
 
 template<typename T>
-inline pstsdk::database_impl<T>::database_impl(const std::wstring& filename)
-: m_file(filename)
+inline void pstsdk::database_impl<T>::load_flat_index()
+{
+    std::vector<std::pair<node_id, node_info> > nodes;
+    std::vector<std::pair<block_id, block_info> > blocks;
+
+    {
+        std::tr1::shared_ptr<nbt_page> nbt_root = read_nbt_root();
+        for(const_nodeinfo_iterator iter = nbt_root->begin(); iter != nbt_root->end(); ++iter)
+            nodes.push_back(std::make_pair(iter->id, *iter));
+
+        std::tr1::shared_ptr<bbt_page> bbt_root = read_bbt_root();
+        for(const_blockinfo_iterator iter = bbt_root->begin(); iter != bbt_root->end(); ++iter)
+            blocks.push_back(std::make_pair(iter->id, *iter));
+    }
+
+    page_info nbt_pi = { m_header.root_info.brefNBT.bid, m_header.root_info.brefNBT.ib };
+    page_info bbt_pi = { m_header.root_info.brefBBT.bid, m_header.root_info.brefBBT.ib };
+
+#ifndef BOOST_NO_RVALUE_REFERENCES
+    std::tr1::shared_ptr<nbt_page> nbt_root(new nbt_flat_page(shared_from_this(), nbt_pi, std::move(nodes)));
+    std::tr1::shared_ptr<bbt_page> bbt_root(new bbt_flat_page(shared_from_this(), bbt_pi, std::move(blocks)));
+#else
+    std::tr1::shared_ptr<nbt_page> nbt_root(new nbt_flat_page(shared_from_this(), nbt_pi, nodes));
+    std::tr1::shared_ptr<bbt_page> bbt_root(new bbt_flat_page(shared_from_this(), bbt_pi, blocks));
+#endif
+
+    lock_guard lock(m_root_lock);
+    m_nbt_root = nbt_root;
+    m_bbt_root = bbt_root;
+
+    // the paged trees are gone; nothing will look for their leaves again
+    m_page_cache.clear();
+}
+
+template<typename T>
+inline pstsdk::database_impl<T>::database_impl(const std::wstring& filename, file_access access, validation_level level)
+: m_file(filename, access), m_validation(level), m_readahead(readahead_default_count), m_single_threaded(false), m_block_cache(block_cache_default_size), m_page_cache(page_cache_default_size)
 {
     std::vector<byte> buffer(sizeof(m_header));
     m_file.read(buffer, 0);
@@ -353,12 +557,16 @@ inline pstsdk::database_impl<T>::database_impl(const std::wstring& filename)
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::nbt_leaf_page> pstsdk::database_impl<T>::read_nbt_leaf_page(const page_info& pi)
 {
-    std::vector<byte> buffer = read_page_data(pi);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
+    std::tr1::shared_ptr<bt_leaf_page<node_id, node_info> > pcached = lookup_cached_page<nbt_leaf_page>(pi);
+    if(pcached)
+        return pcached;
+
+    std::vector<byte> scratch;
+    const disk::page<T>* ppage = (const disk::page<T>*)read_page_data(pi, scratch);
     
     if(ppage->trailer.page_type == disk::page_type_nbt)
     {
-        disk::nbt_leaf_page<T>* leaf_page = (disk::nbt_leaf_page<T>*)ppage;
+        const disk::nbt_leaf_page<T>* leaf_page = (const disk::nbt_leaf_page<T>*)ppage;
 
         if(leaf_page->level == 0)
             return read_nbt_leaf_page(pi, *leaf_page);
@@ -368,7 +576,7 @@ inline std::tr1::shared_ptr<pstsdk::nbt_leaf_page> pstsdk::database_impl<T>::rea
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::nbt_leaf_page> pstsdk::database_impl<T>::read_nbt_leaf_page(const page_info& pi, disk::nbt_leaf_page<T>& the_page)
+inline std::tr1::shared_ptr<pstsdk::nbt_leaf_page> pstsdk::database_impl<T>::read_nbt_leaf_page(const page_info& pi, const disk::nbt_leaf_page<T>& the_page)
 {
     node_info ni;
     std::vector<std::pair<node_id, node_info> > nodes;
@@ -384,21 +592,29 @@ inline std::tr1::shared_ptr<pstsdk::nbt_leaf_page> pstsdk::database_impl<T>::rea
     }
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<nbt_leaf_page>(new nbt_leaf_page(shared_from_this(), pi, std::move(nodes)));
+    std::tr1::shared_ptr<nbt_leaf_page> ppage(new nbt_leaf_page(shared_from_this(), pi, std::move(nodes)));
 #else
-    return std::tr1::shared_ptr<nbt_leaf_page>(new nbt_leaf_page(shared_from_this(), pi, nodes));
+    std::tr1::shared_ptr<nbt_leaf_page> ppage(new nbt_leaf_page(shared_from_this(), pi, nodes));
 #endif
+
+    m_page_cache.insert(pi.id, ppage, 1);
+
+    return ppage;
 }
 
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::bbt_leaf_page> pstsdk::database_impl<T>::read_bbt_leaf_page(const page_info& pi)
 {
-    std::vector<byte> buffer = read_page_data(pi);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
+    std::tr1::shared_ptr<bt_leaf_page<block_id, block_info> > pcached = lookup_cached_page<bbt_leaf_page>(pi);
+    if(pcached)
+        return pcached;
+
+    std::vector<byte> scratch;
+    const disk::page<T>* ppage = (const disk::page<T>*)read_page_data(pi, scratch);
     
     if(ppage->trailer.page_type == disk::page_type_bbt)
     {
-        disk::bbt_leaf_page<T>* leaf_page = (disk::bbt_leaf_page<T>*)ppage;
+        const disk::bbt_leaf_page<T>* leaf_page = (const disk::bbt_leaf_page<T>*)ppage;
 
         if(leaf_page->level == 0)
             return read_bbt_leaf_page(pi, *leaf_page);
@@ -408,7 +624,7 @@ inline std::tr1::shared_ptr<pstsdk::bbt_leaf_page> pstsdk::database_impl<T>::rea
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::bbt_leaf_page> pstsdk::database_impl<T>::read_bbt_leaf_page(const page_info& pi, disk::bbt_leaf_page<T>& the_page)
+inline std::tr1::shared_ptr<pstsdk::bbt_leaf_page> pstsdk::database_impl<T>::read_bbt_leaf_page(const page_info& pi, const disk::bbt_leaf_page<T>& the_page)
 {
     block_info bi;
     std::vector<std::pair<block_id, block_info> > blocks;
@@ -424,21 +640,25 @@ inline std::tr1::shared_ptr<pstsdk::bbt_leaf_page> pstsdk::database_impl<T>::rea
     }
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<bbt_leaf_page>(new bbt_leaf_page(shared_from_this(), pi, std::move(blocks)));
+    std::tr1::shared_ptr<bbt_leaf_page> ppage(new bbt_leaf_page(shared_from_this(), pi, std::move(blocks)));
 #else
-    return std::tr1::shared_ptr<bbt_leaf_page>(new bbt_leaf_page(shared_from_this(), pi, blocks));
+    std::tr1::shared_ptr<bbt_leaf_page> ppage(new bbt_leaf_page(shared_from_this(), pi, blocks));
 #endif
+
+    m_page_cache.insert(pi.id, ppage, 1);
+
+    return ppage;
 }
 
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::nbt_nonleaf_page> pstsdk::database_impl<T>::read_nbt_nonleaf_page(const page_info& pi)
 {
-    std::vector<byte> buffer = read_page_data(pi);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
+    std::vector<byte> scratch;
+    const disk::page<T>* ppage = (const disk::page<T>*)read_page_data(pi, scratch);
     
     if(ppage->trailer.page_type == disk::page_type_nbt)
     {
-        disk::nbt_nonleaf_page<T>* nonleaf_page = (disk::nbt_nonleaf_page<T>*)ppage;
+        const disk::nbt_nonleaf_page<T>* nonleaf_page = (const disk::nbt_nonleaf_page<T>*)ppage;
 
         if(nonleaf_page->level > 0)
             return read_bt_nonleaf_page<node_id, node_info>(pi, *nonleaf_page);
@@ -449,7 +669,7 @@ inline std::tr1::shared_ptr<pstsdk::nbt_nonleaf_page> pstsdk::database_impl<T>::
 
 template<typename T>
 template<typename K, typename V>
-inline std::tr1::shared_ptr<pstsdk::bt_nonleaf_page<K,V> > pstsdk::database_impl<T>::read_bt_nonleaf_page(const page_info& pi, pstsdk::disk::bt_page<T, disk::bt_entry<T> >& the_page)
+inline std::tr1::shared_ptr<pstsdk::bt_nonleaf_page<K,V> > pstsdk::database_impl<T>::read_bt_nonleaf_page(const page_info& pi, const pstsdk::disk::bt_page<T, disk::bt_entry<T> >& the_page)
 {
     std::vector<std::pair<K, page_info> > nodes;
     
@@ -469,12 +689,12 @@ inline std::tr1::shared_ptr<pstsdk::bt_nonleaf_page<K,V> > pstsdk::database_impl
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::bbt_nonleaf_page> pstsdk::database_impl<T>::read_bbt_nonleaf_page(const page_info& pi)
 {
-    std::vector<byte> buffer = read_page_data(pi);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
+    std::vector<byte> scratch;
+    const disk::page<T>* ppage = (const disk::page<T>*)read_page_data(pi, scratch);
     
     if(ppage->trailer.page_type == disk::page_type_bbt)
     {
-        disk::bbt_nonleaf_page<T>* nonleaf_page = (disk::bbt_nonleaf_page<T>*)ppage;
+        const disk::bbt_nonleaf_page<T>* nonleaf_page = (const disk::bbt_nonleaf_page<T>*)ppage;
 
         if(nonleaf_page->level > 0)
             return read_bt_nonleaf_page<block_id, block_info>(pi, *nonleaf_page);
@@ -486,12 +706,16 @@ inline std::tr1::shared_ptr<pstsdk::bbt_nonleaf_page> pstsdk::database_impl<T>::
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::bbt_page> pstsdk::database_impl<T>::read_bbt_page(const page_info& pi)
 {
-    std::vector<byte> buffer = read_page_data(pi);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
+    std::tr1::shared_ptr<bbt_page> pcached = lookup_cached_page<bbt_leaf_page>(pi);
+    if(pcached)
+        return pcached;
+
+    std::vector<byte> scratch;
+    const disk::page<T>* ppage = (const disk::page<T>*)read_page_data(pi, scratch);
 
     if(ppage->trailer.page_type == disk::page_type_bbt)
     {
-        disk::bbt_leaf_page<T>* leaf = (disk::bbt_leaf_page<T>*)ppage;
+        const disk::bbt_leaf_page<T>* leaf = (const disk::bbt_leaf_page<T>*)ppage;
         if(leaf->level == 0)
         {
             // it really is a leaf!
@@ -499,7 +723,7 @@ inline std::tr1::shared_ptr<pstsdk::bbt_page> pstsdk::database_impl<T>::read_bbt
         }
         else
         {
-            disk::bbt_nonleaf_page<T>* nonleaf = (disk::bbt_nonleaf_page<T>*)ppage;
+            const disk::bbt_nonleaf_page<T>* nonleaf = (const disk::bbt_nonleaf_page<T>*)ppage;
             return read_bt_nonleaf_page<block_id, block_info>(pi, *nonleaf);
         }
     }
@@ -512,12 +736,16 @@ inline std::tr1::shared_ptr<pstsdk::bbt_page> pstsdk::database_impl<T>::read_bbt
 template<typename T>
 inline std::tr1::shared_ptr<pstsdk::nbt_page> pstsdk::database_impl<T>::read_nbt_page(const page_info& pi)
 {
-    std::vector<byte> buffer = read_page_data(pi);
-    disk::page<T>* ppage = (disk::page<T>*)&buffer[0];
+    std::tr1::shared_ptr<nbt_page> pcached = lookup_cached_page<nbt_leaf_page>(pi);
+    if(pcached)
+        return pcached;
+
+    std::vector<byte> scratch;
+    const disk::page<T>* ppage = (const disk::page<T>*)read_page_data(pi, scratch);
 
     if(ppage->trailer.page_type == disk::page_type_nbt)
     {
-        disk::nbt_leaf_page<T>* leaf = (disk::nbt_leaf_page<T>*)ppage;
+        const disk::nbt_leaf_page<T>* leaf = (const disk::nbt_leaf_page<T>*)ppage;
         if(leaf->level == 0)
         {
             // it really is a leaf!
@@ -525,7 +753,7 @@ inline std::tr1::shared_ptr<pstsdk::nbt_page> pstsdk::database_impl<T>::read_nbt
         }
         else
         {
-            disk::nbt_nonleaf_page<T>* nonleaf = (disk::nbt_nonleaf_page<T>*)ppage;
+            const disk::nbt_nonleaf_page<T>* nonleaf = (const disk::nbt_nonleaf_page<T>*)ppage;
             return read_bt_nonleaf_page<node_id, node_info>(pi, *nonleaf);
         }
     }
@@ -557,9 +785,43 @@ inline pstsdk::block_info pstsdk::database_impl<T>::lookup_block_info(block_id b
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::block> pstsdk::database_impl<T>::read_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::header_stamp pstsdk::database_impl<T>::get_header_stamp() const
+{
+    // bidNextB is a byte array on some compilers; see disk::header
+    T next_block_id;
+    memcpy(&next_block_id, &m_header.bidNextB, sizeof(next_block_id));
+
+    header_stamp stamp;
+    stamp.next_block_id = next_block_id;
+    stamp.next_page_id = m_header.bidNextP;
+    stamp.file_eof = m_header.root_info.ibFileEof;
+    stamp.unique = m_header.dwUnique;
+    stamp.crc = m_header.dwCRCPartial;
+
+    return stamp;
+}
+
+template<typename T>
+inline void pstsdk::database_impl<T>::prefetch_block(block_id bid)
+{
+    if(bid == 0)
+        return;
+
+    try
+    {
+        block_info bi = lookup_block_info(bid);
+        m_file.prefetch(bi.address, disk::align_disk<T>(bi.size));
+    }
+    catch(key_not_found<block_id>&)
+    {
+        // only a hint; the real read will report the problem
+    }
+}
+
+template<typename T>
+inline pstsdk::block_ptr pstsdk::database_impl<T>::read_block(const shared_db_ptr& parent, const block_info& bi)
 {
-    std::tr1::shared_ptr<block> pblock;
+    block_ptr pblock;
 
     try
     {
@@ -574,14 +836,13 @@ inline std::tr1::shared_ptr<pstsdk::block> pstsdk::database_impl<T>::read_block(
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::data_block> pstsdk::database_impl<T>::read_data_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::data_block_ptr pstsdk::database_impl<T>::read_data_block(const shared_db_ptr& parent, const block_info& bi)
 {
     if(disk::bid_is_external(bi.id))
         return read_external_block(parent, bi);
 
-    std::vector<byte> buffer(sizeof(disk::extended_block<T>));
-    disk::extended_block<T>* peblock = (disk::extended_block<T>*)&buffer[0];
-    m_file.read(buffer, bi.address);
+    std::vector<byte> scratch;
+    const disk::extended_block<T>* peblock = (const disk::extended_block<T>*)m_file.view(bi.address, sizeof(disk::extended_block<T>), scratch);
 
     // the behavior of read_block depends on this throw; this can not go under PSTSDK_VALIDATION_WEAK
     if(peblock->block_type != disk::block_type_extended)
@@ -591,13 +852,13 @@ inline std::tr1::shared_ptr<pstsdk::data_block> pstsdk::database_impl<T>::read_d
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::extended_block> pstsdk::database_impl<T>::read_extended_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::extended_block_ptr pstsdk::database_impl<T>::read_extended_block(const shared_db_ptr& parent, const block_info& bi)
 {
     if(!disk::bid_is_internal(bi.id))
         throw unexpected_block("internal bid expected");
 
-    std::vector<byte> buffer = read_block_data(bi);
-    disk::extended_block<T>* peblock = (disk::extended_block<T>*)&buffer[0];
+    std::vector<byte> scratch;
+    const disk::extended_block<T>* peblock = (const disk::extended_block<T>*)read_block_data(bi, scratch);
     std::vector<block_id> child_blocks;
 
     for(int i = 0; i < peblock->count; ++i)
@@ -617,49 +878,49 @@ inline std::tr1::shared_ptr<pstsdk::extended_block> pstsdk::database_impl<T>::re
     uint sub_page_count = peblock->level == 1 ? 1 : disk::extended_block<T>::max_count;
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, bi, peblock->level, peblock->total_size, sub_size, disk::extended_block<T>::max_count, sub_page_count, std::move(child_blocks)));
+    return extended_block_ptr(new extended_block(parent, bi, peblock->level, peblock->total_size, sub_size, disk::extended_block<T>::max_count, sub_page_count, std::move(child_blocks)));
 #else
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, bi, peblock->level, peblock->total_size, sub_size, disk::extended_block<T>::max_count, sub_page_count, child_blocks));
+    return extended_block_ptr(new extended_block(parent, bi, peblock->level, peblock->total_size, sub_size, disk::extended_block<T>::max_count, sub_page_count, child_blocks));
 #endif
 }
 
 //! \cond write_api
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::external_block> pstsdk::database_impl<T>::create_external_block(const shared_db_ptr& parent, size_t size)
+inline pstsdk::external_block_ptr pstsdk::database_impl<T>::create_external_block(const shared_db_ptr& parent, size_t size)
 {
-    return std::tr1::shared_ptr<external_block>(new external_block(parent, disk::external_block<T>::max_size, size));
+    return external_block_ptr(new external_block(parent, disk::external_block<T>::max_size, size));
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::extended_block> pstsdk::database_impl<T>::create_extended_block(const shared_db_ptr& parent, std::tr1::shared_ptr<external_block>& pchild_block)
+inline pstsdk::extended_block_ptr pstsdk::database_impl<T>::create_extended_block(const shared_db_ptr& parent, external_block_ptr& pchild_block)
 {
-    std::vector<std::tr1::shared_ptr<data_block> > child_blocks;
+    std::vector<data_block_ptr > child_blocks;
     child_blocks.push_back(pchild_block);
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, 1, pchild_block->get_total_size(), disk::external_block<T>::max_size, disk::extended_block<T>::max_count, 1, std::move(child_blocks)));
+    return extended_block_ptr(new extended_block(parent, 1, pchild_block->get_total_size(), disk::external_block<T>::max_size, disk::extended_block<T>::max_count, 1, std::move(child_blocks)));
 #else
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, 1, pchild_block->get_total_size(), disk::external_block<T>::max_size, disk::extended_block<T>::max_count, 1, child_blocks));
+    return extended_block_ptr(new extended_block(parent, 1, pchild_block->get_total_size(), disk::external_block<T>::max_size, disk::extended_block<T>::max_count, 1, child_blocks));
 #endif
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::extended_block> pstsdk::database_impl<T>::create_extended_block(const shared_db_ptr& parent, std::tr1::shared_ptr<extended_block>& pchild_block)
+inline pstsdk::extended_block_ptr pstsdk::database_impl<T>::create_extended_block(const shared_db_ptr& parent, extended_block_ptr& pchild_block)
 {
-    std::vector<std::tr1::shared_ptr<data_block> > child_blocks;
+    std::vector<data_block_ptr > child_blocks;
     child_blocks.push_back(pchild_block);
 
     assert(pchild_block->get_level() == 1);
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, 2, pchild_block->get_total_size(), disk::extended_block<T>::max_size, disk::extended_block<T>::max_count, disk::extended_block<T>::max_count, std::move(child_blocks)));
+    return extended_block_ptr(new extended_block(parent, 2, pchild_block->get_total_size(), disk::extended_block<T>::max_size, disk::extended_block<T>::max_count, disk::extended_block<T>::max_count, std::move(child_blocks)));
 #else
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, 2, pchild_block->get_total_size(), disk::extended_block<T>::max_size, disk::extended_block<T>::max_count, disk::extended_block<T>::max_count, child_blocks));
+    return extended_block_ptr(new extended_block(parent, 2, pchild_block->get_total_size(), disk::extended_block<T>::max_size, disk::extended_block<T>::max_count, disk::extended_block<T>::max_count, child_blocks));
 #endif
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::extended_block> pstsdk::database_impl<T>::create_extended_block(const shared_db_ptr& parent, size_t size)
+inline pstsdk::extended_block_ptr pstsdk::database_impl<T>::create_extended_block(const shared_db_ptr& parent, size_t size)
 {
     ushort level = size > disk::extended_block<T>::max_size ? 2 : 1;
 #ifdef __GNUC__
@@ -674,73 +935,110 @@ inline std::tr1::shared_ptr<pstsdk::extended_block> pstsdk::database_impl<T>::cr
 #endif
     ulong child_max_blocks = level == 1 ? 1 : disk::extended_block<T>::max_count;
 
-    return std::tr1::shared_ptr<extended_block>(new extended_block(parent, level, size, child_max_size, disk::extended_block<T>::max_count, child_max_blocks));
+    return extended_block_ptr(new extended_block(parent, level, size, child_max_size, disk::extended_block<T>::max_count, child_max_blocks));
 }
 //! \endcond
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::external_block> pstsdk::database_impl<T>::read_external_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::external_block_ptr pstsdk::database_impl<T>::read_external_block(const shared_db_ptr& parent, const block_info& bi)
 {
     if(bi.id == 0)
     {
-        return std::tr1::shared_ptr<external_block>(new external_block(parent, bi, disk::external_block<T>::max_size,  std::vector<byte>()));
+        return external_block_ptr(new external_block(parent, bi, disk::external_block<T>::max_size,  std::vector<byte>()));
     }
 
     if(!disk::bid_is_external(bi.id))
         throw unexpected_block("External BID expected");
 
-    std::vector<byte> buffer = read_block_data(bi);
+    external_block_ptr pcached = lookup_cached_block<external_block>(parent, bi);
+    if(pcached)
+        return pcached;
 
-    if(m_header.bCryptMethod == disk::crypt_method_permute)
-    {
-        disk::permute(&buffer[0], bi.size, false);
-    }
-    else if(m_header.bCryptMethod == disk::crypt_method_cyclic)
+    std::vector<byte> buffer;
+    const byte* pdata = read_block_data(bi, buffer);
+
+    // lazy validation checks the data against this once it is first used
+    bool lazy_crc = (m_validation == validation_level_lazy);
+    ulong crc = ((const disk::block_trailer<T>*)(pdata + disk::align_disk<T>(bi.size) - sizeof(disk::block_trailer<T>)))->crc;
+
+    // a mapped view is read only, so decode on the way out of it into the
+    // one copy we need; otherwise the data is already in buffer and is
+    // decoded in place
+    if(m_file.is_mapped())
+        buffer.resize(bi.size);
+
+    if(bi.size > 0)
     {
-        disk::cyclic(&buffer[0], bi.size, (ulong)bi.id);
+        if(m_header.bCryptMethod == disk::crypt_method_permute)
+        {
+            disk::permute_copy(&buffer[0], pdata, bi.size, false);
+        }
+        else if(m_header.bCryptMethod == disk::crypt_method_cyclic)
+        {
+            disk::cyclic_copy(&buffer[0], pdata, bi.size, (ulong)bi.id);
+        }
+        else if(m_file.is_mapped())
+        {
+            memcpy(&buffer[0], pdata, bi.size);
+        }
     }
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<external_block>(new external_block(parent, bi, disk::external_block<T>::max_size, std::move(buffer)));
+    external_block_ptr pblock(new external_block(parent, bi, disk::external_block<T>::max_size, std::move(buffer), lazy_crc, crc));
 #else
-    return std::tr1::shared_ptr<external_block>(new external_block(parent, bi, disk::external_block<T>::max_size, buffer));
+    external_block_ptr pblock(new external_block(parent, bi, disk::external_block<T>::max_size, buffer, lazy_crc, crc));
 #endif
+
+    cache_block(parent, bi, pblock);
+
+    return pblock;
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::subnode_block> pstsdk::database_impl<T>::read_subnode_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::subnode_block_ptr pstsdk::database_impl<T>::read_subnode_block(const shared_db_ptr& parent, const block_info& bi)
 {
     if(bi.id == 0)
     {
-        return std::tr1::shared_ptr<subnode_block>(new subnode_leaf_block(parent, bi, std::vector<std::pair<node_id, subnode_info> >()));
+        return subnode_block_ptr(new subnode_leaf_block(parent, bi, std::vector<std::pair<node_id, subnode_info> >()));
     }
+
+    subnode_block_ptr pcached = lookup_cached_block<subnode_leaf_block>(parent, bi);
+    if(pcached)
+        return pcached;
     
-    std::vector<byte> buffer = read_block_data(bi);
-    disk::sub_leaf_block<T>* psub = (disk::sub_leaf_block<T>*)&buffer[0];
-    std::tr1::shared_ptr<subnode_block> sub_block;
+    std::vector<byte> scratch;
+    const byte* pdata = read_block_data(bi, scratch);
+    const disk::sub_leaf_block<T>* psub = (const disk::sub_leaf_block<T>*)pdata;
+    subnode_block_ptr sub_block;
 
     if(psub->level == 0)
     {
         sub_block = read_subnode_leaf_block(parent, bi, *psub);
+        cache_block(parent, bi, sub_block);
     }
     else
     {
-        sub_block = read_subnode_nonleaf_block(parent, bi, *(disk::sub_nonleaf_block<T>*)&buffer[0]);
+        sub_block = read_subnode_nonleaf_block(parent, bi, *(const disk::sub_nonleaf_block<T>*)pdata);
     }
 
     return sub_block;
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::subnode_leaf_block> pstsdk::database_impl<T>::read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::subnode_leaf_block_ptr pstsdk::database_impl<T>::read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi)
 {
-    std::vector<byte> buffer = read_block_data(bi);
-    disk::sub_leaf_block<T>* psub = (disk::sub_leaf_block<T>*)&buffer[0];
-    std::tr1::shared_ptr<subnode_leaf_block> sub_block;
+    subnode_leaf_block_ptr pcached = lookup_cached_block<subnode_leaf_block>(parent, bi);
+    if(pcached)
+        return pcached;
+
+    std::vector<byte> scratch;
+    const disk::sub_leaf_block<T>* psub = (const disk::sub_leaf_block<T>*)read_block_data(bi, scratch);
+    subnode_leaf_block_ptr sub_block;
 
     if(psub->level == 0)
     {
         sub_block = read_subnode_leaf_block(parent, bi, *psub);
+        cache_block(parent, bi, sub_block);
     }
     else
     {
@@ -751,11 +1049,11 @@ inline std::tr1::shared_ptr<pstsdk::subnode_leaf_block> pstsdk::database_impl<T>
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::subnode_nonleaf_block> pstsdk::database_impl<T>::read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi)
+inline pstsdk::subnode_nonleaf_block_ptr pstsdk::database_impl<T>::read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi)
 {
-    std::vector<byte> buffer = read_block_data(bi);
-    disk::sub_nonleaf_block<T>* psub = (disk::sub_nonleaf_block<T>*)&buffer[0];
-    std::tr1::shared_ptr<subnode_nonleaf_block> sub_block;
+    std::vector<byte> scratch;
+    const disk::sub_nonleaf_block<T>* psub = (const disk::sub_nonleaf_block<T>*)read_block_data(bi, scratch);
+    subnode_nonleaf_block_ptr sub_block;
 
     if(psub->level != 0)
     {
@@ -770,7 +1068,7 @@ inline std::tr1::shared_ptr<pstsdk::subnode_nonleaf_block> pstsdk::database_impl
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::subnode_leaf_block> pstsdk::database_impl<T>::read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi, disk::sub_leaf_block<T>& sub_block)
+inline pstsdk::subnode_leaf_block_ptr pstsdk::database_impl<T>::read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi, const disk::sub_leaf_block<T>& sub_block)
 {
     subnode_info ni;
     std::vector<std::pair<node_id, subnode_info> > subnodes;
@@ -785,14 +1083,14 @@ inline std::tr1::shared_ptr<pstsdk::subnode_leaf_block> pstsdk::database_impl<T>
     }
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<subnode_leaf_block>(new subnode_leaf_block(parent, bi, std::move(subnodes)));
+    return subnode_leaf_block_ptr(new subnode_leaf_block(parent, bi, std::move(subnodes)));
 #else
-    return std::tr1::shared_ptr<subnode_leaf_block>(new subnode_leaf_block(parent, bi, subnodes));
+    return subnode_leaf_block_ptr(new subnode_leaf_block(parent, bi, subnodes));
 #endif
 }
 
 template<typename T>
-inline std::tr1::shared_ptr<pstsdk::subnode_nonleaf_block> pstsdk::database_impl<T>::read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi, disk::sub_nonleaf_block<T>& sub_block)
+inline pstsdk::subnode_nonleaf_block_ptr pstsdk::database_impl<T>::read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi, const disk::sub_nonleaf_block<T>& sub_block)
 {
     std::vector<std::pair<node_id, block_id> > subnodes;
 
@@ -802,12 +1100,45 @@ inline std::tr1::shared_ptr<pstsdk::subnode_nonleaf_block> pstsdk::database_impl
     }
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    return std::tr1::shared_ptr<subnode_nonleaf_block>(new subnode_nonleaf_block(parent, bi, std::move(subnodes)));
+    return subnode_nonleaf_block_ptr(new subnode_nonleaf_block(parent, bi, std::move(subnodes)));
 #else
-    return std::tr1::shared_ptr<subnode_nonleaf_block>(new subnode_nonleaf_block(parent, bi, subnodes));
+    return subnode_nonleaf_block_ptr(new subnode_nonleaf_block(parent, bi, subnodes));
 #endif
 }
 
+template<typename T>
+template<typename Block>
+inline typename pstsdk::counted_ptr<Block>::type pstsdk::database_impl<T>::lookup_cached_block(const shared_db_ptr& parent, const block_info& bi)
+{
+    block_ptr pblock;
+
+    // blocks remember the context they were read for; only share the ones
+    // read directly against this database
+    if(parent.get() != this || !m_block_cache.lookup(bi.id, pblock))
+        return typename counted_ptr<Block>::type();
+
+    return counted_dynamic_cast<Block>(pblock);
+}
+
+template<typename T>
+template<typename Page>
+inline std::tr1::shared_ptr<Page> pstsdk::database_impl<T>::lookup_cached_page(const page_info& pi)
+{
+    std::tr1::shared_ptr<page> ppage;
+
+    if(!m_page_cache.lookup(pi.id, ppage))
+        return std::tr1::shared_ptr<Page>();
+
+    return std::tr1::dynamic_pointer_cast<Page>(ppage);
+}
+
+template<typename T>
+inline void pstsdk::database_impl<T>::cache_block(const shared_db_ptr& parent, const block_info& bi, const block_ptr& pblock)
+{
+    if(parent.get() == this)
+        m_block_cache.insert(bi.id, pblock, bi.size);
+}
+
 //! \cond write_api
 template<typename T>
 inline pstsdk::block_id pstsdk::database_impl<T>::alloc_bid(bool is_internal)
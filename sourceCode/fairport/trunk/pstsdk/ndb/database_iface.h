@@ -14,6 +14,10 @@
 #include <tr1/memory>
 #endif
 
+#include "pstsdk/util/cache.h"
+#include "pstsdk/util/parallel.h"
+#include "pstsdk/util/refcount.h"
+#include "pstsdk/util/file.h"
 #include "pstsdk/util/util.h"
 #include "pstsdk/util/primitives.h"
 
@@ -63,6 +67,41 @@ struct subnode_info
     block_id sub_bid;
 };
 
+//! \brief Values from the header which change whenever the file is written
+//!
+//! Two opens of a file with equal stamps see the same contents, so a stamp
+//! saved alongside anything derived from the file tells when it is stale.
+//! \ingroup ndb
+struct header_stamp
+{
+    ulonglong next_block_id;    //!< bidNextB
+    ulonglong next_page_id;     //!< bidNextP
+    ulonglong file_eof;         //!< ibFileEof
+    ulong unique;               //!< dwUnique, bumped on every header write
+    ulong crc;                  //!< dwCRCPartial
+};
+
+//! \brief Compare two header stamps
+//! \param[in] lhs The first stamp
+//! \param[in] rhs The second stamp
+//! \returns true if they describe the same state of the file
+//! \ingroup ndb
+inline bool operator==(const header_stamp& lhs, const header_stamp& rhs)
+{
+    return lhs.next_block_id == rhs.next_block_id && lhs.next_page_id == rhs.next_page_id
+        && lhs.file_eof == rhs.file_eof && lhs.unique == rhs.unique && lhs.crc == rhs.crc;
+}
+
+//! \brief Compare two header stamps
+//! \param[in] lhs The first stamp
+//! \param[in] rhs The second stamp
+//! \returns true if they describe different states of the file
+//! \ingroup ndb
+inline bool operator!=(const header_stamp& lhs, const header_stamp& rhs)
+{
+    return !(lhs == rhs);
+}
+
 template<typename K, typename V>
 class bt_page;
 typedef bt_page<node_id, node_info> nbt_page;
@@ -78,6 +117,11 @@ class bt_leaf_page;
 typedef bt_leaf_page<node_id, node_info> nbt_leaf_page;
 typedef bt_leaf_page<block_id, block_info> bbt_leaf_page;
 
+template<typename K, typename V>
+class bt_flat_page;
+typedef bt_flat_page<node_id, node_info> nbt_flat_page;
+typedef bt_flat_page<block_id, block_info> bbt_flat_page;
+
 template<typename K, typename V>
 class const_btree_node_iter;
 
@@ -100,10 +144,62 @@ class db_context;
 
 //! \addtogroup ndb
 //@{
+typedef counted_ptr<block>::type block_ptr;
+typedef counted_ptr<data_block>::type data_block_ptr;
+typedef counted_ptr<extended_block>::type extended_block_ptr;
+typedef counted_ptr<external_block>::type external_block_ptr;
+typedef counted_ptr<subnode_block>::type subnode_block_ptr;
+typedef counted_ptr<subnode_leaf_block>::type subnode_leaf_block_ptr;
+typedef counted_ptr<subnode_nonleaf_block>::type subnode_nonleaf_block_ptr;
 typedef std::tr1::shared_ptr<db_context> shared_db_ptr;
 typedef std::tr1::weak_ptr<db_context> weak_db_ptr;
 //@}
 
+//! \brief How the BBT and NBT are held in memory
+//! \ingroup ndb
+enum index_mode
+{
+    //! Pages are read on demand, and leaf pages are cached (the default)
+    index_mode_paged,
+    //! Every leaf page is read when the database is opened, and each
+    //! btree is replaced by a single sorted array. Suited to opening a
+    //! file, walking all of it once, and closing it again.
+    index_mode_flat
+};
+
+//! \brief How much checking a database does as it reads the file
+//!
+//! The validation level of a database is chosen when it is opened and can
+//! be changed afterwards. See \ref PSTSDK_VALIDATION_LEVEL_FULL for the
+//! compile time default.
+//! \ingroup ndb
+enum validation_level
+{
+    //! No checks beyond those needed to tell ANSI from Unicode
+    validation_level_none,
+    //! Cheap checks: sizes, locations, ids, signatures and the header CRC
+    validation_level_weak,
+    //! Weak checks, plus the CRCs of pages and internal blocks as they are
+    //! read. The CRC of an external (data) block is only checked the first
+    //! time its contents are read, so passes which only need sizes or
+    //! subnode maps skip most of the CRC work.
+    validation_level_lazy,
+    //! Weak checks, plus the CRC of every page and block as it is read
+    validation_level_full
+};
+
+//! \brief The validation level used unless another is asked for
+//!
+//! Follows the compile time PSTSDK_VALIDATION_LEVEL_* settings.
+//! \ingroup ndb
+#if defined(PSTSDK_VALIDATION_LEVEL_FULL)
+const validation_level default_validation_level = validation_level_full;
+#elif defined(PSTSDK_VALIDATION_LEVEL_WEAK)
+const validation_level default_validation_level = validation_level_weak;
+#else
+const validation_level default_validation_level = validation_level_none;
+#endif
+
 //! \defgroup ndb_databaserelated Database
 //! \ingroup ndb
 
@@ -114,6 +210,12 @@ typedef std::tr1::weak_ptr<db_context> weak_db_ptr;
 //! address (or other relative context to help locate the physical piece of
 //! data) a db_context will produce an in memory version of that data
 //! structure, with all the Unicode vs. ANSI differences abstracted away.
+//!
+//! The read path of a db_context (the lookup, page factory and block 
+//! factory functions) is safe to call from multiple threads at once, so a 
+//! single opened store and its cached BBT/NBT pages can be shared by a pool
+//! of readers. The objects it hands out (node, block, heap, table, etc) are
+//! not; each thread should open its own. The write API is not thread safe.
 //! \ingroup ndb_databaserelated
 class db_context : public std::tr1::enable_shared_from_this<db_context>
 {
@@ -212,49 +314,49 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<block> read_block(block_id bid) { return read_block(shared_from_this(), bid); }
+    block_ptr read_block(block_id bid);
     //! \brief Open a data_block in this context
     //! \param[in] bid The id of the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<data_block> read_data_block(block_id bid) { return read_data_block(shared_from_this(), bid); }
+    data_block_ptr read_data_block(block_id bid);
     //! \brief Open a extended_block in this context
     //! \param[in] bid The id of the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<extended_block> read_extended_block(block_id bid) { return read_extended_block(shared_from_this(), bid); }
+    extended_block_ptr read_extended_block(block_id bid);
     //! \brief Open a external_block in this context
     //! \param[in] bid The id of the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<external_block> read_external_block(block_id bid) { return read_external_block(shared_from_this(), bid); }
+    external_block_ptr read_external_block(block_id bid);
     //! \brief Open a subnode_block in this context
     //! \param[in] bid The id of the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<subnode_block> read_subnode_block(block_id bid) { return read_subnode_block(shared_from_this(), bid); }
+    subnode_block_ptr read_subnode_block(block_id bid);
     //! \brief Open a subnode_leaf_block in this context
     //! \param[in] bid The id of the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(block_id bid) { return read_subnode_leaf_block(shared_from_this(), bid); }
+    subnode_leaf_block_ptr read_subnode_leaf_block(block_id bid);
     //! \brief Open a subnode_nonleaf_block in this context
     //! \param[in] bid The id of the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(block_id bid) { return read_subnode_nonleaf_block(shared_from_this(), bid); }
+    subnode_nonleaf_block_ptr read_subnode_nonleaf_block(block_id bid);
     //! \brief Open a block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -262,7 +364,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<block> read_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual block_ptr read_block(const shared_db_ptr& parent, block_id bid) = 0;
     //! \brief Open a data_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -270,7 +372,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<data_block> read_data_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual data_block_ptr read_data_block(const shared_db_ptr& parent, block_id bid) = 0;
     //! \brief Open an extended_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -278,7 +380,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<extended_block> read_extended_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual extended_block_ptr read_extended_block(const shared_db_ptr& parent, block_id bid) = 0;
     //! \brief Open a external_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -286,7 +388,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<external_block> read_external_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual external_block_ptr read_external_block(const shared_db_ptr& parent, block_id bid) = 0;
     //! \brief Open a subnode_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -294,7 +396,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<subnode_block> read_subnode_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual subnode_block_ptr read_subnode_block(const shared_db_ptr& parent, block_id bid) = 0;
     //! \brief Open a subnode_leaf_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -302,7 +404,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual subnode_leaf_block_ptr read_subnode_leaf_block(const shared_db_ptr& parent, block_id bid) = 0;
     //! \brief Open a subnode_nonleaf_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bid The id of the block to open
@@ -310,7 +412,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(const shared_db_ptr& parent, block_id bid) = 0;
+    virtual subnode_nonleaf_block_ptr read_subnode_nonleaf_block(const shared_db_ptr& parent, block_id bid) = 0;
 
     //! \brief Open a block in this context
     //! \param[in] bi Information about the block to open
@@ -318,49 +420,49 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<block> read_block(const block_info& bi) { return read_block(shared_from_this(), bi); }
+    block_ptr read_block(const block_info& bi);
     //! \brief Open a data_block in this context
     //! \param[in] bi Information about the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<data_block> read_data_block(const block_info& bi) { return read_data_block(shared_from_this(), bi); }
+    data_block_ptr read_data_block(const block_info& bi);
     //! \brief Open a extended_block in this context
     //! \param[in] bi Information about the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<extended_block> read_extended_block(const block_info& bi) { return read_extended_block(shared_from_this(), bi); }
+    extended_block_ptr read_extended_block(const block_info& bi);
     //! \brief Open a block in this context
     //! \param[in] bi Information about the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<external_block> read_external_block(const block_info& bi) { return read_external_block(shared_from_this(), bi); }
+    external_block_ptr read_external_block(const block_info& bi);
     //! \brief Open a subnode_block in this context
     //! \param[in] bi Information about the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<subnode_block> read_subnode_block(const block_info& bi) { return read_subnode_block(shared_from_this(), bi); }
+    subnode_block_ptr read_subnode_block(const block_info& bi);
     //! \brief Open a subnode_leaf_block in this context
     //! \param[in] bi Information about the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(const block_info& bi) { return read_subnode_leaf_block(shared_from_this(), bi); }
+    subnode_leaf_block_ptr read_subnode_leaf_block(const block_info& bi);
     //! \brief Open a subnode_nonleaf_block in this context
     //! \param[in] bi Information about the block to open
     //! \throws unexpected_block (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the parameters of the block appear incorrect
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(const block_info& bi) { return read_subnode_nonleaf_block(shared_from_this(), bi); }
+    subnode_nonleaf_block_ptr read_subnode_nonleaf_block(const block_info& bi);
     //! \brief Open a block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -368,7 +470,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<block> read_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual block_ptr read_block(const shared_db_ptr& parent, const block_info& bi) = 0;
     //! \brief Open a data_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -376,7 +478,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<data_block> read_data_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual data_block_ptr read_data_block(const shared_db_ptr& parent, const block_info& bi) = 0;
     //! \brief Open a extended_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -384,7 +486,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<extended_block> read_extended_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual extended_block_ptr read_extended_block(const shared_db_ptr& parent, const block_info& bi) = 0;
     //! \brief Open a external_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -392,7 +494,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<external_block> read_external_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual external_block_ptr read_external_block(const shared_db_ptr& parent, const block_info& bi) = 0;
     //! \brief Open a subnode_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -400,7 +502,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<subnode_block> read_subnode_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual subnode_block_ptr read_subnode_block(const shared_db_ptr& parent, const block_info& bi) = 0;
     //! \brief Open a subnode_leaf_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -408,7 +510,7 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<subnode_leaf_block> read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual subnode_leaf_block_ptr read_subnode_leaf_block(const shared_db_ptr& parent, const block_info& bi) = 0;
     //! \brief Open a subnode_nonleaf_block in the specified context
     //! \param[in] parent The context to open this block in. It must be either this context or a child context of this context.
     //! \param[in] bi Information about the block to open
@@ -416,18 +518,131 @@ public:
     //! \throws sig_mismatch (\ref PSTSDK_VALIDATION_LEVEL_WEAK) If the block trailer's signature appears incorrect
     //! \throws crc_fail (\ref PSTSDK_VALIDATION_LEVEL_WEAK "PSTSDK_VALIDATION_LEVEL_FULL") If the block's CRC doesn't match the trailer
     //! \returns The requested block
-    virtual std::tr1::shared_ptr<subnode_nonleaf_block> read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    virtual subnode_nonleaf_block_ptr read_subnode_nonleaf_block(const shared_db_ptr& parent, const block_info& bi) = 0;
+    //@}
+
+    //! \name Cache control
+    //@{
+    //! \brief Get the counters of the decoded block cache
+    //!
+    //! Decoded external blocks and subnode leaf blocks are cached, keyed by
+    //! block id, and shared by every node opened from this context.
+    //! \returns The cache counters
+    virtual cache_stats get_block_cache_stats() const = 0;
+    //! \brief Set the budget of the decoded block cache
+    //! \param[in] size The maximum number of block bytes to keep cached; 0 disables the cache
+    virtual void set_block_cache_size(size_t size) = 0;
+    //! \brief Get the counters of the BBT/NBT leaf page cache
+    //!
+    //! Nonleaf pages of the BBT and NBT are always kept in memory once read.
+    //! Leaf pages are kept in a bounded LRU cache, so a random lookup costs
+    //! at most one leaf page read. The cost of each entry is one page.
+    //! \returns The cache counters
+    virtual cache_stats get_page_cache_stats() const = 0;
+    //! \brief Set the capacity of the BBT/NBT leaf page cache
+    //! \param[in] pages The maximum number of leaf pages to keep cached; 0 disables the cache
+    virtual void set_page_cache_size(size_t pages) = 0;
+    //@}
+
+    //! \name Readahead
+    //@{
+    //! \brief Get how far ahead sequential traversals prefetch
+    //! \returns The number of pages or blocks prefetched ahead of use
+    virtual uint get_readahead() const = 0;
+    //! \brief Set how far ahead sequential traversals prefetch
+    //!
+    //! Iterating over the NBT or BBT, and reading through an extended_block,
+    //! hints the next few pages or blocks to the file before they are
+    //! needed, so a cold read overlaps the I/O with decoding. Set it before
+    //! sharing the context between threads.
+    //! \param[in] count The number of pages or blocks to prefetch; 0 disables readahead
+    virtual void set_readahead(uint count) = 0;
+    //! \brief Change how the file acts on prefetch hints
+    //! \param[in] method The new prefetch method
+    virtual void set_prefetch_method(file_prefetch method) = 0;
+    //! \brief Hint that a BBT or NBT page will be read soon
+    //! \param[in] pi The page which will be read
+    virtual void prefetch_page(const page_info& pi) = 0;
+    //! \brief Hint that a block will be read soon
+    //!
+    //! Blocks missing from the BBT are ignored.
+    //! \param[in] bid The block which will be read
+    virtual void prefetch_block(block_id bid) = 0;
+    //@}
+
+    //! \name Threading
+    //@{
+    //! \brief Check how objects opened from this context count references
+    //! \returns true if the context was marked as used from one thread only
+    virtual bool is_single_threaded() const = 0;
+    //! \brief Promise to use this context, and everything opened from it, from one thread only
+    //!
+    //! Blocks, nodes, heaps and tables opened afterwards take and drop
+    //! references with plain increments instead of atomic ones, which is
+    //! noticeably cheaper on a full traversal. Objects opened before the
+    //! call keep counting atomically. Set it before opening anything;
+    //! sharing such objects between threads is undefined behavior.
+    //!
+    //! The library's own threading honors this: large reads are not decoded
+    //! on the decode pool, and pst::for_each_message and
+    //! pst::for_each_message_info call back on the calling thread only.
+    //! \param[in] single true to use non-atomic reference counts
+    virtual void set_single_threaded(bool single) = 0;
     //@}
 
+    //! \name Parallel decode
+    //@{
+    //! \brief Get the pool large reads decode their blocks on
+    //! \returns The pool, or an empty pointer if reads decode on the calling thread
+    virtual std::tr1::shared_ptr<task_pool> get_decode_pool() const = 0;
+    //! \brief Decode the blocks of large reads in parallel
+    //!
+    //! A read through an extended_block which needs at least
+    //! \ref parallel_decode_min_blocks child blocks not yet loaded has the
+    //! pool read, decrypt and check them all at once, then copies them out
+    //! in order as usual. One pool can serve any number of contexts. Ignored
+    //! while the context is single threaded. Set it before sharing the
+    //! context between threads.
+    //! \param[in] pool The pool to use, or an empty pointer to decode on the calling thread
+    virtual void set_decode_pool(const std::tr1::shared_ptr<task_pool>& pool) = 0;
+    //@}
+
+    //! \name Validation
+    //@{
+    //! \brief Get how much checking this context does as it reads the file
+    //! \returns The current validation level
+    virtual validation_level get_validation_level() const = 0;
+    //! \brief Change how much checking this context does as it reads the file
+    //!
+    //! Only affects pages and blocks read after the call; set it before
+    //! sharing the context between threads.
+    //! \param[in] level The new validation level
+    virtual void set_validation_level(validation_level level) = 0;
+    //! \brief Check the CRC of a block against the data it was read into
+    //!
+    //! Used by \ref external_block to finish the check deferred by
+    //! \ref validation_level_lazy. The data is encoded again as it was on
+    //! disk, rather than read from the file a second time.
+    //! \param[in] bi The block to check
+    //! \param[in] data The block's decoded data, at least bi.size bytes
+    //! \param[in] crc The CRC in the block's trailer when it was read
+    //! \throws crc_fail If the data's CRC doesn't match crc
+    virtual void validate_block_crc(const block_info& bi, const std::vector<byte>& data, ulong crc) = 0;
+    //@}
+
+    //! \brief Get the values identifying the state of the file when it was opened
+    //! \returns The header stamp
+    virtual header_stamp get_header_stamp() const = 0;
+
 //! \cond write_api
-    std::tr1::shared_ptr<external_block> create_external_block(size_t size) { return create_external_block(shared_from_this(), size); }
-    std::tr1::shared_ptr<extended_block> create_extended_block(std::tr1::shared_ptr<external_block>& pblock) { return create_extended_block(shared_from_this(), pblock); }
-    std::tr1::shared_ptr<extended_block> create_extended_block(std::tr1::shared_ptr<extended_block>& pblock) { return create_extended_block(shared_from_this(), pblock); }
-    std::tr1::shared_ptr<extended_block> create_extended_block(size_t size) { return create_extended_block(shared_from_this(), size); }
-    virtual std::tr1::shared_ptr<external_block> create_external_block(const shared_db_ptr& parent, size_t size) = 0;
-    virtual std::tr1::shared_ptr<extended_block> create_extended_block(const shared_db_ptr& parent, std::tr1::shared_ptr<external_block>& pblock) = 0;
-    virtual std::tr1::shared_ptr<extended_block> create_extended_block(const shared_db_ptr& parent, std::tr1::shared_ptr<extended_block>& pblock) = 0;
-    virtual std::tr1::shared_ptr<extended_block> create_extended_block(const shared_db_ptr& parent, size_t size) = 0;
+    external_block_ptr create_external_block(size_t size);
+    extended_block_ptr create_extended_block(external_block_ptr& pblock);
+    extended_block_ptr create_extended_block(extended_block_ptr& pblock);
+    extended_block_ptr create_extended_block(size_t size);
+    virtual external_block_ptr create_external_block(const shared_db_ptr& parent, size_t size) = 0;
+    virtual extended_block_ptr create_extended_block(const shared_db_ptr& parent, external_block_ptr& pblock) = 0;
+    virtual extended_block_ptr create_extended_block(const shared_db_ptr& parent, extended_block_ptr& pblock) = 0;
+    virtual extended_block_ptr create_extended_block(const shared_db_ptr& parent, size_t size) = 0;
 
     // header functions
     virtual block_id alloc_bid(bool is_internal) = 0;
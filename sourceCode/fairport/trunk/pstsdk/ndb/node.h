@@ -24,6 +24,10 @@
 #pragma warning(pop)
 #endif
 
+#include "pstsdk/util/arena.h"
+#include "pstsdk/util/mutex.h"
+#include "pstsdk/util/refcount.h"
+#include "pstsdk/util/slice.h"
 #include "pstsdk/util/util.h"
 #include "pstsdk/util/btree.h"
 
@@ -40,6 +44,46 @@ namespace pstsdk
 //! \defgroup ndb_noderelated Node
 //! \ingroup ndb
 
+class node_impl;
+typedef counted_ptr<node_impl>::type node_impl_ptr;
+
+//! \brief Receives the pages of a node, in order
+//!
+//! Implemented by callers of \ref node::for_each_page which want the data of
+//! a node without holding all of it at once. \ref page_sink_adapter wraps any
+//! callable taking a byte_slice.
+//! \ingroup ndb_noderelated
+class page_sink
+{
+public:
+    virtual ~page_sink() { }
+
+    //! \brief Take the next page
+    //!
+    //! The slice keeps the page alive for as long as the sink holds on to
+    //! it; a sink which only copies the bytes out lets it go right away.
+    //! \param[in] page The data of the page, never empty
+    virtual void write(const byte_slice& page) = 0;
+};
+
+//! \brief A page_sink calling a function object on each page
+//! \tparam Func A callable taking a const byte_slice&
+//! \ingroup ndb_noderelated
+template<typename Func>
+class page_sink_adapter : public page_sink
+{
+public:
+    //! \brief Wrap a function object
+    //! \param[in] f The function object, which must outlive the adapter
+    explicit page_sink_adapter(Func& f)
+        : m_f(f) { }
+    void write(const byte_slice& page)
+        { m_f(page); }
+
+private:
+    Func& m_f;
+};
+
 //! \brief The node implementation
 //!
 //! The node class is really divided into two classes, node and
@@ -59,7 +103,9 @@ namespace pstsdk
 //! \ref node and its \ref node_impl class generally have a one to one mapping,
 //! this isn't true only if someone opens an \ref alias_tag "alias" for a node.
 //! \ingroup ndb_noderelated
-class node_impl : public std::tr1::enable_shared_from_this<node_impl>
+class node_impl : 
+    public ref_counted, 
+    public arena_object
 {
 public:
     //! \brief Constructor for top level nodes
@@ -68,15 +114,15 @@ public:
     //! \param[in] db The database context we're located in
     //! \param[in] info Information about this node
     node_impl(const shared_db_ptr& db, const node_info& info)
-        : m_id(info.id), m_original_data_id(info.data_bid), m_original_sub_id(info.sub_bid), m_original_parent_id(info.parent_id), m_parent_id(info.parent_id), m_db(db) { }
+        : ref_counted(!db->is_single_threaded()), m_id(info.id), m_original_data_id(info.data_bid), m_original_sub_id(info.sub_bid), m_original_parent_id(info.parent_id), m_subnode_map_built(false), m_parent_id(info.parent_id), m_db(db) { }
 
     //! \brief Constructor for subnodes
     //!
     //! This constructor is specific to nodes defined in other nodes
     //! \param[in] container_node The parent or containing node
     //! \param[in] info Information about this node
-    node_impl(const std::tr1::shared_ptr<node_impl>& container_node, const subnode_info& info)
-        : m_id(info.id), m_original_data_id(info.data_bid), m_original_sub_id(info.sub_bid), m_original_parent_id(0), m_parent_id(0), m_pcontainer_node(container_node), m_db(container_node->m_db) { }
+    node_impl(const node_impl_ptr& container_node, const subnode_info& info)
+        : ref_counted(container_node->is_atomic_count()), m_id(info.id), m_original_data_id(info.data_bid), m_original_sub_id(info.sub_bid), m_original_parent_id(0), m_subnode_map_built(false), m_parent_id(0), m_pcontainer_node(container_node), m_db(container_node->m_db) { }
 
     //! \brief Set one node equal to another
     //!
@@ -87,7 +133,7 @@ public:
     //! \param[in] other The node to assign from
     //! \returns *this after the assignment is done
     node_impl& operator=(const node_impl& other)
-        { m_pdata = other.m_pdata; m_psub = other.m_psub; return *this; }
+        { m_pdata = other.m_pdata; m_psub = other.m_psub; m_subnode_map.clear(); m_subnode_map_built = false; return *this; }
 
     //! \brief Get the id of this node
     //! \returns The id
@@ -107,17 +153,21 @@ public:
     //! \returns The id, zero if this is a subnode
     node_id get_parent_id() const { return m_parent_id; }
 
+    //! \brief Get the database context this node lives in
+    //! \returns The database context
+    const shared_db_ptr& get_db_ptr() const { return m_db; }
+
     //! \brief Tells you if this is a subnode
     //! \returns true if this is a subnode, false otherwise
-    bool is_subnode() { return m_pcontainer_node; }
+    bool is_subnode() { return m_pcontainer_node.get() != NULL; }
 
     //! \brief Returns the data block associated with this node
     //! \returns A shared pointer to the data block
-    std::tr1::shared_ptr<data_block> get_data_block() const
+    data_block_ptr get_data_block() const
         { ensure_data_block(); return m_pdata; }
     //! \brief Returns the subnode block associated with this node
     //! \returns A shared pointer to the subnode block
-    std::tr1::shared_ptr<subnode_block> get_subnode_block() const 
+    subnode_block_ptr get_subnode_block() const 
         { ensure_sub_block(); return m_psub; }
     
     //! \brief Read data from this node
@@ -157,6 +207,36 @@ public:
     //! \returns The type read
     template<typename T> T read(uint page_num, ulong offset) const;
 
+    //! \brief Get a view of data in this node
+    //!
+    //! If the range lies within one page the slice shares that page's
+    //! buffer, and nothing is copied.
+    //! \throws out_of_range If size is non-zero and offset >= size()
+    //! \param[in] offset The location to read from
+    //! \param[in] size The amount of data to read; clipped to the end of the node
+    //! \returns A view of the data
+    byte_slice read_slice(ulong offset, size_t size) const;
+
+    //! \brief Get a view of data on a specific page of this node
+    //! \note In this context, a "page" is an external block
+    //! \throws out_of_range If size is non-zero and offset is past the end of the page
+    //! \param[in] page_num The page to read from
+    //! \param[in] offset The location to read from
+    //! \param[in] size The amount of data to read; clipped to the end of the page
+    //! \returns A view of the data, sharing the page's buffer
+    byte_slice read_slice(uint page_num, ulong offset, size_t size) const;
+
+    //! \brief Hand every page of this node, in order, to a sink
+    //!
+    //! Unlike reading the node through read() or a stream, pages are read
+    //! from the database one at a time and not kept by the node, so
+    //! streaming a node of any size holds one page (plus the extended blocks
+    //! above it) at a time. Pages still pass through the database's block
+    //! cache, which has its own budget.
+    //! \param[in] sink The sink to write the pages to
+    //! \returns The number of bytes written to the sink
+    size_t for_each_page(page_sink& sink) const;
+
     //! \brief Read data from this node
     //! \param[out] pdest_buffer The location to read the data into
     //! \param[in] size The amount of data to read
@@ -199,29 +279,50 @@ public:
     const_subnodeinfo_iterator subnode_info_end() const;
 
     //! \brief Lookup a subnode by node id
+    //!
+    //! The first lookup flattens the subnode tree into a sorted array of
+    //! every subnode, so later lookups are a binary search in memory instead
+    //! of a walk down the subnode blocks.
     //! \throws key_not_found<node_id> if a subnode with the specified node_id was not found
     //! \param[in] id The subnode id to find
     //! \returns The subnode
     node lookup(node_id id) const;
 
 private:
+    //! \brief Orders subnode_infos, and node_ids against them, by id
+    struct subnode_id_less
+    {
+        bool operator()(const subnode_info& lhs, const subnode_info& rhs) const
+            { return lhs.id < rhs.id; }
+        bool operator()(const subnode_info& lhs, node_id rhs) const
+            { return lhs.id < rhs; }
+        bool operator()(node_id lhs, const subnode_info& rhs) const
+            { return lhs < rhs.id; }
+    };
+
     //! \brief Loads the data block from disk
     //! \returns The data block for this node
     data_block* ensure_data_block() const;
     //! \brief Loads the subnode block from disk
     //! \returns The subnode block for this node
     subnode_block* ensure_sub_block() const;
+    //! \brief Flattens the subnode tree, if it hasn't been already
+    //! \returns Every subnode of this node, sorted by id
+    const std::vector<subnode_info>& ensure_subnode_map() const;
 
     const node_id m_id;             //!< The node_id of this node
     block_id m_original_data_id;    //!< The original block_id of the data block of this node
     block_id m_original_sub_id;     //!< The original block_id of the subnode block of this node
     node_id m_original_parent_id;   //!< The original node_id of the parent node of this node
 
-    mutable std::tr1::shared_ptr<data_block> m_pdata;    //!< The data block
-    mutable std::tr1::shared_ptr<subnode_block> m_psub;  //!< The subnode block
+    mutable data_block_ptr m_pdata;    //!< The data block
+    mutable subnode_block_ptr m_psub;  //!< The subnode block
+    mutable mutex m_block_lock;                          //!< Guards loading m_pdata, m_psub and m_subnode_map; copies of a node share this object
+    mutable std::vector<subnode_info> m_subnode_map;     //!< Every subnode sorted by id, once a lookup needs it
+    mutable bool m_subnode_map_built;                    //!< True once m_subnode_map is filled in; it may still be empty
     node_id m_parent_id;                            //!< The parent node_id to this node
 
-    std::tr1::shared_ptr<node_impl> m_pcontainer_node;   //!< The container node, of which we're a subnode, if applicable
+    node_impl_ptr m_pcontainer_node;   //!< The container node, of which we're a subnode, if applicable
 
     shared_db_ptr m_db; //!< The database context pointer
 };
@@ -239,7 +340,7 @@ class subnode_transform_info : public std::unary_function<subnode_info, node>
 public:
     //! \brief Initialize this functor with the container node involved
     //! \param[in] parent The containing node
-    subnode_transform_info(const std::tr1::shared_ptr<node_impl>& parent)
+    subnode_transform_info(const node_impl_ptr& parent)
         : m_parent(parent) { }
 
     //! \brief Given a subnode_info, construct a subnode
@@ -248,7 +349,7 @@ public:
     node operator()(const subnode_info& info) const;
 
 private:
-    std::tr1::shared_ptr<node_impl> m_parent; //!< The container node
+    node_impl_ptr m_parent; //!< The container node
 };
 
 //! \brief Defines a stream device for a node for use by boost iostream
@@ -282,10 +383,10 @@ public:
 private:
     friend class node;
     //! \brief Construct the device from a node
-    node_stream_device(std::tr1::shared_ptr<node_impl>& _node) : m_pos(0), m_pnode(_node) { }
+    node_stream_device(node_impl_ptr& _node) : m_pos(0), m_pnode(_node) { }
 
     std::streamsize m_pos;              //!< The stream's current position
-    std::tr1::shared_ptr<node_impl> m_pnode; //!< The node this stream is over
+    node_impl_ptr m_pnode; //!< The node this stream is over
 };
 
 //! \brief The actual node stream, defined using the boost iostream library
@@ -334,8 +435,8 @@ public:
     //! \param[in] info Information about this node
     node(const node& container_node, const subnode_info& info)
         : m_pimpl(new node_impl(container_node.m_pimpl, info)) { }
-    //! \copydoc node_impl::node_impl(const std::tr1::shared_ptr<node_impl>&,const subnode_info&)
-    node(const std::tr1::shared_ptr<node_impl>& container_node, const subnode_info& info)
+    //! \copydoc node_impl::node_impl(const node_impl_ptr&,const subnode_info&)
+    node(const node_impl_ptr& container_node, const subnode_info& info)
         : m_pimpl(new node_impl(container_node, info)) { }
 
     //! \brief Copy construct this node
@@ -373,14 +474,16 @@ public:
 
     //! \copydoc node_impl::get_parent_id()
     node_id get_parent_id() const { return m_pimpl->get_parent_id(); } 
+    //! \copydoc node_impl::get_db_ptr()
+    const shared_db_ptr& get_db_ptr() const { return m_pimpl->get_db_ptr(); }
     //! \copydoc node_impl::is_subnode()
     bool is_subnode() { return m_pimpl->is_subnode(); } 
 
     //! \copydoc node_impl::get_data_block()
-    std::tr1::shared_ptr<data_block> get_data_block() const
+    data_block_ptr get_data_block() const
         { return m_pimpl->get_data_block(); }
     //! \copydoc node_impl::get_subnode_block()
-    std::tr1::shared_ptr<subnode_block> get_subnode_block() const 
+    subnode_block_ptr get_subnode_block() const 
         { return m_pimpl->get_subnode_block(); } 
    
     //! \copydoc node_impl::read(std::vector<byte>&,ulong) const
@@ -395,6 +498,15 @@ public:
     //! \copydoc node_impl::read(uint,ulong) const
     template<typename T> T read(uint page_num, ulong offset) const
         { return m_pimpl->read<T>(page_num, offset); }
+    //! \copydoc node_impl::read_slice(ulong,size_t) const
+    byte_slice read_slice(ulong offset, size_t size) const
+        { return m_pimpl->read_slice(offset, size); }
+    //! \copydoc node_impl::read_slice(uint,ulong,size_t) const
+    byte_slice read_slice(uint page_num, ulong offset, size_t size) const
+        { return m_pimpl->read_slice(page_num, offset, size); }
+    //! \copydoc node_impl::for_each_page()
+    size_t for_each_page(page_sink& sink) const
+        { return m_pimpl->for_each_page(sink); }
 
 //! \cond write_api
     size_t write(std::vector<byte>& buffer, ulong offset) 
@@ -462,7 +574,7 @@ public:
         { return m_pimpl->lookup(id); }
 
 private:
-    std::tr1::shared_ptr<node_impl> m_pimpl; //!< Pointer to the node implementation
+    node_impl_ptr m_pimpl; //!< Pointer to the node implementation
 };
 
 //! \defgroup ndb_blockrelated Blocks
@@ -488,18 +600,21 @@ private:
 //! \sa disk_blockrelated
 //! \sa [MS-PST] 2.2.2.8
 //! \ingroup ndb_blockrelated
-class block
+class block : public ref_counted
 {
 public:
     //! \brief Basic block constructor
+    //!
+    //! The block counts references atomically unless the database context
+    //! is single threaded.
     //! \param[in] db The database context this block was opened in
     //! \param[in] info Information about this block
     block(const shared_db_ptr& db, const block_info& info)
-        : m_modified(false), m_size(info.size), m_id(info.id), m_address(info.address), m_db(db) { }
+        : ref_counted(!db->is_single_threaded()), m_modified(false), m_size(info.size), m_id(info.id), m_address(info.address), m_db(db) { }
 
 //! \cond write_api
     block(const block& other)
-        : m_modified(false), m_size(other.m_size), m_id(0), m_address(0), m_db(other.m_db) { }
+        : ref_counted(other), m_modified(false), m_size(other.m_size), m_id(0), m_address(0), m_db(other.m_db) { }
 //! \endcond
 
     virtual ~block() { }
@@ -582,10 +697,30 @@ public:
     //! \returns The amount of data read
     virtual size_t read_raw(byte* pdest_buffer, size_t size, ulong offset) const = 0;
 
+    //! \brief Get a view of data in this block
+    //!
+    //! The base implementation copies the data into a new buffer. An
+    //! external_block instead hands out a slice of its own buffer, and an
+    //! extended_block passes a read within one child down to it.
+    //! \throws out_of_range If size is non-zero and offset >= get_total_size()
+    //! \param[in] offset The location to read from
+    //! \param[in] size The amount of data to read; clipped to the end of the block
+    //! \returns A view of the data
+    virtual byte_slice read_slice(ulong offset, size_t size) const;
+
+    //! \brief Hand every page of this block, in order, to a sink
+    //!
+    //! An extended_block reads the children it hasn't already loaded one at
+    //! a time and lets each go once its pages are written, rather than
+    //! caching them the way the other read functions do.
+    //! \param[in] sink The sink to write the pages to
+    //! \returns The number of bytes written to the sink
+    virtual size_t for_each_page(page_sink& sink) const = 0;
+
 //! \cond write_api
-    size_t write(const std::vector<byte>& buffer, ulong offset, std::tr1::shared_ptr<data_block>& presult);
-    template<typename T> void write(const T& buffer, ulong offset, std::tr1::shared_ptr<data_block>& presult);
-    virtual size_t write_raw(const byte* psrc_buffer, size_t size, ulong offset, std::tr1::shared_ptr<data_block>& presult) = 0;
+    size_t write(const std::vector<byte>& buffer, ulong offset, data_block_ptr& presult);
+    template<typename T> void write(const T& buffer, ulong offset, data_block_ptr& presult);
+    virtual size_t write_raw(const byte* psrc_buffer, size_t size, ulong offset, data_block_ptr& presult) = 0;
 //! \endcond
 
     //! \brief Get the number of physical pages in this data_block
@@ -598,19 +733,24 @@ public:
     //! \throws out_of_range If page_num >= get_page_count()
     //! \param[in] page_num The ordinal of the external_block to get, zero based
     //! \returns The requested external_block
-    virtual std::tr1::shared_ptr<external_block> get_page(uint page_num) const = 0;
+    virtual external_block_ptr get_page(uint page_num) const = 0;
 
     //! \brief Get the total logical size of this block
     //! \returns The total logical size of this block
     size_t get_total_size() const { return m_total_size; }
 //! \cond write_api
-    virtual size_t resize(size_t size, std::tr1::shared_ptr<data_block>& presult) = 0;
+    virtual size_t resize(size_t size, data_block_ptr& presult) = 0;
 //! \endcond
 
 protected:
     size_t m_total_size;    //!< the total or logical size (sum of all external child blocks)
 };
 
+//! \brief The fewest child blocks a read must load to be decoded in parallel
+//! \sa db_context::set_decode_pool
+//! \ingroup ndb_blockrelated
+const uint parallel_decode_min_blocks = 4;
+
 //! \brief A data block which refers to other data blocks, in order to extend
 //! the physical size limit (8k) to a larger logical size.
 //!
@@ -624,8 +764,7 @@ protected:
 //! \sa [MS-PST] 2.2.2.8.3.2
 //! \ingroup ndb_blockrelated
 class extended_block : 
-    public data_block, 
-    public std::tr1::enable_shared_from_this<extended_block>
+    public data_block
 {
 public:
     //! \brief Construct an extended_block from disk
@@ -639,36 +778,38 @@ public:
     //! \param[in] bi The \ref block_info for all child blocks
 #ifndef BOOST_NO_RVALUE_REFERENCES
     extended_block(const shared_db_ptr& db, const block_info& info, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count, std::vector<block_id> bi)
-        : data_block(db, info, total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_block_info(std::move(bi)), m_child_blocks(m_block_info.size()) { }
+        : data_block(db, info, total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_block_info(std::move(bi)), m_child_blocks(m_block_info.size()), m_prefetched(0) { }
 #else
     extended_block(const shared_db_ptr& db, const block_info& info, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count, const std::vector<block_id>& bi)
-        : data_block(db, info, total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_block_info(bi), m_child_blocks(m_block_info.size()) { }
+        : data_block(db, info, total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_block_info(bi), m_child_blocks(m_block_info.size()), m_prefetched(0) { }
 #endif
 
 //! \cond write_api
     // new block constructors
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    extended_block(const shared_db_ptr& db, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count, std::vector<std::tr1::shared_ptr<data_block> > child_blocks)
-        : data_block(db, block_info(), total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_child_blocks(std::move(child_blocks))
+    extended_block(const shared_db_ptr& db, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count, std::vector<data_block_ptr > child_blocks)
+        : data_block(db, block_info(), total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_child_blocks(std::move(child_blocks)), m_prefetched(0)
         { m_block_info.resize(m_child_blocks.size()); touch(); }
 #else
-    extended_block(const shared_db_ptr& db, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count, const std::vector<std::tr1::shared_ptr<data_block> >& child_blocks)
-        : data_block(db, block_info(), total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_child_blocks(child_blocks)
+    extended_block(const shared_db_ptr& db, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count, const std::vector<data_block_ptr >& child_blocks)
+        : data_block(db, block_info(), total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_child_blocks(child_blocks), m_prefetched(0)
         { m_block_info.resize(m_child_blocks.size()); touch(); }
 #endif
     extended_block(const shared_db_ptr& db, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count);
 //! \endcond
 
     size_t read_raw(byte* pdest_buffer, size_t size, ulong offset) const;
+    byte_slice read_slice(ulong offset, size_t size) const;
+    size_t for_each_page(page_sink& sink) const;
 //! \cond write_api
-    size_t write_raw(const byte* psrc_buffer, size_t size, ulong offset, std::tr1::shared_ptr<data_block>& presult);
+    size_t write_raw(const byte* psrc_buffer, size_t size, ulong offset, data_block_ptr& presult);
 //! \endcond
     
     uint get_page_count() const;
-    std::tr1::shared_ptr<external_block> get_page(uint page_num) const;
+    external_block_ptr get_page(uint page_num) const;
     
 //! \cond write_api
-    size_t resize(size_t size, std::tr1::shared_ptr<data_block>& presult);
+    size_t resize(size_t size, data_block_ptr& presult);
 //! \endcond
     
     //! \brief Get the "level" of this extended_block
@@ -682,6 +823,27 @@ public:
 private:
     extended_block& operator=(const extended_block& other); // = delete
     data_block* get_child_block(uint index) const;
+    //! \brief Hint the children a read of [offset, offset+size) will need, and a few beyond
+    //! \param[in] offset The logical offset the read starts at
+    //! \param[in] size The size of the read, non-zero
+    void read_ahead(ulong offset, size_t size) const;
+    //! \brief Load the children a read of [offset, offset+size) needs on the decode pool, if there is one
+    //! \param[in] offset The logical offset the read starts at
+    //! \param[in] size The size of the read, non-zero
+    void decode_children(ulong offset, size_t size) const;
+
+    //! \brief Loads one child block, for decode_children
+    class child_decoder : public pool_task
+    {
+    public:
+        child_decoder(const extended_block* pblock, uint index)
+            : m_pblock(pblock), m_index(index) { }
+        void run();
+
+    private:
+        const extended_block* m_pblock;
+        uint m_index;
+    };
 
     const size_t m_child_max_total_size;    //!< maximum (logical) size of a child block
     const ulong m_child_max_page_count;     //!< maximum number of child blocks a child can contain
@@ -692,7 +854,9 @@ private:
 
     const ushort m_level;                   //!< The level of this block
     std::vector<block_id> m_block_info;     //!< block_ids of the child blocks in this tree
-    mutable std::vector<std::tr1::shared_ptr<data_block> > m_child_blocks; //!< Cached child blocks
+    mutable std::vector<data_block_ptr > m_child_blocks; //!< Cached child blocks
+    mutable uint m_prefetched;              //!< Children below this index have already been hinted
+    mutable mutex m_child_lock;             //!< Guards m_child_blocks and m_prefetched; blocks are shared through the block cache
 };
 
 //! \brief Contains actual data
@@ -703,8 +867,7 @@ private:
 //! \sa [MS-PST] 2.2.2.8.3.1
 //! \ingroup ndb_blockrelated
 class external_block : 
-    public data_block, 
-    public std::tr1::enable_shared_from_this<external_block>
+    public data_block
 {
 public:
     //! \brief Construct an external_block from disk
@@ -712,31 +875,36 @@ public:
     //! \param[in] info Information about this block
     //! \param[in] max_size The maximum possible size of this block
     //! \param[in] buffer The actual external data (decoded)
+    //! \param[in] lazy_crc True if the CRC of this block still needs to be
+    //! checked before its data is first read (\ref validation_level_lazy)
+    //! \param[in] crc The CRC from the block's trailer, if lazy_crc is set
 #ifndef BOOST_NO_RVALUE_REFERENCES
-    external_block(const shared_db_ptr& db, const block_info& info, size_t max_size, std::vector<byte> buffer)
-        : data_block(db, info, info.size), m_max_size(max_size), m_buffer(std::move(buffer)) { }
+    external_block(const shared_db_ptr& db, const block_info& info, size_t max_size, std::vector<byte> buffer, bool lazy_crc = false, ulong crc = 0)
+        : data_block(db, info, info.size), m_max_size(max_size), m_buffer(new std::vector<byte>(std::move(buffer))), m_lazy_crc(lazy_crc), m_crc(crc), m_crc_pending(lazy_crc) { }
 #else
-    external_block(const shared_db_ptr& db, const block_info& info, size_t max_size, const std::vector<byte>& buffer)
-        : data_block(db, info, info.size), m_max_size(max_size), m_buffer(buffer) { }
+    external_block(const shared_db_ptr& db, const block_info& info, size_t max_size, const std::vector<byte>& buffer, bool lazy_crc = false, ulong crc = 0)
+        : data_block(db, info, info.size), m_max_size(max_size), m_buffer(new std::vector<byte>(buffer)), m_lazy_crc(lazy_crc), m_crc(crc), m_crc_pending(lazy_crc) { }
 #endif
 
 //! \cond write_api
     // new block constructors
     external_block(const shared_db_ptr& db, size_t max_size, size_t current_size)
-        : data_block(db, block_info(), current_size), m_max_size(max_size), m_buffer(current_size)
+        : data_block(db, block_info(), current_size), m_max_size(max_size), m_buffer(new std::vector<byte>(current_size)), m_lazy_crc(false), m_crc(0), m_crc_pending(false)
         { touch(); }
 //! \endcond
 
     size_t read_raw(byte* pdest_buffer, size_t size, ulong offset) const;
+    byte_slice read_slice(ulong offset, size_t size) const;
+    size_t for_each_page(page_sink& sink) const;
 //! \cond write_api
-    size_t write_raw(const byte* psrc_buffer, size_t size, ulong offset, std::tr1::shared_ptr<data_block>& presult);
+    size_t write_raw(const byte* psrc_buffer, size_t size, ulong offset, data_block_ptr& presult);
 //! \endcond
 
     uint get_page_count() const { return 1; }
-    std::tr1::shared_ptr<external_block> get_page(uint page_num) const;
+    external_block_ptr get_page(uint page_num) const;
 
 //! \cond write_api
-    size_t resize(size_t size, std::tr1::shared_ptr<data_block>& presult);
+    size_t resize(size_t size, data_block_ptr& presult);
 //! \endcond
 
     bool is_internal() const { return false; }
@@ -747,7 +915,23 @@ private:
     const size_t m_max_size;
     size_t get_max_size() const { return m_max_size; }
 
-    std::vector<byte> m_buffer;
+    //! \brief Perform the CRC check deferred by \ref validation_level_lazy, once
+    //! \throws crc_fail If the block's data doesn't match the trailer's CRC
+    void check_crc() const;
+
+//! \cond write_api
+    //! \brief Give this block a buffer of its own before it is modified
+    //!
+    //! The buffer is shared with any slices read from this block, and with
+    //! the block this one was copied from.
+    void unshare();
+//! \endcond
+
+    std::tr1::shared_ptr<std::vector<byte> > m_buffer; //!< The decoded data, shared with slices of it
+    const bool m_lazy_crc;          //!< True if this block was read with its CRC check deferred
+    const ulong m_crc;              //!< The CRC from the trailer, for the deferred check
+    mutable bool m_crc_pending;     //!< True until the deferred CRC check has passed
+    mutable mutex m_crc_lock;       //!< Guards m_crc_pending; blocks are shared through the block cache
 };
 
 
@@ -759,6 +943,10 @@ private:
 //!
 //! This hierarchy also models the \ref btree_node structure, inheriting the 
 //! actual iteration and lookup logic.
+//!
+//! Unlike the nodes which use them, subnode blocks are never allocated from
+//! an \ref arena: the block cache may keep one long after the message it
+//! was read for, and with it every chunk of that message's arena.
 //! \sa [MS-PST] 2.2.2.8.3.3
 //! \ingroup ndb_blockrelated
 class subnode_block : 
@@ -799,8 +987,7 @@ protected:
 //! \ingroup ndb_blockrelated
 class subnode_nonleaf_block : 
     public subnode_block, 
-    public btree_node_nonleaf<node_id, subnode_info>, 
-    public std::tr1::enable_shared_from_this<subnode_nonleaf_block>
+    public btree_node_nonleaf<node_id, subnode_info>
 {
 public:
     //! \brief Construct a subnode_nonleaf_block from disk
@@ -824,7 +1011,8 @@ public:
     
 private:
     std::vector<std::pair<node_id, block_id> > m_subnode_info;           //!< Info about the sub-blocks
-    mutable std::vector<std::tr1::shared_ptr<subnode_block> > m_child_blocks; //!< Cached sub-blocks (leafs)
+    mutable std::vector<subnode_block_ptr > m_child_blocks; //!< Cached sub-blocks (leafs)
+    mutable mutex m_child_lock;                                               //!< Guards m_child_blocks; blocks are shared through the block cache
 };
 
 //! \brief Contains the actual subnode information
@@ -836,8 +1024,7 @@ private:
 //! \ingroup ndb_blockrelated
 class subnode_leaf_block : 
     public subnode_block, 
-    public btree_node_leaf<node_id, subnode_info>, 
-    public std::tr1::enable_shared_from_this<subnode_leaf_block>
+    public btree_node_leaf<node_id, subnode_info>
 {
 public:
     //! \brief Construct a subnode_leaf_block from disk
@@ -873,6 +1060,8 @@ inline pstsdk::node pstsdk::subnode_transform_info::operator()(const pstsdk::sub
 
 inline pstsdk::block_id pstsdk::node_impl::get_data_id() const
 { 
+    lock_guard lock(m_block_lock);
+
     if(m_pdata)
         return m_pdata->get_id();
     
@@ -881,6 +1070,8 @@ inline pstsdk::block_id pstsdk::node_impl::get_data_id() const
 
 inline pstsdk::block_id pstsdk::node_impl::get_sub_id() const
 { 
+    lock_guard lock(m_block_lock);
+
     if(m_psub)
         return m_psub->get_id();
     
@@ -912,6 +1103,21 @@ inline size_t pstsdk::node_impl::read_raw(byte* pdest_buffer, size_t size, ulong
     return ensure_data_block()->read_raw(pdest_buffer, size, offset); 
 }
 
+inline pstsdk::byte_slice pstsdk::node_impl::read_slice(ulong offset, size_t size) const
+{
+    return ensure_data_block()->read_slice(offset, size);
+}
+
+inline pstsdk::byte_slice pstsdk::node_impl::read_slice(uint page_num, ulong offset, size_t size) const
+{
+    return ensure_data_block()->get_page(page_num)->read_slice(offset, size);
+}
+
+inline size_t pstsdk::node_impl::for_each_page(page_sink& sink) const
+{
+    return ensure_data_block()->for_each_page(sink);
+}
+
 template<typename T> 
 inline T pstsdk::node_impl::read(ulong offset) const
 {
@@ -966,16 +1172,35 @@ inline size_t pstsdk::node_impl::resize(size_t size)
 
 inline pstsdk::data_block* pstsdk::node_impl::ensure_data_block() const
 { 
-    if(!m_pdata) 
-        m_pdata = m_db->read_data_block(m_original_data_id); 
+    {
+        lock_guard lock(m_block_lock);
+        if(m_pdata)
+            return m_pdata.get();
+    }
+
+    // read without the lock; if another reader got there first, keep theirs
+    data_block_ptr pdata = m_db->read_data_block(m_original_data_id);
+
+    lock_guard lock(m_block_lock);
+    if(!m_pdata)
+        m_pdata = pdata;
 
     return m_pdata.get();
 }
     
 inline pstsdk::subnode_block* pstsdk::node_impl::ensure_sub_block() const
 { 
-    if(!m_psub) 
-        m_psub = m_db->read_subnode_block(m_original_sub_id); 
+    {
+        lock_guard lock(m_block_lock);
+        if(m_psub)
+            return m_psub.get();
+    }
+
+    subnode_block_ptr psub = m_db->read_subnode_block(m_original_sub_id);
+
+    lock_guard lock(m_block_lock);
+    if(!m_psub)
+        m_psub = psub;
 
     return m_psub.get();
 }
@@ -1039,21 +1264,24 @@ inline std::streampos pstsdk::node_stream_device::seek(boost::iostreams::stream_
 
 inline pstsdk::subnode_block* pstsdk::subnode_nonleaf_block::get_child(uint pos)
 {
-    if(m_child_blocks[pos] == NULL)
-    {
-        m_child_blocks[pos] = get_db_ptr()->read_subnode_block(m_subnode_info[pos].second);
-    }
-
-    return m_child_blocks[pos].get();
+    return const_cast<subnode_block*>(const_cast<const subnode_nonleaf_block*>(this)->get_child(pos));
 }
 
 inline const pstsdk::subnode_block* pstsdk::subnode_nonleaf_block::get_child(uint pos) const
 {
-    if(m_child_blocks[pos] == NULL)
     {
-        m_child_blocks[pos] = get_db_ptr()->read_subnode_block(m_subnode_info[pos].second);
+        lock_guard lock(m_child_lock);
+        if(m_child_blocks[pos] != NULL)
+            return m_child_blocks[pos].get();
     }
 
+    // read without the lock; if another reader got there first, keep theirs
+    subnode_block_ptr pchild = get_db_ptr()->read_subnode_block(m_subnode_info[pos].second);
+
+    lock_guard lock(m_child_lock);
+    if(m_child_blocks[pos] == NULL)
+        m_child_blocks[pos] = pchild;
+
     return m_child_blocks[pos].get();
 }
 
@@ -1072,6 +1300,23 @@ inline size_t pstsdk::data_block::read(std::vector<byte>& buffer, ulong offset)
     return read_size;
 }
 
+inline pstsdk::byte_slice pstsdk::data_block::read_slice(ulong offset, size_t size) const
+{
+    if(size == 0)
+        return byte_slice();
+
+    if(offset >= get_total_size())
+        throw std::out_of_range("offset >= size()");
+
+    if(offset + size > get_total_size())
+        size = get_total_size() - offset;
+
+    std::vector<byte> buffer(size);
+    buffer.resize(read_raw(&buffer[0], size, offset));
+
+    return byte_slice(buffer);
+}
+
 template<typename T> 
 inline T pstsdk::data_block::read(ulong offset) const
 {
@@ -1087,7 +1332,7 @@ inline T pstsdk::data_block::read(ulong offset) const
 }
 
 //! \cond write_api
-inline size_t pstsdk::data_block::write(const std::vector<byte>& buffer, ulong offset, std::tr1::shared_ptr<data_block>& presult)
+inline size_t pstsdk::data_block::write(const std::vector<byte>& buffer, ulong offset, data_block_ptr& presult)
 {
     size_t write_size = buffer.size();
     
@@ -1103,7 +1348,7 @@ inline size_t pstsdk::data_block::write(const std::vector<byte>& buffer, ulong o
 }
 
 template<typename T> 
-void pstsdk::data_block::write(const T& buffer, ulong offset, std::tr1::shared_ptr<data_block>& presult)
+void pstsdk::data_block::write(const T& buffer, ulong offset, data_block_ptr& presult)
 {
     if(offset >= get_total_size())
         throw std::out_of_range("offset >= size()");
@@ -1126,7 +1371,7 @@ inline pstsdk::uint pstsdk::extended_block::get_page_count() const
 
 //! \cond write_api
 inline pstsdk::extended_block::extended_block(const shared_db_ptr& db, ushort level, size_t total_size, size_t child_max_total_size, ulong page_max_count, ulong child_page_max_count)
-: data_block(db, block_info(), total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level)
+: data_block(db, block_info(), total_size), m_child_max_total_size(child_max_total_size), m_child_max_page_count(child_page_max_count), m_max_page_count(page_max_count), m_level(level), m_prefetched(0)
 {
     int total_subblocks = total_size / m_child_max_total_size;
     if(total_size % m_child_max_total_size != 0)
@@ -1141,41 +1386,147 @@ inline pstsdk::extended_block::extended_block(const shared_db_ptr& db, ushort le
 
 inline pstsdk::data_block* pstsdk::extended_block::get_child_block(uint index) const
 {
-    if(index >= m_child_blocks.size())
-        throw std::out_of_range("index >= m_child_blocks.size()");
+    {
+        lock_guard lock(m_child_lock);
+
+        if(index >= m_child_blocks.size())
+            throw std::out_of_range("index >= m_child_blocks.size()");
+
+        if(m_child_blocks[index] != NULL)
+            return m_child_blocks[index].get();
+    }
+
+    // read without the lock, so readers of other children (and the decode
+    // pool) aren't held up; if another reader got there first, keep theirs
+    data_block_ptr pchild;
+    if(m_block_info[index] == 0)
+    {
+        if(get_level() == 1)
+            pchild = get_db_ptr()->create_external_block(m_child_max_total_size);
+        else
+            pchild = get_db_ptr()->create_extended_block(m_child_max_total_size);
+    }
+    else
+        pchild = get_db_ptr()->read_data_block(m_block_info[index]);
 
+    lock_guard lock(m_child_lock);
     if(m_child_blocks[index] == NULL)
+        m_child_blocks[index] = pchild;
+
+    return m_child_blocks[index].get();
+}
+
+inline void pstsdk::extended_block::read_ahead(ulong offset, size_t size) const
+{
+    uint count = get_db_ptr()->get_readahead();
+
+    if(count == 0)
+        return;
+
+    uint first = offset / m_child_max_total_size;
+    uint last = (offset + size - 1) / m_child_max_total_size;
+    uint end = std::min<uint>(last + count + 1, m_block_info.size());
+
+    // the first child is about to be read anyway
+    std::vector<block_id> hints;
     {
-        if(m_block_info[index] == 0)
+        lock_guard lock(m_child_lock);
+
+        for(uint i = std::max(first + 1, m_prefetched); i < end; ++i)
         {
-            if(get_level() == 1)
-                m_child_blocks[index] = get_db_ptr()->create_external_block(m_child_max_total_size);
-            else
-                m_child_blocks[index] = get_db_ptr()->create_extended_block(m_child_max_total_size);
+            if(m_child_blocks[i] == NULL && m_block_info[i] != 0)
+                hints.push_back(m_block_info[i]);
         }
-        else
-            m_child_blocks[index] = get_db_ptr()->read_data_block(m_block_info[index]);
+
+        m_prefetched = std::max(m_prefetched, end);
     }
 
-    return m_child_blocks[index].get();
+    // finding a block's address can read BBT pages, so don't hold the lock
+    for(uint i = 0; i < hints.size(); ++i)
+        get_db_ptr()->prefetch_block(hints[i]);
+}
+
+inline void pstsdk::extended_block::decode_children(ulong offset, size_t size) const
+{
+    shared_db_ptr db = get_db_ptr();
+    if(db->is_single_threaded())
+        return;
+
+    std::tr1::shared_ptr<task_pool> pool = db->get_decode_pool();
+    if(!pool)
+        return;
+
+    uint first = offset / m_child_max_total_size;
+    uint last = (offset + size - 1) / m_child_max_total_size;
+
+    std::vector<child_decoder> decoders;
+    {
+        lock_guard lock(m_child_lock);
+
+        for(uint i = first; i <= last && i < m_child_blocks.size(); ++i)
+        {
+            if(m_child_blocks[i] == NULL && m_block_info[i] != 0)
+                decoders.push_back(child_decoder(this, i));
+        }
+    }
+
+    if(decoders.size() < parallel_decode_min_blocks)
+        return;
+
+    std::vector<pool_task*> tasks(decoders.size());
+    for(size_t i = 0; i < decoders.size(); ++i)
+        tasks[i] = &decoders[i];
+
+    // each task fills its own slot of m_child_blocks, under m_child_lock
+    pool->run(tasks);
+}
+
+inline void pstsdk::extended_block::child_decoder::run()
+{
+    try
+    {
+        m_pblock->get_child_block(m_index);
+    }
+    catch(...)
+    {
+        // the slot stays empty; the read itself loads the child again, on
+        // its own thread, and raises the error from there
+    }
 }
 
-inline std::tr1::shared_ptr<pstsdk::external_block> pstsdk::extended_block::get_page(uint page_num) const
+inline pstsdk::external_block_ptr pstsdk::extended_block::get_page(uint page_num) const
 {
     uint page = page_num / m_child_max_page_count;
     return get_child_block(page)->get_page(page_num % m_child_max_page_count);
 }
 
-inline std::tr1::shared_ptr<pstsdk::external_block> pstsdk::external_block::get_page(uint index) const
+inline pstsdk::external_block_ptr pstsdk::external_block::get_page(uint index) const
 {
     if(index != 0)
         throw std::out_of_range("index > 0");
 
-    return std::tr1::const_pointer_cast<external_block>(this->shared_from_this());
+    return counted_from_this(const_cast<external_block*>(this));
+}
+
+inline void pstsdk::external_block::check_crc() const
+{
+    if(!m_lazy_crc)
+        return;
+
+    lock_guard lock(m_crc_lock);
+
+    if(m_crc_pending)
+    {
+        block_info bi = { m_id, m_address, static_cast<ushort>(m_size), 0 };
+        get_db_ptr()->validate_block_crc(bi, *m_buffer, m_crc);
+        m_crc_pending = false;
+    }
 }
 
 inline size_t pstsdk::external_block::read_raw(byte* pdest_buffer, size_t size, ulong offset) const
 {
+    check_crc();
+
     size_t read_size = size;
 
     assert(offset <= get_total_size());
@@ -1183,18 +1534,55 @@ inline size_t pstsdk::external_block::read_raw(byte* pdest_buffer, size_t size,
     if(offset + size > get_total_size())
         read_size = get_total_size() - offset;
 
-    memcpy(pdest_buffer, &m_buffer[offset], read_size);
+    memcpy(pdest_buffer, &(*m_buffer)[offset], read_size);
 
     return read_size;
 }
 
+inline pstsdk::byte_slice pstsdk::external_block::read_slice(ulong offset, size_t size) const
+{
+    if(size == 0)
+        return byte_slice();
+
+    if(offset >= get_total_size())
+        throw std::out_of_range("offset >= size()");
+
+    check_crc();
+
+    if(offset + size > get_total_size())
+        size = get_total_size() - offset;
+
+    return byte_slice(m_buffer, offset, size);
+}
+
+inline size_t pstsdk::external_block::for_each_page(page_sink& sink) const
+{
+    if(get_total_size() == 0)
+        return 0;
+
+    sink.write(read_slice(0, get_total_size()));
+
+    return get_total_size();
+}
+
+//! \cond write_api
+inline void pstsdk::external_block::unshare()
+{
+    if(!m_buffer.unique())
+        m_buffer.reset(new std::vector<byte>(*m_buffer));
+}
+//! \endcond
+
 //! \cond write_api
-inline size_t pstsdk::external_block::write_raw(const byte* psrc_buffer, size_t size, ulong offset, std::tr1::shared_ptr<data_block>& presult)
+inline size_t pstsdk::external_block::write_raw(const byte* psrc_buffer, size_t size, ulong offset, data_block_ptr& presult)
 {
-    std::tr1::shared_ptr<pstsdk::external_block> pblock = shared_from_this();
-    if(pblock.use_count() > 2) // one for me, one for the caller
+    // the rest of the block is carried forward, so it has to be good
+    check_crc();
+
+    pstsdk::external_block_ptr pblock = counted_from_this(this);
+    if(reference_count(pblock) > 2) // one for me, one for the caller
     {
-        std::tr1::shared_ptr<pstsdk::external_block> pnewblock(new external_block(*this));
+        pstsdk::external_block_ptr pnewblock(new external_block(*this));
         return pnewblock->write_raw(psrc_buffer, size, offset, presult);
     }
     touch(); // mutate ourselves inplace
@@ -1206,7 +1594,8 @@ inline size_t pstsdk::external_block::write_raw(const byte* psrc_buffer, size_t
     if(offset + size > get_total_size())
         write_size = get_total_size() - offset;
 
-    memcpy(&m_buffer[0]+offset, psrc_buffer, write_size);
+    unshare();
+    memcpy(&(*m_buffer)[0]+offset, psrc_buffer, write_size);
 
     // assign out param
 #ifndef BOOST_NO_RVALUE_REFERENCES
@@ -1226,6 +1615,12 @@ inline size_t pstsdk::extended_block::read_raw(byte* pdest_buffer, size_t size,
     if(offset + size > get_total_size())
         size = get_total_size() - offset;
 
+    if(size != 0)
+    {
+        read_ahead(offset, size);
+        decode_children(offset, size);
+    }
+
     byte* pend = pdest_buffer + size;
 
     size_t total_bytes_read = 0;
@@ -1253,13 +1648,66 @@ inline size_t pstsdk::extended_block::read_raw(byte* pdest_buffer, size_t size,
     return total_bytes_read;
 }
 
+inline pstsdk::byte_slice pstsdk::extended_block::read_slice(ulong offset, size_t size) const
+{
+    if(size == 0)
+        return byte_slice();
+
+    if(offset >= get_total_size())
+        throw std::out_of_range("offset >= size()");
+
+    if(offset + size > get_total_size())
+        size = get_total_size() - offset;
+
+    uint child_pos = offset / m_child_max_total_size;
+    ulong child_offset = offset % m_child_max_total_size;
+
+    // a read spanning children has to be gathered into a buffer of its own
+    if(child_offset + size > m_child_max_total_size)
+        return data_block::read_slice(offset, size);
+
+    read_ahead(offset, size);
+
+    return get_child_block(child_pos)->read_slice(child_offset, size);
+}
+
+inline size_t pstsdk::extended_block::for_each_page(page_sink& sink) const
+{
+    size_t total = 0;
+
+    for(uint i = 0; i < m_child_blocks.size(); ++i)
+    {
+        read_ahead(i * m_child_max_total_size, 1);
+
+        // children already loaded (or not yet on disk) are used as they are,
+        // the rest are read for the duration of the write only
+        data_block_ptr pchild;
+        {
+            lock_guard lock(m_child_lock);
+            pchild = m_child_blocks[i];
+        }
+
+        if(pchild == NULL)
+        {
+            if(m_block_info[i] == 0)
+                pchild = counted_from_this(get_child_block(i));
+            else
+                pchild = get_db_ptr()->read_data_block(m_block_info[i]);
+        }
+
+        total += pchild->for_each_page(sink);
+    }
+
+    return total;
+}
+
 //! \cond write_api
-inline size_t pstsdk::extended_block::write_raw(const byte* psrc_buffer, size_t size, ulong offset, std::tr1::shared_ptr<data_block>& presult)
+inline size_t pstsdk::extended_block::write_raw(const byte* psrc_buffer, size_t size, ulong offset, data_block_ptr& presult)
 {
-    std::tr1::shared_ptr<extended_block> pblock = shared_from_this();
-    if(pblock.use_count() > 2) // one for me, one for the caller
+    extended_block_ptr pblock = counted_from_this(this);
+    if(reference_count(pblock) > 2) // one for me, one for the caller
     {
-        std::tr1::shared_ptr<extended_block> pnewblock(new extended_block(*this));
+        extended_block_ptr pnewblock(new extended_block(*this));
         return pnewblock->write_raw(psrc_buffer, size, offset, presult);
     }
     touch(); // mutate ourselves inplace
@@ -1302,23 +1750,26 @@ inline size_t pstsdk::extended_block::write_raw(const byte* psrc_buffer, size_t
     return total_bytes_written;
 }
 
-inline size_t pstsdk::external_block::resize(size_t size, std::tr1::shared_ptr<data_block>& presult)
+inline size_t pstsdk::external_block::resize(size_t size, data_block_ptr& presult)
 {
-    std::tr1::shared_ptr<external_block> pblock = shared_from_this();
-    if(pblock.use_count() > 2) // one for me, one for the caller
+    check_crc();
+
+    external_block_ptr pblock = counted_from_this(this);
+    if(reference_count(pblock) > 2) // one for me, one for the caller
     {
-        std::tr1::shared_ptr<external_block> pnewblock(new external_block(*this));
+        external_block_ptr pnewblock(new external_block(*this));
         return pnewblock->resize(size, presult);
     }
     touch(); // mutate ourselves inplace
 
-    m_buffer.resize(size > m_max_size ? m_max_size : size);
-    m_total_size = m_buffer.size();
+    unshare();
+    m_buffer->resize(size > m_max_size ? m_max_size : size);
+    m_total_size = m_buffer->size();
 
     if(size > get_max_size())
     {
         // we need to create an extended_block with us as the first entry
-        std::tr1::shared_ptr<extended_block> pnewxblock = get_db_ptr()->create_extended_block(pblock);
+        extended_block_ptr pnewxblock = get_db_ptr()->create_extended_block(pblock);
         return pnewxblock->resize(size, presult);
     }
 
@@ -1332,7 +1783,7 @@ inline size_t pstsdk::external_block::resize(size_t size, std::tr1::shared_ptr<d
     return size;
 }
 
-inline size_t pstsdk::extended_block::resize(size_t size, std::tr1::shared_ptr<data_block>& presult)
+inline size_t pstsdk::extended_block::resize(size_t size, data_block_ptr& presult)
 {
     // calculate the number of subblocks needed
     uint old_num_subblocks = m_block_info.size();
@@ -1349,10 +1800,10 @@ inline size_t pstsdk::extended_block::resize(size_t size, std::tr1::shared_ptr<d
     if(num_subblocks < 2)
         return get_child_block(0)->resize(size, presult);
 
-    std::tr1::shared_ptr<extended_block> pblock = shared_from_this();
-    if(pblock.use_count() > 2) // one for me, one for the caller
+    extended_block_ptr pblock = counted_from_this(this);
+    if(reference_count(pblock) > 2) // one for me, one for the caller
     {
-        std::tr1::shared_ptr<extended_block> pnewblock(new extended_block(*this));
+        extended_block_ptr pnewblock(new extended_block(*this));
         return pnewblock->resize(size, presult);
     }
     touch(); // mutate ourselves inplace
@@ -1376,7 +1827,7 @@ inline size_t pstsdk::extended_block::resize(size_t size, std::tr1::shared_ptr<d
             throw can_not_resize("size > max_size");
 
         // we need to create a level 2 extended_block with us as the first entry
-        std::tr1::shared_ptr<extended_block> pnewxblock = get_db_ptr()->create_extended_block(pblock);
+        extended_block_ptr pnewxblock = get_db_ptr()->create_extended_block(pblock);
         return pnewxblock->resize(size, presult);
     }
     
@@ -1406,9 +1857,135 @@ inline pstsdk::const_subnodeinfo_iterator pstsdk::node_impl::subnode_info_end()
 
 inline pstsdk::node pstsdk::node_impl::lookup(node_id id) const
 {
-    return node(std::tr1::const_pointer_cast<node_impl>(shared_from_this()), ensure_sub_block()->lookup(id));
+    const std::vector<subnode_info>& map = ensure_subnode_map();
+    std::vector<subnode_info>::const_iterator pos = std::lower_bound(map.begin(), map.end(), id, subnode_id_less());
+
+    if(pos == map.end() || pos->id != id)
+        throw key_not_found<node_id>(id);
+
+    return node(counted_from_this(const_cast<node_impl*>(this)), *pos);
 }
 
+inline const std::vector<pstsdk::subnode_info>& pstsdk::node_impl::ensure_subnode_map() const
+{
+    {
+        lock_guard lock(m_block_lock);
+        if(m_subnode_map_built)
+            return m_subnode_map;
+    }
+
+    // walk the subnode tree without the lock, since it may read blocks; if
+    // another reader got there first, keep theirs
+    const subnode_block* pblock = ensure_sub_block();
+    std::vector<subnode_info> map(pblock->begin(), pblock->end());
+    std::sort(map.begin(), map.end(), subnode_id_less());
+
+    lock_guard lock(m_block_lock);
+    if(!m_subnode_map_built)
+    {
+        m_subnode_map.swap(map);
+        m_subnode_map_built = true;
+    }
+
+    return m_subnode_map;
+}
+
+// The db_context wrappers opening a block in the context itself are
+// defined here, where the block types are complete; with
+// PSTSDK_INTRUSIVE_REFCOUNT a pointer to an incomplete block type can't
+// find the ref_counted base to count with.
+inline pstsdk::block_ptr pstsdk::db_context::read_block(block_id bid)
+{
+    return read_block(shared_from_this(), bid);
+}
+
+inline pstsdk::data_block_ptr pstsdk::db_context::read_data_block(block_id bid)
+{
+    return read_data_block(shared_from_this(), bid);
+}
+
+inline pstsdk::extended_block_ptr pstsdk::db_context::read_extended_block(block_id bid)
+{
+    return read_extended_block(shared_from_this(), bid);
+}
+
+inline pstsdk::external_block_ptr pstsdk::db_context::read_external_block(block_id bid)
+{
+    return read_external_block(shared_from_this(), bid);
+}
+
+inline pstsdk::subnode_block_ptr pstsdk::db_context::read_subnode_block(block_id bid)
+{
+    return read_subnode_block(shared_from_this(), bid);
+}
+
+inline pstsdk::subnode_leaf_block_ptr pstsdk::db_context::read_subnode_leaf_block(block_id bid)
+{
+    return read_subnode_leaf_block(shared_from_this(), bid);
+}
+
+inline pstsdk::subnode_nonleaf_block_ptr pstsdk::db_context::read_subnode_nonleaf_block(block_id bid)
+{
+    return read_subnode_nonleaf_block(shared_from_this(), bid);
+}
+
+inline pstsdk::block_ptr pstsdk::db_context::read_block(const block_info& bi)
+{
+    return read_block(shared_from_this(), bi);
+}
+
+inline pstsdk::data_block_ptr pstsdk::db_context::read_data_block(const block_info& bi)
+{
+    return read_data_block(shared_from_this(), bi);
+}
+
+inline pstsdk::extended_block_ptr pstsdk::db_context::read_extended_block(const block_info& bi)
+{
+    return read_extended_block(shared_from_this(), bi);
+}
+
+inline pstsdk::external_block_ptr pstsdk::db_context::read_external_block(const block_info& bi)
+{
+    return read_external_block(shared_from_this(), bi);
+}
+
+inline pstsdk::subnode_block_ptr pstsdk::db_context::read_subnode_block(const block_info& bi)
+{
+    return read_subnode_block(shared_from_this(), bi);
+}
+
+inline pstsdk::subnode_leaf_block_ptr pstsdk::db_context::read_subnode_leaf_block(const block_info& bi)
+{
+    return read_subnode_leaf_block(shared_from_this(), bi);
+}
+
+inline pstsdk::subnode_nonleaf_block_ptr pstsdk::db_context::read_subnode_nonleaf_block(const block_info& bi)
+{
+    return read_subnode_nonleaf_block(shared_from_this(), bi);
+}
+
+//! \cond write_api
+inline pstsdk::external_block_ptr pstsdk::db_context::create_external_block(size_t size)
+{
+    return create_external_block(shared_from_this(), size);
+}
+
+inline pstsdk::extended_block_ptr pstsdk::db_context::create_extended_block(size_t size)
+{
+    return create_extended_block(shared_from_this(), size);
+}
+
+inline pstsdk::extended_block_ptr pstsdk::db_context::create_extended_block(external_block_ptr& pblock)
+{
+    return create_extended_block(shared_from_this(), pblock);
+}
+
+inline pstsdk::extended_block_ptr pstsdk::db_context::create_extended_block(extended_block_ptr& pblock)
+{
+    return create_extended_block(shared_from_this(), pblock);
+}
+//! \endcond
+
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
@@ -15,9 +15,11 @@
 #ifndef PSTSDK_NDB_PAGE_H
 #define PSTSDK_NDB_PAGE_H
 
+#include <algorithm>
 #include <vector>
 
 #include "pstsdk/util/btree.h"
+#include "pstsdk/util/mutex.h"
 #include "pstsdk/util/util.h"
 
 #include "pstsdk/ndb/database_iface.h"
@@ -56,6 +58,7 @@ public:
     //! \param[in] pi Information about this page
     page(const shared_db_ptr& db, const page_info& pi)
         : m_db(db), m_pid(pi.id), m_address(pi.address) { }
+    virtual ~page() { }
 
     //! \brief Get the page id
     //! \returns The page id
@@ -111,6 +114,20 @@ private:
 //!
 //! A bt_nonleaf_page makes up the body of the NBT and BBT (which differ only
 //! at the leaf). 
+//!
+//! Child pages which are themselves nonleaf pages are pinned in memory for
+//! the life of this page, so the upper levels of the tree are only ever 
+//! read once. Leaf children are left to the database's bounded page cache
+//! (see db_context::set_page_cache_size); this page only keeps a weak 
+//! reference to them, so a leaf in use by an iterator is never read twice.
+//! Calling get_child directly pins a leaf child as well.
+//!
+//! Children are read from disk without holding this page's lock. Two
+//! readers missing on the same child at once may both read it; the first
+//! one stored is kept and the other is dropped.
+//!
+//! Iterating over this page asks the database to prefetch the next few
+//! child pages ahead of the iterator; see db_context::set_readahead.
 //! \tparam K key type
 //! \tparam V value type
 //! \sa [MS-PST] 2.2.2.7.7.2
@@ -129,21 +146,36 @@ public:
     //! \param[in] subpi Information about the child pages
 #ifndef BOOST_NO_RVALUE_REFERENCES
     bt_nonleaf_page(const shared_db_ptr& db, const page_info& pi, ushort level, std::vector<std::pair<K, page_info> > subpi)
-        : bt_page<K,V>(db, pi, level), m_page_info(std::move(subpi)), m_child_pages(m_page_info.size()) { }
+        : bt_page<K,V>(db, pi, level), m_page_info(std::move(subpi)), m_child_pages(m_page_info.size()), m_leaf_pages(m_page_info.size()) { }
 #else
     bt_nonleaf_page(const shared_db_ptr& db, const page_info& pi, ushort level, const std::vector<std::pair<K, page_info> >& subpi)
-        : bt_page<K,V>(db, pi, level), m_page_info(subpi), m_child_pages(m_page_info.size()) { }
+        : bt_page<K,V>(db, pi, level), m_page_info(subpi), m_child_pages(m_page_info.size()), m_leaf_pages(m_page_info.size()) { }
 #endif
 
     // btree_node_nonleaf implementation
     const K& get_key(uint pos) const { return m_page_info[pos].first; }
+    //! \brief Get where a child page lives, without reading it
+    //! \param[in] pos The child
+    //! \returns Information about the child page
+    const page_info& get_child_page_info(uint pos) const { return m_page_info[pos].second; }
     bt_page<K,V>* get_child(uint pos);
     const bt_page<K,V>* get_child(uint pos) const;
     uint num_values() const { return m_child_pages.size(); }
 
+protected:
+    const btree_node<K,V>* get_pinned_child(uint pos, std::tr1::shared_ptr<const void>& pin) const;
+    void read_ahead(uint pos, bool arriving) const;
+
 private:
+    //! \brief Read a child page through the database
+    //! \param[in] pos The child to read
+    //! \returns The child page
+    std::tr1::shared_ptr<bt_page<K,V> > read_child(uint pos) const;
+
     std::vector<std::pair<K, page_info> > m_page_info;   //!< Information about the child pages
-    mutable std::vector<std::tr1::shared_ptr<bt_page<K,V> > > m_child_pages; //!< Cached child pages
+    mutable std::vector<std::tr1::shared_ptr<bt_page<K,V> > > m_child_pages; //!< Pinned child pages
+    mutable std::vector<std::tr1::weak_ptr<bt_page<K,V> > > m_leaf_pages; //!< Leaf child pages, owned by the page cache or their users
+    mutable mutex m_child_lock;     //!< Guards m_child_pages and m_leaf_pages; pages are shared by every reader of the database
 };
 
 //! \brief Contains the actual key value pairs of the btree
@@ -180,49 +212,182 @@ public:
 private:
     std::vector<std::pair<K,V> > m_page_data; //!< The key/value pairs on this leaf page
 };
-//! \cond dont_show_these_member_function_specializations
-template<>
-inline bt_page<block_id, block_info>* bt_nonleaf_page<block_id, block_info>::get_child(uint pos)
+
+//! \brief A single leaf holding every key/value pair of a btree
+//!
+//! Used by \ref index_mode_flat in place of the on disk page hierarchy. All
+//! entries live in one sorted array, so iteration is a linear walk, and the
+//! keys are kept in a second array of their own so lookups can binary
+//! search them without branching on the comparison.
+//! \tparam K key type
+//! \tparam V value type
+//! \ingroup ndb_pagerelated
+template<typename K, typename V>
+class bt_flat_page : public bt_leaf_page<K,V>
 {
-    if(m_child_pages[pos] == NULL)
+public:
+    //! \brief Construct a flat page
+    //! \param[in] db The database context
+    //! \param[in] pi Information about the root page of the btree this replaces
+    //! \param[in] data Every key/value pair in the btree, sorted by key
+#ifndef BOOST_NO_RVALUE_REFERENCES
+    bt_flat_page(const shared_db_ptr& db, const page_info& pi, std::vector<std::pair<K,V> > data)
+        : bt_leaf_page<K,V>(db, pi, std::move(data)) { index_keys(); }
+#else
+    bt_flat_page(const shared_db_ptr& db, const page_info& pi, const std::vector<std::pair<K,V> >& data)
+        : bt_leaf_page<K,V>(db, pi, data) { index_keys(); }
+#endif
+
+    V lookup(const K& k) const;
+
+private:
+    void index_keys();
+
+    std::vector<K> m_keys; //!< A copy of every key, for lookup
+};
+
+template<typename K, typename V>
+inline V bt_flat_page<K,V>::lookup(const K& k) const
+{
+    size_t n = m_keys.size();
+
+    if(n == 0)
+        throw key_not_found<K>(k);
+
+    // halve the range each step; the select compiles to a conditional move
+    const K* base = &m_keys[0];
+    while(n > 1)
     {
-        m_child_pages[pos] = this->get_db_ptr()->read_bbt_page(m_page_info[pos].second);
+        size_t half = n / 2;
+        base = (base[half] < k) ? base + half : base;
+        n -= half;
     }
+    base += (*base < k);
 
-    return m_child_pages[pos].get();
+    size_t pos = base - &m_keys[0];
+    if(pos == m_keys.size() || *base != k)
+        throw key_not_found<K>(k);
+
+    return this->get_value(pos);
 }
 
-template<>
-inline const bt_page<block_id, block_info>* bt_nonleaf_page<block_id, block_info>::get_child(uint pos) const
+template<typename K, typename V>
+inline void bt_flat_page<K,V>::index_keys()
+{
+    m_keys.reserve(this->num_values());
+
+    for(uint i = 0; i < this->num_values(); ++i)
+        m_keys.push_back(this->get_key(i));
+}
+
+template<typename K, typename V>
+inline bt_page<K,V>* bt_nonleaf_page<K,V>::get_child(uint pos)
+{
+    return const_cast<bt_page<K,V>*>(const_cast<const bt_nonleaf_page<K,V>*>(this)->get_child(pos));
+}
+
+template<typename K, typename V>
+inline const bt_page<K,V>* bt_nonleaf_page<K,V>::get_child(uint pos) const
 {
-    if(m_child_pages[pos] == NULL)
     {
-        m_child_pages[pos] = this->get_db_ptr()->read_bbt_page(m_page_info[pos].second);
+        lock_guard lock(m_child_lock);
+
+        if(m_child_pages[pos] == NULL)
+        {
+            // reuse the leaf if someone already has it open
+            m_child_pages[pos] = m_leaf_pages[pos].lock();
+        }
+
+        if(m_child_pages[pos] != NULL)
+            return m_child_pages[pos].get();
     }
 
+    // read without the lock, so a miss doesn't hold up readers of the
+    // other children; if another reader got there first, keep theirs
+    std::tr1::shared_ptr<bt_page<K,V> > pchild = read_child(pos);
+
+    lock_guard lock(m_child_lock);
+
+    if(m_child_pages[pos] == NULL)
+        m_child_pages[pos] = m_leaf_pages[pos].lock();
+
+    if(m_child_pages[pos] == NULL)
+        m_child_pages[pos] = pchild;
+
     return m_child_pages[pos].get();
 }
 
-template<>
-inline bt_page<node_id, node_info>* bt_nonleaf_page<node_id, node_info>::get_child(uint pos)
+template<typename K, typename V>
+inline const btree_node<K,V>* bt_nonleaf_page<K,V>::get_pinned_child(uint pos, std::tr1::shared_ptr<const void>& pin) const
 {
-    if(m_child_pages[pos] == NULL)
+    if(this->get_level() > 1)
+        return get_child(pos);
+
+    std::tr1::shared_ptr<bt_page<K,V> > pchild;
     {
-        m_child_pages[pos] = this->get_db_ptr()->read_nbt_page(m_page_info[pos].second); 
+        lock_guard lock(m_child_lock);
+
+        pchild = m_child_pages[pos];
+        if(!pchild)
+            pchild = m_leaf_pages[pos].lock();
     }
 
-    return m_child_pages[pos].get();
+    if(!pchild)
+    {
+        // as in get_child, read without the lock and keep the first one stored
+        std::tr1::shared_ptr<bt_page<K,V> > pread = read_child(pos);
+
+        lock_guard lock(m_child_lock);
+
+        pchild = m_child_pages[pos];
+        if(!pchild)
+            pchild = m_leaf_pages[pos].lock();
+
+        if(!pchild)
+        {
+            pchild = pread;
+            m_leaf_pages[pos] = pchild;
+        }
+    }
+
+    pin = pchild;
+    return pchild.get();
 }
 
-template<>
-inline const bt_page<node_id, node_info>* bt_nonleaf_page<node_id, node_info>::get_child(uint pos) const
+template<typename K, typename V>
+inline void bt_nonleaf_page<K,V>::read_ahead(uint pos, bool arriving) const
 {
-    if(m_child_pages[pos] == NULL)
+    shared_db_ptr db = this->get_db_ptr();
+    uint count = db->get_readahead();
+
+    // the window is [pos+1, pos+count]; once it's been started, each step
+    // only has to add its far end
+    uint end = std::min<uint>(pos + count + 1, m_page_info.size());
+    uint start = arriving ? pos + 1 : pos + count;
+
+    for(uint i = start; i < end; ++i)
     {
-        m_child_pages[pos] = this->get_db_ptr()->read_nbt_page(m_page_info[pos].second); 
+        {
+            lock_guard lock(m_child_lock);
+            if(m_child_pages[i] || !m_leaf_pages[i].expired())
+                continue;
+        }
+
+        db->prefetch_page(m_page_info[i].second);
     }
+}
 
-    return m_child_pages[pos].get();
+//! \cond dont_show_these_member_function_specializations
+template<>
+inline std::tr1::shared_ptr<bt_page<block_id, block_info> > bt_nonleaf_page<block_id, block_info>::read_child(uint pos) const
+{
+    return this->get_db_ptr()->read_bbt_page(m_page_info[pos].second);
+}
+
+template<>
+inline std::tr1::shared_ptr<bt_page<node_id, node_info> > bt_nonleaf_page<node_id, node_info>::read_child(uint pos) const
+{
+    return this->get_db_ptr()->read_nbt_page(m_page_info[pos].second);
 }
 //! \endcond
 } // end namespace
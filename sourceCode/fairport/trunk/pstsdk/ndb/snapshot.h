@@ -0,0 +1,412 @@
+//! \file
+//! \brief NBT snapshots and deltas
+//! \author Terry Mahaffey
+//!
+//! A snapshot records every entry of the NBT of a database at one point in
+//! time, and can be saved and loaded. Comparing a saved snapshot against a
+//! fresh one yields the nodes added, removed and changed in between, so a
+//! store which is only ever appended to can be re-processed incrementally.
+//!
+//! Pages in the file are never modified in place; a changed page is
+//! written out under a new page id. A new snapshot taken with the previous
+//! one in hand therefore only reads the NBT leaf pages whose ids it hasn't
+//! seen before, and takes the rest from the previous snapshot.
+//! \ingroup ndb
+
+#ifndef PSTSDK_NDB_SNAPSHOT_H
+#define PSTSDK_NDB_SNAPSHOT_H
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <vector>
+#if __GNUC__
+# include <tr1/unordered_map>
+#else
+# include <unordered_map>
+#endif
+
+#include "pstsdk/util/primitives.h"
+#include "pstsdk/util/errors.h"
+
+#include "pstsdk/ndb/database_iface.h"
+#include "pstsdk/ndb/page.h"
+
+namespace pstsdk
+{
+
+//! \defgroup ndb_snapshotrelated NBT Snapshots
+//! \ingroup ndb
+
+//! \brief The entries of the NBT at one point in time
+//! \ingroup ndb_snapshotrelated
+class nbt_snapshot
+{
+public:
+    //! \brief Construct an empty snapshot, which every node is new relative to
+    nbt_snapshot();
+    //! \brief Take a snapshot of a database, reading every NBT page
+    //! \param[in] db The database
+    explicit nbt_snapshot(const shared_db_ptr& db);
+    //! \brief Take a snapshot of a database, starting from an earlier one
+    //!
+    //! Leaf pages recorded in previous are not read again.
+    //! \pre previous was taken of the same file (an earlier version of it)
+    //! \param[in] db The database
+    //! \param[in] previous An earlier snapshot of the same file
+    nbt_snapshot(const shared_db_ptr& db, const nbt_snapshot& previous);
+
+    //! \brief Get the header stamp of the database when this snapshot was taken
+    //! \returns The header stamp
+    const header_stamp& get_stamp() const
+        { return m_stamp; }
+    //! \brief Get every NBT entry, in node_id order
+    //! \returns The entries
+    const std::vector<node_info>& get_nodes() const
+        { return m_nodes; }
+    //! \brief Get the number of NBT leaf pages read to take this snapshot
+    //! \returns The number of leaf pages not taken from a previous snapshot
+    size_t get_pages_read() const
+        { return m_pages_read; }
+
+    //! \brief Write this snapshot to a stream
+    //! \throws write_error If the stream fails
+    //! \param[in] out The stream to write to, opened in binary mode
+    void save(std::ostream& out) const;
+    //! \brief Replace this snapshot with one read from a stream
+    //! \throws invalid_format If the stream doesn't hold a snapshot, or
+    //! holds fewer entries than its header claims
+    //! \param[in] in The stream to read from, opened in binary mode
+    void load(std::istream& in);
+
+private:
+    //! \brief The entries of one NBT leaf page, as a range of m_nodes
+    struct leaf_range
+    {
+        page_id id;
+        ulong first;
+        ulong count;
+    };
+
+    void capture(const shared_db_ptr& db, const nbt_snapshot* pprevious);
+    void add_subtree(const shared_db_ptr& db, const nbt_page& page, const nbt_snapshot* pprevious);
+    void add_leaf(const nbt_page& leaf);
+    bool copy_leaf(page_id id, const nbt_snapshot& previous);
+    void index_leaves();
+
+    header_stamp m_stamp;
+    std::vector<node_info> m_nodes;         //!< Every entry, in node_id order
+    std::vector<leaf_range> m_leaves;       //!< The leaf pages, in node_id order
+    std::tr1::unordered_map<page_id, size_t> m_leaf_index; //!< Position in m_leaves of each leaf page
+    size_t m_pages_read;
+};
+
+//! \brief How a node differs between two snapshots
+//! \ingroup ndb_snapshotrelated
+enum node_change
+{
+    node_added,     //!< Only in the later snapshot
+    node_removed,   //!< Only in the earlier snapshot
+    node_changed    //!< In both, with a different data block, subnode block or parent
+};
+
+//! \brief One difference between two snapshots
+//! \ingroup ndb_snapshotrelated
+struct node_delta
+{
+    node_change change;
+    node_info before;   //!< The entry in the earlier snapshot; not valid for node_added
+    node_info after;    //!< The entry in the later snapshot; not valid for node_removed
+};
+
+//! \brief Compare two snapshots
+//! \param[in] before The earlier snapshot
+//! \param[in] after The later snapshot
+//! \returns The added, removed and changed nodes, in node_id order
+//! \ingroup ndb_snapshotrelated
+std::vector<node_delta> diff_snapshots(const nbt_snapshot& before, const nbt_snapshot& after);
+
+//! \cond snapshot_implementation
+namespace detail
+{
+
+const ulong snapshot_magic = 0x5354424e; // "NBTS"
+const ulong snapshot_version = 1;
+
+struct snapshot_header
+{
+    ulong magic;
+    ulong version;
+    ulong leaf_count;
+    ulong node_count;
+    header_stamp stamp;
+};
+
+//! \brief A node_info, laid out without padding
+struct snapshot_node
+{
+    node_id id;
+    node_id parent_id;
+    block_id data_bid;
+    block_id sub_bid;
+};
+
+//! \brief Get the number of bytes left in a stream
+//! \returns The number of bytes after the read position, or -1 if the
+//! stream can't seek
+inline std::streamoff remaining_length(std::istream& in)
+{
+    std::istream::pos_type pos = in.tellg();
+    if(pos == std::istream::pos_type(-1))
+        return -1;
+
+    in.seekg(0, std::ios::end);
+    std::istream::pos_type end = in.tellg();
+    in.clear();
+    in.seekg(pos);
+
+    if(end == std::istream::pos_type(-1) || !in)
+        return -1;
+
+    return end - pos;
+}
+
+} // end namespace detail
+//! \endcond
+
+} // end namespace pstsdk
+
+inline pstsdk::nbt_snapshot::nbt_snapshot()
+: m_pages_read(0)
+{
+    memset(&m_stamp, 0, sizeof(m_stamp));
+}
+
+inline pstsdk::nbt_snapshot::nbt_snapshot(const shared_db_ptr& db)
+: m_pages_read(0)
+{
+    capture(db, NULL);
+}
+
+inline pstsdk::nbt_snapshot::nbt_snapshot(const shared_db_ptr& db, const nbt_snapshot& previous)
+: m_pages_read(0)
+{
+    capture(db, &previous);
+}
+
+inline void pstsdk::nbt_snapshot::capture(const shared_db_ptr& db, const nbt_snapshot* pprevious)
+{
+    m_stamp = db->get_header_stamp();
+
+    // nothing has been written since; the previous snapshot is this one
+    if(pprevious && pprevious->m_stamp == m_stamp && !pprevious->m_leaves.empty())
+    {
+        m_nodes = pprevious->m_nodes;
+        m_leaves = pprevious->m_leaves;
+        m_leaf_index = pprevious->m_leaf_index;
+        return;
+    }
+
+    std::tr1::shared_ptr<nbt_page> root = db->read_nbt_root();
+    add_subtree(db, *root, pprevious);
+
+    index_leaves();
+}
+
+inline void pstsdk::nbt_snapshot::add_subtree(const shared_db_ptr& db, const nbt_page& page, const nbt_snapshot* pprevious)
+{
+    if(page.get_level() == 0)
+    {
+        if(!pprevious || !copy_leaf(page.get_page_id(), *pprevious))
+            add_leaf(page);
+        return;
+    }
+
+    const nbt_nonleaf_page& nonleaf = dynamic_cast<const nbt_nonleaf_page&>(page);
+
+    for(uint i = 0; i < nonleaf.num_values(); ++i)
+    {
+        if(nonleaf.get_level() > 1)
+        {
+            // nonleaf pages stay pinned by their parent anyway
+            add_subtree(db, *nonleaf.get_child(i), pprevious);
+        }
+        else
+        {
+            const page_info& pi = nonleaf.get_child_page_info(i);
+
+            if(pprevious && copy_leaf(pi.id, *pprevious))
+                continue;
+
+            // go through the database rather than get_child, so the leaf
+            // isn't pinned in the tree for good
+            add_leaf(*db->read_nbt_page(pi));
+        }
+    }
+}
+
+inline void pstsdk::nbt_snapshot::add_leaf(const nbt_page& leaf)
+{
+    const nbt_leaf_page& page = dynamic_cast<const nbt_leaf_page&>(leaf);
+
+    leaf_range range = { page.get_page_id(), static_cast<ulong>(m_nodes.size()), page.num_values() };
+
+    for(uint i = 0; i < page.num_values(); ++i)
+        m_nodes.push_back(page.get_value(i));
+
+    m_leaves.push_back(range);
+    ++m_pages_read;
+}
+
+inline bool pstsdk::nbt_snapshot::copy_leaf(page_id id, const nbt_snapshot& previous)
+{
+    std::tr1::unordered_map<page_id, size_t>::const_iterator iter = previous.m_leaf_index.find(id);
+
+    if(iter == previous.m_leaf_index.end())
+        return false;
+
+    const leaf_range& old_range = previous.m_leaves[iter->second];
+    leaf_range range = { id, static_cast<ulong>(m_nodes.size()), old_range.count };
+
+    m_nodes.insert(m_nodes.end(), previous.m_nodes.begin() + old_range.first, previous.m_nodes.begin() + old_range.first + old_range.count);
+    m_leaves.push_back(range);
+
+    return true;
+}
+
+inline void pstsdk::nbt_snapshot::index_leaves()
+{
+    m_leaf_index.clear();
+
+    for(size_t i = 0; i < m_leaves.size(); ++i)
+        m_leaf_index[m_leaves[i].id] = i;
+}
+
+inline void pstsdk::nbt_snapshot::save(std::ostream& out) const
+{
+    detail::snapshot_header header;
+    header.magic = detail::snapshot_magic;
+    header.version = detail::snapshot_version;
+    header.leaf_count = static_cast<ulong>(m_leaves.size());
+    header.node_count = static_cast<ulong>(m_nodes.size());
+    header.stamp = m_stamp;
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for(size_t i = 0; i < m_leaves.size(); ++i)
+        out.write(reinterpret_cast<const char*>(&m_leaves[i]), sizeof(leaf_range));
+
+    for(size_t i = 0; i < m_nodes.size(); ++i)
+    {
+        detail::snapshot_node node = { m_nodes[i].id, m_nodes[i].parent_id, m_nodes[i].data_bid, m_nodes[i].sub_bid };
+        out.write(reinterpret_cast<const char*>(&node), sizeof(node));
+    }
+
+    if(!out)
+        throw write_error("nbt_snapshot::save: stream failed");
+}
+
+inline void pstsdk::nbt_snapshot::load(std::istream& in)
+{
+    detail::snapshot_header header;
+
+    if(!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != detail::snapshot_magic || header.version != detail::snapshot_version)
+        throw invalid_format();
+
+    // the counts are only as good as the file; don't size anything from
+    // them which the stream can't fill. A stream which can't tell how much
+    // it holds is read without reserving.
+    ulonglong needed = header.leaf_count * static_cast<ulonglong>(sizeof(leaf_range)) + header.node_count * static_cast<ulonglong>(sizeof(detail::snapshot_node));
+    std::streamoff remaining = detail::remaining_length(in);
+
+    if(remaining >= 0 && needed > static_cast<ulonglong>(remaining))
+        throw invalid_format();
+
+    std::vector<leaf_range> leaves;
+    std::vector<node_info> nodes;
+
+    if(remaining >= 0)
+    {
+        leaves.reserve(header.leaf_count);
+        nodes.reserve(header.node_count);
+    }
+
+    for(ulong i = 0; i < header.leaf_count; ++i)
+    {
+        leaf_range range;
+
+        if(!in.read(reinterpret_cast<char*>(&range), sizeof(range)))
+            throw invalid_format();
+
+        leaves.push_back(range);
+    }
+
+    for(ulong i = 0; i < header.node_count; ++i)
+    {
+        detail::snapshot_node node;
+
+        if(!in.read(reinterpret_cast<char*>(&node), sizeof(node)))
+            throw invalid_format();
+
+        node_info info = { node.id, node.data_bid, node.sub_bid, node.parent_id };
+        nodes.push_back(info);
+    }
+
+    for(size_t i = 0; i < leaves.size(); ++i)
+    {
+        if(leaves[i].first > nodes.size() || leaves[i].count > nodes.size() - leaves[i].first)
+            throw invalid_format();
+    }
+
+    m_stamp = header.stamp;
+    m_nodes.swap(nodes);
+    m_leaves.swap(leaves);
+    m_pages_read = 0;
+    index_leaves();
+}
+
+inline std::vector<pstsdk::node_delta> pstsdk::diff_snapshots(const nbt_snapshot& before, const nbt_snapshot& after)
+{
+    std::vector<node_delta> deltas;
+
+    const std::vector<node_info>& old_nodes = before.get_nodes();
+    const std::vector<node_info>& new_nodes = after.get_nodes();
+    size_t i = 0, j = 0;
+
+    while(i < old_nodes.size() || j < new_nodes.size())
+    {
+        node_delta delta;
+
+        if(j == new_nodes.size() || (i < old_nodes.size() && old_nodes[i].id < new_nodes[j].id))
+        {
+            delta.change = node_removed;
+            delta.before = old_nodes[i++];
+            memset(&delta.after, 0, sizeof(delta.after));
+        }
+        else if(i == old_nodes.size() || new_nodes[j].id < old_nodes[i].id)
+        {
+            delta.change = node_added;
+            memset(&delta.before, 0, sizeof(delta.before));
+            delta.after = new_nodes[j++];
+        }
+        else
+        {
+            const node_info& a = old_nodes[i++];
+            const node_info& b = new_nodes[j++];
+
+            if(a.data_bid == b.data_bid && a.sub_bid == b.sub_bid && a.parent_id == b.parent_id)
+                continue;
+
+            delta.change = node_changed;
+            delta.before = a;
+            delta.after = b;
+        }
+
+        deltas.push_back(delta);
+    }
+
+    return deltas;
+}
+
+#endif
@@ -19,6 +19,7 @@
 //!      - Boost.Iostreams
 //!      - Boost.Iterators
 //!      - Boost.Utility
+//!      - Boost.Thread (define PSTSDK_SINGLE_THREADED to do without it)
 //! - GCC 4.4.x (with -std=c++0x) or Visual Studio 2010
 //!
 //! Partial support is offered for some older versions of Visual Studio and
@@ -69,5 +70,6 @@
 #include "pstsdk/pst/pst.h"
 #include "pstsdk/pst/folder.h"
 #include "pstsdk/pst/message.h"
+#include "pstsdk/pst/catalog.h"
 
 #endif
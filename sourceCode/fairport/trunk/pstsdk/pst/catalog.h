@@ -0,0 +1,465 @@
+//! \file
+//! \brief Message catalog sidecar files
+//! \author Terry Mahaffey
+//!
+//! A catalog is a compact summary of every message in a store, written to
+//! a file next to it. It holds a fixed size record per message, sorted by
+//! node_id, and is read straight out of a memory mapping, so questions
+//! like "every message from this sender last week" can be answered
+//! without opening a single folder or message.
+//!
+//! A catalog records the \ref header_stamp of the store it was built
+//! from; \ref open_catalog rebuilds it whenever the store has changed.
+//! \ingroup pst
+
+#ifndef PSTSDK_PST_CATALOG_H
+#define PSTSDK_PST_CATALOG_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+#include "pstsdk/util/primitives.h"
+#include "pstsdk/util/errors.h"
+#include "pstsdk/util/file.h"
+#include "pstsdk/util/util.h"
+
+#include "pstsdk/ndb/database_iface.h"
+
+#include "pstsdk/pst/message.h"
+#include "pstsdk/pst/pst.h"
+
+namespace pstsdk
+{
+
+//! \defgroup pst_catalogrelated Catalog
+//! \ingroup pst
+
+//! \brief The summary of one message kept in a catalog
+//!
+//! This is the on disk format, so every field has a fixed size.
+//! \ingroup pst_catalogrelated
+struct catalog_entry
+{
+    node_id id;                 //!< The message
+    node_id folder;             //!< The folder holding the message
+    ulonglong delivery_time;    //!< PR_MESSAGE_DELIVERY_TIME as a FILETIME, or 0 if not set
+    ulong size;                 //!< PR_MESSAGE_SIZE, or 0 if not set
+    ulong attachment_count;     //!< Number of attachments
+    ulong subject_hash;         //!< \ref catalog_hash of the subject, or 0 if not set
+    ulong sender_hash;          //!< \ref catalog_hash of the sender's address (or name, if it has no address), or 0 if not set
+};
+//! \cond static_asserts
+static_assert(sizeof(catalog_entry) == 32, "catalog_entry incorrect size");
+//! \endcond
+
+//! \brief A filter over the entries of a catalog
+//!
+//! Every criteria left at its default matches every message.
+//! \ingroup pst_catalogrelated
+struct catalog_query
+{
+    catalog_query()
+        : folder(0), delivered_after(0), delivered_before(0), min_size(0), has_attachments(false) { }
+
+    node_id folder;             //!< Only messages in this folder, if non-zero
+    time_t delivered_after;     //!< Only messages delivered at or after this time, if non-zero
+    time_t delivered_before;    //!< Only messages delivered before this time, if non-zero
+    std::wstring sender;        //!< Only messages from this sender address or name (case insensitive), if not empty
+    std::wstring subject;       //!< Only messages with exactly this subject (case insensitive), if not empty
+    ulong min_size;             //!< Only messages at least this large
+    bool has_attachments;       //!< Only messages with attachments, if set
+};
+
+//! \brief The hash a catalog keeps of strings
+//!
+//! A case insensitive 32 bit FNV-1a over the UTF-16 code units. Matching
+//! hashes are treated as matching strings. Case is folded with a fixed
+//! table, never the C library's locale, so a catalog built on one machine
+//! matches the same queries on any other. The table covers ASCII, Latin-1,
+//! Latin Extended-A, Latin Extended Additional, fullwidth Latin, the basic
+//! Greek alphabet, Cyrillic up to U+04BF and Armenian. Other letters,
+//! Latin Extended-B and the rest of Cyrillic among them, are hashed as
+//! they are, so differently cased spellings of them don't match.
+//! \param[in] str The string to hash
+//! \returns The hash; never 0, which a catalog uses for "not set"
+//! \ingroup pst_catalogrelated
+ulong catalog_hash(const std::wstring& str);
+
+//! \brief Build the catalog of a store, writing it to a file
+//! \throws write_error If the file can't be written
+//! \param[in] store The store to catalog
+//! \param[in] filename The catalog file to create, replacing any existing file
+//! \ingroup pst_catalogrelated
+void build_catalog(const pst& store, const std::wstring& filename);
+
+//! \brief A catalog file, opened for reading
+//!
+//! The entries are sorted by node_id. They are read directly from a
+//! mapping of the file, and are valid for the lifetime of this object.
+//! \ingroup pst_catalogrelated
+class catalog : private boost::noncopyable
+{
+public:
+    //! \brief Iterator over the entries of the catalog
+    typedef const catalog_entry* const_iterator;
+
+    //! \brief Open a catalog file
+    //! \throws runtime_error If the file can't be opened
+    //! \throws invalid_format If the file isn't a catalog
+    //! \param[in] filename The catalog file
+    explicit catalog(const std::wstring& filename);
+
+    //! \brief Was this catalog built from the store as it is now?
+    //! \param[in] store The store to check against
+    //! \returns false if the store has been written since the catalog was built
+    bool is_current(const pst& store) const
+        { return store.get_db()->get_header_stamp() == get_stamp(); }
+    //! \brief Get the header stamp of the store this catalog was built from
+    //! \returns The header stamp
+    header_stamp get_stamp() const;
+
+    //! \brief Get the number of messages in the catalog
+    //! \returns The number of entries
+    size_t size() const
+        { return m_count; }
+    //! \brief Get an iterator to the first entry
+    //! \returns The first entry
+    const_iterator begin() const
+        { return m_pentries; }
+    //! \brief Get the end iterator
+    //! \returns One past the last entry
+    const_iterator end() const
+        { return m_pentries + m_count; }
+    //! \brief Get an entry by position
+    //! \param[in] pos The position, less than size()
+    //! \returns The entry
+    const catalog_entry& operator[](size_t pos) const
+        { return m_pentries[pos]; }
+
+    //! \brief Find the entry of a message
+    //! \throws key_not_found<node_id> If the message isn't in the catalog
+    //! \param[in] id The node_id of the message
+    //! \returns The entry
+    const catalog_entry& lookup(node_id id) const;
+    //! \brief Find every message matching a query
+    //! \param[in] query The filter to apply
+    //! \returns The node_ids of the matching messages, in node_id order
+    std::vector<node_id> find(const catalog_query& query) const;
+
+private:
+    file m_file;
+    std::vector<byte> m_scratch;        //!< Holds the file if it could not be mapped
+    const byte* m_pheader;
+    const catalog_entry* m_pentries;
+    size_t m_count;
+};
+
+//! \brief Open the catalog of a store, building it if needed
+//!
+//! The catalog is (re)built if the file is missing, isn't a catalog, or
+//! was built from an older state of the store.
+//! \throws write_error If the catalog had to be built, and couldn't be written
+//! \param[in] store The store
+//! \param[in] filename The catalog file
+//! \returns The opened catalog
+//! \ingroup pst_catalogrelated
+std::tr1::shared_ptr<catalog> open_catalog(const pst& store, const std::wstring& filename);
+
+//! \cond catalog_implementation
+namespace detail
+{
+
+const ulong catalog_magic = 0x43545350; // "PSTC"
+const ulong catalog_version = 2;          // 2: locale independent catalog_hash
+
+//! \brief A run of code points which fold to the code point delta away
+//!
+//! Where stride is 2 only every other code point from first on folds;
+//! the upper and lower case letters alternate.
+struct case_fold_range
+{
+    ushort first;
+    ushort last;
+    ushort stride;
+    short delta;
+};
+
+//! \brief The simple case folding of the letters outside ASCII listed at \ref catalog_hash, by first
+const case_fold_range case_fold_ranges[] =
+{
+    { 0x00B5, 0x00B5, 1, 775 },     // micro sign
+    { 0x00C0, 0x00D6, 1, 32 },
+    { 0x00D8, 0x00DE, 1, 32 },
+    { 0x0100, 0x012E, 2, 1 },
+    { 0x0132, 0x0136, 2, 1 },
+    { 0x0139, 0x0147, 2, 1 },
+    { 0x014A, 0x0176, 2, 1 },
+    { 0x0178, 0x0178, 1, -121 },
+    { 0x0179, 0x017D, 2, 1 },
+    { 0x017F, 0x017F, 1, -268 },    // long s
+    { 0x0386, 0x0386, 1, 38 },
+    { 0x0388, 0x038A, 1, 37 },
+    { 0x038C, 0x038C, 1, 64 },
+    { 0x038E, 0x038F, 1, 63 },
+    { 0x0391, 0x03A1, 1, 32 },
+    { 0x03A3, 0x03AB, 1, 32 },
+    { 0x03C2, 0x03C2, 1, 1 },       // final sigma
+    { 0x0400, 0x040F, 1, 80 },
+    { 0x0410, 0x042F, 1, 32 },
+    { 0x0460, 0x0480, 2, 1 },
+    { 0x048A, 0x04BE, 2, 1 },
+    { 0x0531, 0x0556, 1, 48 },
+    { 0x1E00, 0x1E94, 2, 1 },
+    { 0x1E9E, 0x1E9E, 1, -7615 },   // capital sharp s
+    { 0x1EA0, 0x1EFE, 2, 1 },
+    { 0xFF21, 0xFF3A, 1, 32 }       // fullwidth Latin
+};
+
+//! \brief Fold the case of a UTF-16 code unit, as \ref catalog_hash does
+inline ulong fold_case(ulong c)
+{
+    if(c < 0x80)
+        return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+
+    for(size_t i = 0; i < sizeof(case_fold_ranges) / sizeof(case_fold_ranges[0]) && case_fold_ranges[i].first <= c; ++i)
+    {
+        const case_fold_range& range = case_fold_ranges[i];
+        if(c <= range.last && (c - range.first) % range.stride == 0)
+            return c + range.delta;
+    }
+
+    return c;
+}
+
+//! \brief The start of a catalog file, followed by the entries
+struct catalog_header
+{
+    ulong magic;
+    ulong version;
+    ulong count;
+    ulong entry_size;
+    header_stamp stamp;
+};
+static_assert(sizeof(catalog_header) == 48, "catalog_header incorrect size");
+
+inline bool catalog_entry_less(const catalog_entry& lhs, const catalog_entry& rhs)
+{
+    return lhs.id < rhs.id;
+}
+
+//! \brief Summarize one message into an entry
+inline catalog_entry summarize_message(const message& m)
+{
+    const property_bag& bag = m.get_property_bag();
+
+    catalog_entry entry;
+    memset(&entry, 0, sizeof(entry));
+
+    entry.id = m.get_id();
+    entry.folder = bag.get_node().get_parent_id();
+
+    if(bag.prop_exists(0x0e06)) // PR_MESSAGE_DELIVERY_TIME
+        entry.delivery_time = bag.read_prop<ulonglong>(0x0e06);
+
+    if(bag.prop_exists(0x0e08)) // PR_MESSAGE_SIZE
+        entry.size = bag.read_prop<ulong>(0x0e08);
+
+    if(m.has_subject())
+        entry.subject_hash = catalog_hash(m.get_subject());
+
+    if(bag.prop_exists(0x0c1f)) // PR_SENDER_EMAIL_ADDRESS
+        entry.sender_hash = catalog_hash(bag.read_prop<std::wstring>(0x0c1f));
+    else if(bag.prop_exists(0x0c1a)) // PR_SENDER_NAME
+        entry.sender_hash = catalog_hash(bag.read_prop<std::wstring>(0x0c1a));
+
+    entry.attachment_count = static_cast<ulong>(m.get_attachment_count());
+
+    return entry;
+}
+
+} // end namespace detail
+//! \endcond
+
+} // end namespace pstsdk
+
+inline pstsdk::ulong pstsdk::catalog_hash(const std::wstring& str)
+{
+    ulong hash = 2166136261u;
+
+    for(size_t i = 0; i < str.size(); ++i)
+    {
+        ulong c = detail::fold_case(static_cast<ulong>(str[i]) & 0xffff);
+
+        hash = (hash ^ (c & 0xff)) * 16777619u;
+        hash = (hash ^ (c >> 8)) * 16777619u;
+    }
+
+    return hash ? hash : 1;
+}
+
+inline void pstsdk::build_catalog(const pst& store, const std::wstring& filename)
+{
+    std::vector<catalog_entry> entries;
+
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter)
+        entries.push_back(detail::summarize_message(*iter));
+
+    // the NBT is walked in order already; this is just insurance
+    std::sort(entries.begin(), entries.end(), detail::catalog_entry_less);
+
+    detail::catalog_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = detail::catalog_magic;
+    header.version = detail::catalog_version;
+    header.count = static_cast<ulong>(entries.size());
+    header.entry_size = sizeof(catalog_entry);
+    header.stamp = store.get_db()->get_header_stamp();
+
+    std::ofstream out(std::string(filename.begin(), filename.end()).c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if(!entries.empty())
+        out.write(reinterpret_cast<const char*>(&entries[0]), entries.size() * sizeof(catalog_entry));
+    out.close();
+
+    if(!out)
+        throw write_error("build_catalog: failed to write catalog");
+}
+
+inline pstsdk::catalog::catalog(const std::wstring& filename)
+: m_file(filename, file_access_mmap), m_pheader(NULL), m_pentries(NULL), m_count(0)
+{
+    const detail::catalog_header* pheader;
+
+    try
+    {
+        m_pheader = m_file.view(0, sizeof(detail::catalog_header), m_scratch);
+        pheader = reinterpret_cast<const detail::catalog_header*>(m_pheader);
+    }
+    catch(std::out_of_range&)
+    {
+        throw invalid_format();
+    }
+
+    if(pheader->magic != detail::catalog_magic || pheader->version != detail::catalog_version || pheader->entry_size != sizeof(catalog_entry))
+        throw invalid_format();
+
+    m_count = pheader->count;
+
+    if(m_count == 0)
+        return;
+
+    ulonglong total = sizeof(detail::catalog_header) + static_cast<ulonglong>(m_count) * sizeof(catalog_entry);
+    if(total > (std::numeric_limits<size_t>::max)())
+        throw invalid_format();
+
+    // not mapped; keep the header and read the rest of the file behind it
+    if(!m_file.is_mapped())
+    {
+        // the count is only as good as the file it came from; make sure
+        // the file really is that long before allocating for it
+        try
+        {
+            std::vector<byte> last(1);
+            m_file.read(last, total - 1);
+
+            m_scratch.resize(static_cast<size_t>(total));
+            m_file.read(m_scratch, 0);
+        }
+        catch(std::out_of_range&)
+        {
+            throw invalid_format();
+        }
+
+        m_pheader = &m_scratch[0];
+        m_pentries = reinterpret_cast<const catalog_entry*>(&m_scratch[sizeof(detail::catalog_header)]);
+        return;
+    }
+
+    try
+    {
+        std::vector<byte> unused;
+        m_pentries = reinterpret_cast<const catalog_entry*>(m_file.view(sizeof(detail::catalog_header), m_count * sizeof(catalog_entry), unused));
+    }
+    catch(std::out_of_range&)
+    {
+        throw invalid_format();
+    }
+}
+
+inline pstsdk::header_stamp pstsdk::catalog::get_stamp() const
+{
+    return reinterpret_cast<const detail::catalog_header*>(m_pheader)->stamp;
+}
+
+inline const pstsdk::catalog_entry& pstsdk::catalog::lookup(node_id id) const
+{
+    catalog_entry key;
+    key.id = id;
+
+    const_iterator iter = std::lower_bound(begin(), end(), key, detail::catalog_entry_less);
+
+    if(iter == end() || iter->id != id)
+        throw key_not_found<node_id>(id);
+
+    return *iter;
+}
+
+inline std::vector<pstsdk::node_id> pstsdk::catalog::find(const catalog_query& query) const
+{
+    ulonglong after = query.delivered_after ? time_t_to_filetime(query.delivered_after) : 0;
+    ulonglong before = query.delivered_before ? time_t_to_filetime(query.delivered_before) : 0;
+    ulong sender = query.sender.empty() ? 0 : catalog_hash(query.sender);
+    ulong subject = query.subject.empty() ? 0 : catalog_hash(query.subject);
+
+    std::vector<node_id> results;
+
+    for(const_iterator iter = begin(); iter != end(); ++iter)
+    {
+        if(query.folder && iter->folder != query.folder)
+            continue;
+        if(after && iter->delivery_time < after)
+            continue;
+        if(before && (iter->delivery_time == 0 || iter->delivery_time >= before))
+            continue;
+        if(sender && iter->sender_hash != sender)
+            continue;
+        if(subject && iter->subject_hash != subject)
+            continue;
+        if(iter->size < query.min_size)
+            continue;
+        if(query.has_attachments && iter->attachment_count == 0)
+            continue;
+
+        results.push_back(iter->id);
+    }
+
+    return results;
+}
+
+inline std::tr1::shared_ptr<pstsdk::catalog> pstsdk::open_catalog(const pst& store, const std::wstring& filename)
+{
+    try
+    {
+        std::tr1::shared_ptr<catalog> pcatalog(new catalog(filename));
+
+        if(pcatalog->is_current(store))
+            return pcatalog;
+    }
+    catch(std::exception&)
+    {
+        // missing or unreadable; build it below
+    }
+
+    build_catalog(store, filename);
+
+    return std::tr1::shared_ptr<catalog>(new catalog(filename));
+}
+
+#endif
@@ -93,6 +93,10 @@ public:
     //! \returns The name of this folder
     std::wstring get_name() const
         { return m_bag.read_prop<std::wstring>(0x3001); }
+    //! \brief Get the display name of this folder, in UTF-8
+    //! \returns The name of this folder
+    std::string get_name_utf8() const
+        { return m_bag.read_prop_utf8(0x3001); }
     //! \brief Get the number of unread messages in this folder
     //! \returns The number of unread messages
     size_t get_unread_message_count() const
@@ -260,6 +264,9 @@ public:
     //! \copydoc search_folder::get_name()
     std::wstring get_name() const
         { return m_bag.read_prop<std::wstring>(0x3001); }
+    //! \copydoc search_folder::get_name_utf8()
+    std::string get_name_utf8() const
+        { return m_bag.read_prop_utf8(0x3001); }
     //! \brief Get the number of sub folders in this folder
     //! \returns The number of subfolders
     size_t get_subfolder_count() const
@@ -25,6 +25,23 @@ namespace pstsdk
 //! \ingroup pst
 
 class message;
+
+//! \cond write_to_ostream
+//! \brief A page_sink writing to an ostream, for \ref attachment::write_bytes
+class ostream_page_sink : public page_sink
+{
+public:
+    explicit ostream_page_sink(std::ostream& out)
+        : m_out(out) { }
+    void write(const byte_slice& page)
+        { m_out.write(reinterpret_cast<const char*>(page.data()), page.size()); }
+
+private:
+    ostream_page_sink& operator=(const ostream_page_sink&); // = delete
+    std::ostream& m_out;
+};
+//! \endcond
+
 //! \brief Encapsulates an attachment to a message
 //! 
 //! Attachment objects allow you to query for some basic information about
@@ -40,8 +57,8 @@ public:
     std::wstring get_filename() const;
     //! \brief Get the attachment data, as a blob
     //!
-    //! You might want to consider open_byte_stream if content_size()
-    //! is too large for your tastes.
+    //! You might want to consider for_each_page or write_bytes if
+    //! content_size() is too large for your tastes.
     //! \returns A vector of bytes
     std::vector<byte> get_bytes() const
         { return m_bag.read_prop<std::vector<byte> >(0x3701); }
@@ -56,6 +73,30 @@ public:
     //! \returns A stream device for the attachment data
     hnid_stream_device open_byte_stream()
         { return m_bag.open_prop_stream(0x3701); }
+    //! \brief Hand the attachment data to a function object, a page at a time
+    //!
+    //! Only one page (at most 8k) of the attachment is read and held at a
+    //! time, however large the attachment is. The stream from
+    //! open_byte_stream, by contrast, keeps every page it has read.
+    //! \code
+    //! struct writer { int fd; void operator()(const byte_slice& page) { ::write(fd, page.data(), page.size()); } };
+    //! writer w = { fd };
+    //! a.for_each_page(w);
+    //! \endcode
+    //! A function object wanting fewer, larger writes (a writev batch, say)
+    //! can keep the slices it is given until it has enough of them.
+    //! \tparam Func A callable taking a const byte_slice&
+    //! \param[in] f The function object
+    //! \returns The number of bytes handed to f
+    template<typename Func>
+    size_t for_each_page(Func& f) const
+        { page_sink_adapter<Func> sink(f); return m_bag.for_each_prop_page(0x3701, sink); }
+    //! \brief Write the attachment data to a stream, a page at a time
+    //! \sa attachment::for_each_page
+    //! \param[in,out] out The stream to write to
+    //! \returns The number of bytes written
+    size_t write_bytes(std::ostream& out) const
+        { ostream_page_sink sink(out); return m_bag.for_each_prop_page(0x3701, sink); }
     //! \brief Read the size of this attachment
     //!
     //! The size returned here includes metadata, and as such will be
@@ -113,8 +154,7 @@ private:
 //! \ingroup pst_messagerelated
 inline std::ostream& operator<<(std::ostream& out, const attachment& attach)
 {
-    std::vector<byte> data = attach.get_bytes();
-    out.write(reinterpret_cast<char*>(&data[0]), data.size());
+    attach.write_bytes(out);
     return out;
 }
 
@@ -130,6 +170,10 @@ public:
     explicit attachment_transform(const node& n) 
         : m_node(n) { }
 #ifndef BOOST_NO_RVALUE_REFERENCES
+    //! \brief Copy constructor for transform objects
+    //! \param[in] other The transform object to copy from
+    attachment_transform(const attachment_transform& other)
+        : m_node(other.m_node) { }
     //! \brief Move constructor for transform objects
     //! \param[in] other The transform object to move from
     attachment_transform(attachment_transform&& other)
@@ -157,6 +201,10 @@ public:
     //! \returns The recipient name
     std::wstring get_name() const
         { return m_row.read_prop<std::wstring>(0x3001); }
+    //! \brief Get the display name of this recipient, in UTF-8
+    //! \returns The recipient name
+    std::string get_name_utf8() const
+        { return m_row.read_prop_utf8(0x3001); }
     //! \brief Get the type of this recipient
     //! \returns The recipient type
     recipient_type get_type() const
@@ -165,10 +213,18 @@ public:
     //! \returns The address type
     std::wstring get_address_type() const
         { return m_row.read_prop<std::wstring>(0x3002); }
+    //! \brief Get the address type of the recipient, in UTF-8
+    //! \returns The address type
+    std::string get_address_type_utf8() const
+        { return m_row.read_prop_utf8(0x3002); }
     //! \brief Get the email address of the recipient
     //! \returns The email address
     std::wstring get_email_address() const
         { return m_row.read_prop<std::wstring>(0x39fe); }
+    //! \brief Get the email address of the recipient, in UTF-8
+    //! \returns The email address
+    std::string get_email_address_utf8() const
+        { return m_row.read_prop_utf8(0x39fe); }
     //! \brief Checks to see if this recipient has an email address
     //! \returns true if get_email_address() doesn't throw
     bool has_email_address() const
@@ -177,6 +233,10 @@ public:
     //! \returns The account name
     std::wstring get_account_name() const
         { return m_row.read_prop<std::wstring>(0x3a00); }
+    //! \brief Get the name of the recipients account, in UTF-8
+    //! \returns The account name
+    std::string get_account_name_utf8() const
+        { return m_row.read_prop_utf8(0x3a00); }
     //! \brief Checks to see if this recipient has an account name
     //! \returns true if get_account_name() doesn't throw
     bool has_account_name() const
@@ -261,6 +321,9 @@ public:
     //! \brief Get the subject of this message
     //! \returns The message subject
     std::wstring get_subject() const;
+    //! \brief Get the subject of this message, in UTF-8
+    //! \returns The message subject
+    std::string get_subject_utf8() const;
     //! \brief Check to see if a subject is set on this message
     //! \returns true if a subject is set on this message
     bool has_subject() const
@@ -269,6 +332,10 @@ public:
     //! \returns The message body as a string
     std::wstring get_body() const
         { return m_bag.read_prop<std::wstring>(0x1000); }
+    //! \brief Get the body of this message, in UTF-8
+    //! \returns The message body as a string
+    std::string get_body_utf8() const
+        { return m_bag.read_prop_utf8(0x1000); }
     //! \brief Get the body of this message
     //! 
     //! The returned stream device can be used to construct a proper stream:
@@ -321,6 +388,24 @@ public:
     //! \brief Get the number of recipients on this message
     //! \returns The number of recipients
     size_t get_recipient_count() const;
+    //! \brief Read a set of properties of this message in one pass
+    //!
+    //! Reading many properties this way costs one walk of the property
+    //! bag, where read_prop costs one lookup each:
+    //! \code
+    //! prop_projection proj;
+    //! proj.add(0x37);
+    //! prop_id keywords = add_named_prop(proj, named_prop(ps_public_strings, L"Keywords"), store.get_name_id_map());
+    //! ...
+    //! prop_record r = m.project(proj);
+    //! if(r.prop_exists(keywords))
+    //!     ...
+    //! \endcode
+    //! \param[in] projection The properties to read
+    //! \returns A record of those of the properties this message has
+    //! \sa property_bag::project
+    prop_record project(const prop_projection& projection) const
+        { return m_bag.project(projection); }
 
     // lower layer access
     //! \brief Get the property bag backing this message
@@ -477,4 +562,15 @@ inline std::wstring pstsdk::message::get_subject() const
     }
 }
 
+inline std::string pstsdk::message::get_subject_utf8() const
+{
+    std::string buffer = m_bag.read_prop_utf8(0x37);
+
+    // the lead byte and the prefix length are each one byte in UTF-8
+    if(buffer.size() && buffer[0] == message_subject_prefix_lead_byte)
+        return buffer.substr(2);
+    else
+        return buffer;
+}
+
 #endif
@@ -17,6 +17,8 @@
 #include <boost/iterator/filter_iterator.hpp>
 #include <boost/iterator/transform_iterator.hpp>
 
+#include "pstsdk/util/parallel.h"
+
 #include "pstsdk/ndb/database.h"
 #include "pstsdk/ndb/database_iface.h"
 #include "pstsdk/ndb/node.h"
@@ -33,6 +35,26 @@ namespace pstsdk
 //! \defgroup pst_pstrelated PST
 //! \ingroup pst
 
+//! \cond parallel_implementation
+//! \brief Opens a message from each node_info, for \ref pst::for_each_message
+template<typename Func>
+class message_opener
+{
+public:
+    message_opener(const shared_db_ptr& db, const Func& f)
+        : m_db(db), m_f(f) { }
+    void operator()(const node_info& info)
+    {
+        message m(node(m_db, info));
+        m_f(m);
+    }
+
+private:
+    shared_db_ptr m_db;
+    Func m_f;
+};
+//! \endcond
+
 //! \brief A PST file
 //!
 //! pst represents a pst file on disk. Both OST and PST files are supported,
@@ -57,8 +79,12 @@ public:
 
     //! \brief Construct a pst object from the specified file
     //! \param[in] filename The pst file to open on disk
-    pst(const std::wstring& filename) 
-        : m_db(open_database(filename)) { }
+    //! \param[in] access How the file should be read
+    //! \param[in] mode How the BBT and NBT are held; \ref index_mode_flat makes
+    //! message_begin/message_end a linear walk of one array
+    //! \param[in] level How much checking to do while reading the file
+    pst(const std::wstring& filename, file_access access = file_access_positional, index_mode mode = index_mode_paged, validation_level level = default_validation_level) 
+        : m_db(open_database(filename, access, mode, level)) { }
 
 #ifndef BOOST_NO_RVALUE_REFERENCES
     //! \brief Move constructor
@@ -86,6 +112,34 @@ public:
     message_iterator message_end() const
         { return boost::make_transform_iterator(boost::make_filter_iterator<is_nid_type<nid_type_message> >(m_db->read_nbt_root()->end(), m_db->read_nbt_root()->end()), message_transform_info(m_db) ); }
 
+    //! \brief Call f on every message in the PST file, from a pool of threads
+    //!
+    //! The NBT is walked once, on the calling thread, and the message nodes
+    //! are handed to the workers in batches; each worker opens its own
+    //! message objects. See \ref parallel_for_each for the threading and
+    //! exception behavior. If the database was made single threaded (see
+    //! \ref db_context::set_single_threaded) everything runs on the calling
+    //! thread instead, as \ref serial_for_each.
+    //! \tparam Func A callable taking a message lvalue; called concurrently
+    //! \param[in] f The callback
+    //! \param[in] options The thread, batch and queue sizes
+    //! \throws unspecified Whatever f threw first
+    //! \returns What each worker did, for throughput reporting
+    template<typename Func>
+    std::vector<worker_stats> for_each_message(Func f, const parallel_options& options = parallel_options()) const
+        { message_opener<Func> opener(m_db, f); return for_each_message_info(opener, options); }
+    //! \brief Call f on the node_info of every message in the PST file, from a pool of threads
+    //!
+    //! As \ref for_each_message, for callers which open the nodes themselves
+    //! (or don't need to open them at all).
+    //! \tparam Func A callable taking a node_info lvalue; called concurrently
+    //! \param[in] f The callback
+    //! \param[in] options The thread, batch and queue sizes
+    //! \throws unspecified Whatever f threw first
+    //! \returns What each worker did, for throughput reporting
+    template<typename Func>
+    std::vector<worker_stats> for_each_message_info(Func f, const parallel_options& options = parallel_options()) const;
+
     //! \brief Opens the root folder of this file
     //! \note This is specific to PST files, as an OST file has a different root folder
     //! \returns The root of the folder hierarchy in this file
@@ -198,6 +252,26 @@ inline pstsdk::name_id_map& pstsdk::pst::get_name_id_map()
     return const_cast<name_id_map&>(const_cast<const pst*>(this)->get_name_id_map());
 }
 
+template<typename Func>
+inline std::vector<pstsdk::worker_stats> pstsdk::pst::for_each_message_info(Func f, const parallel_options& options) const
+{
+    std::tr1::shared_ptr<nbt_page> root = m_db->read_nbt_root();
+
+    // objects of a single threaded context count references without
+    // atomics, so they can't be shared with workers
+    if(m_db->is_single_threaded())
+        return serial_for_each(
+            boost::make_filter_iterator<is_nid_type<nid_type_message> >(root->begin(), root->end()),
+            boost::make_filter_iterator<is_nid_type<nid_type_message> >(root->end(), root->end()),
+            f);
+
+    return parallel_for_each(
+        boost::make_filter_iterator<is_nid_type<nid_type_message> >(root->begin(), root->end()),
+        boost::make_filter_iterator<is_nid_type<nid_type_message> >(root->end(), root->end()),
+        f,
+        options);
+}
+
 inline pstsdk::folder pstsdk::pst::open_folder(const std::wstring& name) const
 {
     folder_iterator iter = std::find_if(folder_begin(), folder_end(), compiler_workarounds::folder_name_equal(name));
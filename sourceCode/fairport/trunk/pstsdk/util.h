@@ -2,9 +2,18 @@
 #ifndef PSTSDK_UTIL_H
 #define PSTSDK_UTIL_H
 
+#include "pstsdk/util/arena.h"
 #include "pstsdk/util/btree.h"
+#include "pstsdk/util/cache.h"
 #include "pstsdk/util/errors.h"
+#include "pstsdk/util/file.h"
+#include "pstsdk/util/mutex.h"
+#include "pstsdk/util/parallel.h"
 #include "pstsdk/util/primitives.h"
+#include "pstsdk/util/refcount.h"
+#include "pstsdk/util/slice.h"
+#include "pstsdk/util/slot_index.h"
+#include "pstsdk/util/unicode.h"
 #include "pstsdk/util/util.h"
 
 #endif
@@ -0,0 +1,267 @@
+//! \file
+//! \brief Arena allocation
+//! \author Terry Mahaffey
+//!
+//! Opening a message allocates a small object graph (nodes, heaps, BTH
+//! nodes, tables) which is thrown away again when the message goes out of
+//! scope. An arena lets a caller take that graph's memory from a few large
+//! chunks instead of one heap allocation per object. Blocks, which the
+//! block cache may keep around, always come from the heap.
+//! \ingroup util
+
+//! \defgroup arena Arena Allocation
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_ARENA_H
+#define PSTSDK_UTIL_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <boost/utility.hpp>
+#include <boost/detail/atomic_count.hpp>
+#ifndef PSTSDK_SINGLE_THREADED
+#include <boost/thread/tss.hpp>
+#endif
+
+namespace pstsdk
+{
+
+//! \brief The default size of the chunks an arena allocates from
+//! \ingroup arena
+const size_t arena_chunk_size = 16 * 1024;
+
+//! \brief What an arena has handed out
+//! \ingroup arena
+struct arena_stats
+{
+    size_t objects;         //!< Number of objects allocated from the arena
+    size_t live_objects;    //!< Number of those not yet deleted
+    size_t bytes;           //!< Bytes handed out, including per object overhead
+    size_t chunks;          //!< Number of chunks taken from the heap
+};
+
+//! \cond arena_implementation
+namespace detail
+{
+
+//! \brief The memory behind an arena
+//!
+//! Reference counted by the arena and by every object allocated from it, so
+//! it outlives whichever goes last. Only the thread with the arena in scope
+//! allocates; objects may be deleted from any thread.
+class arena_pool : private boost::noncopyable
+{
+public:
+    explicit arena_pool(size_t chunk_size)
+        : m_refs(1), m_chunk_size(chunk_size), m_next(NULL), m_end(NULL), m_objects(0), m_bytes(0) { }
+    ~arena_pool();
+
+    void* allocate(size_t size);
+    void add_ref() { ++m_refs; }
+    void release() { if(--m_refs == 0) delete this; }
+
+    arena_stats get_stats() const;
+
+private:
+    boost::detail::atomic_count m_refs;
+    const size_t m_chunk_size;
+    std::vector<char*> m_chunks;
+    char* m_next;           //!< The next free byte of the current chunk
+    char* m_end;            //!< The end of the current chunk
+    size_t m_objects;
+    size_t m_bytes;
+};
+
+//! \brief Precedes every arena_object allocation
+//!
+//! Records the pool the object came from, or NULL if it came from the heap.
+//! Padded so the object after it is aligned for any type.
+union arena_header
+{
+    arena_pool* pool;
+    double align_double;
+    long double align_long_double;
+    void* align_pointer[2];
+};
+
+inline arena_pool*& current_pool()
+{
+#ifndef PSTSDK_SINGLE_THREADED
+    static boost::thread_specific_ptr<arena_pool*> slot;
+    if(slot.get() == NULL)
+        slot.reset(new arena_pool*(NULL));
+    return *slot;
+#else
+    static arena_pool* pool = NULL;
+    return pool;
+#endif
+}
+
+} // end namespace detail
+//! \endcond
+
+//! \brief A pool of memory for short lived object graphs
+//!
+//! While an arena_scope on an arena is alive, objects deriving from
+//! arena_object that are created on that thread are carved out of the
+//! arena's chunks. Deleting such an object doesn't free anything; the chunks
+//! are released together once the arena and every object allocated from it
+//! are gone. Objects are free to outlive the arena itself.
+//!
+//! Use one arena per message, or per batch of messages, and keep the batch
+//! small: memory is never reused within an arena, and an object kept around
+//! (by a caller holding on to one node of a message, say) holds all of its
+//! arena's chunks.
+//! \code
+//! for(...)
+//! {
+//!     arena a;
+//!     arena_scope scope(a);
+//!     message m = ...;
+//! }
+//! \endcode
+//! An arena must only be in scope on one thread at a time.
+//! \ingroup arena
+class arena : private boost::noncopyable
+{
+public:
+    //! \brief Construct an empty arena
+    //! \param[in] chunk_size The size of the chunks to allocate from
+    explicit arena(size_t chunk_size = arena_chunk_size)
+        : m_pool(new detail::arena_pool(chunk_size)) { }
+    //! \brief Release the arena; its memory goes once its objects are gone
+    ~arena()
+        { m_pool->release(); }
+
+    //! \brief Get what this arena has handed out
+    //! \returns The arena statistics
+    arena_stats get_stats() const
+        { return m_pool->get_stats(); }
+
+    friend class arena_scope;
+
+private:
+    detail::arena_pool* m_pool;
+};
+
+//! \brief Makes an arena current on this thread for the scope's lifetime
+//!
+//! Scopes nest; the previous arena (or none) is current again once the
+//! scope ends. A scope must not outlive its arena.
+//! \ingroup arena
+class arena_scope : private boost::noncopyable
+{
+public:
+    //! \brief Make an arena current
+    //! \param[in] a The arena to allocate from
+    explicit arena_scope(arena& a)
+        : m_previous(detail::current_pool()) { detail::current_pool() = a.m_pool; }
+    //! \brief Restore the previous arena
+    ~arena_scope()
+        { detail::current_pool() = m_previous; }
+
+private:
+    detail::arena_pool* m_previous;
+};
+
+//! \brief Base class of objects which may be allocated from an arena
+//!
+//! Objects are allocated from the current arena if there is one, and from
+//! the heap otherwise. Either way they are deleted as usual.
+//! \ingroup arena
+class arena_object
+{
+public:
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
+
+protected:
+    arena_object() { }
+    ~arena_object() { }
+};
+
+} // end namespace pstsdk
+
+inline pstsdk::detail::arena_pool::~arena_pool()
+{
+    for(size_t i = 0; i < m_chunks.size(); ++i)
+        ::operator delete(m_chunks[i]);
+}
+
+inline void* pstsdk::detail::arena_pool::allocate(size_t size)
+{
+    const size_t align = sizeof(arena_header);
+    size = (size + align - 1) / align * align;
+
+    if(static_cast<size_t>(m_end - m_next) < size)
+    {
+        // an oversized object gets a chunk to itself, leaving the current one be
+        if(size > m_chunk_size / 4)
+        {
+            m_chunks.push_back(static_cast<char*>(::operator new(size)));
+            ++m_objects;
+            m_bytes += size;
+            return m_chunks.back();
+        }
+
+        m_chunks.push_back(static_cast<char*>(::operator new(m_chunk_size)));
+        m_next = m_chunks.back();
+        m_end = m_next + m_chunk_size;
+    }
+
+    void* p = m_next;
+    m_next += size;
+    ++m_objects;
+    m_bytes += size;
+
+    return p;
+}
+
+inline pstsdk::arena_stats pstsdk::detail::arena_pool::get_stats() const
+{
+    arena_stats stats;
+    stats.objects = m_objects;
+    // one reference belongs to the arena itself
+    long refs = m_refs;
+    stats.live_objects = refs > 0 ? static_cast<size_t>(refs - 1) : 0;
+    stats.bytes = m_bytes;
+    stats.chunks = m_chunks.size();
+
+    return stats;
+}
+
+inline void* pstsdk::arena_object::operator new(size_t size)
+{
+    detail::arena_pool* pool = detail::current_pool();
+    detail::arena_header* header;
+
+    if(pool)
+    {
+        header = static_cast<detail::arena_header*>(pool->allocate(sizeof(detail::arena_header) + size));
+        pool->add_ref();
+    }
+    else
+    {
+        header = static_cast<detail::arena_header*>(::operator new(sizeof(detail::arena_header) + size));
+    }
+
+    header->pool = pool;
+
+    return header + 1;
+}
+
+inline void pstsdk::arena_object::operator delete(void* p)
+{
+    if(p == NULL)
+        return;
+
+    detail::arena_header* header = static_cast<detail::arena_header*>(p) - 1;
+
+    if(header->pool)
+        header->pool->release();
+    else
+        ::operator delete(header);
+}
+
+#endif
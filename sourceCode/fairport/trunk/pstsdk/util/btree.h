@@ -18,6 +18,10 @@
 
 #include <iterator>
 #include <vector>
+#include <memory>
+#ifdef __GNUC__
+#include <tr1/memory>
+#endif
 #include <boost/iterator/iterator_facade.hpp>
 
 #include "pstsdk/util/primitives.h"
@@ -61,7 +65,7 @@ public:
     //! \throw key_not_found<K> if the requested key is not in this btree
     //! \param[in] key The key to lookup
     //! \returns The associated value
-    virtual const V& lookup(const K& key) const = 0;
+    virtual V lookup(const K& key) const = 0;
     
     //! \brief Returns the key at the specified position
     //!
@@ -137,7 +141,7 @@ public:
     //! \throw key_not_found<K> if the requested key is not in this btree
     //! \param[in] key The key to lookup
     //! \returns The associated value
-    const V& lookup(const K& key) const;
+    V lookup(const K& key) const;
 
     //! \brief Returns the value at the associated position on this leaf node
     //! \param[in] pos The position to retrieve the value for
@@ -174,7 +178,7 @@ public:
     virtual ~btree_node_nonleaf() { }
 
     //! \copydoc btree_node::lookup
-    const V& lookup(const K& key) const;
+    V lookup(const K& key) const;
 
 protected:
     //! \brief Returns the child btree_node at the requested location
@@ -185,6 +189,28 @@ protected:
     //! \param[in] i The position at which to get the child
     //! \returns a non-owning pointer of the child btree_node
     virtual const btree_node<K,V>* get_child(uint i) const = 0;
+    //! \brief Returns the child btree_node at the requested location, keeping it alive
+    //!
+    //! Lookups and iterators use this rather than get_child. Nodes which
+    //! don't own all of their children (for example, when the children live 
+    //! in a bounded cache) override it to hand back an owning reference in
+    //! pin, which the caller holds for as long as it uses the child. The 
+    //! default simply calls get_child.
+    //! \param[in] i The position at which to get the child
+    //! \param[out] pin Receives an owning reference to the child, if needed
+    //! \returns a pointer to the child btree_node, valid while pin is held
+    virtual const btree_node<K,V>* get_pinned_child(uint i, std::tr1::shared_ptr<const void>& pin) const
+        { (void)pin; return get_child(i); }
+    //! \brief Called as a forward iterator steps onto a child
+    //!
+    //! Nodes whose children are expensive to read override this to start
+    //! fetching the children the iterator will visit after this one. The
+    //! default does nothing.
+    //! \param[in] i The position of the child being stepped onto
+    //! \param[in] arriving true if the iterator has just entered this node,
+    //! false if it stepped over from child i-1
+    virtual void read_ahead(uint i, bool arriving) const
+        { (void)i; (void)arriving; }
 
     // iter support
     friend class const_btree_node_iter<K,V>;
@@ -209,6 +235,7 @@ struct btree_iter_impl
 {
     btree_node_leaf<K,V>* m_leaf;   //!< The current leaf btree node this iterator is pointing to
     uint m_leaf_pos;                //!< The current position on that leaf
+    std::tr1::shared_ptr<const void> m_leaf_pin; //!< Keeps m_leaf alive, if its parent doesn't
 
     std::vector<std::pair<btree_node_nonleaf<K,V>*, uint> > m_path; //!< The "path" to this leaf, starting at the root of the btree
     typedef typename std::vector<std::pair<btree_node_nonleaf<K,V>*, uint> >::iterator path_iter;
@@ -289,7 +316,7 @@ int pstsdk::btree_node<K,V>::binary_search(const K& k) const
 }
 
 template<typename K, typename V>
-const V& pstsdk::btree_node_leaf<K,V>::lookup(const K& k) const
+V pstsdk::btree_node_leaf<K,V>::lookup(const K& k) const
 {
     int location = this->binary_search(k);
 
@@ -355,28 +382,30 @@ void pstsdk::btree_node_leaf<K,V>::prev(btree_iter_impl<K,V>& iter) const
 }
 
 template<typename K, typename V>
-const V& pstsdk::btree_node_nonleaf<K,V>::lookup(const K& k) const
+V pstsdk::btree_node_nonleaf<K,V>::lookup(const K& k) const
 {
     int location = this->binary_search(k);
 
     if(location == -1)
         throw key_not_found<K>(k);
 
-    return get_child(location)->lookup(k);
+    std::tr1::shared_ptr<const void> pin;
+    return get_pinned_child(location, pin)->lookup(k);
 }
 
 template<typename K, typename V>
 void pstsdk::btree_node_nonleaf<K,V>::first(btree_iter_impl<K,V>& iter) const
 {
     iter.m_path.push_back(std::make_pair(const_cast<btree_node_nonleaf<K,V>*>(this), 0));
-    get_child(0)->first(iter);
+    read_ahead(0, true);
+    get_pinned_child(0, iter.m_leaf_pin)->first(iter);
 }
 
 template<typename K, typename V>
 void pstsdk::btree_node_nonleaf<K,V>::last(btree_iter_impl<K,V>& iter) const
 {
     iter.m_path.push_back(std::make_pair(const_cast<btree_node_nonleaf<K,V>*>(this), this->num_values()-1));
-    get_child(this->num_values()-1)->last(iter);
+    get_pinned_child(this->num_values()-1, iter.m_leaf_pin)->last(iter);
 }
 
 template<typename K, typename V>
@@ -396,7 +425,8 @@ void pstsdk::btree_node_nonleaf<K,V>::next(btree_iter_impl<K,V>& iter) const
     else
     {
         // call into the next leaf
-        get_child(me.second)->first(iter);
+        read_ahead(me.second, false);
+        get_pinned_child(me.second, iter.m_leaf_pin)->first(iter);
     }
 }
 
@@ -417,7 +447,7 @@ void pstsdk::btree_node_nonleaf<K,V>::prev(btree_iter_impl<K,V>& iter) const
     else
     {
         // call into the next child
-        get_child(--me.second)->last(iter);
+        get_pinned_child(--me.second, iter.m_leaf_pin)->last(iter);
     }
 }
 
@@ -0,0 +1,313 @@
+//! \file
+//! \brief Bounded LRU caches
+//! \author Terry Mahaffey
+//!
+//! Generic least-recently-used caches with a budget expressed in bytes
+//! (or any other caller defined cost). The database uses these to keep
+//! decoded blocks and pages around between reads.
+//! \ingroup util
+
+//! \defgroup cache Caches
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_CACHE_H
+#define PSTSDK_UTIL_CACHE_H
+
+#include <list>
+#include <utility>
+#include <vector>
+#if __GNUC__
+# include <tr1/unordered_map>
+#else
+# include <unordered_map>
+#endif
+#include <boost/utility.hpp>
+
+#include "pstsdk/util/primitives.h"
+#include "pstsdk/util/mutex.h"
+
+namespace pstsdk
+{
+
+//! \brief Counters describing the behavior of a cache
+//! \ingroup cache
+struct cache_stats
+{
+    ulonglong hits;         //!< Lookups which found an entry
+    ulonglong misses;       //!< Lookups which didn't
+    ulonglong evictions;    //!< Entries dropped to stay under budget
+    size_t entries;         //!< Entries currently held
+    size_t cost;            //!< Total cost of the entries currently held
+    size_t budget;          //!< Maximum total cost
+};
+
+//! \brief A thread safe, cost bounded LRU cache
+//!
+//! Each entry is inserted with a cost; once the total cost exceeds the
+//! budget the least recently used entries are evicted. A single entry
+//! which costs more than the whole budget is never cached. A budget of
+//! zero disables the cache.
+//! \tparam K The key type; must be usable with std::tr1::hash
+//! \tparam V The value type; copied in and out of the cache
+//! \ingroup cache
+template<typename K, typename V>
+class lru_cache : private boost::noncopyable
+{
+public:
+    //! \brief Construct a cache
+    //! \param[in] budget The maximum total cost of all entries
+    explicit lru_cache(size_t budget = 0)
+        : m_budget(budget), m_cost(0), m_hits(0), m_misses(0), m_evictions(0) { }
+
+    //! \brief Look for an entry, marking it as most recently used
+    //! \param[in] key The key to look for
+    //! \param[out] value Receives the cached value if found
+    //! \returns true if the entry was found
+    bool lookup(const K& key, V& value);
+    //! \brief Add (or replace) an entry
+    //! \param[in] key The key to cache under
+    //! \param[in] value The value to cache
+    //! \param[in] cost The cost of this entry against the budget
+    void insert(const K& key, const V& value, size_t cost);
+    //! \brief Remove an entry, if present
+    //! \param[in] key The key to remove
+    void erase(const K& key);
+    //! \brief Remove every entry. The counters are not reset.
+    void clear();
+
+    //! \brief Change the budget, evicting as needed
+    //! \param[in] budget The new maximum total cost
+    void set_budget(size_t budget);
+    //! \brief Get a snapshot of the counters of this cache
+    //! \returns The counters
+    cache_stats get_stats() const;
+
+private:
+    struct entry
+    {
+        K key;
+        V value;
+        size_t cost;
+    };
+    typedef std::list<entry> lru_list;
+    typedef std::tr1::unordered_map<K, typename lru_list::iterator> lru_map;
+
+    //! \brief Evict entries until the cost is under budget
+    //! \pre m_lock is held
+    void trim();
+
+    lru_list m_list;        //!< Entries, most recently used first
+    lru_map m_map;          //!< Index into m_list
+    size_t m_budget;
+    size_t m_cost;
+    ulonglong m_hits;
+    ulonglong m_misses;
+    ulonglong m_evictions;
+    mutable mutex m_lock;
+};
+
+//! \brief An LRU cache split into independently locked shards
+//!
+//! Keys are spread across Shards lru_caches, each with an even share of the
+//! budget, so concurrent readers touching different keys rarely contend
+//! for the same lock. Eviction order is only LRU within a shard.
+//!
+//! Each shard's share is the budget divided by Shards, rounded up, so any
+//! nonzero budget caches something. A single entry which costs more than
+//! one shard's share is never cached.
+//! \tparam K The key type; must be usable with std::tr1::hash
+//! \tparam V The value type
+//! \tparam Shards The number of shards
+//! \ingroup cache
+template<typename K, typename V, uint Shards = 16>
+class sharded_cache : private boost::noncopyable
+{
+public:
+    //! \brief Construct a cache
+    //! \param[in] budget The maximum total cost of all entries, across all shards
+    explicit sharded_cache(size_t budget = 0)
+        { set_budget(budget); }
+
+    //! \copydoc lru_cache::lookup
+    bool lookup(const K& key, V& value)
+        { return shard(key).lookup(key, value); }
+    //! \copydoc lru_cache::insert
+    void insert(const K& key, const V& value, size_t cost)
+        { shard(key).insert(key, value, cost); }
+    //! \copydoc lru_cache::erase
+    void erase(const K& key)
+        { shard(key).erase(key); }
+    //! \copydoc lru_cache::clear
+    void clear();
+
+    //! \brief Set the total budget, split evenly across the shards
+    //! \param[in] budget The maximum total cost, rounded up to a multiple of Shards; 0 disables the cache
+    void set_budget(size_t budget);
+    //! \brief Get a snapshot of the counters, summed across all shards
+    //! \returns The counters
+    cache_stats get_stats() const;
+
+private:
+    lru_cache<K,V>& shard(const K& key);
+
+    lru_cache<K,V> m_shards[Shards];
+};
+
+} // end namespace pstsdk
+
+template<typename K, typename V>
+inline bool pstsdk::lru_cache<K,V>::lookup(const K& key, V& value)
+{
+    lock_guard lock(m_lock);
+
+    typename lru_map::iterator iter = m_map.find(key);
+
+    if(iter == m_map.end())
+    {
+        ++m_misses;
+        return false;
+    }
+
+    // move to the front
+    m_list.splice(m_list.begin(), m_list, iter->second);
+
+    value = iter->second->value;
+    ++m_hits;
+
+    return true;
+}
+
+template<typename K, typename V>
+inline void pstsdk::lru_cache<K,V>::insert(const K& key, const V& value, size_t cost)
+{
+    lock_guard lock(m_lock);
+
+    typename lru_map::iterator iter = m_map.find(key);
+
+    if(iter != m_map.end())
+    {
+        m_cost -= iter->second->cost;
+        m_list.erase(iter->second);
+        m_map.erase(iter);
+    }
+
+    if(cost > m_budget)
+        return;
+
+    entry e = { key, value, cost };
+    m_list.push_front(e);
+    m_map[key] = m_list.begin();
+    m_cost += cost;
+
+    trim();
+}
+
+template<typename K, typename V>
+inline void pstsdk::lru_cache<K,V>::erase(const K& key)
+{
+    lock_guard lock(m_lock);
+
+    typename lru_map::iterator iter = m_map.find(key);
+
+    if(iter != m_map.end())
+    {
+        m_cost -= iter->second->cost;
+        m_list.erase(iter->second);
+        m_map.erase(iter);
+    }
+}
+
+template<typename K, typename V>
+inline void pstsdk::lru_cache<K,V>::clear()
+{
+    lock_guard lock(m_lock);
+
+    m_list.clear();
+    m_map.clear();
+    m_cost = 0;
+}
+
+template<typename K, typename V>
+inline void pstsdk::lru_cache<K,V>::set_budget(size_t budget)
+{
+    lock_guard lock(m_lock);
+
+    m_budget = budget;
+    trim();
+}
+
+template<typename K, typename V>
+inline pstsdk::cache_stats pstsdk::lru_cache<K,V>::get_stats() const
+{
+    lock_guard lock(m_lock);
+
+    cache_stats stats = { m_hits, m_misses, m_evictions, m_map.size(), m_cost, m_budget };
+    return stats;
+}
+
+template<typename K, typename V>
+inline void pstsdk::lru_cache<K,V>::trim()
+{
+    while(m_cost > m_budget)
+    {
+        const entry& victim = m_list.back();
+
+        m_cost -= victim.cost;
+        m_map.erase(victim.key);
+        m_list.pop_back();
+        ++m_evictions;
+    }
+}
+
+template<typename K, typename V, pstsdk::uint Shards>
+inline void pstsdk::sharded_cache<K,V,Shards>::clear()
+{
+    for(uint i = 0; i < Shards; ++i)
+        m_shards[i].clear();
+}
+
+template<typename K, typename V, pstsdk::uint Shards>
+inline void pstsdk::sharded_cache<K,V,Shards>::set_budget(size_t budget)
+{
+    // round up, so a small nonzero budget leaves every shard able to hold
+    // something rather than disabling the cache
+    size_t share = budget / Shards + (budget % Shards != 0 ? 1 : 0);
+
+    for(uint i = 0; i < Shards; ++i)
+        m_shards[i].set_budget(share);
+}
+
+template<typename K, typename V, pstsdk::uint Shards>
+inline pstsdk::cache_stats pstsdk::sharded_cache<K,V,Shards>::get_stats() const
+{
+    cache_stats total = { 0, 0, 0, 0, 0, 0 };
+
+    for(uint i = 0; i < Shards; ++i)
+    {
+        cache_stats stats = m_shards[i].get_stats();
+
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.evictions += stats.evictions;
+        total.entries += stats.entries;
+        total.cost += stats.cost;
+        total.budget += stats.budget;
+    }
+
+    return total;
+}
+
+template<typename K, typename V, pstsdk::uint Shards>
+inline pstsdk::lru_cache<K,V>& pstsdk::sharded_cache<K,V,Shards>::shard(const K& key)
+{
+    // ids in the PST tend to share low bits (bids step by 4, nids carry a
+    // type in the low 5 bits), so mix before picking a shard
+    size_t h = std::tr1::hash<K>()(key);
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+
+    return m_shards[h % Shards];
+}
+
+#endif
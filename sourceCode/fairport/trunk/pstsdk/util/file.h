@@ -0,0 +1,534 @@
+//! \file
+//! \brief File access
+//! \author Terry Mahaffey
+//!
+//! A file which can be read through stdio, at explicit offsets, or out of
+//! a memory mapping, from several threads at once.
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_FILE_H
+#define PSTSDK_UTIL_FILE_H
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/utility.hpp>
+
+#ifndef PSTSDK_SINGLE_THREADED
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#endif
+
+#if defined(_WIN32) || defined(__MINGW32__)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include "pstsdk/util/errors.h"
+#include "pstsdk/util/mutex.h"
+#include "pstsdk/util/primitives.h"
+
+namespace pstsdk
+{
+
+//! \brief The strategy a file object uses to service reads
+//! \ingroup util
+enum file_access
+{
+    file_access_stdio,      //!< Seek and read through the C runtime, copying into the caller's buffer
+    file_access_mmap,       //!< Map the whole file into memory and read directly out of the mapping; a file too large for the address space is read through stdio instead
+    file_access_positional  //!< Read at an explicit offset (pread, or ReadFile with an OVERLAPPED offset); no shared file position
+};
+
+//! \brief How a file object acts on \ref file::prefetch hints
+//! \ingroup util
+enum file_prefetch
+{
+    file_prefetch_none,     //!< Ignore them
+    file_prefetch_advise,   //!< Pass them to the OS (posix_fadvise, or madvise on a mapping), which reads ahead asynchronously; falls back to file_prefetch_thread where there is no such call
+    file_prefetch_thread    //!< Read the ranges on a helper thread, warming the OS cache ahead of the real reads
+};
+
+class file;
+
+//! \cond prefetch_implementation
+#ifndef PSTSDK_SINGLE_THREADED
+//! \brief The helper thread behind \ref file_prefetch_thread
+//!
+//! Reads each posted range once and throws the data away. Ranges posted
+//! while the backlog is full are dropped; they are only hints.
+class file_readahead : private boost::noncopyable
+{
+public:
+    explicit file_readahead(const file& f)
+        : m_file(f), m_stop(false), m_thread(&file_readahead::run, this) { }
+    ~file_readahead();
+
+    void post(ulonglong offset, size_t size);
+
+private:
+    void run();
+
+    static const size_t max_pending = 64;
+
+    const file& m_file;
+    std::deque<std::pair<ulonglong, size_t> > m_pending;
+    bool m_stop;
+    boost::mutex m_mutex;
+    boost::condition_variable m_wake;
+    boost::thread m_thread;     //!< Declared last, so it starts after everything it uses
+};
+#endif
+//! \endcond
+
+//! \brief A generic class to read and write to a file
+//!
+//! This was necessary to get around the 32 bit limit (4GB) file size
+//! limitation in ANSI C++. I needed to use compiler specific work arounds,
+//! and that logic is centralized here.
+//!
+//! A file can optionally be memory mapped (\ref file_access_mmap), in which
+//! case view() hands out pointers straight into the mapping rather than
+//! copying into a buffer.
+//!
+//! read() and view() are safe to call from multiple threads at once in
+//! every access mode. The mapped and positional modes don't share a file
+//! position and so never block each other; the stdio mode serializes
+//! seek+read under a lock.
+//! \ingroup util
+class file : private boost::noncopyable
+{
+public:
+    //! \brief Construct a file object from the given filename
+    //! \throw runtime_error if an error occurs opening or mapping the file
+    //! \param[in] filename The file to open
+    //! \param[in] access How reads against this file should be serviced
+    file(const std::wstring& filename, file_access access = file_access_positional);
+    
+    //! \brief Close the file
+    ~file();
+
+    //! \brief Read from the file
+    //! \throw out_of_range if the requested location or location+size is past EOF
+    //! \param[in,out] buffer The buffer to store the data in. The size of this vector is the amount of data to read.
+    //! \param[in] offset The location on disk to read the data from.
+    //! \returns The amount of data read
+    size_t read(std::vector<byte>& buffer, ulonglong offset) const;
+
+    //! \brief Get a pointer to a range of the file
+    //!
+    //! If the file is mapped, this is a pointer directly into the mapping
+    //! and scratch is left untouched. Otherwise the data is read into scratch
+    //! and a pointer to the start of scratch is returned. The pointer is valid
+    //! for as long as both this object and scratch are.
+    //! \throw out_of_range if the requested location or location+size is past EOF
+    //! \param[in] offset The location on disk of the data
+    //! \param[in] size The amount of data requested
+    //! \param[in,out] scratch Storage to read into if the file is not mapped
+    //! \returns A pointer to size bytes of file data, or NULL if size is zero
+    const byte* view(ulonglong offset, size_t size, std::vector<byte>& scratch) const;
+
+    //! \brief Is this file being read from a memory mapping?
+    //! \returns true if reads are serviced from a mapping
+    bool is_mapped() const
+        { return m_pmap != NULL; }
+
+    //! \brief Get the access mode this file was opened with
+    //! \returns The access mode
+    file_access get_access() const
+        { return m_access; }
+
+    //! \brief Hint that a range of the file will be read soon
+    //!
+    //! Never blocks on I/O and never throws; ranges past EOF are ignored.
+    //! What happens depends on \ref set_prefetch.
+    //! \param[in] offset The location on disk of the data
+    //! \param[in] size The amount of data which will be read
+    void prefetch(ulonglong offset, size_t size) const;
+    //! \brief Change how \ref prefetch hints are acted on
+    //! \param[in] method The new prefetch method
+    void set_prefetch(file_prefetch method);
+    //! \brief Get how \ref prefetch hints are acted on
+    //! \returns The prefetch method
+    file_prefetch get_prefetch() const
+        { return m_prefetch; }
+
+//! \cond write_api
+
+    //! \brief Write to the file
+    //! \throw out_of_range if the requested location or location+size is past EOF
+    //! \param[in] buffer The data to write. The size of this vector is the amount of data to write.
+    //! \param[in] offset The location on disk to read the data from.
+    //! \returns The amount of data written
+    size_t write(const std::vector<byte>& buffer, ulonglong offset);
+//! \endcond
+
+private:
+    //! \brief Map the entire file into memory
+    //! \throw runtime_error if the platform refuses to map the file
+    void map();
+    //! \brief Release the mapping, if any
+    void unmap();
+
+    std::wstring m_filename;    //!< The filename used to open this file
+    file_access m_access;       //!< How reads are serviced
+    FILE * m_pfile;             //!< The file pointer
+    mutable mutex m_position_lock; //!< Guards the FILE position in \ref file_access_stdio mode
+    byte* m_pmap;               //!< Start of the mapped view, or NULL if not mapped
+    ulonglong m_map_size;       //!< Size of the mapped view
+#if defined(_WIN32) || defined(__MINGW32__)
+    HANDLE m_hmapping;          //!< The file mapping object backing m_pmap
+#endif
+    file_prefetch m_prefetch;   //!< How prefetch hints are acted on
+#ifndef PSTSDK_SINGLE_THREADED
+    mutable mutex m_readahead_lock; //!< Guards creation of m_readahead
+    mutable file_readahead* m_readahead; //!< The \ref file_prefetch_thread helper, started on first use
+#endif
+};
+
+} // end pstsdk namespace
+
+inline pstsdk::file::file(const std::wstring& filename, file_access access)
+: m_filename(filename), m_access(access), m_pmap(NULL), m_map_size(0)
+#if defined(_WIN32) || defined(__MINGW32__)
+, m_hmapping(NULL)
+#endif
+, m_prefetch(file_prefetch_advise)
+#ifndef PSTSDK_SINGLE_THREADED
+, m_readahead(NULL)
+#endif
+{
+    const char* mode = "rb";
+
+#ifdef _MSC_VER 
+    errno_t err = fopen_s(&m_pfile, std::string(filename.begin(), filename.end()).c_str(), mode);
+    if(err != 0)
+        m_pfile = NULL;
+#else
+    m_pfile = fopen(std::string(filename.begin(), filename.end()).c_str(), mode);
+#endif
+    if(m_pfile == NULL)
+        throw std::runtime_error("fopen failed");
+
+    if(access == file_access_mmap)
+    {
+        try
+        {
+            map();
+        }
+        catch(...)
+        {
+            fclose(m_pfile);
+            throw;
+        }
+    }
+}
+
+inline pstsdk::file::~file()
+{
+#ifndef PSTSDK_SINGLE_THREADED
+    // the helper reads through this object; stop it first
+    delete m_readahead;
+#endif
+    unmap();
+    fflush(m_pfile);
+    fclose(m_pfile);
+}
+
+inline void pstsdk::file::map()
+{
+#if defined(_WIN32) || defined(__MINGW32__)
+    HANDLE hfile = (HANDLE)_get_osfhandle(_fileno(m_pfile));
+    LARGE_INTEGER size;
+
+    if(hfile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hfile, &size))
+        throw std::runtime_error("GetFileSizeEx failed");
+
+    // an empty file can't be mapped, and one larger than the address space
+    // can't be mapped whole; reads of either fall through to stdio
+    if(size.QuadPart == 0 || (ulonglong)size.QuadPart > (std::numeric_limits<size_t>::max)())
+        return;
+
+    m_hmapping = CreateFileMapping(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(m_hmapping == NULL)
+        throw std::runtime_error("CreateFileMapping failed");
+
+    m_pmap = (byte*)MapViewOfFile(m_hmapping, FILE_MAP_READ, 0, 0, 0);
+    if(m_pmap == NULL)
+    {
+        CloseHandle(m_hmapping);
+        m_hmapping = NULL;
+        throw std::runtime_error("MapViewOfFile failed");
+    }
+
+    m_map_size = size.QuadPart;
+#else
+    struct stat st;
+
+    if(fstat(fileno(m_pfile), &st) != 0)
+        throw std::runtime_error("fstat failed");
+
+    // an empty file can't be mapped, and one larger than the address space
+    // can't be mapped whole; reads of either fall through to stdio
+    if(st.st_size == 0 || (ulonglong)st.st_size > (std::numeric_limits<size_t>::max)())
+        return;
+
+    void* pmap = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(m_pfile), 0);
+    if(pmap == MAP_FAILED)
+        throw std::runtime_error("mmap failed");
+
+    m_pmap = (byte*)pmap;
+    m_map_size = st.st_size;
+#endif
+}
+
+inline void pstsdk::file::unmap()
+{
+    if(m_pmap == NULL)
+        return;
+
+#if defined(_WIN32) || defined(__MINGW32__)
+    UnmapViewOfFile(m_pmap);
+    CloseHandle(m_hmapping);
+    m_hmapping = NULL;
+#else
+    munmap(m_pmap, (size_t)m_map_size);
+#endif
+
+    m_pmap = NULL;
+    m_map_size = 0;
+}
+
+inline const pstsdk::byte* pstsdk::file::view(ulonglong offset, size_t size, std::vector<byte>& scratch) const
+{
+    if(size == 0)
+        return NULL;
+
+    if(m_pmap != NULL)
+    {
+        if(offset > m_map_size || size > m_map_size - offset)
+            throw std::out_of_range("view past eof");
+
+        return m_pmap + offset;
+    }
+
+    scratch.resize(size);
+    read(scratch, offset);
+
+    return &scratch[0];
+}
+
+inline size_t pstsdk::file::read(std::vector<byte>& buffer, ulonglong offset) const
+{
+    if(buffer.empty())
+        return 0;
+
+    if(m_pmap != NULL)
+    {
+        if(offset > m_map_size || buffer.size() > m_map_size - offset)
+            throw std::out_of_range("read past eof");
+
+        memcpy(&buffer[0], m_pmap + offset, buffer.size());
+        return buffer.size();
+    }
+
+    if(m_access == file_access_positional)
+    {
+        size_t read = 0;
+
+        while(read < buffer.size())
+        {
+#if defined(_WIN32) || defined(__MINGW32__)
+            HANDLE hfile = (HANDLE)_get_osfhandle(_fileno(m_pfile));
+            ulonglong pos = offset + read;
+            OVERLAPPED ov;
+            DWORD count = 0;
+
+            memset(&ov, 0, sizeof(ov));
+            ov.Offset = (DWORD)pos;
+            ov.OffsetHigh = (DWORD)(pos >> 32);
+
+            if(!ReadFile(hfile, &buffer[read], (DWORD)(buffer.size() - read), &count, &ov) || count == 0)
+                throw std::out_of_range("ReadFile failed");
+#else
+            ssize_t count = pread(fileno(m_pfile), &buffer[read], buffer.size() - read, (off_t)(offset + read));
+
+            if(count <= 0)
+                throw std::out_of_range("pread failed");
+#endif
+            read += count;
+        }
+
+        return read;
+    }
+
+    lock_guard lock(m_position_lock);
+
+#ifdef _MSC_VER
+    if(_fseeki64(m_pfile, offset, SEEK_SET) != 0)
+#else
+    if(fseek(m_pfile, offset, SEEK_SET) != 0)
+#endif
+    {
+        throw std::out_of_range("fseek failed");
+    }
+
+    size_t read = fread(&buffer[0], 1, buffer.size(), m_pfile);
+
+    if(read != buffer.size())
+        throw std::out_of_range("fread failed");
+
+    return read;
+}
+
+inline void pstsdk::file::set_prefetch(file_prefetch method)
+{
+    m_prefetch = method;
+}
+
+inline void pstsdk::file::prefetch(ulonglong offset, size_t size) const
+{
+    file_prefetch method = m_prefetch;
+
+    if(method == file_prefetch_none || size == 0)
+        return;
+
+    if(method == file_prefetch_advise)
+    {
+#if !defined(_WIN32) && !defined(__MINGW32__)
+        if(m_pmap != NULL)
+        {
+            if(offset >= m_map_size)
+                return;
+            if(size > m_map_size - offset)
+                size = (size_t)(m_map_size - offset);
+
+            // madvise wants a page aligned start
+            ulonglong page_mask = (ulonglong)sysconf(_SC_PAGESIZE) - 1;
+            ulonglong start = offset & ~page_mask;
+
+            (void)madvise(m_pmap + start, (size_t)(offset + size - start), MADV_WILLNEED);
+            return;
+        }
+#if defined(POSIX_FADV_WILLNEED)
+        (void)posix_fadvise(fileno(m_pfile), (off_t)offset, (off_t)size, POSIX_FADV_WILLNEED);
+        return;
+#endif
+#endif
+        // no advisory call on this platform
+        method = file_prefetch_thread;
+    }
+
+#ifndef PSTSDK_SINGLE_THREADED
+    file_readahead* preadahead;
+    {
+        lock_guard lock(m_readahead_lock);
+        if(m_readahead == NULL)
+            m_readahead = new file_readahead(*this);
+        preadahead = m_readahead;
+    }
+
+    preadahead->post(offset, size);
+#else
+    (void)offset;
+#endif
+}
+
+#ifndef PSTSDK_SINGLE_THREADED
+inline pstsdk::file_readahead::~file_readahead()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_stop = true;
+        m_wake.notify_one();
+    }
+
+    m_thread.join();
+}
+
+inline void pstsdk::file_readahead::post(ulonglong offset, size_t size)
+{
+    boost::lock_guard<boost::mutex> lock(m_mutex);
+
+    if(m_pending.size() >= max_pending)
+        return;
+
+    m_pending.push_back(std::make_pair(offset, size));
+    m_wake.notify_one();
+}
+
+inline void pstsdk::file_readahead::run()
+{
+    std::vector<byte> scratch;
+
+    for(;;)
+    {
+        std::pair<ulonglong, size_t> range;
+        {
+            boost::unique_lock<boost::mutex> lock(m_mutex);
+
+            while(m_pending.empty() && !m_stop)
+                m_wake.wait(lock);
+
+            if(m_stop)
+                return;
+
+            range = m_pending.front();
+            m_pending.pop_front();
+        }
+
+        try
+        {
+            const byte* pdata = m_file.view(range.first, range.second, scratch);
+
+            // a mapping hands back a pointer without reading anything, so
+            // touch every page of it
+            volatile byte sink = 0;
+            for(size_t i = 0; i < range.second; i += 4096)
+                sink ^= pdata[i];
+        }
+        catch(std::exception&)
+        {
+            // only a hint; the real read will report the problem
+        }
+    }
+}
+#endif
+
+//! \cond write_api
+inline size_t pstsdk::file::write(const std::vector<byte>& buffer, ulonglong offset)
+{
+    lock_guard lock(m_position_lock);
+
+#ifdef _MSC_VER
+    if(_fseeki64(m_pfile, offset, SEEK_SET) != 0)
+#else
+    if(fseek(m_pfile, offset, SEEK_SET) != 0)
+#endif
+    {
+        throw std::out_of_range("fseek failed");
+    }
+
+    size_t write = fwrite(&buffer[0], 1, buffer.size(), m_pfile);
+
+    if(write != buffer.size())
+        throw std::out_of_range("fwrite failed");
+
+    return write;
+}
+//! \endcond
+
+#endif
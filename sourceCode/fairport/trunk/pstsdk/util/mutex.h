@@ -0,0 +1,75 @@
+//! \file
+//! \brief Mutex wrapper
+//! \author Terry Mahaffey
+//!
+//! A mutex which compiles away when the library is built single threaded.
+//! Used by the database, page and block code to guard shared state.
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_MUTEX_H
+#define PSTSDK_UTIL_MUTEX_H
+
+#include <boost/utility.hpp>
+#ifndef PSTSDK_SINGLE_THREADED
+#include <boost/thread/mutex.hpp>
+#endif
+
+namespace pstsdk
+{
+
+//! \brief A mutex guarding state shared between threads
+//!
+//! A thin wrapper around boost::mutex. Defining PSTSDK_SINGLE_THREADED
+//! turns it into a no-op and removes the dependency on Boost.Thread.
+//!
+//! Copying a mutex produces a new, unlocked mutex, so classes holding one
+//! can keep their compiler generated copy constructors.
+//! \ingroup util
+class mutex
+{
+public:
+    mutex() { }
+    mutex(const mutex&) { }
+    mutex& operator=(const mutex&) { return *this; }
+
+    //! \brief Acquire the mutex, blocking if needed
+    void lock()
+#ifndef PSTSDK_SINGLE_THREADED
+        { m_mutex.lock(); }
+#else
+        { }
+#endif
+    //! \brief Release the mutex
+    void unlock()
+#ifndef PSTSDK_SINGLE_THREADED
+        { m_mutex.unlock(); }
+#else
+        { }
+#endif
+
+private:
+#ifndef PSTSDK_SINGLE_THREADED
+    boost::mutex m_mutex;
+#endif
+};
+
+//! \brief Holds a mutex for the lifetime of this object
+//! \ingroup util
+class lock_guard : private boost::noncopyable
+{
+public:
+    //! \brief Acquire the given mutex
+    //! \param[in] m The mutex to hold
+    explicit lock_guard(mutex& m)
+        : m_mutex(m) { m_mutex.lock(); }
+    //! \brief Release the mutex
+    ~lock_guard()
+        { m_mutex.unlock(); }
+
+private:
+    mutex& m_mutex;
+};
+
+} // end pstsdk namespace
+
+#endif
@@ -0,0 +1,552 @@
+//! \file
+//! \brief Parallel traversal
+//! \author Terry Mahaffey
+//!
+//! A small helper for running a callback over a sequence from several
+//! threads. The calling thread walks the sequence and hands out batches of
+//! items through a bounded queue; a pool of workers takes batches as they
+//! become free, so a slow item only ever holds up its own worker.
+//!
+//! Also a long lived pool of threads, for callers which have a handful of
+//! tasks at a time (decoding the blocks of one large read, say) and can't
+//! afford to start threads for each handful.
+//! \ingroup util
+
+//! \defgroup parallel Parallel Traversal
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_PARALLEL_H
+#define PSTSDK_UTIL_PARALLEL_H
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <iterator>
+#include <vector>
+#include <boost/utility.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#ifndef PSTSDK_SINGLE_THREADED
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#endif
+
+#include "pstsdk/util/primitives.h"
+
+namespace pstsdk
+{
+
+//! \brief Settings for \ref parallel_for_each
+//! \ingroup parallel
+struct parallel_options
+{
+    parallel_options()
+        : threads(0), batch_size(64), max_batches(0) { }
+
+    uint threads;           //!< Number of worker threads; 0 picks one per hardware thread
+    size_t batch_size;      //!< Number of items handed to a worker at a time
+    size_t max_batches;     //!< Most batches queued and not yet taken; 0 picks two per worker
+};
+
+//! \brief What one worker of a \ref parallel_for_each did
+//! \ingroup parallel
+struct worker_stats
+{
+    uint thread;            //!< Index of the worker, from 0
+    ulonglong items;        //!< Number of items processed
+    double seconds;         //!< Time spent inside the callback
+
+    //! \brief Items processed per second of callback time
+    //! \returns The throughput of this worker, or 0 if it did nothing
+    double rate() const
+        { return seconds > 0 ? items / seconds : 0; }
+};
+
+//! \brief Call f on every item of [begin, end) from a pool of threads
+//!
+//! The calling thread walks the range (so Iterator needs only be an input
+//! iterator, and is never touched by more than one thread) and queues the
+//! items in batches. At most options.max_batches batches are queued at
+//! once, bounding the memory held by items not yet processed.
+//!
+//! f is taken by value, like std::for_each; the one copy is shared by every
+//! worker and called concurrently, with an lvalue of the iterator's value
+//! type. A callback keeping results should refer to them rather than hold
+//! them. If f throws, no further batches are handed out, the workers finish
+//! the batch they hold, and the first exception is rethrown from here.
+//!
+//! With PSTSDK_SINGLE_THREADED defined everything runs on the calling thread.
+//! \tparam Iterator An input iterator type
+//! \tparam Func A callable taking the iterator's value type
+//! \param[in] begin The start of the range
+//! \param[in] end The end of the range
+//! \param[in] f The callback
+//! \param[in] options The thread, batch and queue sizes
+//! \throws unspecified Whatever f threw first
+//! \returns What each worker did, indexed by worker
+//! \ingroup parallel
+template<typename Iterator, typename Func>
+std::vector<worker_stats> parallel_for_each(Iterator begin, Iterator end, Func f, const parallel_options& options = parallel_options());
+
+//! \brief Call f on every item of [begin, end) on the calling thread
+//!
+//! What \ref parallel_for_each does with PSTSDK_SINGLE_THREADED defined,
+//! for callers which must not use other threads. The exception behavior is
+//! the same, and the one worker reported is the calling thread.
+//! \tparam Iterator An input iterator type
+//! \tparam Func A callable taking the iterator's value type
+//! \param[in] begin The start of the range
+//! \param[in] end The end of the range
+//! \param[in] f The callback
+//! \throws unspecified Whatever f threw
+//! \returns What the calling thread did
+//! \ingroup parallel
+template<typename Iterator, typename Func>
+std::vector<worker_stats> serial_for_each(Iterator begin, Iterator end, Func f);
+
+//! \brief A unit of work for a \ref task_pool
+//! \ingroup parallel
+class pool_task
+{
+public:
+    virtual ~pool_task() { }
+    //! \brief Do the work; called once, from any thread
+    virtual void run() = 0;
+};
+
+//! \cond parallel_implementation
+namespace detail
+{
+//! \brief The tasks of one call to task_pool::run
+struct task_group
+{
+    explicit task_group(const std::vector<pool_task*>& tasks)
+        : tasks(tasks), next(0), finished(0), failed(false) { }
+
+    const std::vector<pool_task*>& tasks;
+    size_t next;            //!< The next task to hand out
+    size_t finished;        //!< Number of tasks done
+    bool failed;
+    std::exception_ptr error; //!< What the first failed task threw
+};
+} // end namespace detail
+//! \endcond
+
+//! \brief A fixed set of threads running groups of tasks
+//!
+//! One pool is meant to be shared by everything in a process wanting
+//! parallelism in small doses, so the number of threads stays fixed however
+//! many callers there are. The thread calling run works on its own tasks
+//! too, so a call always makes progress, even when every pool thread is
+//! busy or itself blocked in run.
+//!
+//! With PSTSDK_SINGLE_THREADED defined the pool has no threads and run
+//! does everything on the calling thread.
+//! \ingroup parallel
+class task_pool : private boost::noncopyable
+{
+public:
+    //! \brief Start the pool's threads
+    //! \param[in] threads Number of threads; 0 picks one per hardware thread
+    explicit task_pool(uint threads = 0);
+    //! \brief Stop the pool's threads
+    //! \pre No call to run is in progress
+    ~task_pool();
+
+    //! \brief Get the number of threads in this pool
+    //! \returns The number of threads, not counting callers of run
+    uint get_thread_count() const
+        { return m_thread_count; }
+
+    //! \brief Run every task, returning once all have finished
+    //!
+    //! Tasks run in no particular order, on the pool's threads and on the
+    //! calling thread. If tasks throw, the rest still run, and the first
+    //! exception is rethrown from here.
+    //! \param[in] tasks The tasks, which must stay alive until run returns
+    //! \throws unspecified Whatever the first failed task threw
+    void run(const std::vector<pool_task*>& tasks);
+
+private:
+#ifndef PSTSDK_SINGLE_THREADED
+    //! \brief Runs work() on a pool thread
+    struct thread_body
+    {
+        explicit thread_body(task_pool* ppool) : m_ppool(ppool) { }
+        void operator()() { m_ppool->work(); }
+        task_pool* m_ppool;
+    };
+
+    //! \brief The body of each pool thread
+    void work();
+    //! \brief Run the next task of a group, with m_mutex held by lock
+    //! \pre group.next < group.tasks.size()
+    void run_next(detail::task_group& group, boost::unique_lock<boost::mutex>& lock);
+
+    boost::mutex m_mutex;
+    boost::condition_variable m_work;       //!< Signalled when a group is queued, or the pool stops
+    boost::condition_variable m_done;       //!< Signalled when a group's last task finishes
+    std::deque<detail::task_group*> m_groups; //!< Groups with tasks not yet handed out
+    bool m_stopping;
+    boost::thread_group m_threads;
+#endif
+    uint m_thread_count;
+};
+
+//! \cond parallel_implementation
+namespace detail
+{
+
+inline double seconds_since(const boost::posix_time::ptime& start)
+{
+    return (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1e6;
+}
+
+#ifndef PSTSDK_SINGLE_THREADED
+//! \brief The bounded queue of batches between the walker and the workers
+template<typename T>
+class batch_queue : private boost::noncopyable
+{
+public:
+    explicit batch_queue(size_t capacity)
+        : m_capacity(capacity), m_closed(false), m_failed(false) { }
+
+    //! \brief Queue a batch, waiting for room; the batch is left empty
+    //! \returns false if a worker has failed and the walk should stop
+    bool push(std::vector<T>& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        while(m_batches.size() >= m_capacity && !m_failed)
+            m_not_full.wait(lock);
+
+        if(m_failed)
+            return false;
+
+        m_batches.push_back(std::vector<T>());
+        m_batches.back().swap(batch);
+        m_not_empty.notify_one();
+
+        return true;
+    }
+
+    //! \brief Take a batch, waiting for one
+    //! \returns false once the queue is closed and drained, or has failed
+    bool pop(std::vector<T>& batch)
+    {
+        boost::unique_lock<boost::mutex> lock(m_mutex);
+
+        while(m_batches.empty() && !m_closed && !m_failed)
+            m_not_empty.wait(lock);
+
+        if(m_failed || m_batches.empty())
+            return false;
+
+        batch.swap(m_batches.front());
+        m_batches.pop_front();
+        m_not_full.notify_one();
+
+        return true;
+    }
+
+    //! \brief No more batches are coming
+    void close()
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+    }
+
+    //! \brief Stop the traversal, remembering the first exception given
+    void fail(const std::exception_ptr& error)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        if(!m_failed)
+            m_error = error;
+        m_failed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+
+    bool failed(std::exception_ptr& error)
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        error = m_error;
+        return m_failed;
+    }
+
+private:
+    const size_t m_capacity;
+    std::deque<std::vector<T> > m_batches;
+    bool m_closed;
+    bool m_failed;
+    std::exception_ptr m_error;
+    boost::mutex m_mutex;
+    boost::condition_variable m_not_empty;
+    boost::condition_variable m_not_full;
+};
+
+//! \brief The body of one worker thread
+template<typename T, typename Func>
+class batch_worker
+{
+public:
+    batch_worker(batch_queue<T>& queue, Func& f, worker_stats& stats)
+        : m_queue(queue), m_f(f), m_stats(stats) { }
+
+    void operator()()
+    {
+        std::vector<T> batch;
+
+        try
+        {
+            while(m_queue.pop(batch))
+            {
+                boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+                for(size_t i = 0; i < batch.size(); ++i)
+                {
+                    m_f(batch[i]);
+                    ++m_stats.items;
+                }
+
+                m_stats.seconds += seconds_since(start);
+            }
+        }
+        catch(...)
+        {
+            m_queue.fail(std::current_exception());
+        }
+    }
+
+private:
+    batch_queue<T>& m_queue;
+    Func& m_f;
+    worker_stats& m_stats;
+};
+#endif
+
+} // end namespace detail
+//! \endcond
+
+} // end namespace pstsdk
+
+template<typename Iterator, typename Func>
+inline std::vector<pstsdk::worker_stats> pstsdk::parallel_for_each(Iterator begin, Iterator end, Func f, const parallel_options& options)
+{
+    size_t batch_size = options.batch_size ? options.batch_size : 1;
+
+#ifndef PSTSDK_SINGLE_THREADED
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+
+    uint threads = options.threads ? options.threads : boost::thread::hardware_concurrency();
+    if(threads == 0)
+        threads = 1;
+    size_t max_batches = options.max_batches ? options.max_batches : 2 * threads;
+
+    std::vector<worker_stats> stats(threads);
+    for(uint i = 0; i < threads; ++i)
+    {
+        stats[i].thread = i;
+        stats[i].items = 0;
+        stats[i].seconds = 0;
+    }
+
+    detail::batch_queue<value_type> queue(max_batches);
+    boost::thread_group workers;
+
+    try
+    {
+        for(uint i = 0; i < threads; ++i)
+            workers.create_thread(detail::batch_worker<value_type, Func>(queue, f, stats[i]));
+
+        std::vector<value_type> batch;
+        batch.reserve(batch_size);
+
+        bool running = true;
+        for(; running && begin != end; ++begin)
+        {
+            batch.push_back(*begin);
+
+            if(batch.size() == batch_size)
+            {
+                running = queue.push(batch);
+                batch.reserve(batch_size);
+            }
+        }
+
+        if(running && !batch.empty())
+            queue.push(batch);
+    }
+    catch(...)
+    {
+        // the walk itself failed; let the workers go before reporting it
+        queue.fail(std::current_exception());
+    }
+
+    queue.close();
+    workers.join_all();
+
+    std::exception_ptr error;
+    if(queue.failed(error))
+        std::rethrow_exception(error);
+
+    return stats;
+#else
+    (void)options;
+    (void)batch_size;
+
+    return serial_for_each(begin, end, f);
+#endif
+}
+
+template<typename Iterator, typename Func>
+inline std::vector<pstsdk::worker_stats> pstsdk::serial_for_each(Iterator begin, Iterator end, Func f)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type value_type;
+
+    std::vector<worker_stats> stats(1);
+    stats[0].thread = 0;
+    stats[0].items = 0;
+    stats[0].seconds = 0;
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    for(; begin != end; ++begin)
+    {
+        value_type item = *begin;
+        f(item);
+        ++stats[0].items;
+    }
+
+    stats[0].seconds = detail::seconds_since(start);
+
+    return stats;
+}
+
+#ifndef PSTSDK_SINGLE_THREADED
+inline pstsdk::task_pool::task_pool(uint threads)
+: m_stopping(false), m_thread_count(threads ? threads : boost::thread::hardware_concurrency())
+{
+    if(m_thread_count == 0)
+        m_thread_count = 1;
+
+    for(uint i = 0; i < m_thread_count; ++i)
+        m_threads.create_thread(thread_body(this));
+}
+
+inline pstsdk::task_pool::~task_pool()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_work.notify_all();
+    }
+
+    m_threads.join_all();
+}
+
+inline void pstsdk::task_pool::run(const std::vector<pool_task*>& tasks)
+{
+    if(tasks.empty())
+        return;
+
+    detail::task_group group(tasks);
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    m_groups.push_back(&group);
+    m_work.notify_all();
+
+    // help out, then wait for the tasks the pool took
+    while(group.next < tasks.size())
+        run_next(group, lock);
+    while(group.finished < tasks.size())
+        m_done.wait(lock);
+
+    if(group.failed)
+        std::rethrow_exception(group.error);
+}
+
+inline void pstsdk::task_pool::work()
+{
+    boost::unique_lock<boost::mutex> lock(m_mutex);
+
+    for(;;)
+    {
+        while(m_groups.empty() && !m_stopping)
+            m_work.wait(lock);
+
+        if(m_groups.empty())
+            return;
+
+        run_next(*m_groups.front(), lock);
+    }
+}
+
+inline void pstsdk::task_pool::run_next(detail::task_group& group, boost::unique_lock<boost::mutex>& lock)
+{
+    pool_task* ptask = group.tasks[group.next++];
+
+    if(group.next == group.tasks.size())
+        m_groups.erase(std::find(m_groups.begin(), m_groups.end(), &group));
+
+    std::exception_ptr error;
+    bool failed = false;
+
+    lock.unlock();
+    try
+    {
+        ptask->run();
+    }
+    catch(...)
+    {
+        failed = true;
+        error = std::current_exception();
+    }
+    lock.lock();
+
+    if(failed && !group.failed)
+    {
+        group.failed = true;
+        group.error = error;
+    }
+
+    if(++group.finished == group.tasks.size())
+        m_done.notify_all();
+}
+#else
+inline pstsdk::task_pool::task_pool(uint threads)
+: m_thread_count(0)
+{
+    (void)threads;
+}
+
+inline pstsdk::task_pool::~task_pool()
+{
+}
+
+inline void pstsdk::task_pool::run(const std::vector<pool_task*>& tasks)
+{
+    std::exception_ptr error;
+    bool failed = false;
+
+    for(size_t i = 0; i < tasks.size(); ++i)
+    {
+        try
+        {
+            tasks[i]->run();
+        }
+        catch(...)
+        {
+            if(!failed)
+                error = std::current_exception();
+            failed = true;
+        }
+    }
+
+    if(failed)
+        std::rethrow_exception(error);
+}
+#endif
+
+#endif
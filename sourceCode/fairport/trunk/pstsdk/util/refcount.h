@@ -0,0 +1,219 @@
+//! \file
+//! \brief Reference counting of database objects
+//! \author Terry Mahaffey
+//!
+//! The objects a database hands out on every hop down the object graph
+//! (blocks, nodes, heaps, tables) derive from ref_counted and are held
+//! through counted_ptr. By default counted_ptr is std::tr1::shared_ptr.
+//!
+//! Defining PSTSDK_INTRUSIVE_REFCOUNT makes it boost::intrusive_ptr
+//! instead, with the count kept inside the object. Taking a reference is
+//! then one increment of a counter already in cache, rather than a trip to
+//! a separately allocated shared_ptr control block, and a database only
+//! ever used from one thread can make that increment a plain one. This
+//! changes the public pointer typedefs (block_ptr, heap_ptr, table_ptr and
+//! so on), so code which names their underlying type must be built the
+//! same way.
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_REFCOUNT_H
+#define PSTSDK_UTIL_REFCOUNT_H
+
+#ifdef PSTSDK_INTRUSIVE_REFCOUNT
+#include <boost/detail/atomic_count.hpp>
+#include <boost/intrusive_ptr.hpp>
+#else
+#include <memory>
+#ifdef __GNUC__
+#include <tr1/memory>
+#endif
+#endif
+
+namespace pstsdk
+{
+
+//! \brief The smart pointer type holding a reference counted object
+//!
+//! std::tr1::shared_ptr<T>, or boost::intrusive_ptr<T> with
+//! PSTSDK_INTRUSIVE_REFCOUNT defined.
+//! \ingroup util
+template<typename T>
+struct counted_ptr
+{
+#ifdef PSTSDK_INTRUSIVE_REFCOUNT
+    typedef boost::intrusive_ptr<T> type;
+#else
+    typedef std::tr1::shared_ptr<T> type;
+#endif
+};
+
+#ifdef PSTSDK_INTRUSIVE_REFCOUNT
+
+//! \brief Base class of reference counted objects
+//!
+//! Each object decides when it is constructed whether its count is updated
+//! atomically. A non-atomic object must only ever be referenced from one
+//! thread at a time. Defining PSTSDK_SINGLE_THREADED makes every count
+//! non-atomic.
+//!
+//! Copying an object doesn't copy its count; the copy starts unreferenced,
+//! counting the same way as the original.
+//! \ingroup util
+class ref_counted
+{
+public:
+    //! \brief Get the number of references to this object
+    //! \returns The current count
+    long use_count() const
+        { return m_atomic ? static_cast<long>(m_atomic_refs) : m_refs; }
+
+    //! \brief Check how this object counts references
+    //! \returns true if the count is updated atomically
+    bool is_atomic_count() const
+        { return m_atomic; }
+
+    friend void intrusive_ptr_add_ref(const ref_counted* p);
+    friend void intrusive_ptr_release(const ref_counted* p);
+
+protected:
+    //! \brief Construct an unreferenced object
+    //! \param[in] atomic True if references may be taken from several threads
+    explicit ref_counted(bool atomic = true)
+        : m_atomic_refs(0), m_refs(0), m_atomic(select(atomic)) { }
+    ref_counted(const ref_counted& other)
+        : m_atomic_refs(0), m_refs(0), m_atomic(other.m_atomic) { }
+    ref_counted& operator=(const ref_counted&)
+        { return *this; }
+    virtual ~ref_counted() { }
+
+private:
+    static bool select(bool atomic)
+    {
+#ifndef PSTSDK_SINGLE_THREADED
+        return atomic;
+#else
+        (void)atomic;
+        return false;
+#endif
+    }
+
+    mutable boost::detail::atomic_count m_atomic_refs;  //!< The count, if it is updated atomically
+    mutable long m_refs;                                //!< The count, if not
+    const bool m_atomic;                                //!< Which of the two counts is in use
+};
+
+//! \brief Take a reference; called by boost::intrusive_ptr
+//! \param[in] p The object
+//! \ingroup util
+inline void intrusive_ptr_add_ref(const ref_counted* p)
+{
+    if(p->m_atomic)
+        ++p->m_atomic_refs;
+    else
+        ++p->m_refs;
+}
+
+//! \brief Drop a reference, deleting the object with the last; called by boost::intrusive_ptr
+//! \param[in] p The object
+//! \ingroup util
+inline void intrusive_ptr_release(const ref_counted* p)
+{
+    // atomic_count's decrement is a full barrier, so whichever thread
+    // drops the last reference sees every write made through the others
+    long refs = p->m_atomic ? --p->m_atomic_refs : --p->m_refs;
+
+    if(refs == 0)
+        delete p;
+}
+
+//! \brief Get a counted pointer to an object already held by one
+//! \param[in] p The object
+//! \returns A new reference to p
+//! \ingroup util
+template<typename T>
+inline typename counted_ptr<T>::type counted_from_this(T* p)
+{
+    return typename counted_ptr<T>::type(p);
+}
+
+//! \brief Cast a counted pointer down to a derived type
+//! \param[in] p The pointer to cast
+//! \returns p as a T, or an empty pointer if it isn't one
+//! \ingroup util
+template<typename T, typename U>
+inline typename counted_ptr<T>::type counted_dynamic_cast(const boost::intrusive_ptr<U>& p)
+{
+    return boost::dynamic_pointer_cast<T>(p);
+}
+
+//! \brief Get the number of references to an object
+//! \param[in] p A pointer to the object
+//! \returns The current count, including p
+//! \ingroup util
+template<typename T>
+inline long reference_count(const boost::intrusive_ptr<T>& p)
+{
+    return p ? p->use_count() : 0;
+}
+
+#else // !PSTSDK_INTRUSIVE_REFCOUNT
+
+//! \brief Base class of reference counted objects
+//!
+//! The count lives in the shared_ptr control block, which always updates
+//! it atomically; the atomic flag a database passes is accepted so callers
+//! needn't care which way the library was built, and otherwise ignored.
+//! \ingroup util
+class ref_counted : public std::tr1::enable_shared_from_this<ref_counted>
+{
+public:
+    //! \brief Check how this object counts references
+    //! \returns true; shared_ptr counts are always updated atomically
+    bool is_atomic_count() const
+        { return true; }
+
+protected:
+    //! \brief Construct an unreferenced object
+    explicit ref_counted(bool = true) { }
+    ref_counted(const ref_counted& other)
+        : std::tr1::enable_shared_from_this<ref_counted>(other) { }
+    ref_counted& operator=(const ref_counted&)
+        { return *this; }
+    virtual ~ref_counted() { }
+};
+
+//! \brief Get a counted pointer to an object already held by one
+//! \param[in] p The object
+//! \returns A new reference to p
+//! \ingroup util
+template<typename T>
+inline typename counted_ptr<T>::type counted_from_this(T* p)
+{
+    return std::tr1::static_pointer_cast<T>(p->ref_counted::shared_from_this());
+}
+
+//! \brief Cast a counted pointer down to a derived type
+//! \param[in] p The pointer to cast
+//! \returns p as a T, or an empty pointer if it isn't one
+//! \ingroup util
+template<typename T, typename U>
+inline typename counted_ptr<T>::type counted_dynamic_cast(const std::tr1::shared_ptr<U>& p)
+{
+    return std::tr1::dynamic_pointer_cast<T>(p);
+}
+
+//! \brief Get the number of references to an object
+//! \param[in] p A pointer to the object
+//! \returns The current count, including p
+//! \ingroup util
+template<typename T>
+inline long reference_count(const std::tr1::shared_ptr<T>& p)
+{
+    return p.use_count();
+}
+
+#endif // !PSTSDK_INTRUSIVE_REFCOUNT
+
+} // end namespace pstsdk
+
+#endif
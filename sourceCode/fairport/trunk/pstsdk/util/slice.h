@@ -0,0 +1,130 @@
+//! \file
+//! \brief Shared byte buffers
+//! \author Terry Mahaffey
+//!
+//! A byte_slice is a read only window onto a reference counted buffer.
+//! Copying or narrowing a slice never copies bytes, so a block's decoded
+//! data can be handed up through the node, heap and property layers as a
+//! view, and only copied by whoever finally wants a copy of their own.
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_SLICE_H
+#define PSTSDK_UTIL_SLICE_H
+
+#include <memory>
+#ifdef __GNUC__
+#include <tr1/memory>
+#endif
+#include <stdexcept>
+#include <vector>
+
+#include "pstsdk/util/primitives.h"
+
+namespace pstsdk
+{
+
+//! \brief The reference counted storage behind a byte_slice
+//! \ingroup util
+typedef std::tr1::shared_ptr<const std::vector<byte> > shared_bytes;
+
+//! \brief A read only view of part of a shared buffer
+//!
+//! The slice keeps the buffer alive for as long as it (or any slice taken
+//! from it) exists. The owner of the buffer must not modify it while it is
+//! shared; see external_block, which copies its buffer before writing if
+//! any slice still refers to it.
+//! \ingroup util
+class byte_slice
+{
+public:
+    typedef const byte* const_iterator;
+
+    //! \brief Construct an empty slice
+    byte_slice()
+        : m_data(NULL), m_size(0) { }
+
+    //! \brief Construct a slice over all of a buffer, taking its contents
+    //! \param[in,out] buffer The bytes; left empty
+    explicit byte_slice(std::vector<byte>& buffer)
+        : m_data(NULL), m_size(0)
+    {
+        std::tr1::shared_ptr<std::vector<byte> > storage(new std::vector<byte>());
+        storage->swap(buffer);
+        assign(storage, 0, storage->size());
+    }
+
+    //! \brief Construct a slice over part of a shared buffer
+    //! \param[in] storage The buffer
+    //! \param[in] offset Where the slice starts in the buffer
+    //! \param[in] size The length of the slice
+    //! \throws std::out_of_range If the slice doesn't fit in the buffer
+    byte_slice(const shared_bytes& storage, size_t offset, size_t size)
+        : m_data(NULL), m_size(0)
+        { assign(storage, offset, size); }
+
+    //! \brief A pointer to the first byte of the slice
+    //! \returns The data, or NULL if the slice is empty
+    const byte* data() const { return m_data; }
+    //! \brief The length of the slice
+    //! \returns The number of bytes in the slice
+    size_t size() const { return m_size; }
+    //! \brief Check for an empty slice
+    //! \returns true if the slice has no bytes
+    bool empty() const { return m_size == 0; }
+
+    const_iterator begin() const { return m_data; }
+    const_iterator end() const { return m_data + m_size; }
+    const byte& operator[](size_t pos) const { return m_data[pos]; }
+
+    //! \brief Take a narrower view of the same buffer
+    //! \param[in] offset Where the new slice starts, relative to this one
+    //! \param[in] size The length of the new slice
+    //! \throws std::out_of_range If the new slice doesn't fit in this one
+    //! \returns The new slice, sharing this slice's buffer
+    byte_slice slice(size_t offset, size_t size) const;
+
+    //! \brief Copy the slice out into a buffer of its own
+    //! \returns A copy of the bytes
+    std::vector<byte> to_vector() const
+        { return std::vector<byte>(begin(), end()); }
+
+    //! \brief Get the buffer this slice is a view of
+    //! \returns The shared buffer, which may be larger than the slice
+    const shared_bytes& get_storage() const { return m_storage; }
+
+private:
+    void assign(const shared_bytes& storage, size_t offset, size_t size);
+
+    shared_bytes m_storage;     //!< Keeps the bytes alive
+    const byte* m_data;         //!< The first byte of the slice
+    size_t m_size;              //!< The length of the slice
+};
+
+} // end namespace pstsdk
+
+inline void pstsdk::byte_slice::assign(const shared_bytes& storage, size_t offset, size_t size)
+{
+    size_t total = storage ? storage->size() : 0;
+
+    if(offset > total || size > total - offset)
+        throw std::out_of_range("slice past end of buffer");
+
+    m_storage = storage;
+    m_data = size ? &(*storage)[offset] : NULL;
+    m_size = size;
+}
+
+inline pstsdk::byte_slice pstsdk::byte_slice::slice(size_t offset, size_t size) const
+{
+    if(offset > m_size || size > m_size - offset)
+        throw std::out_of_range("slice past end of slice");
+
+    byte_slice result;
+    result.m_storage = m_storage;
+    result.m_data = size ? m_data + offset : NULL;
+    result.m_size = size;
+
+    return result;
+}
+
+#endif
@@ -0,0 +1,114 @@
+//! \file
+//! \brief Open addressed hash index over an array
+//! \author Terry Mahaffey
+//!
+//! Several read only lookups in the library (the columns of a table, the
+//! entries of the named property map) are built once from an array and then
+//! searched many times. slot_index maps a hash to positions in that array,
+//! so the caller keeps the array in its own order and owns the comparison.
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_SLOT_INDEX_H
+#define PSTSDK_UTIL_SLOT_INDEX_H
+
+#include <vector>
+
+#include "pstsdk/util/primitives.h"
+
+namespace pstsdk
+{
+
+//! \brief An open addressed index of positions in an array, by hash
+//!
+//! Slots are found with fibonacci hashing, which spreads clustered keys
+//! (such as runs of prop_ids) across the table, and collisions probe
+//! linearly. Each slot holds a position plus one, so zero marks it empty.
+//! \tparam Slot An unsigned type big enough to hold the array's size
+//! \ingroup util
+template<typename Slot>
+class slot_index
+{
+public:
+    //! \brief Returned by find when no position matches
+    static const size_t npos = static_cast<size_t>(-1);
+
+    //! \brief Construct an index holding nothing
+    slot_index()
+        : m_shift(32) { }
+
+    //! \brief Empty the index, and size it for a number of positions
+    //! \param[in] count The number of positions which will be inserted
+    void reset(size_t count);
+
+    //! \brief Add a position to the index
+    //! \param[in] hash The hash of the key at that position
+    //! \param[in] position The position in the caller's array
+    void insert(ulong hash, size_t position);
+
+    //! \brief Find the first position with a given key
+    //! \tparam Match A callable taking a position, returning true if the key there is the one sought
+    //! \param[in] hash The hash of the key sought
+    //! \param[in] match Compares the key at a candidate position
+    //! \returns The position, or npos if no candidate matches
+    template<typename Match>
+    size_t find(ulong hash, Match match) const;
+
+private:
+    ulong slot_of(ulong hash) const
+        { return static_cast<ulong>(hash * 0x9E3779B1u) >> m_shift; }
+
+    std::vector<Slot> m_slots;  //!< 0 is empty, otherwise the position + 1
+    ulong m_shift;              //!< Shift taking a 32 bit hash to a slot of m_slots
+};
+
+template<typename Slot>
+const size_t slot_index<Slot>::npos;
+
+} // end namespace pstsdk
+
+template<typename Slot>
+inline void pstsdk::slot_index<Slot>::reset(size_t count)
+{
+    // keep the table at most half full, so probe sequences stay short
+    ulong bits = 3;
+    while((1u << bits) < 2 * count)
+        ++bits;
+
+    m_shift = 32 - bits;
+    m_slots.assign(1u << bits, 0);
+}
+
+template<typename Slot>
+inline void pstsdk::slot_index<Slot>::insert(ulong hash, size_t position)
+{
+    ulong mask = static_cast<ulong>(m_slots.size() - 1);
+    ulong slot = slot_of(hash);
+
+    while(m_slots[slot] != 0)
+        slot = (slot + 1) & mask;
+
+    m_slots[slot] = static_cast<Slot>(position + 1);
+}
+
+template<typename Slot>
+template<typename Match>
+inline size_t pstsdk::slot_index<Slot>::find(ulong hash, Match match) const
+{
+    if(m_slots.empty())
+        return npos;
+
+    ulong mask = static_cast<ulong>(m_slots.size() - 1);
+    ulong slot = slot_of(hash);
+
+    for(Slot entry = m_slots[slot]; entry != 0; entry = m_slots[slot])
+    {
+        if(match(static_cast<size_t>(entry - 1)))
+            return entry - 1;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return npos;
+}
+
+#endif
@@ -0,0 +1,461 @@
+//! \file
+//! \brief UTF-16LE transcoding
+//! \author Terry Mahaffey
+//!
+//! Unicode strings in a PST file are UTF-16LE. These functions convert them
+//! to and from wide strings and UTF-8 directly, without going through the
+//! platform's conversion library. Runs of characters which need no real
+//! work (anything outside the surrogate range when widening, ASCII when
+//! narrowing to UTF-8) are converted eight at a time with SSE2 where the
+//! compiler targets it.
+//!
+//! 8-bit strings are in whatever codepage the message was written with. The
+//! store itself doesn't record one; messages usually do, and where they
+//! don't the strings are taken to be Windows-1252, which is what Outlook
+//! writes on western systems. Only Windows-1252, Latin-1, US-ASCII and
+//! UTF-8 are understood; strings in any other codepage are refused rather
+//! than guessed at.
+//!
+//! Malformed input is not an error: an unpaired surrogate, or an invalid
+//! UTF-8 sequence, is converted to U+FFFD REPLACEMENT CHARACTER.
+//! \ingroup util
+
+#ifndef PSTSDK_UTIL_UNICODE_H
+#define PSTSDK_UTIL_UNICODE_H
+
+#include <algorithm>
+#include <cwchar>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PSTSDK_UNICODE_SSE2
+#include <emmintrin.h>
+#endif
+
+#include "pstsdk/util/errors.h"
+#include "pstsdk/util/primitives.h"
+
+namespace pstsdk
+{
+
+//! \brief Convert UTF-16LE to a std::wstring
+//!
+//! Where wchar_t is 32 bits wide, surrogate pairs become one wchar_t.
+//! \param[in] pbytes The UTF-16LE data
+//! \param[in] size The number of bytes
+//! \throws std::runtime_error If size is odd
+//! \returns The string
+//! \ingroup util
+std::wstring utf16le_to_wstring(const byte* pbytes, size_t size);
+
+//! \brief Convert a std::wstring to UTF-16LE
+//! \param[in] wstr The string
+//! \returns The UTF-16LE data
+//! \ingroup util
+std::vector<byte> wstring_to_utf16le(const std::wstring& wstr);
+
+//! \brief Convert UTF-16LE to UTF-8
+//! \param[in] pbytes The UTF-16LE data
+//! \param[in] size The number of bytes
+//! \throws std::runtime_error If size is odd
+//! \returns The UTF-8 string
+//! \ingroup util
+std::string utf16le_to_utf8(const byte* pbytes, size_t size);
+
+//! \brief Convert UTF-8 to UTF-16LE
+//! \param[in] str The UTF-8 string
+//! \returns The UTF-16LE data
+//! \ingroup util
+std::vector<byte> utf8_to_utf16le(const std::string& str);
+
+//! \brief The codepage 8-bit strings are assumed to be in
+//! \ingroup util
+const ulong default_codepage = 1252;
+
+//! \brief Convert an 8-bit string to UTF-8
+//!
+//! Windows-1252 (1252), Latin-1 (28591), US-ASCII (20127) and UTF-8 (65001)
+//! are understood. The five bytes Windows-1252 leaves undefined map to the
+//! code point of the same value, as they do on Windows; bytes past 0x7F in
+//! US-ASCII become U+FFFD.
+//! \param[in] pbytes The 8-bit data
+//! \param[in] size The number of bytes
+//! \param[in] codepage The Windows codepage identifier of the data
+//! \throws not_implemented If codepage is not one of the above
+//! \returns The UTF-8 string
+//! \ingroup util
+std::string ansi_to_utf8(const byte* pbytes, size_t size, ulong codepage = default_codepage);
+
+//! \cond unicode_implementation
+namespace detail
+{
+
+const ulong replacement_character = 0xFFFD;
+
+inline ulong read_utf16_unit(const byte* p)
+{
+    return static_cast<ulong>(p[0]) | (static_cast<ulong>(p[1]) << 8);
+}
+
+inline void write_utf16_unit(byte*& p, ulong unit)
+{
+    *p++ = static_cast<byte>(unit & 0xFF);
+    *p++ = static_cast<byte>(unit >> 8);
+}
+
+//! \brief Decode the code point starting at unit i, moving i past it
+inline ulong next_code_point(const byte* pbytes, size_t units, size_t& i)
+{
+    ulong unit = read_utf16_unit(pbytes + 2 * i++);
+
+    if(unit < 0xD800 || unit > 0xDFFF)
+        return unit;
+
+    if(unit <= 0xDBFF && i < units)
+    {
+        ulong low = read_utf16_unit(pbytes + 2 * i);
+        if(low >= 0xDC00 && low <= 0xDFFF)
+        {
+            ++i;
+            return 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+        }
+    }
+
+    return replacement_character;
+}
+
+//! \brief The code points of Windows-1252 bytes 0x80 through 0x9F
+const ushort cp1252_high[32] =
+{
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+//! \brief Encode a code point as UTF-16LE
+inline void put_utf16(byte*& p, ulong cp)
+{
+    if(cp >= 0xD800 && cp <= 0xDFFF)
+        cp = replacement_character;
+
+    if(cp < 0x10000)
+    {
+        write_utf16_unit(p, cp);
+    }
+    else if(cp <= 0x10FFFF)
+    {
+        cp -= 0x10000;
+        write_utf16_unit(p, 0xD800 + (cp >> 10));
+        write_utf16_unit(p, 0xDC00 + (cp & 0x3FF));
+    }
+    else
+    {
+        write_utf16_unit(p, replacement_character);
+    }
+}
+
+//! \brief Encode a code point as UTF-8
+inline void put_utf8(char*& p, ulong cp)
+{
+    if(cp < 0x80)
+    {
+        *p++ = static_cast<char>(cp);
+    }
+    else if(cp < 0x800)
+    {
+        *p++ = static_cast<char>(0xC0 | (cp >> 6));
+        *p++ = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if(cp < 0x10000)
+    {
+        *p++ = static_cast<char>(0xE0 | (cp >> 12));
+        *p++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        *p++ = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        *p++ = static_cast<char>(0xF0 | (cp >> 18));
+        *p++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        *p++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        *p++ = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+//! \brief Decode the UTF-8 sequence starting at i, moving i past it
+inline ulong next_utf8_code_point(const std::string& str, size_t& i)
+{
+    ulong lead = static_cast<byte>(str[i++]);
+
+    if(lead < 0x80)
+        return lead;
+
+    size_t extra;
+    ulong cp;
+    ulong min;
+    if(lead >= 0xC2 && lead <= 0xDF)
+    {
+        extra = 1; cp = lead & 0x1F; min = 0x80;
+    }
+    else if(lead >= 0xE0 && lead <= 0xEF)
+    {
+        extra = 2; cp = lead & 0x0F; min = 0x800;
+    }
+    else if(lead >= 0xF0 && lead <= 0xF4)
+    {
+        extra = 3; cp = lead & 0x07; min = 0x10000;
+    }
+    else
+    {
+        return replacement_character;
+    }
+
+    // a truncated sequence consumes only the bytes which belong to it
+    for(size_t n = 0; n < extra; ++n)
+    {
+        if(i >= str.size() || (static_cast<byte>(str[i]) & 0xC0) != 0x80)
+            return replacement_character;
+        cp = (cp << 6) | (static_cast<byte>(str[i++]) & 0x3F);
+    }
+
+    if(cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        return replacement_character;
+
+    return cp;
+}
+
+#ifdef PSTSDK_UNICODE_SSE2
+//! \brief Copy the leading units outside the surrogate range, eight at a time
+//! \returns The number of units copied, a multiple of eight
+inline size_t widen_bmp_run(const byte* pbytes, size_t units, boost::uint32_t* pout)
+{
+    const __m128i surrogate_mask = _mm_set1_epi16(static_cast<short>(0xF800));
+    const __m128i surrogate_bits = _mm_set1_epi16(static_cast<short>(0xD800));
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for(; i + 8 <= units; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pbytes + 2 * i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, surrogate_mask), surrogate_bits)) != 0)
+            break;
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pout + i), _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pout + i + 4), _mm_unpackhi_epi16(v, zero));
+    }
+
+    return i;
+}
+
+//! \brief Copy the leading ASCII units, eight at a time
+//! \returns The number of units copied, a multiple of eight
+inline size_t narrow_ascii_run(const byte* pbytes, size_t units, char* pout)
+{
+    const __m128i non_ascii = _mm_set1_epi16(static_cast<short>(0xFF80));
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for(; i + 8 <= units; i += 8)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pbytes + 2 * i));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) != 0xFFFF)
+            break;
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pout + i), _mm_packus_epi16(v, v));
+    }
+
+    return i;
+}
+
+//! \brief Count the leading ASCII bytes, sixteen at a time
+//! \returns The number of bytes counted, a multiple of sixteen
+inline size_t ascii_run(const byte* pbytes, size_t size)
+{
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pbytes + i));
+        if(_mm_movemask_epi8(v) != 0)
+            break;
+    }
+
+    return i;
+}
+#endif
+
+} // end namespace detail
+//! \endcond
+
+} // end namespace pstsdk
+
+inline std::wstring pstsdk::utf16le_to_wstring(const byte* pbytes, size_t size)
+{
+    if(size % 2 != 0)
+        throw std::runtime_error("Cannot interpret odd number of bytes as UTF-16LE");
+
+    size_t units = size / 2;
+    if(units == 0)
+        return std::wstring();
+
+    // at most one wchar_t per unit
+    std::wstring out(units, L'\0');
+
+#if WCHAR_MAX > 0xFFFF
+    size_t i = 0;
+    size_t written = 0;
+
+    while(i < units)
+    {
+#ifdef PSTSDK_UNICODE_SSE2
+        if(sizeof(wchar_t) == sizeof(boost::uint32_t))
+        {
+            size_t run = detail::widen_bmp_run(pbytes + 2 * i, units - i, reinterpret_cast<boost::uint32_t*>(&out[written]));
+            i += run;
+            written += run;
+            if(i == units)
+                break;
+        }
+#endif
+        out[written++] = static_cast<wchar_t>(detail::next_code_point(pbytes, units, i));
+    }
+
+    out.resize(written);
+#else
+    for(size_t i = 0; i < units; ++i)
+        out[i] = static_cast<wchar_t>(detail::read_utf16_unit(pbytes + 2 * i));
+#endif
+
+    return out;
+}
+
+inline std::vector<pstsdk::byte> pstsdk::wstring_to_utf16le(const std::wstring& wstr)
+{
+    if(wstr.empty())
+        return std::vector<byte>();
+
+#if WCHAR_MAX > 0xFFFF
+    // up to two units per character, for those outside the BMP
+    std::vector<byte> out(wstr.size() * 4);
+    byte* p = &out[0];
+
+    for(size_t i = 0; i < wstr.size(); ++i)
+        detail::put_utf16(p, static_cast<ulong>(wstr[i]));
+
+    out.resize(p - &out[0]);
+#else
+    std::vector<byte> out(wstr.size() * 2);
+    byte* p = &out[0];
+
+    for(size_t i = 0; i < wstr.size(); ++i)
+        detail::write_utf16_unit(p, static_cast<ulong>(wstr[i]) & 0xFFFF);
+#endif
+
+    return out;
+}
+
+inline std::string pstsdk::utf16le_to_utf8(const byte* pbytes, size_t size)
+{
+    if(size % 2 != 0)
+        throw std::runtime_error("Cannot interpret odd number of bytes as UTF-16LE");
+
+    size_t units = size / 2;
+    if(units == 0)
+        return std::string();
+
+    // three bytes per unit covers the BMP, and a surrogate pair's four
+    std::string out(units * 3, '\0');
+    char* pbegin = &out[0];
+    char* p = pbegin;
+    size_t i = 0;
+
+    while(i < units)
+    {
+#ifdef PSTSDK_UNICODE_SSE2
+        size_t run = detail::narrow_ascii_run(pbytes + 2 * i, units - i, p);
+        i += run;
+        p += run;
+        if(i == units)
+            break;
+#endif
+        detail::put_utf8(p, detail::next_code_point(pbytes, units, i));
+    }
+
+    out.resize(p - pbegin);
+    return out;
+}
+
+inline std::vector<pstsdk::byte> pstsdk::utf8_to_utf16le(const std::string& str)
+{
+    if(str.empty())
+        return std::vector<byte>();
+
+    // never more units than bytes
+    std::vector<byte> out(str.size() * 2);
+    byte* p = &out[0];
+
+    for(size_t i = 0; i < str.size(); )
+        detail::put_utf16(p, detail::next_utf8_code_point(str, i));
+
+    out.resize(p - &out[0]);
+    return out;
+}
+
+inline std::string pstsdk::ansi_to_utf8(const byte* pbytes, size_t size, ulong codepage)
+{
+    // even an ASCII string may mean something else in another codepage
+    // (ISO-2022-JP is all 7-bit), so refuse those outright
+    if(codepage != 1252 && codepage != 28591 && codepage != 20127 && codepage != 65001)
+        throw not_implemented("ansi_to_utf8: unsupported codepage");
+
+    if(size == 0)
+        return std::string();
+
+    size_t ascii = 0;
+#ifdef PSTSDK_UNICODE_SSE2
+    ascii = detail::ascii_run(pbytes, size);
+#endif
+    while(ascii < size && pbytes[ascii] < 0x80)
+        ++ascii;
+
+    if(ascii == size)
+        return std::string(reinterpret_cast<const char*>(pbytes), size);
+
+    // three bytes for everything past the ASCII prefix is enough; that is
+    // the longest Windows-1252 character, and the replacement for a byte
+    // which isn't valid UTF-8 or US-ASCII
+    std::string out(ascii + 3 * (size - ascii), '\0');
+    char* pbegin = &out[0];
+    char* p = std::copy(pbytes, pbytes + ascii, pbegin);
+
+    if(codepage == 65001)
+    {
+        std::string str(reinterpret_cast<const char*>(pbytes), size);
+        for(size_t i = ascii; i < size; )
+            detail::put_utf8(p, detail::next_utf8_code_point(str, i));
+    }
+    else if(codepage == 28591)
+    {
+        for(size_t i = ascii; i < size; ++i)
+            detail::put_utf8(p, pbytes[i]);
+    }
+    else if(codepage == 20127)
+    {
+        for(size_t i = ascii; i < size; ++i)
+            detail::put_utf8(p, pbytes[i] < 0x80 ? pbytes[i] : detail::replacement_character);
+    }
+    else // 1252
+    {
+        for(size_t i = ascii; i < size; ++i)
+        {
+            byte b = pbytes[i];
+            detail::put_utf8(p, (b >= 0x80 && b < 0xA0) ? detail::cp1252_high[b - 0x80] : b);
+        }
+    }
+
+    out.resize(p - pbegin);
+    return out;
+}
+
+#endif
@@ -10,58 +10,16 @@
 #ifndef PSTSDK_UTIL_UTIL_H
 #define PSTSDK_UTIL_UTIL_H
 
-#include <cstdio>
 #include <time.h>
-#include <memory>
 #include <vector>
-#include <boost/utility.hpp>
 
 #include "pstsdk/util/errors.h"
 #include "pstsdk/util/primitives.h"
+#include "pstsdk/util/unicode.h"
 
 namespace pstsdk
 {
 
-//! \brief A generic class to read and write to a file
-//!
-//! This was necessary to get around the 32 bit limit (4GB) file size
-//! limitation in ANSI C++. I needed to use compiler specific work arounds,
-//! and that logic is centralized here.
-//! \ingroup util
-class file : private boost::noncopyable
-{
-public:
-    //! \brief Construct a file object from the given filename
-    //! \throw runtime_error if an error occurs opening the file
-    //! \param[in] filename The file to open
-    file(const std::wstring& filename);
-    
-    //! \brief Close the file
-    ~file();
-
-    //! \brief Read from the file
-    //! \throw out_of_range if the requested location or location+size is past EOF
-    //! \param[in,out] buffer The buffer to store the data in. The size of this vector is the amount of data to read.
-    //! \param[in] offset The location on disk to read the data from.
-    //! \returns The amount of data read
-    size_t read(std::vector<byte>& buffer, ulonglong offset) const;
-
-//! \cond write_api
-
-    //! \brief Write to the file
-    //! \throw out_of_range if the requested location or location+size is past EOF
-    //! \param[in] buffer The data to write. The size of this vector is the amount of data to write.
-    //! \param[in] offset The location on disk to read the data from.
-    //! \returns The amount of data written
-    size_t write(const std::vector<byte>& buffer, ulonglong offset);
-//! \endcond
-
-private:
-    std::wstring m_filename;    //!< The filename used to open this file
-    FILE * m_pfile;             //!< The file pointer
-};
-
-
 //! \brief Convert from a filetime to time_t
 //!
 //! FILETIME is a Win32 date/time type representing the number of 100 ns
@@ -115,6 +73,13 @@ bool test_bit(const byte* pbytes, ulong bit);
 //! \ingroup util
 std::wstring bytes_to_wstring(const std::vector<byte> &bytes);
 
+//! \brief Convert a range of bytes to a std::wstring
+//! \param[in] pbytes The bytes to convert
+//! \param[in] size The number of bytes
+//! \returns A std::wstring
+//! \ingroup util
+std::wstring bytes_to_wstring(const byte* pbytes, size_t size);
+
 //! \brief Convert a std::wstring to an array of bytes
 //! \param[in] wstr The std::wstring to convert
 //! \returns An array of bytes
@@ -123,68 +88,6 @@ std::vector<byte> wstring_to_bytes(const std::wstring &wstr);
 
 } // end pstsdk namespace
 
-inline pstsdk::file::file(const std::wstring& filename)
-: m_filename(filename)
-{
-    const char* mode = "rb";
-
-#ifdef _MSC_VER 
-    errno_t err = fopen_s(&m_pfile, std::string(filename.begin(), filename.end()).c_str(), mode);
-    if(err != 0)
-        m_pfile = NULL;
-#else
-    m_pfile = fopen(std::string(filename.begin(), filename.end()).c_str(), mode);
-#endif
-    if(m_pfile == NULL)
-        throw std::runtime_error("fopen failed");
-}
-
-inline pstsdk::file::~file()
-{
-    fflush(m_pfile);
-    fclose(m_pfile);
-}
-
-inline size_t pstsdk::file::read(std::vector<byte>& buffer, ulonglong offset) const
-{
-#ifdef _MSC_VER
-    if(_fseeki64(m_pfile, offset, SEEK_SET) != 0)
-#else
-    if(fseek(m_pfile, offset, SEEK_SET) != 0)
-#endif
-    {
-        throw std::out_of_range("fseek failed");
-    }
-
-    size_t read = fread(&buffer[0], 1, buffer.size(), m_pfile);
-
-    if(read != buffer.size())
-        throw std::out_of_range("fread failed");
-
-    return read;
-}
-
-//! \cond write_api
-inline size_t pstsdk::file::write(const std::vector<byte>& buffer, ulonglong offset)
-{
-#ifdef _MSC_VER
-    if(_fseeki64(m_pfile, offset, SEEK_SET) != 0)
-#else
-    if(fseek(m_pfile, offset, SEEK_SET) != 0)
-#endif
-    {
-        throw std::out_of_range("fseek failed");
-    }
-
-    size_t write = fwrite(&buffer[0], 1, buffer.size(), m_pfile);
-
-    if(write != buffer.size())
-        throw std::out_of_range("fwrite failed");
-
-    return write;
-}
-//! \endcond
-
 inline time_t pstsdk::filetime_to_time_t(ulonglong filetime)
 {
     const ulonglong jan1970 = 116444736000000000ULL;
@@ -218,12 +121,12 @@ inline bool pstsdk::test_bit(const byte* pbytes, ulong bit)
 
 // We know that std::wstring is always UCS-2LE on Windows.
 
-inline std::wstring pstsdk::bytes_to_wstring(const std::vector<byte> &bytes)
+inline std::wstring pstsdk::bytes_to_wstring(const byte* pbytes, size_t size)
 {
-    if(bytes.size() == 0)
+    if(size == 0)
         return std::wstring();
 
-    return std::wstring(reinterpret_cast<const wchar_t *>(&bytes[0]), bytes.size()/sizeof(wchar_t));
+    return std::wstring(reinterpret_cast<const wchar_t *>(pbytes), size/sizeof(wchar_t));
 }
 
 inline std::vector<pstsdk::byte> pstsdk::wstring_to_bytes(const std::wstring &wstr)
@@ -237,66 +140,23 @@ inline std::vector<pstsdk::byte> pstsdk::wstring_to_bytes(const std::wstring &ws
 
 #else // !(defined(_WIN32) || defined(__MINGW32__))
 
-// We're going to have to do this the hard way, since we don't know how
-// big wchar_t really is, or what encoding it uses.
-#include <iconv.h>
+// We don't know how big wchar_t is here, so transcode, rather than copy.
 
-inline std::wstring pstsdk::bytes_to_wstring(const std::vector<byte> &bytes)
+inline std::wstring pstsdk::bytes_to_wstring(const byte* pbytes, size_t size)
 {
-    if(bytes.size() == 0)
-        return std::wstring();
-
-    // Up to one wchar_t for every 2 bytes, if there are no surrogate pairs.
-    if(bytes.size() % 2 != 0)
-        throw std::runtime_error("Cannot interpret odd number of bytes as UTF-16LE");
-    std::wstring out(bytes.size() / 2, L'\0');
-
-    iconv_t cd(::iconv_open("WCHAR_T", "UTF-16LE"));
-    if(cd == (iconv_t)(-1)) {
-        perror("bytes_to_wstring");
-        throw std::runtime_error("Unable to convert from UTF-16LE to wstring");
-    }
-
-    const char *inbuf = reinterpret_cast<const char *>(&bytes[0]);
-    size_t inbytesleft = bytes.size();
-    char *outbuf = reinterpret_cast<char *>(&out[0]);
-    size_t outbytesleft = out.size() * sizeof(wchar_t);
-    size_t result = ::iconv(cd, const_cast<char **>(&inbuf), &inbytesleft, &outbuf, &outbytesleft);
-    ::iconv_close(cd);
-    if(result == (size_t)(-1) || inbytesleft > 0 || outbytesleft % sizeof(wchar_t) != 0)
-        throw std::runtime_error("Failed to convert from UTF-16LE to wstring");
-
-    out.resize(out.size() - (outbytesleft / sizeof(wchar_t)));
-    return out;
+    return utf16le_to_wstring(pbytes, size);
 }
 
 inline std::vector<pstsdk::byte> pstsdk::wstring_to_bytes(const std::wstring &wstr)
 {
-    if(wstr.size() == 0)
-        return std::vector<byte>();
-
-    // Up to 4 bytes per character if all codepoints are surrogate pairs.
-    std::vector<byte> out(wstr.size() * 4);
-
-    iconv_t cd(::iconv_open("UTF-16LE", "WCHAR_T"));
-    if(cd == (iconv_t)(-1)) {
-        perror("wstring_to_bytes");
-        throw std::runtime_error("Unable to convert from wstring to UTF-16LE");
-    }
-
-    const char *inbuf = reinterpret_cast<const char *>(&wstr[0]);
-    size_t inbytesleft = wstr.size() * sizeof(wchar_t);
-    char *outbuf = reinterpret_cast<char *>(&out[0]);
-    size_t outbytesleft = out.size();
-    size_t result = ::iconv(cd, const_cast<char **>(&inbuf), &inbytesleft, &outbuf, &outbytesleft);
-    ::iconv_close(cd);
-    if(result == (size_t)(-1) || inbytesleft > 0)
-        throw std::runtime_error("Failed to convert from wstring to UTF-16LE");
-
-    out.resize(out.size() - outbytesleft);
-    return out;
+    return wstring_to_utf16le(wstr);
 }
 
 #endif // !(defined(_WIN32) || defined(__MINGW32__))
 
+inline std::wstring pstsdk::bytes_to_wstring(const std::vector<byte> &bytes)
+{
+    return bytes_to_wstring(bytes.empty() ? NULL : &bytes[0], bytes.size());
+}
+
 #endif
@@ -1,5 +1,11 @@
 #include <iostream>
+#include <fstream>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <boost/thread/thread.hpp>
 #include "pstsdk/disk/disk.h"
 #include "pstsdk/ndb.h"
 
@@ -74,13 +80,34 @@ void process_node(const pstsdk::node& n)
     using namespace std;
     using namespace pstsdk;
 
+    node_id last = 0;
     for(const_subnodeinfo_iterator iter = n.subnode_info_begin();
                     iter != n.subnode_info_end();
                     ++iter)
     {
         process_node(node(n, *iter));
+
+        // lookups go through the flattened subnode map
+        node found = n.lookup(iter->id);
+        assert(found.get_id() == iter->id);
+        assert(found.get_data_id() == iter->data_bid);
+        assert(found.get_sub_id() == iter->sub_bid);
+        last = iter->id;
+    }
+
+    if(n.get_sub_id() != 0)
+    {
+        bool caught_not_found = false;
+        try
+        {
+            n.lookup(last + 1);
+        }
+        catch(key_not_found<node_id>&)
+        {
+            caught_not_found = true;
+        }
+        assert(caught_not_found);
     }
-    
 }
 
 size_t step_size_up(size_t i)
@@ -190,6 +217,805 @@ void test_node_stream(pstsdk::node n)
     
 }
 
+void test_mapped_db(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr db = open_database(filename);
+    shared_db_ptr mapped = open_database(filename, file_access_mmap);
+
+    // every node read through the mapping must match the stdio path
+    std::tr1::shared_ptr<const nbt_page> nbt_root = db->read_nbt_root();
+    for(const_nodeinfo_iterator iter = nbt_root->begin();
+                    iter != nbt_root->end();
+                    ++iter)
+    {
+        pstsdk::node n(db, *iter);
+        pstsdk::node m(mapped->lookup_node(iter->id));
+        assert(n.size() == m.size());
+
+        vector<byte> expected(n.size());
+        vector<byte> actual(m.size());
+        n.read(expected, 0);
+        m.read(actual, 0);
+        assert(expected == actual);
+
+        process_node(m);
+    }
+
+    // an empty read doesn't touch the file, mapped or not
+    file_access modes[] = { file_access_stdio, file_access_mmap, file_access_positional };
+    for(size_t i = 0; i < sizeof(modes)/sizeof(modes[0]); ++i)
+    {
+        pstsdk::file f(filename, modes[i]);
+        vector<byte> empty;
+        assert(f.read(empty, 0) == 0);
+        assert(f.read(empty, 0xFFFFFFFFFFULL) == 0);
+    }
+}
+
+// reads every node of a shared database, counting any that don't match
+struct concurrent_reader
+{
+    concurrent_reader(const pstsdk::shared_db_ptr& db, const std::map<pstsdk::node_id, std::vector<pstsdk::byte> >& expected, int& mismatches)
+        : m_db(db), m_expected(expected), m_mismatches(mismatches) { }
+
+    void operator()() const
+    {
+        using namespace pstsdk;
+
+        try
+        {
+            for(int pass = 0; pass < 5; ++pass)
+            {
+                std::map<node_id, std::vector<byte> >::const_iterator iter;
+                for(iter = m_expected.begin(); iter != m_expected.end(); ++iter)
+                {
+                    pstsdk::node n(m_db->lookup_node(iter->first));
+                    std::vector<byte> contents(n.size());
+                    n.read(contents, 0);
+
+                    if(contents != iter->second)
+                        ++m_mismatches;
+                }
+            }
+        }
+        catch(std::exception&)
+        {
+            ++m_mismatches;
+        }
+    }
+
+    pstsdk::shared_db_ptr m_db;
+    const std::map<pstsdk::node_id, std::vector<pstsdk::byte> >& m_expected;
+    int& m_mismatches;
+};
+
+void test_concurrent_db(const std::wstring& filename, pstsdk::file_access access)
+{
+    using namespace std;
+    using namespace pstsdk;
+    const int thread_count = 8;
+
+    map<node_id, vector<byte> > expected;
+    shared_db_ptr reference = open_database(filename, file_access_stdio);
+    std::tr1::shared_ptr<const nbt_page> nbt_root = reference->read_nbt_root();
+    for(const_nodeinfo_iterator iter = nbt_root->begin();
+                    iter != nbt_root->end();
+                    ++iter)
+    {
+        pstsdk::node n(reference, *iter);
+        vector<byte> contents(n.size());
+        n.read(contents, 0);
+        expected[iter->id] = contents;
+    }
+
+    // a fresh db, so the threads race to load the BBT/NBT as well
+    shared_db_ptr db = open_database(filename, access);
+    vector<int> mismatches(thread_count, 0);
+    boost::thread_group threads;
+
+    for(int i = 0; i < thread_count; ++i)
+        threads.create_thread(concurrent_reader(db, expected, mismatches[i]));
+    threads.join_all();
+
+    for(int i = 0; i < thread_count; ++i)
+        assert(mismatches[i] == 0);
+}
+
+// reads the same node objects as every other thread, walking the subnodes
+// of each as it goes
+struct shared_node_reader
+{
+    shared_node_reader(const std::vector<pstsdk::node>& nodes, const std::vector<std::vector<pstsdk::byte> >& expected, int& mismatches)
+        : m_nodes(nodes), m_expected(expected), m_mismatches(mismatches) { }
+
+    void operator()() const
+    {
+        using namespace pstsdk;
+
+        try
+        {
+            for(size_t i = 0; i < m_nodes.size(); ++i)
+            {
+                const pstsdk::node& n = m_nodes[i];
+                std::vector<byte> contents(n.size());
+                if(!contents.empty())
+                    n.read(contents, 0);
+
+                if(contents != m_expected[i])
+                    ++m_mismatches;
+
+                // every thread builds or reuses the node's one subnode map,
+                // which is empty for a node without subnodes
+                try
+                {
+                    n.lookup(0);
+                    ++m_mismatches;
+                }
+                catch(key_not_found<node_id>&)
+                {
+                }
+
+                if(n.get_sub_id() == 0)
+                    continue;
+
+                for(const_subnodeinfo_iterator sub = n.subnode_info_begin(); sub != n.subnode_info_end(); ++sub)
+                {
+                    (void)pstsdk::node(n, *sub).size();
+                    if(n.lookup(sub->id).get_id() != sub->id)
+                        ++m_mismatches;
+                }
+            }
+        }
+        catch(std::exception&)
+        {
+            ++m_mismatches;
+        }
+    }
+
+    const std::vector<pstsdk::node>& m_nodes;
+    const std::vector<std::vector<pstsdk::byte> >& m_expected;
+    int& m_mismatches;
+};
+
+void test_shared_nodes(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+    const int thread_count = 8;
+
+    vector<vector<byte> > expected;
+    shared_db_ptr reference = open_database(filename);
+    for(const_nodeinfo_iterator iter = reference->read_nbt_root()->begin(); iter != reference->read_nbt_root()->end(); ++iter)
+    {
+        pstsdk::node n(reference, *iter);
+        expected.push_back(vector<byte>(n.size()));
+        if(!expected.back().empty())
+            n.read(expected.back(), 0);
+
+        if(n.get_sub_id() == 0)
+            continue;
+
+        for(const_subnodeinfo_iterator sub = n.subnode_info_begin(); sub != n.subnode_info_end(); ++sub)
+        {
+            pstsdk::node s(n, *sub);
+            expected.push_back(vector<byte>(s.size()));
+            if(!expected.back().empty())
+                s.read(expected.back(), 0);
+        }
+    }
+
+    // one set of nodes, none of them read yet, so the threads race to load
+    // the same data blocks, extended block children and subnode blocks
+    for(int decode = 0; decode < 2; ++decode)
+    {
+        shared_db_ptr db = open_database(filename);
+        if(decode)
+            db->set_decode_pool(std::tr1::shared_ptr<task_pool>(new task_pool(2)));
+
+        // subnodes are reached through a separate copy of their parent, so
+        // the parents in the list still have their subnode blocks to load
+        vector<pstsdk::node> nodes;
+        for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter)
+        {
+            nodes.push_back(pstsdk::node(db, *iter));
+
+            pstsdk::node parent(db, *iter);
+            if(parent.get_sub_id() == 0)
+                continue;
+
+            for(const_subnodeinfo_iterator sub = parent.subnode_info_begin(); sub != parent.subnode_info_end(); ++sub)
+                nodes.push_back(pstsdk::node(parent, *sub));
+        }
+        assert(nodes.size() == expected.size());
+
+        vector<int> mismatches(thread_count, 0);
+        boost::thread_group threads;
+        for(int i = 0; i < thread_count; ++i)
+            threads.create_thread(shared_node_reader(nodes, expected, mismatches[i]));
+        threads.join_all();
+
+        for(int i = 0; i < thread_count; ++i)
+            assert(mismatches[i] == 0);
+    }
+}
+
+void test_block_cache(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr db = open_database(filename);
+    pstsdk::node store = db->lookup_node(nid_message_store);
+    vector<byte> first(store.size());
+    store.read(first, 0);
+
+    // a second node object for the same id is served from the cache
+    cache_stats before = db->get_block_cache_stats();
+    pstsdk::node again = db->lookup_node(nid_message_store);
+    vector<byte> second(again.size());
+    again.read(second, 0);
+    cache_stats after = db->get_block_cache_stats();
+
+    assert(first == second);
+    assert(after.hits > before.hits);
+    assert(after.misses == before.misses);
+    assert(after.cost <= after.budget);
+
+    // disabling the cache empties it, and reads still work
+    db->set_block_cache_size(0);
+    assert(db->get_block_cache_stats().entries == 0);
+    pstsdk::node uncached = db->lookup_node(nid_message_store);
+    vector<byte> third(uncached.size());
+    uncached.read(third, 0);
+    assert(first == third);
+    assert(db->get_block_cache_stats().entries == 0);
+}
+
+void test_page_cache(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr db = open_database(filename);
+    std::tr1::shared_ptr<const nbt_page> nbt_root = db->read_nbt_root();
+    std::tr1::shared_ptr<const bbt_page> bbt_root = db->read_bbt_root();
+
+    vector<node_id> nodes;
+    for(const_nodeinfo_iterator iter = nbt_root->begin(); iter != nbt_root->end(); ++iter)
+        nodes.push_back(iter->id);
+    size_t blocks = 0;
+    for(const_blockinfo_iterator iter = bbt_root->begin(); iter != bbt_root->end(); ++iter)
+        ++blocks;
+
+    // the walks above cached every leaf, so reading one again only hits
+    std::tr1::shared_ptr<const nbt_nonleaf_page> nbt_nonleaf = std::tr1::dynamic_pointer_cast<const nbt_nonleaf_page>(nbt_root);
+    assert(nbt_nonleaf && nbt_nonleaf->get_level() == 1);
+
+    cache_stats before = db->get_page_cache_stats();
+    assert(before.entries > 0 && before.evictions == 0);
+    for(uint i = 0; i < nbt_nonleaf->num_values(); ++i)
+        assert(db->read_nbt_page(nbt_nonleaf->get_child_page_info(i))->get_level() == 0);
+    cache_stats after = db->get_page_cache_stats();
+    assert(after.hits == before.hits + nbt_nonleaf->num_values());
+    assert(after.misses == before.misses);
+    assert(after.entries == before.entries);
+
+    // as do lookups
+    for(size_t i = 0; i < nodes.size(); ++i)
+        assert(db->lookup_node_info(nodes[i]).id == nodes[i]);
+    assert(db->get_page_cache_stats().misses == before.misses);
+    assert(after.entries <= after.budget);
+
+    // with no cache at all, lookups and walks still see every entry
+    db->set_page_cache_size(0);
+    assert(db->get_page_cache_stats().entries == 0);
+
+    size_t count = 0;
+    for(const_nodeinfo_iterator iter = nbt_root->begin(); iter != nbt_root->end(); ++iter)
+        assert(iter->id == nodes[count++]);
+    assert(count == nodes.size());
+
+    count = 0;
+    for(const_blockinfo_iterator iter = bbt_root->begin(); iter != bbt_root->end(); ++iter)
+        ++count;
+    assert(count == blocks);
+
+    for(size_t i = 0; i < nodes.size(); ++i)
+        assert(db->lookup_node_info(nodes[i]).id == nodes[i]);
+    assert(db->get_page_cache_stats().entries == 0);
+
+    // a cache smaller than its shard count still caches
+    db->set_page_cache_size(1);
+    page_info leaf = nbt_nonleaf->get_child_page_info(0);
+    db->read_nbt_page(leaf);
+    before = db->get_page_cache_stats();
+    assert(before.entries == 1);
+    db->read_nbt_page(leaf);
+    assert(db->get_page_cache_stats().hits == before.hits + 1);
+}
+
+void test_flat_index(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr paged = open_database(filename);
+    shared_db_ptr flat = open_database(filename, file_access_positional, index_mode_flat);
+
+    // same entries, in the same order
+    const_nodeinfo_iterator piter = paged->read_nbt_root()->begin();
+    const_nodeinfo_iterator fiter = flat->read_nbt_root()->begin();
+    for(; piter != paged->read_nbt_root()->end(); ++piter, ++fiter)
+    {
+        assert(fiter != flat->read_nbt_root()->end());
+        assert(fiter->id == piter->id);
+        assert(fiter->data_bid == piter->data_bid);
+        assert(flat->lookup_node_info(piter->id).sub_bid == piter->sub_bid);
+    }
+    assert(fiter == flat->read_nbt_root()->end());
+
+    size_t blocks = 0;
+    for(const_blockinfo_iterator iter = paged->read_bbt_root()->begin(); iter != paged->read_bbt_root()->end(); ++iter, ++blocks)
+    {
+        pstsdk::block_info bi = flat->lookup_block_info(iter->id);
+        assert(bi.address == iter->address && bi.size == iter->size);
+    }
+    assert(blocks == flat->read_bbt_root()->num_values());
+
+    bool caught_not_found = false;
+    try
+    {
+        flat->lookup_node_info(0xFFFFFFFF);
+    }
+    catch(key_not_found<node_id>&)
+    {
+        caught_not_found = true;
+    }
+    assert(caught_not_found);
+
+    // and the nodes read back identically
+    pstsdk::node store = flat->lookup_node(nid_message_store);
+    pstsdk::node expected = paged->lookup_node(nid_message_store);
+    vector<byte> a(store.size()), b(expected.size());
+    store.read(a, 0);
+    expected.read(b, 0);
+    assert(a == b);
+}
+
+void test_readahead(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr reference = open_database(filename);
+    reference->set_readahead(0);
+
+    vector<node_id> nodes;
+    for(const_nodeinfo_iterator iter = reference->read_nbt_root()->begin(); iter != reference->read_nbt_root()->end(); ++iter)
+        nodes.push_back(iter->id);
+    vector<block_id> blocks;
+    for(const_blockinfo_iterator iter = reference->read_bbt_root()->begin(); iter != reference->read_bbt_root()->end(); ++iter)
+        blocks.push_back(iter->id);
+
+    struct { file_access access; file_prefetch method; pstsdk::uint count; } configs[] = {
+        { file_access_positional, file_prefetch_advise, readahead_default_count },
+        { file_access_mmap, file_prefetch_advise, 1 },
+        { file_access_stdio, file_prefetch_thread, 2 },
+        { file_access_mmap, file_prefetch_thread, readahead_default_count },
+        { file_access_positional, file_prefetch_none, readahead_default_count }
+    };
+
+    // hints must never change what is read
+    for(size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i)
+    {
+        shared_db_ptr db = open_database(filename, configs[i].access);
+        db->set_prefetch_method(configs[i].method);
+        db->set_readahead(configs[i].count);
+        assert(db->get_readahead() == configs[i].count);
+
+        size_t pos = 0;
+        for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter, ++pos)
+            assert(iter->id == nodes[pos]);
+        assert(pos == nodes.size());
+
+        pos = 0;
+        for(const_blockinfo_iterator iter = db->read_bbt_root()->begin(); iter != db->read_bbt_root()->end(); ++iter, ++pos)
+            assert(iter->id == blocks[pos]);
+        assert(pos == blocks.size());
+
+        for(size_t j = 0; j < nodes.size(); ++j)
+        {
+            pstsdk::node n(db->lookup_node(nodes[j]));
+            pstsdk::node expected(reference->lookup_node(nodes[j]));
+            vector<byte> a(n.size()), b(expected.size());
+            if(a.empty())
+                continue;
+            n.read(a, 0);
+            expected.read(b, 0);
+            assert(a == b);
+        }
+
+        // unknown blocks and ranges past eof are ignored
+        db->prefetch_block(0xFFFFFFF0);
+    }
+}
+
+void test_single_threaded(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr reference = open_database(filename);
+    shared_db_ptr db = open_database(filename);
+    assert(!db->is_single_threaded());
+    db->set_single_threaded(true);
+    assert(db->is_single_threaded());
+
+    for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter)
+    {
+        pstsdk::node n(db->lookup_node(iter->id));
+        pstsdk::node expected(reference->lookup_node(iter->id));
+        if(n.get_data_id() == 0)
+            continue;
+
+        data_block_ptr pblock = n.get_data_block();
+#ifdef PSTSDK_INTRUSIVE_REFCOUNT
+        assert(!pblock->is_atomic_count());
+#ifndef PSTSDK_SINGLE_THREADED
+        assert(expected.get_data_block()->is_atomic_count());
+#endif
+#endif
+
+        // plain counts still count
+        long refs = reference_count(pblock);
+        {
+            data_block_ptr copy(pblock);
+            assert(reference_count(pblock) == refs + 1);
+        }
+        assert(reference_count(pblock) == refs);
+
+        vector<byte> a(n.size()), b(expected.size());
+        if(!a.empty())
+        {
+            n.read(a, 0);
+            expected.read(b, 0);
+            assert(a == b);
+        }
+
+#ifdef PSTSDK_INTRUSIVE_REFCOUNT
+        // subnodes count the way their container does
+        if(n.get_sub_id() != 0)
+        {
+            for(const_subnodeinfo_iterator sub = n.subnode_info_begin(); sub != n.subnode_info_end(); ++sub)
+            {
+                pstsdk::node child(n, *sub);
+                if(child.get_data_id() != 0)
+                    assert(!child.get_data_block()->is_atomic_count());
+            }
+        }
+#endif
+    }
+}
+
+void compare_node_data(const pstsdk::node& n, const pstsdk::node& expected)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<byte> a(n.size()), b(expected.size());
+    assert(a.size() == b.size());
+    if(!a.empty())
+    {
+        n.read(a, 0);
+        expected.read(b, 0);
+        assert(a == b);
+    }
+
+    if(n.get_sub_id() == 0)
+        return;
+
+    for(const_subnodeinfo_iterator sub = n.subnode_info_begin(); sub != n.subnode_info_end(); ++sub)
+        compare_node_data(node(n, *sub), node(expected, *sub));
+}
+
+void test_decode_pool(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr reference = open_database(filename);
+    shared_db_ptr db = open_database(filename);
+    std::tr1::shared_ptr<task_pool> pool(new task_pool(2));
+
+    assert(!db->get_decode_pool());
+    db->set_decode_pool(pool);
+    assert(db->get_decode_pool() == pool);
+
+    // reads come out the same, whole or in pieces
+    for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter)
+    {
+        pstsdk::node n(db->lookup_node(iter->id));
+        pstsdk::node expected(reference->lookup_node(iter->id));
+        compare_node_data(n, expected);
+
+        // and starting part way into the first page
+        if(n.size() > 3)
+        {
+            pstsdk::node again(db->lookup_node(iter->id));
+            vector<byte> a(n.size()), b(n.size() - 3);
+            expected.read(a, 0);
+            again.read(b, 3);
+            assert(std::equal(b.begin(), b.end(), a.begin() + 3));
+        }
+    }
+
+    // one pool serves several databases at once; with no block caches
+    // every read decodes again
+    map<node_id, vector<byte> > expected;
+    for(const_nodeinfo_iterator iter = reference->read_nbt_root()->begin(); iter != reference->read_nbt_root()->end(); ++iter)
+    {
+        pstsdk::node n(reference, *iter);
+        vector<byte> contents(n.size());
+        n.read(contents, 0);
+        expected[iter->id] = contents;
+    }
+
+    shared_db_ptr other = open_database(filename);
+    other->set_decode_pool(pool);
+    db->set_block_cache_size(0);
+    other->set_block_cache_size(0);
+
+    vector<int> mismatches(2, 0);
+    boost::thread_group threads;
+    threads.create_thread(concurrent_reader(db, expected, mismatches[0]));
+    threads.create_thread(concurrent_reader(other, expected, mismatches[1]));
+    threads.join_all();
+    assert(mismatches[0] == 0);
+    assert(mismatches[1] == 0);
+
+    db->set_decode_pool(std::tr1::shared_ptr<task_pool>());
+    assert(!db->get_decode_pool());
+    assert(other->get_decode_pool() == pool);
+}
+
+void test_snapshot(const std::wstring& filename, const std::wstring& other)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    shared_db_ptr db = open_database(filename);
+    nbt_snapshot snap(db);
+
+    size_t count = 0;
+    for(const_nodeinfo_iterator iter = db->read_nbt_root()->begin(); iter != db->read_nbt_root()->end(); ++iter, ++count)
+    {
+        assert(snap.get_nodes()[count].id == iter->id);
+        assert(snap.get_nodes()[count].data_bid == iter->data_bid);
+        assert(snap.get_nodes()[count].sub_bid == iter->sub_bid);
+        assert(snap.get_nodes()[count].parent_id == iter->parent_id);
+    }
+    assert(count == snap.get_nodes().size());
+    assert(snap.get_pages_read() > 0);
+    assert(snap.get_stamp() == db->get_header_stamp());
+    assert(diff_snapshots(snap, snap).empty());
+
+    // round trip through a stream
+    stringstream stream(ios::in | ios::out | ios::binary);
+    snap.save(stream);
+    nbt_snapshot loaded;
+    loaded.load(stream);
+    assert(loaded.get_stamp() == snap.get_stamp());
+    assert(diff_snapshots(snap, loaded).empty());
+    assert(loaded.get_nodes().size() == snap.get_nodes().size());
+
+    // nothing has changed, so a second snapshot reads nothing
+    shared_db_ptr reopened = open_database(filename, file_access_mmap, index_mode_flat);
+    nbt_snapshot again(reopened, loaded);
+    assert(again.get_pages_read() == 0);
+    assert(diff_snapshots(loaded, again).empty());
+
+    // and even when the header says otherwise, no leaf page is read twice
+    string bytes = stream.str();
+    bytes[16 + 24] = ~bytes[16 + 24]; // header_stamp::unique
+    stringstream stale_stream(bytes, ios::in | ios::binary);
+    nbt_snapshot stale;
+    stale.load(stale_stream);
+    assert(stale.get_stamp() != snap.get_stamp());
+    nbt_snapshot incremental(db, stale);
+    assert(incremental.get_pages_read() == 0);
+    assert(diff_snapshots(snap, incremental).empty());
+
+    // everything is new relative to an empty snapshot
+    vector<node_delta> all = diff_snapshots(nbt_snapshot(), snap);
+    assert(all.size() == snap.get_nodes().size());
+    for(size_t i = 0; i < all.size(); ++i)
+        assert(all[i].change == node_added && all[i].after.id == snap.get_nodes()[i].id);
+
+    // applying the delta between two stores turns one into the other
+    nbt_snapshot target(open_database(other));
+    map<node_id, pstsdk::node_info> nodes;
+    for(size_t i = 0; i < snap.get_nodes().size(); ++i)
+        nodes[snap.get_nodes()[i].id] = snap.get_nodes()[i];
+
+    vector<node_delta> deltas = diff_snapshots(snap, target);
+    for(size_t i = 0; i < deltas.size(); ++i)
+    {
+        if(deltas[i].change == node_removed)
+        {
+            assert(nodes.count(deltas[i].before.id) == 1);
+            nodes.erase(deltas[i].before.id);
+        }
+        else
+        {
+            assert(nodes.count(deltas[i].after.id) == (deltas[i].change == node_changed ? 1u : 0u));
+            nodes[deltas[i].after.id] = deltas[i].after;
+        }
+    }
+    assert(nodes.size() == target.get_nodes().size());
+    for(size_t i = 0; i < target.get_nodes().size(); ++i)
+    {
+        const pstsdk::node_info& expected = target.get_nodes()[i];
+        assert(nodes[expected.id].data_bid == expected.data_bid && nodes[expected.id].sub_bid == expected.sub_bid);
+    }
+
+    bool caught = false;
+    try
+    {
+        stringstream garbage("not a snapshot");
+        loaded.load(garbage);
+    }
+    catch(invalid_format&)
+    {
+        caught = true;
+    }
+    assert(caught);
+
+    // counts the stream can't back are rejected before anything is sized
+    // from them; 8 and 12 are the leaf and node counts
+    for(int i = 0; i < 3; ++i)
+    {
+        string bad = stream.str();
+        if(i == 0)
+            memset(&bad[8], 0xFF, 4);
+        else if(i == 1)
+            memset(&bad[12], 0xFF, 4);
+        else
+            bad.resize(bad.size() - 1);
+
+        stringstream bad_stream(bad, ios::in | ios::binary);
+        caught = false;
+        try
+        {
+            loaded.load(bad_stream);
+        }
+        catch(invalid_format&)
+        {
+            caught = true;
+        }
+        assert(caught);
+    }
+    assert(diff_snapshots(snap, loaded).empty());
+}
+
+// read a node's data, reporting if the read failed a CRC check
+bool read_fails_crc(pstsdk::node& n)
+{
+    try
+    {
+        std::vector<pstsdk::byte> data(n.size());
+        n.read(data, 0);
+    }
+    catch(pstsdk::crc_fail&)
+    {
+        return true;
+    }
+    return false;
+}
+
+// damage (or repair) a copy of a file by flipping the bits of one byte
+void flip_first_byte(const char* filename, pstsdk::ulonglong address)
+{
+    std::fstream damage(filename, std::ios::binary | std::ios::in | std::ios::out);
+    damage.seekg(static_cast<std::streamoff>(address));
+    char c = static_cast<char>(damage.get());
+    damage.seekp(static_cast<std::streamoff>(address));
+    damage.put(static_cast<char>(c ^ 0xFF));
+}
+
+void test_lazy_validation(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    // a clean file reads the same under every level
+    shared_db_ptr full = open_database(filename, file_access_positional, index_mode_paged, validation_level_full);
+    shared_db_ptr lazy = open_database(filename, file_access_positional, index_mode_paged, validation_level_lazy);
+    assert(full->get_validation_level() == validation_level_full);
+    assert(lazy->get_validation_level() == validation_level_lazy);
+
+    pstsdk::node full_store = full->lookup_node(nid_message_store);
+    pstsdk::node lazy_store = lazy->lookup_node(nid_message_store);
+    vector<byte> expected(full_store.size()), actual(lazy_store.size());
+    full_store.read(expected, 0);
+    lazy_store.read(actual, 0);
+    assert(expected == actual);
+
+    // now damage the payload of the message store's data block in a copy
+    pstsdk::block_info bi = full->lookup_block_info(full_store.get_data_id());
+    assert(disk::bid_is_external(bi.id));
+    full.reset();
+    lazy.reset();
+
+    const char* copy_name = "lazy_validation.pst";
+    {
+        string narrow(filename.begin(), filename.end());
+        ifstream in(narrow.c_str(), ios::binary);
+        ofstream out(copy_name, ios::binary);
+        out << in.rdbuf();
+    }
+    wstring wide_copy_name(copy_name, copy_name + strlen(copy_name));
+
+    // the deferred check is of the data the block was read into, not of
+    // whatever the file holds by the time it runs; this damage stays for
+    // the rest of the test
+    {
+        shared_db_ptr db = open_database(wide_copy_name, file_access_positional, index_mode_paged, validation_level_lazy);
+        pstsdk::node store = db->lookup_node(nid_message_store);
+        assert(store.size() == expected.size());
+
+        flip_first_byte(copy_name, bi.address);
+        assert(!read_fails_crc(store));
+    }
+
+    // full validation catches it as soon as the block is read
+    {
+        shared_db_ptr db = open_database(wide_copy_name, file_access_positional, index_mode_paged, validation_level_full);
+        pstsdk::node store = db->lookup_node(nid_message_store);
+        bool caught = false;
+        try
+        {
+            store.size();
+        }
+        catch(crc_fail&)
+        {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // lazy validation hands out the size, and catches it on the first read
+    {
+        shared_db_ptr db = open_database(wide_copy_name, file_access_positional, index_mode_paged, validation_level_lazy);
+        pstsdk::node store = db->lookup_node(nid_message_store);
+        assert(store.size() == expected.size());
+
+        // repairing the file after the block was read doesn't help it
+        flip_first_byte(copy_name, bi.address);
+        assert(read_fails_crc(store));
+        assert(read_fails_crc(store));
+        flip_first_byte(copy_name, bi.address);
+    }
+
+    // and weak validation never looks
+    {
+        shared_db_ptr db = open_database(wide_copy_name, file_access_positional, index_mode_paged, validation_level_weak);
+        pstsdk::node store = db->lookup_node(nid_message_store);
+        assert(!read_fails_crc(store));
+
+        // the level can be raised after opening; the cached block was
+        // already accepted, so only newly read blocks are checked
+        db->set_validation_level(validation_level_full);
+        db->set_block_cache_size(0);
+        pstsdk::node again = db->lookup_node(nid_message_store);
+        assert(read_fails_crc(again));
+    }
+
+    remove(copy_name);
+}
+
 void test_db()
 {
     using namespace std;
@@ -276,6 +1102,30 @@ void test_db()
         assert(iter->size == block_info_ansi[block].size);
         assert(iter->ref_count == block_info_ansi[block].refs);
     }
-}
 
+    test_mapped_db(L"test_unicode.pst");
+    test_mapped_db(L"test_ansi.pst");
+    test_mapped_db(L"sample1.pst");
+
+    test_concurrent_db(L"sample1.pst", file_access_positional);
+    test_concurrent_db(L"sample1.pst", file_access_mmap);
+    test_concurrent_db(L"sample1.pst", file_access_stdio);
+    test_concurrent_db(L"test_unicode.pst", file_access_positional);
+    test_shared_nodes(L"sample1.pst");
+    test_shared_nodes(L"test_unicode.pst");
 
+    test_block_cache(L"sample1.pst");
+    test_page_cache(L"sample1.pst");
+    test_flat_index(L"sample1.pst");
+    test_flat_index(L"test_ansi.pst");
+    test_lazy_validation(L"sample1.pst");
+    test_lazy_validation(L"test_ansi.pst");
+    test_readahead(L"sample1.pst");
+    test_readahead(L"test_unicode.pst");
+    test_single_threaded(L"sample1.pst");
+    test_single_threaded(L"test_ansi.pst");
+    test_decode_pool(L"sample1.pst");
+    test_decode_pool(L"test_unicode.pst");
+    test_snapshot(L"sample1.pst", L"sample2.pst");
+    test_snapshot(L"test_ansi.pst", L"test_unicode.pst");
+}
@@ -86,8 +86,149 @@ void test_disk_structures(pstsdk::file& file)
     test_page<T>(file, pheader->root_info.brefBBT, pheader->bCryptMethod);
 }
 
+void test_crc()
+{
+    using namespace pstsdk;
+    using namespace pstsdk::disk;
+
+    // the check value of this CRC-32 variant (no pre or post inversion)
+    const char check[] = "123456789";
+    assert(compute_crc_bytewise(check, 9) == 0x2DFD2D88);
+
+    std::vector<byte> data(4096 + 16);
+    pstsdk::ulong seed = 0x12345678;
+    for(size_t i = 0; i < data.size(); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = static_cast<byte>(seed >> 16);
+    }
+
+    // every engine agrees at every length and alignment, including the
+    // sizes which straddle the vector kernel's 64 and 16 byte steps
+    for(pstsdk::ulong offset = 0; offset < 16; offset += 3)
+    {
+        for(pstsdk::ulong cb = 0; cb <= 4096; cb += (cb < 160 ? 1 : 61))
+        {
+            pstsdk::ulong expected = compute_crc_bytewise(&data[offset], cb);
+
+            assert(compute_crc_slice8(&data[offset], cb) == expected);
+            assert(compute_crc(&data[offset], cb) == expected);
+#ifdef PSTSDK_CRC_CLMUL
+            if(crc_clmul_supported())
+                assert(compute_crc_clmul(&data[offset], cb) == expected);
+#endif
+        }
+    }
+
+    // and can be chained
+    pstsdk::ulong first = compute_crc_slice8(&data[0], 1000);
+    assert(compute_crc_bytewise(&data[1000], 3000, first) == compute_crc_bytewise(&data[0], 4000));
+}
+
+// the byte at a time reference algorithms, straight from [MS-PST] 5.1/5.2
+void reference_permute(std::vector<pstsdk::byte>& data, bool encrypt)
+{
+    using namespace pstsdk::disk;
+    const pstsdk::byte * ptable = encrypt ? table1 : table3;
+
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = ptable[data[i]];
+}
+
+void reference_cyclic(std::vector<pstsdk::byte>& data, pstsdk::ulong key)
+{
+    using namespace pstsdk::disk;
+    pstsdk::ushort w = (pstsdk::ushort)(key ^ (key >> 16));
+
+    for(size_t i = 0; i < data.size(); ++i)
+    {
+        pstsdk::byte b = data[i];
+        b = (pstsdk::byte)(b + (pstsdk::byte)w);
+        b = table1[b];
+        b = (pstsdk::byte)(b + (pstsdk::byte)(w >> 8));
+        b = table2[b];
+        b = (pstsdk::byte)(b - (pstsdk::byte)(w >> 8));
+        b = table3[b];
+        b = (pstsdk::byte)(b - (pstsdk::byte)w);
+        data[i] = b;
+        w = (pstsdk::ushort)(w + 1);
+    }
+}
+
+typedef void (*permute_kernel)(void*, const void*, pstsdk::ulong, bool);
+typedef void (*cyclic_kernel)(void*, const void*, pstsdk::ulong, pstsdk::ulong);
+
+void test_decode_kernel(permute_kernel permute, cyclic_kernel cyclic)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<byte> source(1100);
+    for(size_t i = 0; i < source.size(); ++i)
+        source[i] = static_cast<byte>(i * 7 + (i >> 8));
+
+    // keys chosen so the running key wraps its low byte and its high byte
+    const pstsdk::ulong keys[] = { 0, 1, 0xF0, 0xFFE0, 0x1234FFF8, 0xDEADBEEF };
+
+    for(size_t cb = 0; cb <= source.size(); cb += (cb < 100 ? 1 : 37))
+    {
+        vector<byte> input(source.begin(), source.begin() + cb);
+        vector<byte> output(cb + 1, 0xCC);
+
+        for(int encrypt = 0; encrypt < 2; ++encrypt)
+        {
+            vector<byte> expected(input);
+            reference_permute(expected, encrypt != 0);
+
+            permute(&output[0], cb ? &input[0] : NULL, cb, encrypt != 0);
+            assert(equal(expected.begin(), expected.end(), output.begin()));
+            assert(output[cb] == 0xCC);
+
+            vector<byte> in_place(input);
+            if(cb)
+                permute(&in_place[0], &in_place[0], cb, encrypt != 0);
+            assert(in_place == expected);
+        }
+
+        vector<byte> round_trip(input);
+        if(cb)
+        {
+            permute(&round_trip[0], &round_trip[0], cb, true);
+            permute(&round_trip[0], &round_trip[0], cb, false);
+        }
+        assert(round_trip == input);
+
+        for(size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); ++k)
+        {
+            vector<byte> expected(input);
+            reference_cyclic(expected, keys[k]);
+
+            cyclic(&output[0], cb ? &input[0] : NULL, cb, keys[k]);
+            assert(equal(expected.begin(), expected.end(), output.begin()));
+            assert(output[cb] == 0xCC);
+        }
+    }
+}
+
+void test_decode()
+{
+    using namespace pstsdk::disk;
+
+    test_decode_kernel(permute_scalar, cyclic_scalar);
+    test_decode_kernel(permute_copy, cyclic_copy);
+#ifdef PSTSDK_X86_SIMD
+    if(ssse3_supported())
+        test_decode_kernel(permute_ssse3, cyclic_ssse3);
+    if(avx2_supported())
+        test_decode_kernel(permute_avx2, cyclic_avx2);
+#endif
+}
+
 void test_disk() 
 {
+    test_crc();
+    test_decode();
+
     using namespace std;
     using namespace pstsdk;
     file uni(L"test_unicode.pst");
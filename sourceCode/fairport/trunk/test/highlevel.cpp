@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include "test.h"
 #include "pstsdk/ndb.h"
 #include "pstsdk/ltp.h"
@@ -51,6 +54,28 @@ void test_nameid_map_samp1(pstsdk::shared_db_ptr pdb)
         not_found = true;
     }
     assert(not_found);
+    assert(!nm.named_prop_exists(t6));
+
+    not_found = false;
+    try
+    {
+        nm.lookup(static_cast<prop_id>(0x8000 + nm.get_prop_count()));
+    }
+    catch(key_not_found<prop_id>&)
+    {
+        not_found = true;
+    }
+    assert(not_found);
+
+    // every mapping should round trip through the index
+    std::vector<prop_id> props = nm.get_prop_list();
+    assert(props.size() == nm.get_prop_count());
+    for(size_t i = 0; i < props.size(); ++i)
+        assert(nm.lookup(nm.lookup(props[i])) == props[i]);
+
+    // ps_mapi ids below 0x8000 map to themselves
+    assert(nm.lookup(ps_mapi, 0x37) == 0x37);
+    assert(!nm.id_exists(ps_mapi, 0x8001));
 }
 
 void test_prop_stream(pstsdk::const_property_object& obj, pstsdk::prop_id id)
@@ -62,16 +87,83 @@ void test_prop_stream(pstsdk::const_property_object& obj, pstsdk::prop_id id)
 
     assert(contents.size() == obj.size(id));
 
+    pstsdk::byte_slice view = obj.read_prop_slice(id);
+    assert(view.size() == contents.size());
+    assert(std::equal(view.begin(), view.end(), contents.begin()));
+
     stream.unsetf(std::ios::skipws);
     while(stream >> b)
         assert(b == contents[pos++]);
 }
 
+// batched column reads must agree with reading each cell on its own
+void test_table_columns(const pstsdk::table& tc)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<column_batch> columns;
+    std::vector<prop_id> prop_list = tc.get_prop_list();
+    for(size_t c = 0; c < prop_list.size(); ++c)
+        columns.push_back(column_batch(prop_list[c]));
+    columns.push_back(column_batch(0xFFFE)); // not a column
+
+    const pstsdk::ulong step[] = { static_cast<pstsdk::ulong>(tc.size()), 3, 1 };
+    for(int s = 0; s < 3; ++s)
+    {
+        if(step[s] == 0)
+            continue;
+
+        for(pstsdk::ulong start = 0; start < tc.size(); start += step[s])
+        {
+            pstsdk::ulong count = tc.read_columns(start, step[s], columns);
+            assert(count == std::min<pstsdk::ulong>(step[s], tc.size() - start));
+
+            for(size_t c = 0; c < columns.size(); ++c)
+            {
+                assert(columns[c].values.size() == count);
+
+                prepared_column column = tc.prepare_column(columns[c].id);
+                assert(column.get_id() == columns[c].id);
+                assert(column.is_present() == (c + 1 < columns.size()));
+
+                for(pstsdk::ulong r = 0; r < count; ++r)
+                {
+                    bool exists = tc[start + r].prop_exists(columns[c].id);
+                    assert(columns[c].exists(r) == exists);
+                    assert(tc.prop_exists(start + r, column) == exists);
+                    if(exists)
+                    {
+                        assert(columns[c].values[r] == tc.get_cell_value(start + r, columns[c].id));
+                        assert(columns[c].values[r] == tc.get_cell_value(start + r, column));
+                    }
+                }
+            }
+        }
+    }
+
+    assert(tc.read_columns(tc.size(), 10, columns) == 0);
+    assert(!columns[0].exists(0));
+    assert(!column_batch(columns[0].id).exists(0));
+    bool caught = false;
+    try
+    {
+        tc.read_columns(tc.size() + 1, 1, columns);
+    }
+    catch(std::out_of_range&)
+    {
+        caught = true;
+    }
+    assert(caught);
+}
+
 void test_table(const pstsdk::table& tc)
 {
     using namespace std;
     using namespace pstsdk;
 
+    test_table_columns(tc);
+
     wcout << "Properties on this table (" << tc.size() << "): " << endl;
     std::vector<prop_id> prop_list = tc.get_prop_list();
     for(pstsdk::uint i = 0; i < prop_list.size(); ++i)
@@ -173,6 +265,14 @@ void iterate(pstsdk::shared_db_ptr pdb)
         std::vector<byte> buffer(n.size());
         n.read(buffer, 0);
 
+        // a view of the node must match a copy of it, and a view of a
+        // single page shares that page's buffer rather than copying it
+        byte_slice view = n.read_slice(0, n.size());
+        assert(view.size() == buffer.size());
+        assert(std::equal(view.begin(), view.end(), buffer.begin()));
+        if(n.size() > 0 && n.get_page_count() == 1)
+            assert(n.read_slice(0, 0, n.size()).get_storage() == view.get_storage());
+
         try
         {
             property_bag bag(n);
@@ -1,7 +1,13 @@
 #include <cassert>
+#include <clocale>
 #include <iostream>
 #include <string>
 #include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
 
 #include "test.h"
 
@@ -12,6 +18,14 @@
 #include "pstsdk/pst/message.h"
 #include "pstsdk/pst/folder.h"
 #include "pstsdk/pst/pst.h"
+#include "pstsdk/pst/catalog.h"
+
+// what the utf8 accessors should return, by way of the wide ones
+std::string to_utf8(const std::wstring& wstr)
+{
+    std::vector<pstsdk::byte> bytes = pstsdk::wstring_to_utf16le(wstr);
+    return bytes.empty() ? std::string() : pstsdk::utf16le_to_utf8(&bytes[0], bytes.size());
+}
 
 void process_recipient(const pstsdk::recipient& r)
 {
@@ -19,9 +33,27 @@ void process_recipient(const pstsdk::recipient& r)
     using namespace pstsdk;
 
     wcout << "\t\t" << r.get_name() << "(" << r.get_email_address() << ")\n";
+
+    assert(r.get_name_utf8() == to_utf8(r.get_name()));
+    assert(r.get_email_address_utf8() == to_utf8(r.get_email_address()));
 }
 
 void process_message(const pstsdk::message& m);
+
+struct page_collector
+{
+    std::vector<pstsdk::byte> bytes;
+    size_t pages;
+
+    page_collector() : pages(0) { }
+    void operator()(const pstsdk::byte_slice& page)
+    {
+        assert(!page.empty());
+        assert(page.size() <= pstsdk::disk::external_block<pstsdk::ulong>::max_size);
+        bytes.insert(bytes.end(), page.begin(), page.end());
+        ++pages;
+    }
+};
 void process_attachment(const pstsdk::attachment& a)
 {
     using namespace std;
@@ -42,6 +74,15 @@ void process_attachment(const pstsdk::attachment& a)
 
         std::vector<byte> contents = a.get_bytes();
         assert(contents.size() == a.content_size());
+
+        // streaming the pages gives the same bytes
+        page_collector collector;
+        assert(a.for_each_page(collector) == contents.size());
+        assert(collector.bytes == contents);
+
+        ostringstream out;
+        assert(a.write_bytes(out) == contents.size());
+        assert(out.str() == string(contents.begin(), contents.end()));
     }
 }
 
@@ -53,6 +94,11 @@ void process_message(const pstsdk::message& m)
     wcout << "Message Subject: " << m.get_subject() << endl;
     wcout << "\tAttachment Count: " << m.get_attachment_count() << endl;
 
+    if(m.has_subject())
+        assert(m.get_subject_utf8() == to_utf8(m.get_subject()));
+    if(m.has_body())
+        assert(m.get_body_utf8() == to_utf8(m.get_body()));
+
     if(m.get_attachment_count() > 0)
     {
         for_each(m.attachment_begin(), m.attachment_end(), process_attachment);
@@ -73,6 +119,7 @@ void process_folder(const pstsdk::folder& f)
     using namespace pstsdk;
 
     wcout << "Folder (M" << f.get_message_count() << ", F" << f.get_subfolder_count() << ") : " << f.get_name() << endl;
+    assert(f.get_name_utf8() == to_utf8(f.get_name()));
 
     for_each(f.message_begin(), f.message_end(), process_message);
 
@@ -89,6 +136,376 @@ void process_pst(const pstsdk::pst& p)
     process_folder(root);
 }
 
+// the callbacks are copied, so they refer to what they collect
+struct message_ids
+{
+    std::vector<pstsdk::node_id> ids;
+    pstsdk::mutex lock;
+};
+
+struct collect_message_ids
+{
+    explicit collect_message_ids(message_ids& out) : m_out(&out) { }
+    void operator()(const pstsdk::node_info& info)
+    {
+        pstsdk::lock_guard guard(m_out->lock);
+        m_out->ids.push_back(info.id);
+    }
+
+    message_ids* m_out;
+};
+
+struct subject_count
+{
+    subject_count() : count(0) { }
+    size_t count;
+    pstsdk::mutex lock;
+};
+
+struct read_subjects
+{
+    explicit read_subjects(subject_count& out) : m_out(&out) { }
+    void operator()(pstsdk::message& m)
+    {
+        m.get_subject();
+        pstsdk::lock_guard guard(m_out->lock);
+        ++m_out->count;
+    }
+
+    subject_count* m_out;
+};
+
+struct throw_on_message
+{
+    void operator()(const pstsdk::node_info&)
+    {
+        throw std::length_error("stop");
+    }
+};
+
+void test_parallel_messages(const pstsdk::pst& store)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<node_id> serial;
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter)
+        serial.push_back(iter->get_id());
+    sort(serial.begin(), serial.end());
+
+    // every message exactly once, whatever the batching
+    parallel_options small;
+    small.threads = 4;
+    small.batch_size = 1;
+    small.max_batches = 1;
+
+    parallel_options options[2];
+    options[0].threads = 4;
+    options[1] = small;
+
+    for(int i = 0; i < 2; ++i)
+    {
+        message_ids collected;
+        vector<worker_stats> stats = store.for_each_message_info(collect_message_ids(collected), options[i]);
+
+#ifndef PSTSDK_SINGLE_THREADED
+        assert(stats.size() == 4);
+#else
+        assert(stats.size() == 1);
+#endif
+        ulonglong items = 0;
+        for(size_t j = 0; j < stats.size(); ++j)
+            items += stats[j].items;
+        assert(items == serial.size());
+
+        sort(collected.ids.begin(), collected.ids.end());
+        assert(collected.ids == serial);
+    }
+
+    subject_count subjects;
+    store.for_each_message(read_subjects(subjects), small);
+    assert(subjects.count == serial.size());
+
+    // a failing callback's exception surfaces, as is, on the calling thread
+    if(!serial.empty())
+    {
+        bool threw = false;
+        try
+        {
+            store.for_each_message_info(throw_on_message(), small);
+        }
+        catch(std::length_error&)
+        {
+            threw = true;
+        }
+        assert(threw);
+    }
+}
+
+// a single threaded store must not hand its objects to worker threads
+void test_single_threaded_messages(const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    pst store(filename);
+    store.get_db()->set_single_threaded(true);
+
+    vector<node_id> serial;
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter)
+        serial.push_back(iter->get_id());
+    sort(serial.begin(), serial.end());
+
+    parallel_options options;
+    options.threads = 4;
+
+    message_ids collected;
+    vector<worker_stats> stats = store.for_each_message_info(collect_message_ids(collected), options);
+    assert(stats.size() == 1);
+    assert(stats[0].items == serial.size());
+
+    sort(collected.ids.begin(), collected.ids.end());
+    assert(collected.ids == serial);
+
+    subject_count subjects;
+    store.for_each_message(read_subjects(subjects), options);
+    assert(subjects.count == serial.size());
+}
+
+// a message opened inside an arena must read the same as one opened outside,
+// and must stay usable after the arena itself is gone
+std::wstring summarize(const pstsdk::message& m)
+{
+    std::wstring summary = m.has_subject() ? m.get_subject() : std::wstring();
+    summary += static_cast<wchar_t>(L'0' + m.get_recipient_count());
+    summary += static_cast<wchar_t>(L'0' + m.get_attachment_count());
+    if(m.get_recipient_count() > 0)
+        for(pstsdk::message::recipient_iterator r = m.recipient_begin(); r != m.recipient_end(); ++r)
+            summary += r->get_name();
+    return summary;
+}
+
+void test_arena(const pstsdk::pst& store)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<node_id> ids;
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter)
+        ids.push_back(iter->get_id());
+
+    arena batch;
+    for(size_t i = 0; i < ids.size(); ++i)
+    {
+        // the block cache may keep a message's blocks once it's gone, but
+        // none of them come from the arena, so none hold its chunks
+        {
+            arena dropped;
+            {
+                arena_scope scope(dropped);
+                summarize(store.open_message(ids[i]));
+            }
+            assert(dropped.get_stats().live_objects == 0);
+        }
+
+        wstring expected = summarize(store.open_message(ids[i]));
+
+        std::tr1::shared_ptr<message> survivor;
+        {
+            arena per_message;
+            arena_scope scope(per_message);
+
+            message m = store.open_message(ids[i]);
+            assert(summarize(m) == expected);
+            survivor.reset(new message(m));
+
+            arena_stats stats = per_message.get_stats();
+            assert(stats.objects > 0);
+            assert(stats.live_objects > 0);
+            assert(stats.chunks > 0);
+        }
+        assert(summarize(*survivor) == expected);
+
+        // scopes nest, and a batch arena serves many messages
+        arena_scope scope(batch);
+        assert(summarize(store.open_message(ids[i])) == expected);
+    }
+
+    if(!ids.empty())
+        assert(batch.get_stats().objects > 0);
+}
+
+void test_projection(const pstsdk::pst& store)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter)
+    {
+        message m = *iter;
+        const property_bag& bag = m.get_property_bag();
+        vector<prop_id> props = bag.get_prop_list();
+
+        // every property of the message, one of them twice, and one it doesn't have
+        const prop_id missing = 0x7ffe;
+        prop_projection proj(props);
+        proj.add(missing);
+        if(!props.empty())
+            proj.add(props[0]);
+        assert(proj.size() == props.size() + 1);
+
+        bool has_keywords = store.get_name_id_map().name_exists(ps_public_strings, L"Keywords");
+        prop_id keywords = 0;
+        if(has_keywords)
+        {
+            keywords = add_named_prop(proj, named_prop(ps_public_strings, L"Keywords"), store.get_name_id_map());
+            assert(keywords == store.lookup_prop_id(ps_public_strings, L"Keywords"));
+        }
+
+        prop_record r = m.project(proj);
+        assert(!r.prop_exists(missing));
+        assert(!bag.prop_exists(missing));
+        if(has_keywords)
+            assert(r.prop_exists(keywords) == bag.prop_exists(keywords));
+
+        // a copy of a bag gets the same entries
+        property_bag copy(bag);
+        assert(copy.get_prop_list() == bag.get_prop_list());
+
+        vector<prop_id> found = r.get_prop_list();
+        sort(props.begin(), props.end());
+        assert(found == props);
+
+        for(size_t i = 0; i < props.size(); ++i)
+        {
+            assert(r.get_prop_type(props[i]) == bag.get_prop_type(props[i]));
+            assert(r.read_prop<pstsdk::ulong>(props[i]) == bag.read_prop<pstsdk::ulong>(props[i]));
+
+            if(bag.get_prop_type(props[i]) == prop_type_wstring || bag.get_prop_type(props[i]) == prop_type_string)
+                assert(r.read_prop<wstring>(props[i]) == bag.read_prop<wstring>(props[i]));
+        }
+    }
+
+    bool not_found = false;
+    try
+    {
+        prop_projection proj;
+        add_named_prop(proj, named_prop(ps_public_strings, L"fake-property"), store.get_name_id_map());
+    }
+    catch(key_not_found<named_prop>&)
+    {
+        not_found = true;
+    }
+    assert(not_found);
+}
+
+// the hash folds case the same way whatever the locale
+void test_catalog_hash()
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    setlocale(LC_ALL, "C");
+    assert(catalog_hash(L"Hello World") == catalog_hash(L"hELLO wORLD"));
+    assert(catalog_hash(L"Hello World") != catalog_hash(L"Hello Word"));
+
+    // Latin-1, Latin Extended-A, Greek, Cyrillic and fullwidth letters
+    const wchar_t upper[] = { 0x00C9, 0x0178, 0x0141, 0x03A3, 0x0386, 0x0416, 0x0401, 0xFF21, 0 };
+    const wchar_t lower[] = { 0x00E9, 0x00FF, 0x0142, 0x03C3, 0x03AC, 0x0436, 0x0451, 0xFF41, 0 };
+    assert(catalog_hash(upper) == catalog_hash(lower));
+    for(size_t i = 0; upper[i]; ++i)
+        assert(catalog_hash(wstring(1, upper[i])) == catalog_hash(wstring(1, lower[i])));
+
+    // the multiplication sign sits among the capitals, but isn't one
+    assert(catalog_hash(wstring(1, 0x00D7)) != catalog_hash(wstring(1, 0x00F7)));
+}
+
+void test_catalog(const pstsdk::pst& store, const std::wstring& filename)
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    std::tr1::shared_ptr<catalog> cat = open_catalog(store, filename);
+    assert(cat->is_current(store));
+
+    // one entry per message, in node_id order, agreeing with the messages
+    size_t count = 0;
+    for(pst::message_iterator iter = store.message_begin(); iter != store.message_end(); ++iter, ++count)
+    {
+        const catalog_entry& entry = cat->lookup(iter->get_id());
+        assert(entry.folder == iter->get_property_bag().get_node().get_parent_id());
+        assert(entry.attachment_count == iter->get_attachment_count());
+        if(iter->has_subject())
+            assert(entry.subject_hash == catalog_hash(iter->get_subject()));
+
+        catalog_query by_folder;
+        by_folder.folder = entry.folder;
+        vector<node_id> in_folder = cat->find(by_folder);
+        assert(std::find(in_folder.begin(), in_folder.end(), entry.id) != in_folder.end());
+
+        if(iter->has_subject())
+        {
+            catalog_query by_subject;
+            by_subject.subject = iter->get_subject();
+            vector<node_id> same_subject = cat->find(by_subject);
+            assert(std::find(same_subject.begin(), same_subject.end(), entry.id) != same_subject.end());
+        }
+    }
+    assert(count == cat->size());
+    for(size_t i = 1; i < cat->size(); ++i)
+        assert((*cat)[i-1].id < (*cat)[i].id);
+
+    assert(cat->find(catalog_query()).size() == cat->size());
+
+    bool caught = false;
+    try
+    {
+        cat->lookup(0xFFFFFFE4);
+    }
+    catch(key_not_found<node_id>&)
+    {
+        caught = true;
+    }
+    assert(caught);
+
+    // a catalog from another state of the store is rebuilt
+    std::tr1::shared_ptr<catalog> reopened = open_catalog(store, filename);
+    assert(reopened->size() == cat->size());
+    cat.reset();
+    reopened.reset();
+
+    std::string narrow(filename.begin(), filename.end());
+    {
+        fstream stale(narrow.c_str(), ios::in | ios::out | ios::binary);
+        stale.seekg(16 + 24); // header_stamp::unique
+        char c = static_cast<char>(stale.get());
+        stale.seekp(16 + 24);
+        stale.put(~c);
+    }
+    assert(!catalog(filename).is_current(store));
+    assert(open_catalog(store, filename)->is_current(store));
+
+    // a count larger than the file is refused, not allocated for
+    {
+        fstream truncated(narrow.c_str(), ios::in | ios::out | ios::binary);
+        truncated.seekp(8); // catalog_header::count
+        const char count[] = { '\xff', '\xff', '\xff', '\x7f' };
+        truncated.write(count, sizeof(count));
+    }
+    caught = false;
+    try
+    {
+        catalog cat(filename);
+    }
+    catch(invalid_format&)
+    {
+        caught = true;
+    }
+    assert(caught);
+
+    remove(narrow.c_str());
+}
+
 void test_pstlevel()
 {
     using namespace pstsdk;
@@ -105,6 +522,26 @@ void test_pstlevel()
     process_pst(s2);
     process_pst(submess);
 
+    test_parallel_messages(uni);
+    test_parallel_messages(s1);
+    test_parallel_messages(submess);
+    test_single_threaded_messages(L"test_unicode.pst");
+    test_single_threaded_messages(L"submessage.pst");
+
+    // fresh stores, so the arena reads blocks the cache hasn't seen yet
+    test_arena(pst(L"test_unicode.pst"));
+    test_arena(pst(L"sample1.pst"));
+    test_arena(pst(L"submessage.pst"));
+
+    test_projection(uni);
+    test_projection(ansi);
+    test_projection(s1);
+
+    test_catalog_hash();
+    test_catalog(uni, L"test_unicode.pst.catalog");
+    test_catalog(ansi, L"test_ansi.pst.catalog");
+    test_catalog(s1, L"sample1.pst.catalog");
+
     // make sure searching by name works
     process_folder(uni.open_folder(L"Folder"));
 }
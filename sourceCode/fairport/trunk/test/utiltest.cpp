@@ -1,8 +1,11 @@
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <stdexcept>
 #include <string>
+#include <vector>
 #include "pstsdk/util.h"
+#include "pstsdk/util/cache.h"
 
 void test_wstring_conversion()
 {
@@ -20,7 +23,407 @@ void test_wstring_conversion()
     assert(bytes_to_wstring(std::vector<byte>()).size() == 0);
 }
 
+// the code points a UTF-16LE string decodes to, one unit at a time
+std::vector<pstsdk::ulong> reference_decode(const std::vector<pstsdk::byte>& bytes)
+{
+    std::vector<pstsdk::ulong> cps;
+
+    for(size_t i = 0; i + 1 < bytes.size(); i += 2)
+    {
+        pstsdk::ulong unit = bytes[i] | (bytes[i + 1] << 8);
+        if(unit >= 0xD800 && unit <= 0xDBFF && i + 3 < bytes.size())
+        {
+            pstsdk::ulong low = bytes[i + 2] | (bytes[i + 3] << 8);
+            if(low >= 0xDC00 && low <= 0xDFFF)
+            {
+                cps.push_back(0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00));
+                i += 2;
+                continue;
+            }
+        }
+        cps.push_back((unit >= 0xD800 && unit <= 0xDFFF) ? 0xFFFD : unit);
+    }
+
+    return cps;
+}
+
+void test_unicode()
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    // ascii, long enough for the vector paths, with a short tail
+    string ascii("The quick brown fox jumps over the lazy dog, 0123456789");
+    vector<byte> bytes = utf8_to_utf16le(ascii);
+    assert(bytes.size() == ascii.size() * 2);
+    assert(utf16le_to_utf8(&bytes[0], bytes.size()) == ascii);
+    assert(utf16le_to_wstring(&bytes[0], bytes.size()) == wstring(ascii.begin(), ascii.end()));
+
+    // two, three and four byte UTF-8, at and across the eight unit boundaries
+    string mixed("abcdefg\xc3\xa9hijklmn\xe2\x82\xacopqrstu\xf0\x9f\x98\x80vwxyz");
+    bytes = utf8_to_utf16le(mixed);
+    assert(utf16le_to_utf8(&bytes[0], bytes.size()) == mixed);
+    wstring wide = utf16le_to_wstring(&bytes[0], bytes.size());
+    assert(wstring_to_utf16le(wide) == bytes);
+    if(sizeof(wchar_t) == 4)
+    {
+        assert(wide.size() == 29);
+        assert(wide[7] == 0xE9);
+        assert(wide[15] == 0x20AC);
+        assert(static_cast<pstsdk::ulong>(wide[23]) == 0x1F600);
+    }
+
+    // unpaired surrogates become U+FFFD
+    byte lone[] = { 'a', 0, 0x00, 0xD8, 'b', 0, 0x00, 0xDC, 0x3D, 0xD8 };
+    assert(utf16le_to_utf8(lone, sizeof(lone)) == "a\xef\xbf\xbd" "b\xef\xbf\xbd\xef\xbf\xbd");
+
+    // invalid UTF-8 does too, one replacement per bad sequence
+    string bad("x\xff\xc3y\xe2\x82z\xed\xa0\x80");
+    bytes = utf8_to_utf16le(bad);
+    vector<pstsdk::ulong> cps = reference_decode(bytes);
+    assert(cps.size() == 7);
+    assert(cps[0] == 'x' && cps[1] == 0xFFFD && cps[2] == 0xFFFD && cps[3] == 'y');
+    assert(cps[4] == 0xFFFD && cps[5] == 'z' && cps[6] == 0xFFFD);
+
+    // 8-bit strings are Windows-1252 by default; ascii past sixteen bytes,
+    // then not
+    string ansi("0123456789abcdefghij\xe9\xff\x7f");
+    assert(ansi_to_utf8(reinterpret_cast<const byte*>(ansi.data()), 20) == ansi.substr(0, 20));
+    assert(ansi_to_utf8(reinterpret_cast<const byte*>(ansi.data()), ansi.size()) == "0123456789abcdefghij\xc3\xa9\xc3\xbf\x7f");
+    assert(ansi_to_utf8(NULL, 0).empty());
+
+    // 0x80 through 0x9F are punctuation in Windows-1252, not C1 controls;
+    // the undefined bytes keep their value
+    string high("\x80\x93quote\x94\x81");
+    const byte* phigh = reinterpret_cast<const byte*>(high.data());
+    assert(ansi_to_utf8(phigh, high.size()) == "\xe2\x82\xac\xe2\x80\x9cquote\xe2\x80\x9d\xc2\x81");
+    assert(ansi_to_utf8(phigh, high.size(), 1252) == ansi_to_utf8(phigh, high.size()));
+    assert(ansi_to_utf8(phigh, high.size(), 28591) == "\xc2\x80\xc2\x93quote\xc2\x94\xc2\x81");
+    assert(ansi_to_utf8(phigh, high.size(), 20127) == "\xef\xbf\xbd\xef\xbf\xbdquote\xef\xbf\xbd\xef\xbf\xbd");
+
+    // other codepages are refused, not read as Windows-1252
+    bool refused = false;
+    try
+    {
+        ansi_to_utf8(phigh, high.size(), 936);
+    }
+    catch(not_implemented&)
+    {
+        refused = true;
+    }
+    assert(refused);
+
+    // UTF-8 is validated on the way through
+    string utf8("ok\xe2\x82\xac\xff");
+    assert(ansi_to_utf8(reinterpret_cast<const byte*>(utf8.data()), utf8.size(), 65001) == "ok\xe2\x82\xac\xef\xbf\xbd");
+
+    // odd lengths are an error
+    bool caught = false;
+    try
+    {
+        utf16le_to_wstring(lone, 3);
+    }
+    catch(std::runtime_error&)
+    {
+        caught = true;
+    }
+    assert(caught);
+
+    assert(utf16le_to_wstring(NULL, 0).empty());
+    assert(utf16le_to_utf8(NULL, 0).empty());
+    assert(wstring_to_utf16le(wstring()).empty());
+    assert(utf8_to_utf16le(string()).empty());
+
+    // random units, surrogates included, against a unit at a time decode
+    pstsdk::ulong seed = 12345;
+    for(int round = 0; round < 200; ++round)
+    {
+        vector<byte> random(2 * (round % 40));
+        for(size_t i = 0; i < random.size(); i += 2)
+        {
+            seed = seed * 1103515245 + 12345;
+            pstsdk::ulong unit = (seed >> 8) & 0xFFFF;
+            if(seed & 0x10000000)
+                unit &= 0x7F;
+            else if(seed & 0x20000000)
+                unit = 0xD800 | (unit & 0x7FF);
+            random[i] = static_cast<byte>(unit & 0xFF);
+            random[i + 1] = static_cast<byte>(unit >> 8);
+        }
+
+        vector<pstsdk::ulong> expected = reference_decode(random);
+        string utf8 = utf16le_to_utf8(random.empty() ? NULL : &random[0], random.size());
+        vector<byte> again = utf8_to_utf16le(utf8);
+        assert(reference_decode(again) == expected);
+
+        if(sizeof(wchar_t) == 4)
+        {
+            wstring w = utf16le_to_wstring(random.empty() ? NULL : &random[0], random.size());
+            assert(w.size() == expected.size());
+            for(size_t i = 0; i < w.size(); ++i)
+                assert(static_cast<pstsdk::ulong>(w[i]) == expected[i]);
+        }
+    }
+}
+
+void test_byte_slice()
+{
+    using namespace pstsdk;
+
+    const byte data[] = { 1, 2, 3, 4, 5, 6 };
+    std::vector<byte> bytes(data, data + 6);
+
+    byte_slice whole(bytes);
+    assert(bytes.empty());
+    assert(whole.size() == 6 && whole[0] == 1 && whole[5] == 6);
+
+    // narrowing shares the buffer
+    byte_slice middle = whole.slice(2, 3);
+    assert(middle.size() == 3 && middle[0] == 3 && middle[2] == 5);
+    assert(middle.get_storage() == whole.get_storage());
+    assert(middle.data() == whole.data() + 2);
+    assert(middle.to_vector() == std::vector<byte>(data + 2, data + 5));
+
+    // and keeps it alive
+    whole = byte_slice();
+    assert(whole.empty() && whole.begin() == whole.end());
+    assert(middle[1] == 4);
+
+    assert(middle.slice(3, 0).empty());
+
+    bool caught = false;
+    try
+    {
+        middle.slice(2, 2);
+    }
+    catch(std::out_of_range&)
+    {
+        caught = true;
+    }
+    assert(caught);
+}
+
+void test_lru_cache()
+{
+    using namespace pstsdk;
+
+    lru_cache<int, std::string> cache(10);
+    std::string value;
+
+    cache.insert(1, "one", 4);
+    cache.insert(2, "two", 4);
+    assert(cache.lookup(1, value) && value == "one");
+
+    // 2 is now least recently used, and is evicted to make room
+    cache.insert(3, "three", 4);
+    assert(!cache.lookup(2, value));
+    assert(cache.lookup(1, value) && value == "one");
+    assert(cache.lookup(3, value) && value == "three");
+
+    // anything larger than the budget is never cached
+    cache.insert(4, "four", 11);
+    assert(!cache.lookup(4, value));
+
+    cache_stats stats = cache.get_stats();
+    assert(stats.hits == 3);
+    assert(stats.misses == 2);
+    assert(stats.evictions == 1);
+    assert(stats.entries == 2);
+    assert(stats.cost == 8);
+
+    cache.set_budget(0);
+    assert(cache.get_stats().entries == 0);
+
+    sharded_cache<int, int, 4> sharded(400);
+    for(int i = 0; i < 100; ++i)
+        sharded.insert(i, i * 2, 1);
+    for(int i = 0; i < 100; ++i)
+    {
+        int doubled = 0;
+        assert(sharded.lookup(i, doubled) && doubled == i * 2);
+    }
+    assert(sharded.get_stats().entries == 100);
+    assert(sharded.get_stats().budget == 400);
+
+    // each shard's share rounds up, so a budget below the shard count caches
+    sharded.set_budget(1);
+    sharded.insert(7, 14, 1);
+    int doubled = 0;
+    assert(sharded.lookup(7, doubled) && doubled == 14);
+    assert(sharded.get_stats().budget == 4);
+}
+
+struct key_matches
+{
+    key_matches(const std::vector<int>& keys, int key) : keys(keys), key(key) { }
+    bool operator()(size_t i) const { return keys[i] == key; }
+
+    const std::vector<int>& keys;
+    int key;
+};
+
+void test_slot_index()
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    slot_index<ushort> index;
+    vector<int> keys;
+    assert(index.find(0, key_matches(keys, 0)) == slot_index<ushort>::npos);
+
+    // the keys share three hashes, so most finds probe past other keys
+    for(int i = 0; i < 50; ++i)
+        keys.push_back(i * 7);
+    index.reset(keys.size());
+    for(size_t i = 0; i < keys.size(); ++i)
+        index.insert(keys[i] % 3, i);
+
+    for(size_t i = 0; i < keys.size(); ++i)
+        assert(index.find(keys[i] % 3, key_matches(keys, keys[i])) == i);
+    assert(index.find(1, key_matches(keys, 1)) == slot_index<ushort>::npos);
+
+    index.reset(0);
+    assert(index.find(0, key_matches(keys, 0)) == slot_index<ushort>::npos);
+}
+
+struct corrupt_task : public pstsdk::pool_task
+{
+    void run()
+    {
+        throw pstsdk::crc_fail("corrupt", 0, 0, 1, 2);
+    }
+};
+
+struct square_task : public pstsdk::pool_task
+{
+    int in;
+    int out;
+
+    square_task() : in(0), out(0) { }
+    void run()
+    {
+        if(in < 0)
+            throw std::invalid_argument("negative");
+        out = in * in;
+    }
+};
+
+void test_task_pool()
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    task_pool pool(3);
+#ifndef PSTSDK_SINGLE_THREADED
+    assert(pool.get_thread_count() == 3);
+#endif
+
+    vector<square_task> squares(100);
+    vector<pool_task*> tasks;
+    for(size_t i = 0; i < squares.size(); ++i)
+    {
+        squares[i].in = static_cast<int>(i);
+        tasks.push_back(&squares[i]);
+    }
+
+    // every task runs exactly once, over several rounds
+    for(int round = 0; round < 3; ++round)
+    {
+        for(size_t i = 0; i < squares.size(); ++i)
+            squares[i].out = -1;
+        pool.run(tasks);
+        for(size_t i = 0; i < squares.size(); ++i)
+            assert(squares[i].out == squares[i].in * squares[i].in);
+    }
+
+    pool.run(vector<pool_task*>());
+
+    // a failure is rethrown as is, once the rest have run
+    squares[10].in = -1;
+    for(size_t i = 0; i < squares.size(); ++i)
+        squares[i].out = -1;
+    bool caught = false;
+    try
+    {
+        pool.run(tasks);
+    }
+    catch(invalid_argument&)
+    {
+        caught = true;
+    }
+    assert(caught);
+    for(size_t i = 0; i < squares.size(); ++i)
+        assert(i == 10 || squares[i].out == squares[i].in * squares[i].in);
+
+    // exceptions not derived from boost::exception keep their type too
+    corrupt_task corrupt;
+    tasks.push_back(&corrupt);
+    squares[10].in = 10;
+    caught = false;
+    try
+    {
+        pool.run(tasks);
+    }
+    catch(crc_fail&)
+    {
+        caught = true;
+    }
+    assert(caught);
+}
+
+struct corrupt_on_seven
+{
+    void operator()(int i) const
+    {
+        if(i == 7)
+            throw pstsdk::crc_fail("corrupt", 0, 0, 1, 2);
+    }
+};
+
+void test_parallel_for_each()
+{
+    using namespace std;
+    using namespace pstsdk;
+
+    vector<int> items;
+    for(int i = 0; i < 100; ++i)
+        items.push_back(i);
+
+    parallel_options options;
+    options.threads = 4;
+    options.batch_size = 3;
+
+    // the callback's exception reaches the caller as its own type
+    bool caught = false;
+    try
+    {
+        parallel_for_each(items.begin(), items.end(), corrupt_on_seven(), options);
+    }
+    catch(crc_fail&)
+    {
+        caught = true;
+    }
+    assert(caught);
+
+    caught = false;
+    try
+    {
+        serial_for_each(items.begin(), items.end(), corrupt_on_seven());
+    }
+    catch(crc_fail&)
+    {
+        caught = true;
+    }
+    assert(caught);
+}
+
 void test_util()
 {
     test_wstring_conversion();
+    test_unicode();
+    test_byte_slice();
+    test_lru_cache();
+    test_slot_index();
+    test_task_pool();
+    test_parallel_for_each();
 }